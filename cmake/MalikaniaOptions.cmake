@@ -49,6 +49,16 @@ if (NOT WITH_DOCS)
 	set(WITH_DOCS_BOOKS Off)
 endif ()
 
+#
+# Network
+# -------------------------------------------------------------------
+#
+# The following options are available:
+#    WITH_IO_URING	- Build the io_uring listener backend, used with Listener<IoUring> only (Linux only, requires liburing).
+#
+
+option(WITH_IO_URING "Build the io_uring listener backend" Off)
+
 #
 # Targets to build
 # -------------------------------------------------------------------
@@ -0,0 +1,45 @@
+# FindUring
+# ---------
+#
+# Find liburing library, this modules defines:
+#
+# URING_INCLUDE_DIRS, where to find liburing.h
+# URING_LIBRARIES, where to find library
+# URING_FOUND, if it is found
+#
+# Only liburing 2.2 or later is accepted, older versions lack the 64-bit user
+# data and submit with timeout functions.
+
+include(CheckSymbolExists)
+
+find_path(
+	URING_INCLUDE_DIR
+	NAMES liburing.h
+)
+
+find_library(
+	URING_LIBRARY
+	NAMES uring liburing
+)
+
+if (URING_INCLUDE_DIR AND URING_LIBRARY)
+	set(CMAKE_REQUIRED_INCLUDES ${URING_INCLUDE_DIR})
+	set(CMAKE_REQUIRED_LIBRARIES ${URING_LIBRARY})
+	check_symbol_exists(io_uring_submit_and_wait_timeout liburing.h URING_HAVE_SUBMIT_AND_WAIT_TIMEOUT)
+	unset(CMAKE_REQUIRED_INCLUDES)
+	unset(CMAKE_REQUIRED_LIBRARIES)
+endif ()
+
+include(FindPackageHandleStandardArgs)
+
+find_package_handle_standard_args(
+	Uring
+	REQUIRED_VARS URING_LIBRARY URING_INCLUDE_DIR URING_HAVE_SUBMIT_AND_WAIT_TIMEOUT
+)
+
+if (URING_FOUND)
+	set(URING_LIBRARIES ${URING_LIBRARY})
+	set(URING_INCLUDE_DIRS ${URING_INCLUDE_DIR})
+endif ()
+
+mark_as_advanced(URING_LIBRARY URING_INCLUDE_DIR)
@@ -0,0 +1,1391 @@
+/*
+ * Coroutines.h -- C++20 coroutines on top of sockets and listeners
+ *
+ * Copyright (c) 2013-2016 Malikania Authors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _MALIKANIA_COROUTINES_H_
+#define _MALIKANIA_COROUTINES_H_
+
+/**
+ * @file Coroutines.h
+ * @brief C++20 coroutines on top of sockets and listeners
+ *
+ * The rest of the library is C++14, this file is empty unless the compiler implements coroutines (e.g. with
+ * -std=c++20), so it can be included unconditionally.
+ */
+
+#include "Sockets.h"
+
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <optional>
+#include <string>
+#include <utility>
+
+namespace malikania {
+
+namespace net {
+
+/*
+ * FramePool
+ * ------------------------------------------------------------------
+ *
+ * Recycled memory for coroutine frames.
+ */
+
+/* {{{ FramePool */
+
+/**
+ * @class FramePool
+ * @brief Free lists of coroutine frames, one per thread.
+ *
+ * The frames are rounded up to a multiple of 64 bytes and kept in a free list per size once released, so a server
+ * that starts a task per request only allocates while its number of concurrent tasks grows. Frames larger than
+ * 2 KiB are not pooled.
+ *
+ * The frames must be released before their thread exits.
+ */
+class FramePool {
+private:
+	static constexpr std::size_t granularity{64};
+	static constexpr std::size_t classes{32};
+
+	class Block {
+	public:
+		Block *next;
+	};
+
+	Block *m_free[classes]{};
+	std::size_t m_allocated{0};
+	std::size_t m_reused{0};
+
+	FramePool() = default;
+
+	static inline std::size_t index(std::size_t size) noexcept
+	{
+		return (size - 1) / granularity;
+	}
+
+public:
+	/**
+	 * Release the frames kept.
+	 */
+	~FramePool()
+	{
+		for (auto head : m_free) {
+			while (head) {
+				auto next = head->next;
+
+				::operator delete(head);
+				head = next;
+			}
+		}
+	}
+
+	/**
+	 * Deleted copy constructor.
+	 */
+	FramePool(const FramePool &) = delete;
+
+	/**
+	 * Deleted copy assignment.
+	 *
+	 * @return *this
+	 */
+	FramePool &operator=(const FramePool &) = delete;
+
+	/**
+	 * Get the pool of the current thread.
+	 *
+	 * @return the pool
+	 */
+	static FramePool &local() noexcept
+	{
+		thread_local FramePool pool;
+
+		return pool;
+	}
+
+	/**
+	 * Get a frame.
+	 *
+	 * @param size the frame size
+	 * @return the memory
+	 * @throw std::bad_alloc on failures
+	 */
+	void *allocate(std::size_t size)
+	{
+		auto i = index(size);
+
+		if (i >= classes) {
+			return ::operator new(size);
+		}
+
+		if (m_free[i]) {
+			auto block = m_free[i];
+
+			m_free[i] = block->next;
+			m_reused ++;
+
+			return block;
+		}
+
+		m_allocated ++;
+
+		return ::operator new((i + 1) * granularity);
+	}
+
+	/**
+	 * Give back a frame.
+	 *
+	 * @param ptr the memory returned by allocate
+	 * @param size the same size as given to allocate
+	 */
+	void deallocate(void *ptr, std::size_t size) noexcept
+	{
+		auto i = index(size);
+
+		if (i >= classes) {
+			::operator delete(ptr);
+		} else {
+			auto block = static_cast<Block *>(ptr);
+
+			block->next = m_free[i];
+			m_free[i] = block;
+		}
+	}
+
+	/**
+	 * Get the number of pooled frames allocated from the system.
+	 *
+	 * @return the number of frames
+	 */
+	inline std::size_t allocated() const noexcept
+	{
+		return m_allocated;
+	}
+
+	/**
+	 * Get the number of frames taken from the free lists.
+	 *
+	 * @return the number of frames
+	 */
+	inline std::size_t reused() const noexcept
+	{
+		return m_reused;
+	}
+};
+
+/* }}} */
+
+/*
+ * Task
+ * ------------------------------------------------------------------
+ *
+ * Coroutine type for request handling code.
+ */
+
+/* {{{ Task */
+
+template <typename T>
+class Task;
+
+/**
+ * @class TaskList
+ * @brief Tasks started with Reactor::spawn.
+ *
+ * Only used by Reactor, it owns the frames of the tasks still running and keeps the first exception that escaped
+ * one of them.
+ */
+class TaskList;
+
+/**
+ * @class TaskPromise
+ * @brief Part of the promise common to all tasks.
+ */
+class TaskPromise {
+private:
+	friend class TaskList;
+
+	template <typename T>
+	friend class Task;
+
+	/* Task awaiting this one */
+	std::coroutine_handle<> m_continuation;
+
+	/* Only for the tasks started by Reactor::spawn */
+	std::coroutine_handle<> m_self;
+	TaskList *m_list{nullptr};
+	TaskPromise *m_prev{nullptr};
+	TaskPromise *m_next{nullptr};
+
+	class FinalAwaiter {
+	public:
+		inline bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		template <typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept;
+
+		inline void await_resume() const noexcept
+		{
+		}
+	};
+
+protected:
+	/**
+	 * Exception that escaped the task.
+	 */
+	std::exception_ptr m_exception;
+
+public:
+	/**
+	 * Allocate the frame from the pool of the current thread.
+	 *
+	 * @param size the frame size
+	 * @return the frame
+	 */
+	static void *operator new(std::size_t size)
+	{
+		return FramePool::local().allocate(size);
+	}
+
+	/**
+	 * Give the frame back to the pool of the current thread.
+	 *
+	 * @param ptr the frame
+	 * @param size the frame size
+	 */
+	static void operator delete(void *ptr, std::size_t size) noexcept
+	{
+		FramePool::local().deallocate(ptr, size);
+	}
+
+	/**
+	 * Tasks are lazy, they start when awaited or spawned.
+	 *
+	 * @return std::suspend_always
+	 */
+	inline std::suspend_always initial_suspend() const noexcept
+	{
+		return {};
+	}
+
+	/**
+	 * Resume the awaiting task.
+	 *
+	 * @return the awaiter
+	 */
+	inline FinalAwaiter final_suspend() const noexcept
+	{
+		return {};
+	}
+
+	/**
+	 * Keep the exception for the awaiting task.
+	 */
+	inline void unhandled_exception() noexcept
+	{
+		m_exception = std::current_exception();
+	}
+};
+
+class TaskList {
+private:
+	friend class TaskPromise;
+
+	TaskPromise *m_head{nullptr};
+	std::size_t m_size{0};
+	std::exception_ptr m_exception;
+
+	void unlink(TaskPromise &promise) noexcept
+	{
+		if (promise.m_prev) {
+			promise.m_prev->m_next = promise.m_next;
+		} else {
+			m_head = promise.m_next;
+		}
+		if (promise.m_next) {
+			promise.m_next->m_prev = promise.m_prev;
+		}
+
+		promise.m_list = nullptr;
+		m_size --;
+	}
+
+public:
+	/**
+	 * Destroy the tasks still running.
+	 */
+	~TaskList()
+	{
+		clear();
+	}
+
+	/**
+	 * Get the number of tasks running.
+	 *
+	 * @return the number of tasks
+	 */
+	inline std::size_t size() const noexcept
+	{
+		return m_size;
+	}
+
+	/**
+	 * Take ownership of a task frame.
+	 *
+	 * @param promise the promise
+	 * @param handle the coroutine handle of the promise
+	 */
+	void insert(TaskPromise &promise, std::coroutine_handle<> handle) noexcept
+	{
+		promise.m_self = handle;
+		promise.m_list = this;
+		promise.m_next = m_head;
+
+		if (m_head) {
+			m_head->m_prev = &promise;
+		}
+
+		m_head = &promise;
+		m_size ++;
+	}
+
+	/**
+	 * Destroy all the tasks running, the tasks they are awaiting are destroyed too.
+	 */
+	void clear() noexcept
+	{
+		while (m_head) {
+			auto handle = m_head->m_self;
+
+			unlink(*m_head);
+			handle.destroy();
+		}
+	}
+
+	/**
+	 * Rethrow and forget the first exception that escaped a task.
+	 */
+	void rethrow()
+	{
+		if (m_exception) {
+			std::rethrow_exception(std::exchange(m_exception, nullptr));
+		}
+	}
+};
+
+template <typename Promise>
+std::coroutine_handle<> TaskPromise::FinalAwaiter::await_suspend(std::coroutine_handle<Promise> handle) noexcept
+{
+	TaskPromise &promise = handle.promise();
+
+	if (promise.m_continuation) {
+		return promise.m_continuation;
+	}
+
+	/* Spawned, nobody will read the result */
+	if (promise.m_list) {
+		auto list = promise.m_list;
+
+		if (promise.m_exception && !list->m_exception) {
+			list->m_exception = promise.m_exception;
+		}
+
+		list->unlink(promise);
+		handle.destroy();
+	}
+
+	return std::noop_coroutine();
+}
+
+/**
+ * @class TaskResult
+ * @brief Value returned by a task.
+ */
+template <typename T>
+class TaskResult : public TaskPromise {
+protected:
+	std::optional<T> m_value;
+
+public:
+	/**
+	 * Store the value returned by co_return.
+	 *
+	 * @param value the value
+	 */
+	template <typename Value>
+	inline void return_value(Value &&value)
+	{
+		m_value.emplace(std::forward<Value>(value));
+	}
+
+	/**
+	 * Get the value or rethrow the exception.
+	 *
+	 * @return the value
+	 */
+	T result()
+	{
+		if (m_exception) {
+			std::rethrow_exception(m_exception);
+		}
+
+		return std::move(*m_value);
+	}
+};
+
+/**
+ * @brief Specialization for tasks without value.
+ */
+template <>
+class TaskResult<void> : public TaskPromise {
+public:
+	/**
+	 * Nothing to store.
+	 */
+	inline void return_void() const noexcept
+	{
+	}
+
+	/**
+	 * Rethrow the exception, if any.
+	 */
+	void result()
+	{
+		if (m_exception) {
+			std::rethrow_exception(m_exception);
+		}
+	}
+};
+
+/**
+ * @class Task
+ * @brief Lazy coroutine returning a value.
+ *
+ * A task starts when it is awaited from another task, the awaiting task continues when it completes and gets its
+ * value or its exception. The outermost tasks are started with Reactor::spawn.
+ *
+ * The frames are allocated from the FramePool of the current thread.
+ *
+ * Example:
+ *
+ * @code
+ * Task<std::string> line(Reactor<> &reactor, SocketTcpIp &socket)
+ * {
+ *	std::string result;
+ *	char ch;
+ *
+ *	while (co_await reactor.recv(socket, &ch, 1) == 1 && ch != '\n') {
+ *		result.push_back(ch);
+ *	}
+ *
+ *	co_return result;
+ * }
+ * @endcode
+ */
+template <typename T = void>
+class Task {
+public:
+	/**
+	 * Promise type, required by the compiler.
+	 */
+	class promise_type : public TaskResult<T> {
+	public:
+		/**
+		 * Create the task.
+		 *
+		 * @return the task
+		 */
+		inline Task get_return_object() noexcept
+		{
+			return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
+		}
+	};
+
+private:
+	template <typename Backend>
+	friend class Reactor;
+
+	std::coroutine_handle<promise_type> m_handle;
+
+	explicit inline Task(std::coroutine_handle<promise_type> handle) noexcept
+		: m_handle(handle)
+	{
+	}
+
+	/*
+	 * Give the frame to the caller.
+	 */
+	inline std::coroutine_handle<promise_type> release() noexcept
+	{
+		return std::exchange(m_handle, nullptr);
+	}
+
+public:
+	/**
+	 * Move constructor.
+	 *
+	 * @param other the other task
+	 */
+	inline Task(Task &&other) noexcept
+		: m_handle(other.release())
+	{
+	}
+
+	/**
+	 * Move assignment.
+	 *
+	 * @param other the other task
+	 * @return *this
+	 */
+	Task &operator=(Task &&other) noexcept
+	{
+		if (this != &other) {
+			if (m_handle) {
+				m_handle.destroy();
+			}
+
+			m_handle = other.release();
+		}
+
+		return *this;
+	}
+
+	/**
+	 * Destroy the frame, the task must not be running.
+	 */
+	~Task()
+	{
+		if (m_handle) {
+			m_handle.destroy();
+		}
+	}
+
+	/**
+	 * Check if the task has completed.
+	 *
+	 * @return true if done
+	 */
+	inline bool done() const noexcept
+	{
+		return !m_handle || m_handle.done();
+	}
+
+	/**
+	 * Awaiter of a task.
+	 */
+	class Awaiter {
+	private:
+		std::coroutine_handle<promise_type> m_handle;
+
+	public:
+		/**
+		 * Constructor.
+		 *
+		 * @param handle the task
+		 */
+		explicit inline Awaiter(std::coroutine_handle<promise_type> handle) noexcept
+			: m_handle(handle)
+		{
+		}
+
+		/**
+		 * Always start the task.
+		 *
+		 * @return false
+		 */
+		inline bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		/**
+		 * Start the task, the awaiting task is resumed when it completes.
+		 *
+		 * @param continuation the awaiting task
+		 * @return the task to resume
+		 */
+		inline std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+		{
+			m_handle.promise().m_continuation = continuation;
+
+			return m_handle;
+		}
+
+		/**
+		 * Get the result.
+		 *
+		 * @return the value
+		 * @throw any exception that escaped the task
+		 */
+		inline T await_resume()
+		{
+			return m_handle.promise().result();
+		}
+	};
+
+	/**
+	 * Await the task, it can only be done once.
+	 *
+	 * @return the awaiter
+	 */
+	inline Awaiter operator co_await() && noexcept
+	{
+		return Awaiter{m_handle};
+	}
+
+	/**
+	 * Overloaded function.
+	 *
+	 * @return the awaiter
+	 */
+	inline Awaiter operator co_await() & noexcept
+	{
+		return Awaiter{m_handle};
+	}
+};
+
+/* }}} */
+
+/*
+ * Reactor
+ * ------------------------------------------------------------------
+ *
+ * Resume the coroutines waiting for sockets.
+ */
+
+/* {{{ Reactor */
+
+/**
+ * @class Reactor
+ * @brief Await socket operations from tasks, driven by a Listener.
+ *
+ * The functions recv, send, accept and connect return awaitables that try the operation immediately and only
+ * suspend the task if the socket must wait for a condition, as told by Socket::condition. The reactor then calls the
+ * operation again each time the condition is met and resumes the task once it is complete, so a Tls handshake or
+ * renegotiation is transparent.
+ *
+ * The sockets must be non-blocking and a socket must not be closed while an operation is pending on it. Only one
+ * receiving (recv, accept) and one sending (send, connect) operation may be pending per socket. Destroying a task
+ * suspended in an operation removes the operation from the reactor.
+ *
+ * Like the other classes, a reactor is not thread safe, all its tasks run in the thread calling poll. Destroying the
+ * reactor destroys the tasks still running.
+ *
+ * Example:
+ *
+ * @code
+ * Task<> echo(Reactor<> &reactor, SocketTcpIp client)
+ * {
+ *	char buffer[512];
+ *	unsigned n;
+ *
+ *	while ((n = co_await reactor.recv(client, buffer, sizeof (buffer))) > 0) {
+ *		co_await reactor.send(client, buffer, n);
+ *	}
+ * }
+ *
+ * Task<> serve(Reactor<> &reactor, SocketTcpIp &master)
+ * {
+ *	for (;;) {
+ *		reactor.spawn(echo(reactor, co_await reactor.accept(master)));
+ *	}
+ * }
+ * @endcode
+ */
+template <typename Backend = SOCKET_DEFAULT_BACKEND>
+class Reactor {
+public:
+	/**
+	 * @class Operation
+	 * @brief Pending operation, base of the awaitables.
+	 */
+	class Operation {
+	private:
+		friend class Reactor;
+
+		std::coroutine_handle<> m_waiting;
+
+	protected:
+		/**
+		 * The reactor.
+		 */
+		Reactor &m_reactor;
+
+		/**
+		 * The handle to wait for.
+		 */
+		Handle m_handle{Invalid};
+
+		/**
+		 * The condition to wait for.
+		 */
+		Condition m_condition{Condition::None};
+
+		/**
+		 * Exception thrown by the operation.
+		 */
+		std::exception_ptr m_exception;
+
+		/**
+		 * Constructor.
+		 *
+		 * @param reactor the reactor
+		 */
+		explicit inline Operation(Reactor &reactor) noexcept
+			: m_reactor(reactor)
+		{
+		}
+
+		/**
+		 * Remove the operation from the reactor if the task is destroyed while it waits.
+		 */
+		~Operation()
+		{
+			m_reactor.cancel(*this);
+		}
+
+		/**
+		 * Try to complete the operation, m_handle and m_condition must be set if it must wait.
+		 *
+		 * @return true if complete
+		 */
+		virtual bool attempt() = 0;
+
+		/**
+		 * Tell if the operation receives (recv, accept) or sends (send, connect).
+		 *
+		 * @return true if sending
+		 */
+		virtual bool sending() const noexcept = 0;
+
+		/*
+		 * Call attempt, an exception completes the operation.
+		 */
+		bool complete() noexcept
+		{
+			try {
+				m_condition = Condition::None;
+
+				return attempt();
+			} catch (...) {
+				m_exception = std::current_exception();
+			}
+
+			return true;
+		}
+
+		/*
+		 * Rethrow the exception of the operation.
+		 */
+		void rethrow()
+		{
+			if (m_exception) {
+				std::rethrow_exception(m_exception);
+			}
+		}
+
+	public:
+		/**
+		 * Try the operation without waiting.
+		 *
+		 * @return true if complete
+		 */
+		inline bool await_ready() noexcept
+		{
+			return complete();
+		}
+
+		/**
+		 * Wait for the socket.
+		 *
+		 * @param handle the awaiting task
+		 * @throw net::Error if an operation of the same kind is already pending on the socket
+		 */
+		inline void await_suspend(std::coroutine_handle<> handle)
+		{
+			m_waiting = handle;
+			m_reactor.wait(*this);
+		}
+	};
+
+	/**
+	 * @class RecvOperation
+	 * @brief Awaitable of recv.
+	 */
+	template <typename Address, typename Protocol>
+	class RecvOperation : public Operation {
+	private:
+		Socket<Address, Protocol> &m_socket;
+		void *m_data;
+		unsigned m_length;
+		unsigned m_result{0};
+
+	protected:
+		bool attempt() override
+		{
+			m_result = m_socket.recv(m_data, m_length);
+
+			if (m_socket.condition() == Condition::None) {
+				return true;
+			}
+
+			this->m_handle = m_socket.handle();
+			this->m_condition = m_socket.condition();
+
+			return false;
+		}
+
+		bool sending() const noexcept override
+		{
+			return false;
+		}
+
+	public:
+		/**
+		 * Constructor.
+		 *
+		 * @param reactor the reactor
+		 * @param socket the socket
+		 * @param data the destination buffer
+		 * @param length the buffer length
+		 */
+		inline RecvOperation(Reactor &reactor, Socket<Address, Protocol> &socket, void *data, unsigned length) noexcept
+			: Operation(reactor)
+			, m_socket(socket)
+			, m_data(data)
+			, m_length(length)
+		{
+		}
+
+		/**
+		 * Get the result.
+		 *
+		 * @return the number of bytes received, 0 on disconnection
+		 * @throw net::Error on errors
+		 */
+		inline unsigned await_resume()
+		{
+			this->rethrow();
+
+			return m_result;
+		}
+	};
+
+	/**
+	 * @class SendOperation
+	 * @brief Awaitable of send.
+	 */
+	template <typename Address, typename Protocol>
+	class SendOperation : public Operation {
+	private:
+		Socket<Address, Protocol> &m_socket;
+		const char *m_data;
+		unsigned m_length;
+		unsigned m_sent{0};
+
+	protected:
+		bool attempt() override
+		{
+			while (m_sent < m_length) {
+				auto n = m_socket.send(m_data + m_sent, m_length - m_sent);
+
+				if (m_socket.condition() != Condition::None) {
+					this->m_handle = m_socket.handle();
+					this->m_condition = m_socket.condition();
+
+					return false;
+				}
+				if (n == 0) {
+					break;
+				}
+
+				m_sent += n;
+			}
+
+			return true;
+		}
+
+		bool sending() const noexcept override
+		{
+			return true;
+		}
+
+	public:
+		/**
+		 * Constructor.
+		 *
+		 * @param reactor the reactor
+		 * @param socket the socket
+		 * @param data the data, it must stay valid until the operation completes
+		 * @param length the data length
+		 */
+		inline SendOperation(Reactor &reactor, Socket<Address, Protocol> &socket, const void *data, unsigned length) noexcept
+			: Operation(reactor)
+			, m_socket(socket)
+			, m_data(static_cast<const char *>(data))
+			, m_length(length)
+		{
+		}
+
+		/**
+		 * Get the result.
+		 *
+		 * @return the number of bytes sent, always the whole data
+		 * @throw net::Error on errors
+		 */
+		inline unsigned await_resume()
+		{
+			this->rethrow();
+
+			return m_sent;
+		}
+	};
+
+	/**
+	 * @class AcceptOperation
+	 * @brief Awaitable of accept.
+	 */
+	template <typename Address, typename Protocol>
+	class AcceptOperation : public Operation {
+	private:
+		Socket<Address, Protocol> &m_master;
+		Socket<Address, Protocol> m_client{nullptr};
+		Address *m_address;
+
+	protected:
+		bool attempt() override
+		{
+			if (m_client.handle() == Invalid) {
+				m_client = m_master.accept(m_address);
+
+				if (m_client.handle() == Invalid) {
+					this->m_handle = m_master.handle();
+					this->m_condition = m_master.condition();
+
+					return false;
+				}
+			} else {
+				m_client.accept();
+			}
+
+			if (m_client.state() == State::Accepted) {
+				return true;
+			}
+
+			/* The handshake continues on the client */
+			this->m_handle = m_client.handle();
+			this->m_condition = m_client.condition();
+
+			return false;
+		}
+
+		bool sending() const noexcept override
+		{
+			return false;
+		}
+
+	public:
+		/**
+		 * Constructor.
+		 *
+		 * @param reactor the reactor
+		 * @param master the bound and listening socket
+		 * @param address where to store the client address (optional)
+		 */
+		inline AcceptOperation(Reactor &reactor, Socket<Address, Protocol> &master, Address *address) noexcept
+			: Operation(reactor)
+			, m_master(master)
+			, m_address(address)
+		{
+			m_master.protocol().setAcceptNonBlocking();
+		}
+
+		/**
+		 * Get the client.
+		 *
+		 * @return the accepted and non-blocking client
+		 * @throw net::Error on errors
+		 */
+		inline Socket<Address, Protocol> await_resume()
+		{
+			this->rethrow();
+
+			return std::move(m_client);
+		}
+	};
+
+	/**
+	 * @class ConnectOperation
+	 * @brief Awaitable of connect.
+	 */
+	template <typename Address, typename Protocol>
+	class ConnectOperation : public Operation {
+	private:
+		Socket<Address, Protocol> &m_socket;
+		Address m_address;
+		bool m_started{false};
+
+	protected:
+		bool attempt() override
+		{
+			if (!m_started) {
+				m_started = true;
+				m_socket.connect(m_address);
+			} else {
+				m_socket.connect();
+			}
+
+			if (m_socket.state() == State::Connected) {
+				return true;
+			}
+
+			this->m_handle = m_socket.handle();
+			this->m_condition = m_socket.condition();
+
+			return false;
+		}
+
+		bool sending() const noexcept override
+		{
+			return true;
+		}
+
+	public:
+		/**
+		 * Constructor.
+		 *
+		 * @param reactor the reactor
+		 * @param socket the socket
+		 * @param address the address
+		 */
+		inline ConnectOperation(Reactor &reactor, Socket<Address, Protocol> &socket, Address address)
+			: Operation(reactor)
+			, m_socket(socket)
+			, m_address(std::move(address))
+		{
+		}
+
+		/**
+		 * Check for errors.
+		 *
+		 * @throw net::Error on errors
+		 */
+		inline void await_resume()
+		{
+			this->rethrow();
+		}
+	};
+
+private:
+	class Entry {
+	public:
+		Operation *receiving{nullptr};
+		Operation *sending{nullptr};
+	};
+
+	Listener<Backend> m_listener;
+	HandleTable<Entry> m_operations;
+	TaskList m_tasks;
+
+	Reactor(const Reactor &) = delete;
+	Reactor &operator=(const Reactor &) = delete;
+
+	/*
+	 * Listen for the union of the conditions of the pending operations.
+	 */
+	void update(typename HandleTable<Entry>::iterator it)
+	{
+		auto handle = it->first;
+		auto condition = Condition::None;
+
+		if (it->second.receiving) {
+			condition |= it->second.receiving->m_condition;
+		}
+		if (it->second.sending) {
+			condition |= it->second.sending->m_condition;
+		}
+		if (condition == Condition::None) {
+			m_operations.erase(it);
+		}
+
+		m_listener.assign(handle, condition);
+	}
+
+	void wait(Operation &operation)
+	{
+		auto it = m_operations.emplace(operation.m_handle, Entry{}).first;
+		auto &slot = operation.sending() ? it->second.sending : it->second.receiving;
+
+		if (slot != nullptr) {
+			throw Error{Error::Other, "reactor", "operation already pending on this socket"};
+		}
+
+		slot = &operation;
+		update(it);
+	}
+
+	/*
+	 * Forget an operation destroyed while it is pending, the socket is still open as the operation is destroyed
+	 * before the variables of the task.
+	 */
+	void cancel(Operation &operation) noexcept
+	{
+		auto it = m_operations.find(operation.m_handle);
+
+		if (it == m_operations.end()) {
+			return;
+		}
+
+		/* Called from ~Operation, sending() can't be used anymore */
+		if (it->second.receiving == &operation) {
+			it->second.receiving = nullptr;
+		} else if (it->second.sending == &operation) {
+			it->second.sending = nullptr;
+		} else {
+			return;
+		}
+
+		try {
+			update(it);
+		} catch (const Error &) {
+			/* The socket may have been closed by the user, it is not in the listener anymore */
+		}
+	}
+
+	/*
+	 * Continue the operation waiting in a slot if its condition is met.
+	 */
+	bool process(Handle handle, Condition flags, bool sending)
+	{
+		auto it = m_operations.find(handle);
+
+		if (it == m_operations.end()) {
+			return false;
+		}
+
+		auto &slot = sending ? it->second.sending : it->second.receiving;
+		auto operation = slot;
+
+		if (operation == nullptr || (operation->m_condition & flags) == Condition::None) {
+			return false;
+		}
+
+		slot = nullptr;
+
+		if (!operation->complete()) {
+			if (operation->m_handle == handle) {
+				slot = operation;
+				update(it);
+			} else {
+				/* The Tls handshake of an accepted client */
+				update(it);
+				wait(*operation);
+			}
+
+			return false;
+		}
+
+		update(it);
+		operation->m_waiting.resume();
+
+		return true;
+	}
+
+public:
+	/**
+	 * Create the reactor.
+	 */
+	Reactor() = default;
+
+	/**
+	 * Destroy the tasks still running.
+	 */
+	~Reactor()
+	{
+		m_tasks.clear();
+	}
+
+	/**
+	 * Get the listener.
+	 *
+	 * @return the listener
+	 */
+	inline const Listener<Backend> &listener() const noexcept
+	{
+		return m_listener;
+	}
+
+	/**
+	 * Get the number of sockets with a pending operation.
+	 *
+	 * @return the number of sockets
+	 */
+	inline std::size_t size() const noexcept
+	{
+		return m_operations.size();
+	}
+
+	/**
+	 * Get the number of tasks started with spawn and not yet complete.
+	 *
+	 * @return the number of tasks
+	 */
+	inline std::size_t running() const noexcept
+	{
+		return m_tasks.size();
+	}
+
+	/**
+	 * Start a task owned by the reactor, it runs until it suspends.
+	 *
+	 * An exception that escapes the task is rethrown by the next call to poll, the others are lost.
+	 *
+	 * @param task the task
+	 */
+	void spawn(Task<> task)
+	{
+		auto handle = task.release();
+
+		m_tasks.insert(handle.promise(), handle);
+		handle.resume();
+	}
+
+	/**
+	 * Receive some data.
+	 *
+	 * @param socket the socket
+	 * @param data the destination buffer
+	 * @param length the buffer length
+	 * @return the awaitable, the number of bytes received or 0 on disconnection
+	 */
+	template <typename Address, typename Protocol>
+	inline RecvOperation<Address, Protocol> recv(Socket<Address, Protocol> &socket, void *data, unsigned length) noexcept
+	{
+		return RecvOperation<Address, Protocol>(*this, socket, data, length);
+	}
+
+	/**
+	 * Send all the data.
+	 *
+	 * @param socket the socket
+	 * @param data the data, it must stay valid until the operation completes
+	 * @param length the data length
+	 * @return the awaitable, the number of bytes sent
+	 */
+	template <typename Address, typename Protocol>
+	inline SendOperation<Address, Protocol> send(Socket<Address, Protocol> &socket, const void *data, unsigned length) noexcept
+	{
+		return SendOperation<Address, Protocol>(*this, socket, data, length);
+	}
+
+	/**
+	 * Overloaded function.
+	 *
+	 * @param socket the socket
+	 * @param data the data, it must stay valid until the operation completes
+	 * @return the awaitable, the number of bytes sent
+	 */
+	template <typename Address, typename Protocol>
+	inline SendOperation<Address, Protocol> send(Socket<Address, Protocol> &socket, const std::string &data) noexcept
+	{
+		return SendOperation<Address, Protocol>(*this, socket, data.data(), data.size());
+	}
+
+	/**
+	 * Accept a client, including the Tls handshake.
+	 *
+	 * @param master the bound and listening socket
+	 * @param address where to store the client address (optional)
+	 * @return the awaitable, the client
+	 */
+	template <typename Address, typename Protocol>
+	inline AcceptOperation<Address, Protocol> accept(Socket<Address, Protocol> &master, Address *address = nullptr) noexcept
+	{
+		return AcceptOperation<Address, Protocol>(*this, master, address);
+	}
+
+	/**
+	 * Connect to an address, including the Tls handshake.
+	 *
+	 * @param socket the socket
+	 * @param address the address
+	 * @return the awaitable
+	 */
+	template <typename Address, typename Protocol>
+	inline ConnectOperation<Address, Protocol> connect(Socket<Address, Protocol> &socket, Address address)
+	{
+		return ConnectOperation<Address, Protocol>(*this, socket, std::move(address));
+	}
+
+	/**
+	 * Wait for the sockets and resume the tasks whose operation is complete, returns immediately if no operation is
+	 * pending.
+	 *
+	 * @param timeout the timeout in milliseconds
+	 * @return the number of tasks resumed, 0 on timeout
+	 * @throw net::Error on listener errors
+	 * @throw any exception that escaped a spawned task
+	 */
+	unsigned poll(int timeout = -1)
+	{
+		std::vector<ListenerStatus> events;
+		unsigned resumed = 0;
+
+		m_tasks.rethrow();
+
+		/* Nothing to wait for */
+		if (m_operations.empty()) {
+			return 0;
+		}
+
+		try {
+			events = m_listener.waitMultiple(timeout);
+		} catch (const Error &error) {
+			if (error.code() != Error::Timeout) {
+				throw;
+			}
+		}
+
+		/* The tasks resumed may change the operations of the next handles */
+		for (const auto &event : events) {
+			resumed += process(event.socket, event.flags, false);
+			resumed += process(event.socket, event.flags, true);
+		}
+
+		m_tasks.rethrow();
+
+		return resumed;
+	}
+};
+
+/* }}} */
+
+} // !net
+
+} // !malikania
+
+#endif // !__cpp_impl_coroutine
+
+#endif // !_MALIKANIA_COROUTINES_H_
@@ -0,0 +1,450 @@
+/*
+ * RequestClient.h -- pipelined requests on a stream client
+ *
+ * Copyright (c) 2013-2016 Malikania Authors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _MALIKANIA_REQUEST_CLIENT_H_
+#define _MALIKANIA_REQUEST_CLIENT_H_
+
+/**
+ * @file RequestClient.h
+ * @brief Pipelined requests on a stream client
+ */
+
+#include <chrono>
+#include <exception>
+#include <future>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+#include "Json.h"
+#include "Sockets.h"
+#include "Wire.h"
+
+namespace malikania {
+
+namespace wire {
+
+/**
+ * @class RequestClient
+ * @brief Send commands without waiting for the previous responses
+ *
+ * Each request gets a unique "request" field that the server copies in its
+ * response, so many requests can be in flight and the responses may arrive
+ * in any order. A request that gets no response before its timeout, or that
+ * is still pending when the connection is lost, fails with a net::Error.
+ *
+ * The messages received without a known request id, like the ones broadcast
+ * by the server, are passed to the message handler.
+ *
+ * The client owns the read, disconnection and error handlers of the
+ * underlying StreamClient, do not replace them. Like StreamClient, this class
+ * is not thread safe.
+ *
+ * Many clients can share one listener, see the StreamClient constructor with
+ * a listener. The owner then calls dispatch and advance instead of poll.
+ */
+template <typename Address, typename Protocol>
+class RequestClient {
+public:
+	/**
+	 * The underlying client.
+	 */
+	using Client = net::StreamClient<Address, Protocol>;
+
+	/**
+	 * Handler when the response of a request has been received.
+	 */
+	using ResponseHandler = net::Callback<const json::Value &>;
+
+	/**
+	 * Handler when a request has failed, on timeout or disconnection.
+	 */
+	using FailureHandler = net::Callback<const net::Error &>;
+
+	/**
+	 * Handler when a message that is not a response has been received.
+	 */
+	using MessageHandler = net::Callback<const json::Value &>;
+
+	/**
+	 * Handler when disconnected, called after the pending requests have failed.
+	 */
+	using DisconnectionHandler = net::Callback<>;
+
+	/**
+	 * Handler on unrecoverable error, including invalid data from the server.
+	 */
+	using ErrorHandler = net::Callback<const net::Error &>;
+
+private:
+	class Pending {
+	public:
+		ResponseHandler onResponse;
+		FailureHandler onFailure;
+		net::TimerWheel::Id timer;
+	};
+
+	/* Signals */
+	MessageHandler m_onMessage;
+	DisconnectionHandler m_onDisconnection;
+	ErrorHandler m_onError;
+
+	Client m_client;
+	Decoder m_decoder;
+	net::TimerWheel m_timers;
+	std::unordered_map<int, Pending> m_pending;
+	std::chrono::milliseconds m_timeout{10000};
+	int m_next{0};
+
+	RequestClient(const RequestClient &) = delete;
+	RequestClient &operator=(const RequestClient &) = delete;
+
+	std::string encode(const json::Value &message) const
+	{
+		if (m_decoder.mode() == Mode::Binary && m_decoder.deflate()) {
+			return m_decoder.deflate()->encode(message);
+		}
+
+		return wire::encode(message, m_decoder.mode());
+	}
+
+	void fail(int id, const net::Error &error)
+	{
+		auto it = m_pending.find(id);
+
+		if (it == m_pending.end()) {
+			return;
+		}
+
+		auto handler = std::move(it->second.onFailure);
+
+		m_timers.cancel(it->second.timer);
+		m_pending.erase(it);
+		handler(error);
+	}
+
+	/*
+	 * The handlers may send new requests, they are not failed.
+	 */
+	void failAll(const net::Error &error)
+	{
+		auto pending = std::move(m_pending);
+
+		m_pending.clear();
+
+		for (auto &pair : pending) {
+			m_timers.cancel(pair.second.timer);
+		}
+		for (auto &pair : pending) {
+			pair.second.onFailure(error);
+		}
+	}
+
+	void dispatch(const json::Value &message)
+	{
+		auto id = message.find("request");
+
+		if (id != message.end() && id->isInt()) {
+			auto it = m_pending.find(id->toInt());
+
+			if (it != m_pending.end()) {
+				auto handler = std::move(it->second.onResponse);
+
+				m_timers.cancel(it->second.timer);
+				m_pending.erase(it);
+				handler(message);
+
+				return;
+			}
+		}
+
+		m_onMessage(message);
+	}
+
+	void processRead(net::InputBuffer &input)
+	{
+		try {
+			input.consume(m_decoder.split(input.data(), input.size(), [this] (json::Value message) {
+				dispatch(message);
+			}));
+		} catch (const std::exception &ex) {
+			/* The stream can not be resynchronized */
+			net::Error error{net::Error::Other, "read", ex.what()};
+
+			input.clear();
+			failAll(error);
+			m_onError(error);
+		}
+	}
+
+	void init()
+	{
+		m_client.setReadHandler([this] (net::InputBuffer &input) {
+			processRead(input);
+		});
+		m_client.setDisconnectionHandler([this] () {
+			failAll(net::Error{net::Error::Other, "request", "disconnected"});
+			m_onDisconnection();
+		});
+		m_client.setErrorHandler([this] (const net::Error &error) {
+			failAll(error);
+			m_onError(error);
+		});
+	}
+
+public:
+	/**
+	 * Create the client.
+	 *
+	 * @param protocol the protocol (Tcp or Tls)
+	 * @param address the optional address
+	 * @throw net::Error on failures
+	 */
+	RequestClient(Protocol protocol = {}, const Address &address = {})
+		: m_client{std::move(protocol), address}
+		, m_timers{std::chrono::milliseconds{10}}
+	{
+		init();
+	}
+
+	/**
+	 * Create the client with a listener shared with other clients.
+	 *
+	 * @param listener the listener, must outlive the client
+	 * @param protocol the protocol (Tcp or Tls)
+	 * @param address the optional address
+	 * @throw net::Error on failures
+	 */
+	RequestClient(net::Listener<> &listener, Protocol protocol = {}, const Address &address = {})
+		: m_client{listener, std::move(protocol), address}
+		, m_timers{std::chrono::milliseconds{10}}
+	{
+		init();
+	}
+
+	/**
+	 * Get the underlying client, to connect and set the other handlers.
+	 *
+	 * @return the client
+	 */
+	inline Client &client() noexcept
+	{
+		return m_client;
+	}
+
+	/**
+	 * Get the decoder, its mode and compression are also used to encode the messages sent.
+	 *
+	 * @return the decoder
+	 */
+	inline Decoder &decoder() noexcept
+	{
+		return m_decoder;
+	}
+
+	/**
+	 * Set the message handler.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setMessageHandler(MessageHandler handler)
+	{
+		m_onMessage = std::move(handler);
+	}
+
+	/**
+	 * Set the disconnection handler.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setDisconnectionHandler(DisconnectionHandler handler)
+	{
+		m_onDisconnection = std::move(handler);
+	}
+
+	/**
+	 * Set the error handler.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setErrorHandler(ErrorHandler handler)
+	{
+		m_onError = std::move(handler);
+	}
+
+	/**
+	 * Get the default timeout.
+	 *
+	 * @return the timeout
+	 */
+	inline std::chrono::milliseconds timeout() const noexcept
+	{
+		return m_timeout;
+	}
+
+	/**
+	 * Set the timeout used by the requests that do not specify one.
+	 *
+	 * @param timeout the timeout
+	 */
+	inline void setTimeout(std::chrono::milliseconds timeout) noexcept
+	{
+		m_timeout = timeout;
+	}
+
+	/**
+	 * Get the number of requests waiting for a response.
+	 *
+	 * @return the number of requests
+	 */
+	inline std::size_t pending() const noexcept
+	{
+		return m_pending.size();
+	}
+
+	/**
+	 * Send a message that does not expect a response.
+	 *
+	 * @param message the message
+	 * @throw std::invalid_argument in binary mode, see pack
+	 */
+	void send(const json::Value &message)
+	{
+		m_client.send(encode(message));
+	}
+
+	/**
+	 * Send a request.
+	 *
+	 * The request field of the message is replaced. The handlers are called from poll, exactly one of them is
+	 * called unless the request is cancelled.
+	 *
+	 * @param message the message
+	 * @param onResponse the response handler
+	 * @param onFailure the optional failure handler
+	 * @param timeout the timeout, zero for the default one
+	 * @return the request id
+	 * @throw std::invalid_argument in binary mode, see pack
+	 */
+	int request(json::Value message,
+		    ResponseHandler onResponse,
+		    FailureHandler onFailure = nullptr,
+		    std::chrono::milliseconds timeout = std::chrono::milliseconds::zero())
+	{
+		/* Never reuse the id of a pending request */
+		do {
+			m_next = m_next == std::numeric_limits<int>::max() ? 1 : m_next + 1;
+		} while (m_pending.count(m_next) != 0);
+
+		auto id = m_next;
+
+		message.erase("request");
+		message.insert("request", id);
+
+		auto data = encode(message);
+		auto timer = m_timers.schedule(timeout == std::chrono::milliseconds::zero() ? m_timeout : timeout, [this, id] () {
+			fail(id, net::Error{net::Error::Timeout, "request", "no response"});
+		});
+
+		m_pending.emplace(id, Pending{std::move(onResponse), std::move(onFailure), timer});
+		m_client.send(std::move(data));
+
+		return id;
+	}
+
+	/**
+	 * Overloaded function.
+	 *
+	 * The future is ready once poll has received the response, it holds the net::Error if the request failed.
+	 *
+	 * @param message the message
+	 * @param timeout the timeout, zero for the default one
+	 * @return the future response
+	 * @throw std::invalid_argument in binary mode, see pack
+	 */
+	std::future<json::Value> request(json::Value message, std::chrono::milliseconds timeout = std::chrono::milliseconds::zero())
+	{
+		auto promise = std::make_shared<std::promise<json::Value>>();
+		auto future = promise->get_future();
+
+		request(std::move(message), [promise] (const json::Value &response) {
+			promise->set_value(response);
+		}, [promise] (const net::Error &error) {
+			promise->set_exception(std::make_exception_ptr(error));
+		}, timeout);
+
+		return future;
+	}
+
+	/**
+	 * Forget a pending request, none of its handlers will be called.
+	 *
+	 * @param id the request id
+	 * @return true if the request was pending
+	 */
+	bool cancel(int id)
+	{
+		auto it = m_pending.find(id);
+
+		if (it == m_pending.end()) {
+			return false;
+		}
+
+		m_timers.cancel(it->second.timer);
+		m_pending.erase(it);
+
+		return true;
+	}
+
+	/**
+	 * Wait for the next event, the wait is shortened for the next request timeout.
+	 *
+	 * @param timeout the time to wait in milliseconds
+	 */
+	void poll(int timeout = -1)
+	{
+		m_client.poll(m_timers.timeout(timeout));
+		m_timers.advance();
+	}
+
+	/**
+	 * Process an event of a shared listener for client().handle().
+	 *
+	 * @param status the event
+	 */
+	void dispatch(const net::ListenerStatus &status)
+	{
+		m_client.dispatch(status);
+		m_timers.advance();
+	}
+
+	/**
+	 * Fail the requests whose timeout has expired, with a shared listener this must be called regularly.
+	 */
+	inline void advance()
+	{
+		m_timers.advance();
+	}
+};
+
+} // !wire
+
+} // !malikania
+
+#endif // !_MALIKANIA_REQUEST_CLIENT_H_
@@ -20,11 +20,24 @@
 
 #include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cstring>
+#include <iterator>
+#include <limits>
 #include <mutex>
+#include <random>
 
 #include "Sockets.h"
 
+#if !defined(SOCKET_NO_SSL)
+#  include <openssl/rand.h>
+#  if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#    include <openssl/core_names.h>
+#  else
+#    include <openssl/hmac.h>
+#  endif
+#endif
+
 namespace malikania {
 
 namespace net {
@@ -209,6 +222,184 @@ Error::Error(Code code, std::string function, std::string error)
 
 /* }}} */
 
+/*
+ * TLS sessions
+ * ------------------------------------------------------------------
+ */
+
+/* {{{ TLS sessions */
+
+#if !defined(SOCKET_NO_SSL)
+
+namespace ssl {
+
+namespace {
+
+/*
+ * Called by OpenSSL to encrypt a new ticket (enc = 1) or to decrypt a ticket presented by a client (enc = 0), see
+ * SSL_CTX_set_tlsext_ticket_key_cb. The TicketKeys object is stored in the context application data.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+
+int ticketCallback(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int enc)
+{
+	auto keys = static_cast<TicketKeys *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+	TicketKeys::Key key;
+	int result = 1;
+
+	try {
+		if (enc) {
+			key = keys->current();
+
+			if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1) {
+				return -1;
+			}
+
+			std::memcpy(name, key.name, sizeof (key.name));
+		} else if ((result = keys->find(name, key)) == 0) {
+			return 0;
+		}
+	} catch (...) {
+		return -1;
+	}
+
+	char digest[] = "SHA256";
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac, sizeof (key.hmac)),
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+		OSSL_PARAM_construct_end()
+	};
+
+	if (EVP_CipherInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes, iv, enc) != 1 ||
+	    EVP_MAC_CTX_set_params(mac, params) != 1) {
+		return -1;
+	}
+
+	return result;
+}
+
+#else
+
+int ticketCallback(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cipher, HMAC_CTX *mac, int enc)
+{
+	auto keys = static_cast<TicketKeys *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+	TicketKeys::Key key;
+	int result = 1;
+
+	try {
+		if (enc) {
+			key = keys->current();
+
+			if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1) {
+				return -1;
+			}
+
+			std::memcpy(name, key.name, sizeof (key.name));
+		} else if ((result = keys->find(name, key)) == 0) {
+			return 0;
+		}
+	} catch (...) {
+		return -1;
+	}
+
+	if (EVP_CipherInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes, iv, enc) != 1 ||
+	    HMAC_Init_ex(mac, key.hmac, sizeof (key.hmac), EVP_sha256(), nullptr) != 1) {
+		return -1;
+	}
+
+	return result;
+}
+
+#endif
+
+} // !namespace
+
+TicketKeys::TicketKeys(std::chrono::seconds interval, std::size_t count)
+	: m_interval{interval}
+	, m_count{count == 0 ? 1 : count}
+{
+	generate();
+}
+
+void TicketKeys::generate()
+{
+	Key key;
+
+	if (RAND_bytes(key.name, sizeof (key.name)) != 1 ||
+	    RAND_bytes(key.aes, sizeof (key.aes)) != 1 ||
+	    RAND_bytes(key.hmac, sizeof (key.hmac)) != 1) {
+		throw Error{Error::System, "RAND_bytes", "unable to generate ticket key"};
+	}
+
+	key.created = std::chrono::steady_clock::now();
+
+	m_keys.push_front(key);
+
+	while (m_keys.size() > m_count) {
+		m_keys.pop_back();
+	}
+}
+
+void TicketKeys::rotate()
+{
+	std::lock_guard<std::mutex> lock{m_mutex};
+
+	generate();
+	++m_rotations;
+}
+
+TicketKeys::Key TicketKeys::current()
+{
+	std::lock_guard<std::mutex> lock{m_mutex};
+
+	if (std::chrono::steady_clock::now() - m_keys.front().created >= m_interval) {
+		generate();
+		++m_rotations;
+	}
+
+	return m_keys.front();
+}
+
+int TicketKeys::find(const unsigned char *name, Key &key) const
+{
+	std::lock_guard<std::mutex> lock{m_mutex};
+
+	for (std::size_t i = 0; i < m_keys.size(); ++i) {
+		if (std::memcmp(m_keys[i].name, name, sizeof (m_keys[i].name)) == 0) {
+			key = m_keys[i];
+
+			/* Tickets encrypted with an older key are renewed */
+			return i == 0 ? 1 : 2;
+		}
+	}
+
+	return 0;
+}
+
+std::size_t TicketKeys::size() const
+{
+	std::lock_guard<std::mutex> lock{m_mutex};
+
+	return m_keys.size();
+}
+
+void TicketKeys::install(SSL_CTX *context)
+{
+	SSL_CTX_set_app_data(context, this);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(context, ticketCallback);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(context, ticketCallback);
+#endif
+}
+
+} // !ssl
+
+#endif // !SOCKET_NO_SSL
+
+/* }}} */
+
 /*
  * Predefine addressed to be used
  * ------------------------------------------------------------------
@@ -282,10 +473,13 @@ Ip::Ip(const sockaddr_storage *ss, socklen_t length) noexcept
 {
 	assert(ss->ss_family == AF_INET6 || ss->ss_family == AF_INET);
 
+	/* The length may come from outside (e.g. Handoff), never copy past the address */
 	if (ss->ss_family == AF_INET6) {
-		std::memcpy(&m_sin6, ss, length);
+		m_length = std::min<socklen_t>(length, sizeof (sockaddr_in6));
+		std::memcpy(&m_sin6, ss, m_length);
 	} else if (ss->ss_family == AF_INET) {
-		std::memcpy(&m_sin, ss, length);
+		m_length = std::min<socklen_t>(length, sizeof (sockaddr_in));
+		std::memcpy(&m_sin, ss, m_length);
 	}
 }
 
@@ -316,8 +510,11 @@ Local::Local(const sockaddr_storage *ss, socklen_t length) noexcept
 {
 	assert(ss->ss_family == AF_LOCAL);
 
+	std::memset(&m_sun, 0, sizeof (sockaddr_un));
+
 	if (ss->ss_family == AF_LOCAL) {
-		std::memcpy(&m_sun, ss, length);
+		/* Keep the last byte for the terminator of sun_path */
+		std::memcpy(&m_sun, ss, std::min<std::size_t>(length, sizeof (sockaddr_un) - 1));
 		m_path = reinterpret_cast<const sockaddr_un &>(m_sun).sun_path;
 	}
 }
@@ -359,8 +556,8 @@ std::vector<ListenerStatus> Select::wait(const ListenerTable &table, int ms)
 		}
 	}
 
-	maxwait.tv_sec = 0;
-	maxwait.tv_usec = ms * 1000;
+	maxwait.tv_sec = ms / 1000;
+	maxwait.tv_usec = (ms % 1000) * 1000;
 
 	// Set to nullptr for infinite timeout.
 	towait = (ms < 0) ? nullptr : &maxwait;
@@ -448,29 +645,37 @@ Condition Poll::toCondition(short &event) const noexcept
 void Poll::set(const ListenerTable &, Handle h, Condition condition, bool add)
 {
 	if (add) {
+		m_positions.emplace(h, m_fds.size());
 		m_fds.push_back(pollfd{h, toPoll(condition), 0});
 	} else {
-		auto it = std::find_if(m_fds.begin(), m_fds.end(), [&] (const pollfd &pfd) {
-			return pfd.fd == h;
-		});
-
-		it->events |= toPoll(condition);
+		m_fds[m_positions.at(h)].events |= toPoll(condition);
 	}
 }
 
 void Poll::unset(const ListenerTable &, Handle h, Condition condition, bool remove)
 {
-	auto it = std::find_if(m_fds.begin(), m_fds.end(), [&] (const pollfd &pfd) {
-		return pfd.fd == h;
-	});
+	auto it = m_positions.find(h);
+	auto position = it->second;
 
 	if (remove) {
-		m_fds.erase(it);
+		/* Move the last entry to the removed place */
+		if (position != m_fds.size() - 1) {
+			m_fds[position] = m_fds.back();
+			m_positions.find(m_fds[position].fd)->second = position;
+		}
+
+		m_fds.pop_back();
+		m_positions.erase(it);
 	} else {
-		it->events &= ~(toPoll(condition));
+		m_fds[position].events &= ~(toPoll(condition));
 	}
 }
 
+void Poll::modify(const ListenerTable &, Handle h, Condition condition)
+{
+	m_fds[m_positions.at(h)].events = toPoll(condition);
+}
+
 std::vector<ListenerStatus> Poll::wait(const ListenerTable &, int ms)
 {
 	auto result = poll(m_fds.data(), m_fds.size(), ms);
@@ -482,9 +687,13 @@ std::vector<ListenerStatus> Poll::wait(const ListenerTable &, int ms)
 	}
 
 	std::vector<ListenerStatus> sockets;
-	for (auto &fd : m_fds) {
-		if (fd.revents != 0) {
-			sockets.push_back(ListenerStatus{fd.fd, toCondition(fd.revents)});
+
+	sockets.reserve(result);
+
+	/* Stop as soon as all the ready sockets have been found */
+	for (auto it = m_fds.begin(); it != m_fds.end() && sockets.size() < static_cast<std::size_t>(result); ++it) {
+		if (it->revents != 0) {
+			sockets.push_back(ListenerStatus{it->fd, toCondition(it->revents)});
 		}
 	}
 
@@ -592,6 +801,11 @@ void Epoll::unset(const ListenerTable &table, Handle sc, Condition condition, bo
 	}
 }
 
+void Epoll::modify(const ListenerTable &, Handle sc, Condition condition)
+{
+	update(sc, EPOLL_CTL_MOD, toEpoll(condition));
+}
+
 std::vector<ListenerStatus> Epoll::wait(const ListenerTable &, int ms)
 {
 	int ret = epoll_wait(m_handle, m_events.data(), m_events.size(), ms);
@@ -615,6 +829,280 @@ std::vector<ListenerStatus> Epoll::wait(const ListenerTable &, int ms)
 
 /* }}} */
 
+/*
+ * IoUring implementation
+ * ------------------------------------------------------------------
+ */
+
+/* {{{ IoUring */
+
+#if defined(SOCKET_HAVE_IO_URING)
+
+namespace {
+
+/*
+ * The user data of poll requests is the generation in the high bits and the handle in the low bits, the
+ * generation is never 0 so that 0 identifies the cancellation requests.
+ */
+inline std::uint64_t key(Handle h, std::uint32_t generation) noexcept
+{
+	return (static_cast<std::uint64_t>(generation) << 32) | static_cast<std::uint32_t>(h);
+}
+
+} // !namespace
+
+IoUring::IoUring(unsigned entries)
+{
+	int error = io_uring_queue_init(entries, &m_ring, 0);
+
+	if (error < 0) {
+		throw Error{Error::System, "io_uring_queue_init", -error};
+	}
+}
+
+IoUring::~IoUring()
+{
+	/* The ring is torn down asynchronously, release the sockets now so that their address can be bound again */
+	try {
+		for (auto &pair : m_entries) {
+			cancel(pair.first, pair.second);
+		}
+
+		io_uring_submit(&m_ring);
+	} catch (...) {
+	}
+
+	io_uring_queue_exit(&m_ring);
+}
+
+unsigned IoUring::toPoll(Condition condition) const noexcept
+{
+	unsigned result = 0;
+
+	if ((condition & Condition::Readable) == Condition::Readable) {
+		result |= POLLIN;
+	}
+	if ((condition & Condition::Writable) == Condition::Writable) {
+		result |= POLLOUT;
+	}
+
+	return result;
+}
+
+Condition IoUring::toCondition(int mask) const noexcept
+{
+	Condition condition{Condition::None};
+
+	/* Like Epoll, errors and hang up are reported as readable so that recv() gets the result */
+	if (mask < 0 || (mask & (POLLIN | POLLHUP | POLLERR))) {
+		condition |= Condition::Readable;
+	}
+	if (mask > 0 && (mask & POLLOUT)) {
+		condition |= Condition::Writable;
+	}
+
+	return condition;
+}
+
+io_uring_sqe *IoUring::sqe()
+{
+	io_uring_sqe *sqe = io_uring_get_sqe(&m_ring);
+
+	/* Submission queue full, flush it without waiting */
+	if (sqe == nullptr) {
+		int error = io_uring_submit(&m_ring);
+
+		if (error < 0) {
+			throw Error{Error::System, "io_uring_submit", -error};
+		}
+
+		sqe = io_uring_get_sqe(&m_ring);
+
+		if (sqe == nullptr) {
+			throw Error{Error::Other, "io_uring_get_sqe", "submission queue full"};
+		}
+	}
+
+	return sqe;
+}
+
+void IoUring::queue(Handle h, Entry &entry)
+{
+	if (!entry.queued) {
+		entry.queued = true;
+		m_pending.push_back(h);
+	}
+}
+
+void IoUring::cancel(Handle h, Entry &entry)
+{
+	if (entry.generation != 0) {
+		io_uring_sqe *request = sqe();
+
+		io_uring_prep_poll_remove(request, key(h, entry.generation));
+		io_uring_sqe_set_data64(request, 0);
+		entry.generation = 0;
+	}
+}
+
+void IoUring::arm(Handle h, Entry &entry)
+{
+	if (++m_generation == 0) {
+		m_generation = 1;
+	}
+
+	io_uring_sqe *request = sqe();
+
+	io_uring_prep_poll_add(request, h, toPoll(entry.condition));
+	io_uring_sqe_set_data64(request, key(h, m_generation));
+	entry.generation = m_generation;
+}
+
+void IoUring::set(const ListenerTable &table, Handle h, Condition condition, bool add)
+{
+	if (add) {
+		auto it = m_entries.emplace(h, Entry{}).first;
+
+		it->second.condition = condition;
+		queue(h, it->second);
+	} else {
+		auto it = m_entries.find(h);
+
+		it->second.condition = table.at(h) | condition;
+		cancel(h, it->second);
+		queue(h, it->second);
+	}
+}
+
+void IoUring::unset(const ListenerTable &table, Handle h, Condition condition, bool remove)
+{
+	auto it = m_entries.find(h);
+
+	cancel(h, it->second);
+
+	if (remove) {
+		/*
+		 * A pending poll request holds a reference to the file, the socket is usually closed just after and
+		 * would stay open until the next wait, submit the cancellation now.
+		 */
+		int error = io_uring_submit(&m_ring);
+
+		m_entries.erase(it);
+
+		if (error < 0) {
+			throw Error{Error::System, "io_uring_submit", -error};
+		}
+	} else {
+		it->second.condition = table.at(h) & ~(condition);
+		queue(h, it->second);
+	}
+}
+
+void IoUring::modify(const ListenerTable &, Handle h, Condition condition)
+{
+	auto it = m_entries.find(h);
+
+	it->second.condition = condition;
+	cancel(h, it->second);
+	queue(h, it->second);
+}
+
+std::vector<ListenerStatus> IoUring::reap()
+{
+	std::vector<ListenerStatus> result;
+	io_uring_cqe *cqes[256];
+	unsigned count;
+
+	while ((count = io_uring_peek_batch_cqe(&m_ring, cqes, 256)) > 0) {
+		for (unsigned i = 0; i < count; ++i) {
+			auto data = io_uring_cqe_get_data64(cqes[i]);
+			auto h = static_cast<Handle>(data & 0xffffffff);
+			auto generation = static_cast<std::uint32_t>(data >> 32);
+
+			/* Cancellation or request of a socket modified or removed since */
+			if (generation == 0 || cqes[i]->res == -ECANCELED) {
+				continue;
+			}
+
+			auto it = m_entries.find(h);
+
+			if (it == m_entries.end() || it->second.generation != generation) {
+				continue;
+			}
+
+			/* One-shot request, arm it again on the next wait */
+			it->second.generation = 0;
+			queue(h, it->second);
+			result.push_back(ListenerStatus{h, toCondition(cqes[i]->res)});
+		}
+
+		io_uring_cq_advance(&m_ring, count);
+	}
+
+	return result;
+}
+
+std::vector<ListenerStatus> IoUring::wait(const ListenerTable &, int ms)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms < 0 ? 0 : ms);
+
+	for (;;) {
+		/* Arm the new and modified sockets, they are submitted with the wait */
+		for (auto h : m_pending) {
+			auto it = m_entries.find(h);
+
+			if (it != m_entries.end()) {
+				it->second.queued = false;
+
+				if (it->second.generation == 0) {
+					arm(h, it->second);
+				}
+			}
+		}
+
+		m_pending.clear();
+
+		int error;
+
+		if (ms < 0) {
+			error = io_uring_submit_and_wait(&m_ring, 1);
+		} else {
+			auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(
+				deadline - std::chrono::steady_clock::now()).count();
+			__kernel_timespec ts;
+			io_uring_cqe *cqe = nullptr;
+
+			if (remaining < 0) {
+				remaining = 0;
+			}
+
+			ts.tv_sec = remaining / 1000000000LL;
+			ts.tv_nsec = remaining % 1000000000LL;
+			error = io_uring_submit_and_wait_timeout(&m_ring, &cqe, 1, &ts, nullptr);
+		}
+
+		if (error < 0 && error != -ETIME && error != -EINTR) {
+			throw Error{Error::System, "io_uring_enter", -error};
+		}
+
+		/* Reap even on timeout, a completion may have arrived with it */
+		auto result = reap();
+
+		if (!result.empty()) {
+			return result;
+		}
+
+		/* Only stale or cancelled completions, wait again with the remaining time */
+		if (error == -ETIME || (ms >= 0 && std::chrono::steady_clock::now() >= deadline)) {
+			throw Error{Error::Timeout, "io_uring", TIMEOUT_MSG};
+		}
+	}
+}
+
+#endif // !SOCKET_HAVE_IO_URING
+
+/* }}} */
+
 /*
  * Kqueue implementation
  * ------------------------------------------------------------------
@@ -676,6 +1164,28 @@ void Kqueue::unset(const ListenerTable &, Handle h, Condition condition, bool re
 	}
 }
 
+void Kqueue::modify(const ListenerTable &table, Handle h, Condition condition)
+{
+	struct kevent ev[2];
+	int count = 0;
+
+	/* Flags are both added and removed, so each filter changes, submit them in one call */
+	if ((condition & Condition::Readable) == Condition::Readable) {
+		EV_SET(&ev[count++], h, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, nullptr);
+	} else if ((table.at(h) & Condition::Readable) == Condition::Readable) {
+		EV_SET(&ev[count++], h, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+	}
+	if ((condition & Condition::Writable) == Condition::Writable) {
+		EV_SET(&ev[count++], h, EVFILT_WRITE, EV_ADD | EV_ENABLE, 0, 0, nullptr);
+	} else if ((table.at(h) & Condition::Writable) == Condition::Writable) {
+		EV_SET(&ev[count++], h, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+	}
+
+	if (kevent(m_handle, ev, count, nullptr, 0, nullptr) < 0) {
+		throw Error{Error::System, "kevent"};
+	}
+}
+
 std::vector<ListenerStatus> Kqueue::wait(const ListenerTable &, int ms)
 {
 	std::vector<ListenerStatus> sockets;
@@ -708,6 +1218,1350 @@ std::vector<ListenerStatus> Kqueue::wait(const ListenerTable &, int ms)
 
 /* }}} */
 
+/*
+ * Wakeup
+ * ------------------------------------------------------------------
+ */
+
+/* {{{ Wakeup */
+
+#if defined(_WIN32)
+
+Wakeup::Wakeup()
+{
+	sockaddr_in sin;
+	int length = sizeof (sin);
+	u_long mode = 1;
+
+	std::memset(&sin, 0, sizeof (sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((m_read = ::socket(AF_INET, SOCK_DGRAM, 0)) == Invalid) {
+		throw Error{Error::System, "socket"};
+	}
+	if (::bind(m_read, reinterpret_cast<sockaddr *>(&sin), sizeof (sin)) == Failure ||
+	    ::getsockname(m_read, reinterpret_cast<sockaddr *>(&sin), &length) == Failure ||
+	    ::connect(m_read, reinterpret_cast<sockaddr *>(&sin), length) == Failure ||
+	    ::ioctlsocket(m_read, FIONBIO, &mode) == Failure) {
+		Error error{Error::System, "wakeup"};
+
+		::closesocket(m_read);
+		throw error;
+	}
+
+	/* The socket sends to itself */
+	m_write = m_read;
+}
+
+Wakeup::~Wakeup()
+{
+	::closesocket(m_read);
+}
+
+void Wakeup::notify() noexcept
+{
+	char byte = 0;
+
+	::send(m_write, &byte, 1, 0);
+}
+
+void Wakeup::clear() noexcept
+{
+	char buffer[64];
+
+	while (::recv(m_read, buffer, sizeof (buffer), 0) > 0) {
+		continue;
+	}
+}
+
+#elif defined(__linux__)
+
+Wakeup::Wakeup()
+{
+	if ((m_read = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		throw Error{Error::System, "eventfd"};
+	}
+
+	m_write = m_read;
+}
+
+Wakeup::~Wakeup()
+{
+	::close(m_read);
+}
+
+void Wakeup::notify() noexcept
+{
+	std::uint64_t value = 1;
+
+	(void)::write(m_write, &value, sizeof (value));
+}
+
+void Wakeup::clear() noexcept
+{
+	std::uint64_t value;
+
+	(void)::read(m_read, &value, sizeof (value));
+}
+
+#else
+
+Wakeup::Wakeup()
+{
+	int fds[2];
+
+	if (::pipe(fds) < 0) {
+		throw Error{Error::System, "pipe"};
+	}
+
+	for (int fd : fds) {
+		::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+		::fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+
+	m_read = fds[0];
+	m_write = fds[1];
+}
+
+Wakeup::~Wakeup()
+{
+	::close(m_read);
+	::close(m_write);
+}
+
+void Wakeup::notify() noexcept
+{
+	char byte = 0;
+
+	/* If the pipe is full, the listener is already woken up */
+	(void)::write(m_write, &byte, 1);
+}
+
+void Wakeup::clear() noexcept
+{
+	char buffer[64];
+
+	while (::read(m_read, buffer, sizeof (buffer)) > 0) {
+		continue;
+	}
+}
+
+#endif
+
+/* }}} */
+
+/*
+ * Handoff
+ * ------------------------------------------------------------------
+ */
+
+/* {{{ Handoff */
+
+#if !defined(_WIN32)
+
+namespace {
+
+#if defined(MSG_NOSIGNAL)
+const int handoffSendFlags = MSG_NOSIGNAL;
+#else
+const int handoffSendFlags = 0;
+#endif
+
+#if defined(MSG_CMSG_CLOEXEC)
+const int handoffRecvFlags = MSG_WAITALL | MSG_CMSG_CLOEXEC;
+#else
+const int handoffRecvFlags = MSG_WAITALL;
+#endif
+
+/*
+ * Each record is a header (type and payload length) followed by the payload, the descriptor is attached to the
+ * header so the receiver gets it with the first recvmsg.
+ */
+enum class Record : std::uint32_t {
+	Master,
+	Client,
+	End
+};
+
+union Control {
+	cmsghdr header;
+	char buffer[CMSG_SPACE(sizeof (int))];
+};
+
+void append(std::string &payload, const std::string &value)
+{
+	auto length = static_cast<std::uint32_t>(value.size());
+
+	payload.append(reinterpret_cast<const char *>(&length), sizeof (length));
+	payload.append(value);
+}
+
+std::string extract(const std::string &payload, std::size_t &offset)
+{
+	std::uint32_t length;
+
+	if (payload.size() - offset < sizeof (length)) {
+		throw Error{Error::Other, "handoff", "truncated record"};
+	}
+
+	std::memcpy(&length, payload.data() + offset, sizeof (length));
+	offset += sizeof (length);
+
+	if (payload.size() - offset < length) {
+		throw Error{Error::Other, "handoff", "truncated record"};
+	}
+
+	offset += length;
+
+	return payload.substr(offset - length, length);
+}
+
+void sendAll(Handle channel, const char *data, std::size_t length)
+{
+	while (length > 0) {
+		auto n = ::send(channel, data, length, handoffSendFlags);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			throw Error{Error::System, "send"};
+		}
+
+		data += n;
+		length -= n;
+	}
+}
+
+void recvAll(Handle channel, char *data, std::size_t length)
+{
+	while (length > 0) {
+		auto n = ::recv(channel, data, length, MSG_WAITALL);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			throw Error{Error::System, "recv"};
+		}
+		if (n == 0) {
+			throw Error{Error::Other, "handoff", "connection closed"};
+		}
+
+		data += n;
+		length -= n;
+	}
+}
+
+void sendRecord(Handle channel, Record type, const std::string &payload, Handle handle)
+{
+	std::uint32_t header[2] = { static_cast<std::uint32_t>(type), static_cast<std::uint32_t>(payload.size()) };
+	iovec iov[2];
+	msghdr msg;
+	Control control;
+
+	std::memset(&msg, 0, sizeof (msg));
+	std::memset(&control, 0, sizeof (control));
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof (header);
+	iov[1].iov_base = const_cast<char *>(payload.data());
+	iov[1].iov_len = payload.size();
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	if (handle != Invalid) {
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof (control.buffer);
+
+		auto cmsg = CMSG_FIRSTHDR(&msg);
+
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+		std::memcpy(CMSG_DATA(cmsg), &handle, sizeof (int));
+	}
+
+	ssize_t n;
+
+	while ((n = ::sendmsg(channel, &msg, handoffSendFlags)) < 0 && errno == EINTR) {
+		continue;
+	}
+
+	if (n < 0) {
+		throw Error{Error::System, "sendmsg"};
+	}
+
+	/* The descriptor went with the first byte, the rest is plain data */
+	std::size_t sent = n;
+
+	if (sent < sizeof (header)) {
+		sendAll(channel, reinterpret_cast<const char *>(header) + sent, sizeof (header) - sent);
+		sent = sizeof (header);
+	}
+
+	sendAll(channel, payload.data() + (sent - sizeof (header)), payload.size() - (sent - sizeof (header)));
+}
+
+Record recvRecord(Handle channel, std::string &payload, Handle &handle)
+{
+	std::uint32_t header[2];
+	iovec iov;
+	msghdr msg;
+	Control control;
+
+	std::memset(&msg, 0, sizeof (msg));
+
+	iov.iov_base = header;
+	iov.iov_len = sizeof (header);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof (control.buffer);
+
+	ssize_t n;
+
+	while ((n = ::recvmsg(channel, &msg, handoffRecvFlags)) < 0 && errno == EINTR) {
+		continue;
+	}
+
+	if (n < 0) {
+		throw Error{Error::System, "recvmsg"};
+	}
+	if (n == 0) {
+		throw Error{Error::Other, "handoff", "connection closed"};
+	}
+
+	handle = Invalid;
+
+	for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len >= CMSG_LEN(sizeof (int))) {
+			std::memcpy(&handle, CMSG_DATA(cmsg), sizeof (int));
+		}
+	}
+
+	try {
+		if (msg.msg_flags & MSG_CTRUNC) {
+			throw Error{Error::Other, "handoff", "descriptor truncated"};
+		}
+		if (static_cast<std::size_t>(n) < sizeof (header)) {
+			recvAll(channel, reinterpret_cast<char *>(header) + n, sizeof (header) - n);
+		}
+
+		payload.resize(header[1]);
+		recvAll(channel, &payload[0], payload.size());
+	} catch (...) {
+		if (handle != Invalid) {
+			::close(handle);
+		}
+
+		throw;
+	}
+
+	return static_cast<Record>(header[0]);
+}
+
+} // !namespace
+
+void Handoff::send(Handle channel) const
+{
+	if (master != Invalid) {
+		sendRecord(channel, Record::Master, "", master);
+	}
+
+	for (const auto &client : clients) {
+		std::string payload;
+
+		append(payload, client.address);
+		append(payload, client.input);
+		append(payload, client.output);
+		append(payload, client.state);
+		sendRecord(channel, Record::Client, payload, client.handle);
+	}
+
+	sendRecord(channel, Record::End, "", Invalid);
+}
+
+Handoff Handoff::receive(Handle channel)
+{
+	Handoff handoff;
+
+	try {
+		for (;;) {
+			std::string payload;
+			Handle handle;
+			Record type = recvRecord(channel, payload, handle);
+
+			if (type != Record::Master && type != Record::Client) {
+				if (handle != Invalid) {
+					::close(handle);
+				}
+				if (type != Record::End) {
+					throw Error{Error::Other, "handoff", "invalid record"};
+				}
+
+				break;
+			}
+			if (handle == Invalid) {
+				throw Error{Error::Other, "handoff", "missing descriptor"};
+			}
+
+			if (type == Record::Master) {
+				if (handoff.master != Invalid) {
+					::close(handoff.master);
+				}
+
+				handoff.master = handle;
+			} else {
+				std::size_t offset = 0;
+
+				/* Owned from now, closed on errors */
+				handoff.clients.emplace_back();
+				handoff.clients.back().handle = handle;
+				handoff.clients.back().address = extract(payload, offset);
+				handoff.clients.back().input = extract(payload, offset);
+				handoff.clients.back().output = extract(payload, offset);
+				handoff.clients.back().state = extract(payload, offset);
+			}
+		}
+	} catch (...) {
+		handoff.close();
+		throw;
+	}
+
+	return handoff;
+}
+
+void Handoff::close() noexcept
+{
+	if (master != Invalid) {
+		::close(master);
+		master = Invalid;
+	}
+
+	for (auto &client : clients) {
+		if (client.handle != Invalid) {
+			::close(client.handle);
+			client.handle = Invalid;
+		}
+	}
+}
+
+#endif // !_WIN32
+
+/* }}} */
+
+/*
+ * TimerWheel
+ * ------------------------------------------------------------------
+ */
+
+/* {{{ TimerWheel */
+
+namespace {
+
+unsigned lowest(std::uint64_t value) noexcept
+{
+	assert(value != 0);
+
+#if defined(__GNUC__)
+	return static_cast<unsigned>(__builtin_ctzll(value));
+#else
+	unsigned index = 0;
+
+	while ((value & 1) == 0) {
+		value >>= 1;
+		++index;
+	}
+
+	return index;
+#endif
+}
+
+} // !namespace
+
+constexpr std::uint32_t TimerWheel::npos;
+
+TimerWheel::TimerWheel(std::chrono::milliseconds resolution, Clock::time_point origin)
+	: m_resolution{resolution}
+	, m_origin{origin}
+{
+	assert(resolution.count() > 0);
+
+	std::fill(std::begin(m_heads), std::end(m_heads), npos);
+}
+
+std::uint64_t TimerWheel::ticks(std::chrono::milliseconds delay) const noexcept
+{
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(delay).count();
+
+	if (ns <= 0) {
+		return 1;
+	}
+
+	/* Rounded up, the timer never expires early */
+	return static_cast<std::uint64_t>((ns + m_resolution.count() - 1) / m_resolution.count());
+}
+
+std::uint64_t TimerWheel::tick(Clock::time_point when) const noexcept
+{
+	if (when <= m_origin) {
+		return 0;
+	}
+
+	return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(when - m_origin) / m_resolution);
+}
+
+std::uint32_t TimerWheel::find(Id id) const noexcept
+{
+	auto index = static_cast<std::uint32_t>(id & 0xffffffffU);
+
+	if (index >= m_nodes.size() || m_nodes[index].generation != (id >> 32)) {
+		return npos;
+	}
+
+	auto slot = m_nodes[index].slot;
+
+	return (slot == none || slot == cancelled) ? npos : index;
+}
+
+void TimerWheel::link(std::uint32_t index, std::uint32_t slot) noexcept
+{
+	auto &node = m_nodes[index];
+
+	node.prev = npos;
+	node.next = m_heads[slot];
+	node.slot = slot;
+
+	if (node.next != npos) {
+		m_nodes[node.next].prev = index;
+	}
+
+	m_heads[slot] = index;
+
+	if (slot < overflow) {
+		m_bitmaps[slot / slots] |= std::uint64_t(1) << (slot % slots);
+	}
+}
+
+void TimerWheel::unlink(std::uint32_t index) noexcept
+{
+	auto &node = m_nodes[index];
+
+	if (node.prev != npos) {
+		m_nodes[node.prev].next = node.next;
+	} else {
+		m_heads[node.slot] = node.next;
+	}
+	if (node.next != npos) {
+		m_nodes[node.next].prev = node.prev;
+	}
+	if (node.slot < overflow && m_heads[node.slot] == npos) {
+		m_bitmaps[node.slot / slots] &= ~(std::uint64_t(1) << (node.slot % slots));
+	}
+
+	node.prev = npos;
+	node.next = npos;
+	node.slot = none;
+}
+
+void TimerWheel::insert(std::uint32_t index) noexcept
+{
+	auto &node = m_nodes[index];
+
+	if (node.deadline < m_current) {
+		node.deadline = m_current;
+	}
+
+	/* The first level whose block contains the deadline */
+	for (unsigned level = 0; level < levels; ++level) {
+		auto shift = bits * (level + 1);
+
+		if ((node.deadline >> shift) == (m_current >> shift)) {
+			link(index, level * slots + ((node.deadline >> (bits * level)) & (slots - 1)));
+			return;
+		}
+	}
+
+	link(index, overflow);
+}
+
+void TimerWheel::release(std::uint32_t index) noexcept
+{
+	auto &node = m_nodes[index];
+
+	node.handler = nullptr;
+	node.slot = none;
+
+	if (++node.generation == 0) {
+		node.generation = 1;
+	}
+
+	m_free.push_back(index);
+	m_size --;
+}
+
+void TimerWheel::cascade(std::uint32_t slot) noexcept
+{
+	auto index = m_heads[slot];
+
+	m_heads[slot] = npos;
+
+	if (slot < overflow) {
+		m_bitmaps[slot / slots] &= ~(std::uint64_t(1) << (slot % slots));
+	}
+
+	while (index != npos) {
+		auto next = m_nodes[index].next;
+
+		m_nodes[index].prev = npos;
+		m_nodes[index].next = npos;
+		insert(index);
+		index = next;
+	}
+}
+
+void TimerWheel::finish(std::uint32_t index, Handler handler) noexcept
+{
+	auto &node = m_nodes[index];
+
+	if (node.slot == rescheduled) {
+		node.handler = std::move(handler);
+		insert(index);
+	} else if (node.slot == running && node.period > 0) {
+		node.handler = std::move(handler);
+		node.deadline += node.period;
+		insert(index);
+	} else {
+		release(index);
+	}
+}
+
+unsigned TimerWheel::fire()
+{
+	auto slot = static_cast<std::uint32_t>(m_current & (slots - 1));
+	unsigned count = 0;
+
+	/* New timers always expire after the current tick, they can't be added to this slot */
+	while (m_heads[slot] != npos) {
+		auto index = m_heads[slot];
+
+		unlink(index);
+		m_nodes[index].slot = running;
+
+		/* The handler may add timers and move the nodes */
+		auto handler = std::move(m_nodes[index].handler);
+
+		try {
+			handler();
+		} catch (...) {
+			release(index);
+			throw;
+		}
+
+		finish(index, std::move(handler));
+		count ++;
+	}
+
+	return count;
+}
+
+TimerWheel::Id TimerWheel::create(std::chrono::milliseconds delay, std::uint64_t period, Handler handler)
+{
+	assert(handler);
+
+	std::uint32_t index;
+
+	if (m_free.empty()) {
+		index = static_cast<std::uint32_t>(m_nodes.size());
+		m_nodes.emplace_back();
+	} else {
+		index = m_free.back();
+		m_free.pop_back();
+	}
+
+	auto &node = m_nodes[index];
+
+	node.handler = std::move(handler);
+	node.period = period;
+	node.deadline = m_current + ticks(delay);
+
+	insert(index);
+	m_size ++;
+
+	return (static_cast<Id>(node.generation) << 32) | index;
+}
+
+TimerWheel::Id TimerWheel::schedule(std::chrono::milliseconds delay, Handler handler)
+{
+	return create(delay, 0, std::move(handler));
+}
+
+TimerWheel::Id TimerWheel::schedulePeriodic(std::chrono::milliseconds period, Handler handler)
+{
+	assert(period.count() > 0);
+
+	return create(period, ticks(period), std::move(handler));
+}
+
+bool TimerWheel::reschedule(Id id, std::chrono::milliseconds delay) noexcept
+{
+	auto index = find(id);
+
+	if (index == npos) {
+		return false;
+	}
+
+	auto &node = m_nodes[index];
+
+	node.deadline = m_current + ticks(delay);
+
+	/* Inserted again once the handler returns */
+	if (node.slot == running || node.slot == rescheduled) {
+		node.slot = rescheduled;
+	} else {
+		unlink(index);
+		insert(index);
+	}
+
+	return true;
+}
+
+bool TimerWheel::cancel(Id id) noexcept
+{
+	auto index = find(id);
+
+	if (index == npos) {
+		return false;
+	}
+
+	/* Released once the handler returns */
+	if (m_nodes[index].slot == running || m_nodes[index].slot == rescheduled) {
+		m_nodes[index].slot = cancelled;
+	} else {
+		unlink(index);
+		release(index);
+	}
+
+	return true;
+}
+
+bool TimerWheel::active(Id id) const noexcept
+{
+	return find(id) != npos;
+}
+
+int TimerWheel::timeout(int max, Clock::time_point now) const noexcept
+{
+	std::uint64_t next = 0;
+	bool found = false;
+
+	/* The first slot after the current tick, in the lowest level */
+	for (unsigned level = 0; level < levels && !found; ++level) {
+		auto shift = bits * level;
+		auto current = (m_current >> shift) & (slots - 1);
+		auto mask = m_bitmaps[level] & ~((std::uint64_t(2) << current) - 1);
+
+		if (mask != 0) {
+			next = ((m_current >> (shift + bits)) << (shift + bits)) | (static_cast<std::uint64_t>(lowest(mask)) << shift);
+			found = true;
+		}
+	}
+
+	if (!found) {
+		if (m_heads[overflow] == npos) {
+			return max;
+		}
+
+		next = ((m_current >> (bits * levels)) + 1) << (bits * levels);
+	}
+
+	auto remaining = m_origin + m_resolution * static_cast<std::int64_t>(next) - now;
+
+	if (remaining <= Clock::duration::zero()) {
+		return 0;
+	}
+
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(remaining + std::chrono::milliseconds{1} - Clock::duration{1}).count();
+
+	if (max >= 0 && ms > max) {
+		return max;
+	}
+
+	return static_cast<int>(std::min<decltype(ms)>(ms, std::numeric_limits<int>::max()));
+}
+
+unsigned TimerWheel::advance(Clock::time_point now)
+{
+	auto target = tick(now);
+	unsigned count = 0;
+
+	while (m_current < target) {
+		if (m_size == 0) {
+			m_current = target;
+			break;
+		}
+
+		/* Nothing left in the block of the first level, go to its last tick */
+		auto current = m_current & (slots - 1);
+
+		if ((m_bitmaps[0] & ~((std::uint64_t(2) << current) - 1)) == 0 && current != slots - 1) {
+			m_current = std::min(target, m_current | (slots - 1));
+			continue;
+		}
+
+		++m_current;
+
+		/* Distribute the next slot of the upper levels, from the highest */
+		if ((m_current & (slots - 1)) == 0) {
+			if ((m_current & ((std::uint64_t(1) << (bits * levels)) - 1)) == 0) {
+				cascade(overflow);
+			}
+
+			for (unsigned level = levels - 1; level > 0; --level) {
+				if ((m_current & ((std::uint64_t(1) << (bits * level)) - 1)) == 0) {
+					cascade(level * slots + ((m_current >> (bits * level)) & (slots - 1)));
+				}
+			}
+		}
+
+		count += fire();
+	}
+
+	return count;
+}
+
+/* }}} */
+
+/*
+ * DatagramChannel
+ * ------------------------------------------------------------------
+ */
+
+/* {{{ DatagramChannel */
+
+namespace {
+
+void write32(unsigned char *out, std::uint32_t value) noexcept
+{
+	for (int i = 0; i < 4; ++i) {
+		out[i] = static_cast<unsigned char>(value >> (24 - i * 8));
+	}
+}
+
+void write64(unsigned char *out, std::uint64_t value) noexcept
+{
+	write32(out, static_cast<std::uint32_t>(value >> 32));
+	write32(out + 4, static_cast<std::uint32_t>(value));
+}
+
+std::uint32_t read32(const unsigned char *in) noexcept
+{
+	std::uint32_t value = 0;
+
+	for (int i = 0; i < 4; ++i) {
+		value = (value << 8) | in[i];
+	}
+
+	return value;
+}
+
+std::uint64_t read64(const unsigned char *in) noexcept
+{
+	return (static_cast<std::uint64_t>(read32(in)) << 32) | read32(in + 4);
+}
+
+/*
+ * Signed distance between two sequence numbers, they wrap around.
+ */
+inline std::int32_t distance(std::uint32_t from, std::uint32_t to) noexcept
+{
+	return static_cast<std::int32_t>(to - from);
+}
+
+#if !defined(SOCKET_NO_SSL)
+
+/*
+ * The nonce is unique as long as the sequence numbers are not reused with the same key, the side is part of it
+ * because both peers use the same key.
+ */
+void nonce(unsigned char *iv, DatagramChannel::Side side, std::uint32_t sequence) noexcept
+{
+	write32(iv, side == DatagramChannel::Side::Server ? 0 : 1);
+	write32(iv + 4, 0);
+	write32(iv + 8, sequence);
+}
+
+#endif
+
+} // !namespace
+
+constexpr std::size_t DatagramChannel::headerSize;
+constexpr std::size_t DatagramChannel::tagSize;
+constexpr std::size_t DatagramChannel::keySize;
+constexpr std::size_t DatagramChannel::materialSize;
+constexpr std::uint32_t DatagramChannel::window;
+
+const std::string DatagramChannel::label{"EXPORTER-malikania-datagram"};
+
+std::shared_ptr<DatagramChannel> DatagramChannel::random(Side side, bool encrypted)
+{
+	std::string material(materialSize, '\0');
+
+#if !defined(SOCKET_NO_SSL)
+	if (RAND_bytes(reinterpret_cast<unsigned char *>(&material[0]), materialSize) != 1) {
+		throw Error{Error::System, "RAND_bytes", "unable to generate datagram token"};
+	}
+#else
+	std::random_device device;
+
+	for (auto &c : material) {
+		c = static_cast<char>(device());
+	}
+#endif
+
+	return derive(side, material, encrypted);
+}
+
+std::shared_ptr<DatagramChannel> DatagramChannel::derive(Side side, const std::string &material, bool encrypted)
+{
+	if (material.size() < materialSize) {
+		throw Error{Error::Other, "derive", "material too short"};
+	}
+
+	auto token = read64(reinterpret_cast<const unsigned char *>(material.data()));
+
+	return std::make_shared<DatagramChannel>(side, token, encrypted ? material.substr(8, keySize) : "");
+}
+
+std::uint64_t DatagramChannel::token(const char *packet) noexcept
+{
+	return read64(reinterpret_cast<const unsigned char *>(packet));
+}
+
+DatagramChannel::DatagramChannel(Side side, std::uint64_t token, std::string key)
+	: m_side{side}
+	, m_token{token}
+	, m_key{std::move(key)}
+	, m_sent(window)
+{
+	if (m_key.empty()) {
+		return;
+	}
+	if (m_key.size() != keySize) {
+		throw Error{Error::Other, "DatagramChannel", "invalid key length"};
+	}
+
+#if !defined(SOCKET_NO_SSL)
+	auto bytes = reinterpret_cast<const unsigned char *>(m_key.data());
+
+	m_encrypt = {EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free};
+	m_decrypt = {EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free};
+
+	if (!m_encrypt || !m_decrypt ||
+	    EVP_EncryptInit_ex(m_encrypt.get(), EVP_aes_256_gcm(), nullptr, bytes, nullptr) != 1 ||
+	    EVP_DecryptInit_ex(m_decrypt.get(), EVP_aes_256_gcm(), nullptr, bytes, nullptr) != 1) {
+		throw Error{Error::System, "EVP_EncryptInit_ex", "unable to initialize the cipher"};
+	}
+#else
+	throw Error{Error::Other, "DatagramChannel", "encryption requires OpenSSL"};
+#endif
+}
+
+bool DatagramChannel::fresh(std::uint32_t sequence) const noexcept
+{
+	if (!m_remoteValid) {
+		return true;
+	}
+
+	auto diff = distance(m_remote, sequence);
+
+	if (diff > 0) {
+		return true;
+	}
+	if (diff == 0 || diff < -32) {
+		return false;
+	}
+
+	return (m_remoteBits & (std::uint32_t(1) << (-diff - 1))) == 0;
+}
+
+void DatagramChannel::receive(std::uint32_t sequence) noexcept
+{
+	if (!m_remoteValid) {
+		m_remoteValid = true;
+		m_remote = sequence;
+		m_remoteBits = 0;
+		return;
+	}
+
+	auto diff = distance(m_remote, sequence);
+
+	if (diff > 0) {
+		/* The previous last one is now in the bitfield */
+		if (diff > 32) {
+			m_remoteBits = 0;
+		} else {
+			m_remoteBits = static_cast<std::uint32_t>(((std::uint64_t(m_remoteBits) << diff) | (std::uint64_t(1) << (diff - 1))));
+		}
+
+		m_remote = sequence;
+	} else {
+		m_remoteBits |= std::uint32_t(1) << (-diff - 1);
+	}
+}
+
+void DatagramChannel::acknowledge(std::uint32_t ack, std::uint32_t bits)
+{
+	/* Nothing received by the peer yet */
+	if (ack == 0) {
+		return;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+
+	for (std::uint32_t i = 0; i <= 32; ++i) {
+		if (i > 0 && (bits & (std::uint32_t(1) << (i - 1))) == 0) {
+			continue;
+		}
+
+		auto sequence = ack - i;
+		auto &sent = m_sent[sequence % window];
+
+		if (!sent.pending || sent.sequence != sequence) {
+			continue;
+		}
+
+		auto rtt = std::chrono::duration_cast<std::chrono::milliseconds>(now - sent.time);
+
+		sent.pending = false;
+		m_statistics.rtt = m_statistics.acked == 0 ? rtt : (m_statistics.rtt * 7 + rtt) / 8;
+		m_statistics.acked ++;
+		m_onAck(sequence);
+	}
+
+	/* The packets older than the window can not be acknowledged anymore */
+	auto limit = ack - 32;
+
+	if (distance(limit, sequence()) < 0) {
+		return;
+	}
+	if (distance(m_checked, limit) > static_cast<std::int32_t>(window)) {
+		/* The slots have been reused, they were counted by encode */
+		m_checked = limit - window;
+	}
+
+	for (; distance(m_checked, limit) > 0; ++m_checked) {
+		auto &sent = m_sent[m_checked % window];
+
+		if (sent.pending && sent.sequence == m_checked) {
+			sent.pending = false;
+			m_statistics.lost ++;
+		}
+	}
+}
+
+std::uint32_t DatagramChannel::encode(const void *data, std::size_t length, std::string &packet)
+{
+	/* 0 is never used, it means that nothing was received */
+	if (static_cast<std::uint32_t>(m_next) == 0) {
+		if (m_next > 0 && encrypted()) {
+			throw Error{Error::Other, "encode", "all sequence numbers used, open a new channel"};
+		}
+
+		m_next ++;
+	}
+
+	auto sequence = static_cast<std::uint32_t>(m_next++);
+
+	packet.resize(headerSize + length + (encrypted() ? tagSize : 0));
+
+	auto out = reinterpret_cast<unsigned char *>(&packet[0]);
+
+	write64(out, m_token);
+	write32(out + 8, sequence);
+	write32(out + 12, m_remoteValid ? m_remote : 0);
+	write32(out + 16, m_remoteBits);
+
+	if (!encrypted()) {
+		if (length > 0) {
+			std::memcpy(out + headerSize, data, length);
+		}
+	} else {
+#if !defined(SOCKET_NO_SSL)
+		unsigned char iv[12];
+		int n;
+
+		nonce(iv, m_side, sequence);
+
+		/* The header is authenticated, the payload is encrypted */
+		if (EVP_EncryptInit_ex(m_encrypt.get(), nullptr, nullptr, nullptr, iv) != 1 ||
+		    EVP_EncryptUpdate(m_encrypt.get(), nullptr, &n, out, headerSize) != 1 ||
+		    (length > 0 && EVP_EncryptUpdate(m_encrypt.get(), out + headerSize, &n,
+						     static_cast<const unsigned char *>(data), static_cast<int>(length)) != 1) ||
+		    EVP_EncryptFinal_ex(m_encrypt.get(), out + headerSize + length, &n) != 1 ||
+		    EVP_CIPHER_CTX_ctrl(m_encrypt.get(), EVP_CTRL_GCM_GET_TAG, tagSize, out + headerSize + length) != 1) {
+			throw Error{Error::System, "EVP_EncryptUpdate", "unable to encrypt the packet"};
+		}
+#endif
+	}
+
+	auto &sent = m_sent[sequence % window];
+
+	if (sent.pending) {
+		m_statistics.lost ++;
+	}
+
+	sent.sequence = sequence;
+	sent.pending = true;
+	sent.time = std::chrono::steady_clock::now();
+	m_statistics.sent ++;
+
+	return sequence;
+}
+
+bool DatagramChannel::decode(const char *packet, std::size_t length, std::string &payload)
+{
+	auto in = reinterpret_cast<const unsigned char *>(packet);
+	auto overhead = headerSize + (encrypted() ? tagSize : 0);
+
+	if (length < overhead || read64(in) != m_token || read32(in + 8) == 0) {
+		m_statistics.rejected ++;
+		return false;
+	}
+
+	auto sequence = read32(in + 8);
+
+	if (!fresh(sequence)) {
+		m_statistics.duplicated ++;
+		return false;
+	}
+
+	if (!encrypted()) {
+		payload.assign(packet + headerSize, length - overhead);
+	} else {
+#if !defined(SOCKET_NO_SSL)
+		auto size = length - overhead;
+		unsigned char iv[12];
+		unsigned char tag[tagSize];
+		int n;
+
+		payload.resize(size);
+		nonce(iv, m_side == Side::Server ? Side::Client : Side::Server, sequence);
+		std::memcpy(tag, in + headerSize + size, tagSize);
+
+		if (EVP_DecryptInit_ex(m_decrypt.get(), nullptr, nullptr, nullptr, iv) != 1 ||
+		    EVP_DecryptUpdate(m_decrypt.get(), nullptr, &n, in, headerSize) != 1 ||
+		    (size > 0 && EVP_DecryptUpdate(m_decrypt.get(), reinterpret_cast<unsigned char *>(&payload[0]), &n,
+						   in + headerSize, static_cast<int>(size)) != 1) ||
+		    EVP_CIPHER_CTX_ctrl(m_decrypt.get(), EVP_CTRL_GCM_SET_TAG, tagSize, tag) != 1 ||
+		    EVP_DecryptFinal_ex(m_decrypt.get(), reinterpret_cast<unsigned char *>(&payload[0]) + size, &n) != 1) {
+			m_statistics.rejected ++;
+			return false;
+		}
+#endif
+	}
+
+	/* Only authenticated packets change the state */
+	receive(sequence);
+	m_statistics.received ++;
+	acknowledge(read32(in + 12), read32(in + 16));
+
+	return true;
+}
+
+/* }}} */
+
+/*
+ * DatagramBatch
+ * ------------------------------------------------------------------
+ */
+
+/* {{{ DatagramBatch */
+
+DatagramBatch::DatagramBatch(unsigned capacity, unsigned packetSize)
+	: m_capacity{capacity}
+	, m_packetSize{packetSize}
+	, m_buffers(static_cast<std::size_t>(capacity) * packetSize)
+	, m_lengths(capacity)
+	, m_addresses(capacity)
+	, m_addressLengths(capacity)
+{
+	assert(capacity > 0);
+
+#if defined(SOCKET_HAVE_MMSG)
+	m_headers.resize(capacity);
+	m_vectors.resize(capacity);
+#endif
+}
+
+bool DatagramBatch::push(const void *data, unsigned length, const sockaddr *address, socklen_t addrlen) noexcept
+{
+	assert(length <= m_packetSize);
+
+	if (full()) {
+		return false;
+	}
+
+	std::memcpy(&m_buffers[static_cast<std::size_t>(m_count) * m_packetSize], data, length);
+	std::memcpy(&m_addresses[m_count], address, addrlen);
+	m_lengths[m_count] = length;
+	m_addressLengths[m_count] = addrlen;
+	m_count ++;
+
+	return true;
+}
+
+#if defined(SOCKET_HAVE_MMSG)
+
+unsigned DatagramBatch::receive(Handle handle)
+{
+	for (unsigned i = 0; i < m_capacity; ++i) {
+		std::memset(&m_headers[i], 0, sizeof (mmsghdr));
+
+		m_vectors[i].iov_base = &m_buffers[static_cast<std::size_t>(i) * m_packetSize];
+		m_vectors[i].iov_len = m_packetSize;
+		m_headers[i].msg_hdr.msg_name = &m_addresses[i];
+		m_headers[i].msg_hdr.msg_namelen = sizeof (sockaddr_storage);
+		m_headers[i].msg_hdr.msg_iov = &m_vectors[i];
+		m_headers[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	m_count = 0;
+
+	auto n = ::recvmmsg(handle, m_headers.data(), m_capacity, MSG_DONTWAIT, nullptr);
+
+	if (n == Failure) {
+		/* ECONNREFUSED reports a previous packet sent to a closed port */
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED) {
+			return 0;
+		}
+
+		throw Error{Error::System, "recvmmsg"};
+	}
+
+	for (int i = 0; i < n; ++i) {
+		m_lengths[i] = m_headers[i].msg_len;
+		m_addressLengths[i] = m_headers[i].msg_hdr.msg_namelen;
+	}
+
+	return m_count = static_cast<unsigned>(n);
+}
+
+unsigned DatagramBatch::send(Handle handle)
+{
+	unsigned sent = 0;
+
+	for (unsigned i = 0; i < m_count; ++i) {
+		std::memset(&m_headers[i], 0, sizeof (mmsghdr));
+
+		m_vectors[i].iov_base = &m_buffers[static_cast<std::size_t>(i) * m_packetSize];
+		m_vectors[i].iov_len = m_lengths[i];
+		m_headers[i].msg_hdr.msg_name = &m_addresses[i];
+		m_headers[i].msg_hdr.msg_namelen = m_addressLengths[i];
+		m_headers[i].msg_hdr.msg_iov = &m_vectors[i];
+		m_headers[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (sent < m_count) {
+		auto n = ::sendmmsg(handle, &m_headers[sent], m_count - sent, MSG_DONTWAIT);
+
+		if (n == Failure) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+
+			m_count = 0;
+			throw Error{Error::System, "sendmmsg"};
+		}
+
+		sent += static_cast<unsigned>(n);
+	}
+
+	m_count = 0;
+
+	return sent;
+}
+
+#else
+
+unsigned DatagramBatch::receive(Handle handle)
+{
+	m_count = 0;
+
+	while (m_count < m_capacity) {
+		socklen_t length = sizeof (sockaddr_storage);
+		auto n = ::recvfrom(handle, (Arg)&m_buffers[static_cast<std::size_t>(m_count) * m_packetSize], m_packetSize, 0,
+				    reinterpret_cast<sockaddr *>(&m_addresses[m_count]), &length);
+
+		if (n == Failure) {
+#if defined(_WIN32)
+			int error = WSAGetLastError();
+
+			/* WSAECONNRESET reports a previous packet sent to a closed port */
+			if (error == WSAEWOULDBLOCK || error == WSAECONNRESET) {
+				break;
+			}
+
+			throw Error{Error::System, "recvfrom", error};
+#else
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED) {
+				break;
+			}
+
+			throw Error{Error::System, "recvfrom"};
+#endif
+		}
+
+		m_lengths[m_count] = static_cast<unsigned>(n);
+		m_addressLengths[m_count] = length;
+		m_count ++;
+	}
+
+	return m_count;
+}
+
+unsigned DatagramBatch::send(Handle handle)
+{
+	unsigned sent = 0;
+
+	for (; sent < m_count; ++sent) {
+		auto n = ::sendto(handle, (ConstArg)&m_buffers[static_cast<std::size_t>(sent) * m_packetSize], m_lengths[sent], 0,
+				  reinterpret_cast<const sockaddr *>(&m_addresses[sent]), m_addressLengths[sent]);
+
+		if (n == Failure) {
+#if defined(_WIN32)
+			int error = WSAGetLastError();
+
+			if (error == WSAEWOULDBLOCK) {
+				break;
+			}
+
+			m_count = 0;
+			throw Error{Error::System, "sendto", error};
+#else
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+
+			m_count = 0;
+			throw Error{Error::System, "sendto"};
+#endif
+		}
+	}
+
+	m_count = 0;
+
+	return sent;
+}
+
+#endif
+
+/* }}} */
+
 } // !net
 
 } // !malikania
@@ -38,6 +38,10 @@
  * - **SOCKET_NO_SSL**: (bool) Set to 0 if you don't have access to OpenSSL library.
  * - **SOCKET_NO_AUTO_SSL_INIT**: (bool) Set to 0 if you don't want Socket class with Tls to automatically init
  * the OpenSSL library. You will need to call net::ssl::init and net::ssl::finish.
+ * - **SOCKET_HAVE_KTLS**: Defined on Linux if OpenSSL supports kernel TLS (OpenSSL 3.0 or later built with
+ *   enable-ktls), see Tls::setKernelTls.
+ * - **SOCKET_HAVE_MMSG**: Defined on Linux, DatagramBatch uses `recvmmsg(2)` and `sendmmsg(2)` instead of one
+ *   system call per packet.
  *
  * ### Options for Listener class
  *
@@ -51,6 +55,9 @@
  *   if _WIN32_WINNT is set to 0x0600 or greater.
  * - **SOCKET_HAVE_KQUEUE**: Defined on all BSD and Apple.
  * - **SOCKET_HAVE_EPOLL**: Defined on Linux only.
+ * - **SOCKET_HAVE_IO_URING**: Never defined automatically, define it on Linux 5.11 or later with liburing 2.2 or
+ *   later to enable the IoUring backend (see the WITH_IO_URING CMake option). It is never the default backend,
+ *   use Listener<IoUring> explicitly.
  * - **SOCKET_DEFAULT_BACKEND**: Which backend to use (e.g. `Select`).
  *
  * The preference priority is ordered from left to right.
@@ -58,6 +65,7 @@
  * | System        | Backend                 | Class name   |
  * |---------------|-------------------------|--------------|
  * | Linux         | epoll(7)                | Epoll        |
+ * | Linux 5.11    | io_uring(7) (optional)  | IoUring      |
  * | *BSD          | kqueue(2)               | Kqueue       |
  * | Windows       | poll(2), select(2)      | Poll, Select |
  * | Mac OS X      | kqueue(2)               | Kqueue       |
@@ -103,10 +111,14 @@
 #  endif
 #elif defined(__linux__)
 #  include <sys/epoll.h>
+#  include <sys/eventfd.h>
 
 #  if !defined(SOCKET_DEFAULT_BACKEND)
 #    define SOCKET_DEFAULT_BACKEND Epoll
 #  endif
+#  if !defined(SOCKET_HAVE_MMSG)
+#    define SOCKET_HAVE_MMSG
+#  endif
 #elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__) || defined(__APPLE__)
 #  include <sys/types.h>
 #  include <sys/event.h>
@@ -121,10 +133,14 @@
 #  endif
 #endif
 
-#if defined(SOCKET_HAVE_POLL) && !defined(_WIN32)
+#if (defined(SOCKET_HAVE_POLL) || defined(SOCKET_HAVE_IO_URING)) && !defined(_WIN32)
 #  include <poll.h>
 #endif
 
+#if defined(SOCKET_HAVE_IO_URING)
+#  include <liburing.h>
+#endif
+
 /*
  * Headers to include
  * ------------------------------------------------------------------
@@ -141,6 +157,7 @@
 #  include <sys/ioctl.h>
 #  include <sys/types.h>
 #  include <sys/socket.h>
+#  include <sys/uio.h>
 #  include <sys/un.h>
 
 #  include <arpa/inet.h>
@@ -156,18 +173,31 @@
 #if !defined(SOCKET_NO_SSL)
 #  include <openssl/err.h>
 #  include <openssl/evp.h>
+#  include <openssl/pem.h>
 #  include <openssl/ssl.h>
+
+#  if defined(__linux__) && defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS) && !defined(SOCKET_HAVE_KTLS)
+#    define SOCKET_HAVE_KTLS
+#  endif
 #endif
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <exception>
 #include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 namespace malikania {
@@ -272,8 +302,8 @@ namespace ssl {
  * @brief Which OpenSSL method to use.
  */
 enum Method {
-	Tlsv1,		//!< TLS v1.2 (recommended)
-	Sslv3		//!< SSLv3
+	Tlsv1,		//!< TLS v1.2 or later (recommended)
+	Sslv3		//!< any version supported by OpenSSL
 };
 
 } // !ssl
@@ -342,6 +372,132 @@ std::string error(int errn);
 
 /* }}} */
 
+/*
+ * TLS sessions
+ * ------------------------------------------------------------------
+ *
+ * Objects shared between a Tls server socket and the clients it accepts, they may also be shared between several
+ * servers (e.g. the MultiStreamServer reactors).
+ */
+
+/* {{{ TLS sessions */
+
+#if !defined(SOCKET_NO_SSL)
+
+namespace ssl {
+
+/**
+ * @class Statistics
+ * @brief Handshake counters.
+ *
+ * Updated by Tls when a handshake completes, a handshake is resumed if the client presented a session found in the
+ * server cache or a valid ticket.
+ */
+class Statistics {
+public:
+	std::atomic<std::uint64_t> full{0};	//!< complete handshakes
+	std::atomic<std::uint64_t> resumed{0};	//!< abbreviated handshakes
+};
+
+/**
+ * @class TicketKeys
+ * @brief Session ticket keys, rotated periodically.
+ *
+ * The keys are only kept in memory. New tickets are always encrypted with the current key which is replaced every
+ * interval, the previous keys are kept so that the tickets they encrypted can still be decrypted, such tickets are
+ * then renewed. At most count keys are kept, the oldest are removed.
+ *
+ * This class is thread safe.
+ */
+class TicketKeys {
+public:
+	/**
+	 * @class Key
+	 * @brief One ticket key.
+	 */
+	class Key {
+	public:
+		unsigned char name[16];						//!< identifies the key in the ticket
+		unsigned char aes[32];						//!< AES-256-CBC key
+		unsigned char hmac[32];						//!< HMAC-SHA256 key
+		std::chrono::steady_clock::time_point created;			//!< creation time
+	};
+
+private:
+	mutable std::mutex m_mutex;
+	std::deque<Key> m_keys;
+	std::chrono::seconds m_interval;
+	std::size_t m_count;
+	std::atomic<std::uint64_t> m_rotations{0};
+
+	void generate();
+
+public:
+	/**
+	 * Create the first key.
+	 *
+	 * @param interval the time before the current key is replaced
+	 * @param count the maximum number of keys kept (at least 1)
+	 * @throw net::Error if no random key could be generated
+	 */
+	TicketKeys(std::chrono::seconds interval = std::chrono::hours{1}, std::size_t count = 2);
+
+	/**
+	 * Replace the current key now.
+	 *
+	 * @throw net::Error if no random key could be generated
+	 */
+	void rotate();
+
+	/**
+	 * Get the current key, it is rotated if expired.
+	 *
+	 * @return the key
+	 * @throw net::Error if no random key could be generated
+	 */
+	Key current();
+
+	/**
+	 * Find a key by its name.
+	 *
+	 * @param name the key name (16 bytes)
+	 * @param key the key (set on success)
+	 * @return 0 if not found, 1 if it is the current key, 2 if it is an older key
+	 */
+	int find(const unsigned char *name, Key &key) const;
+
+	/**
+	 * Get the number of keys currently kept.
+	 *
+	 * @return the number of keys
+	 */
+	std::size_t size() const;
+
+	/**
+	 * Get the number of rotations since the creation.
+	 *
+	 * @return the number of rotations
+	 */
+	inline std::uint64_t rotations() const noexcept
+	{
+		return m_rotations;
+	}
+
+	/**
+	 * Use these keys for the tickets of the context.
+	 *
+	 * @param context the context
+	 * @warning the object must stay alive as long as the context
+	 */
+	void install(SSL_CTX *context);
+};
+
+} // !ssl
+
+#endif // !SOCKET_NO_SSL
+
+/* }}} */
+
 /*
  * Error class
  * ------------------------------------------------------------------
@@ -604,6 +760,317 @@ inline Condition &operator^=(Condition &v1, Condition v2) noexcept
 
 /* }}} */
 
+/*
+ * OutputQueue class
+ * ------------------------------------------------------------------
+ *
+ * Chain of buffers to be sent.
+ */
+
+/* {{{ OutputQueue */
+
+/**
+ * @class OutputQueue
+ * @brief Segmented output buffer.
+ *
+ * This class stores the data to be sent as a chain of reference counted and immutable segments. Appending data never
+ * copies the previous content and removing the data that has been sent only moves an offset in the first segment, so
+ * partial writes are O(1).
+ *
+ * The segments are sent at once with Socket::send(const OutputQueue &) which uses writev(2) like functions when
+ * possible.
+ */
+class OutputQueue {
+public:
+	/**
+	 * Immutable segment, may be shared between several queues.
+	 */
+	using Segment = std::shared_ptr<const std::string>;
+
+private:
+	std::deque<Segment> m_segments;
+	std::size_t m_offset{0};
+	std::size_t m_size{0};
+
+public:
+	/**
+	 * Check if there is no data to send.
+	 *
+	 * @return true if empty
+	 */
+	inline bool empty() const noexcept
+	{
+		return m_size == 0;
+	}
+
+	/**
+	 * Get the number of bytes to send.
+	 *
+	 * @return the size
+	 */
+	inline std::size_t size() const noexcept
+	{
+		return m_size;
+	}
+
+	/**
+	 * Get the number of segments.
+	 *
+	 * @return the number of segments
+	 */
+	inline std::size_t count() const noexcept
+	{
+		return m_segments.size();
+	}
+
+	/**
+	 * Get the data of a segment that still needs to be sent.
+	 *
+	 * @param index the segment index
+	 * @return the data
+	 * @pre index < count()
+	 */
+	inline const char *data(std::size_t index) const noexcept
+	{
+		assert(index < m_segments.size());
+
+		return m_segments[index]->data() + (index == 0 ? m_offset : 0);
+	}
+
+	/**
+	 * Get the length of a segment that still needs to be sent.
+	 *
+	 * @param index the segment index
+	 * @return the length
+	 * @pre index < count()
+	 */
+	inline std::size_t length(std::size_t index) const noexcept
+	{
+		assert(index < m_segments.size());
+
+		return m_segments[index]->size() - (index == 0 ? m_offset : 0);
+	}
+
+	/**
+	 * Append a shared segment, the data is not copied.
+	 *
+	 * @param segment the segment
+	 */
+	void append(Segment segment)
+	{
+		if (segment && !segment->empty()) {
+			m_size += segment->size();
+			m_segments.push_back(std::move(segment));
+		}
+	}
+
+	/**
+	 * Overloaded function.
+	 *
+	 * @param data the data
+	 */
+	inline void append(std::string data)
+	{
+		if (!data.empty()) {
+			append(std::make_shared<const std::string>(std::move(data)));
+		}
+	}
+
+	/**
+	 * Remove some data that has been sent.
+	 *
+	 * @param length the number of bytes to remove
+	 * @pre length <= size()
+	 */
+	void consume(std::size_t length) noexcept
+	{
+		assert(length <= m_size);
+
+		m_size -= length;
+
+		while (length > 0) {
+			auto remaining = m_segments.front()->size() - m_offset;
+
+			if (length < remaining) {
+				m_offset += length;
+				length = 0;
+			} else {
+				length -= remaining;
+				m_offset = 0;
+				m_segments.pop_front();
+			}
+		}
+	}
+
+	/**
+	 * Remove all the data.
+	 */
+	inline void clear() noexcept
+	{
+		m_segments.clear();
+		m_offset = 0;
+		m_size = 0;
+	}
+
+	/**
+	 * Concatenate the remaining data.
+	 *
+	 * @return the data as a string
+	 * @note this function copies the data, it should only be used for debugging
+	 */
+	std::string str() const
+	{
+		std::string result;
+
+		result.reserve(m_size);
+
+		for (std::size_t i = 0; i < m_segments.size(); ++i) {
+			result.append(data(i), length(i));
+		}
+
+		return result;
+	}
+};
+
+/* }}} */
+
+/*
+ * InputBuffer class
+ * ------------------------------------------------------------------
+ *
+ * Reusable buffer for received data.
+ */
+
+/* {{{ InputBuffer */
+
+/**
+ * @class InputBuffer
+ * @brief Growable buffer for received data.
+ *
+ * The buffer keeps its memory between reads so receiving data does not allocate once it has grown to the usual
+ * message size. The received data is appended at the end with prepare and commit and the data that has been processed is
+ * removed with consume.
+ */
+class InputBuffer {
+private:
+	std::vector<char> m_data;
+	std::size_t m_begin{0};
+	std::size_t m_end{0};
+
+public:
+	/**
+	 * Get the pending data.
+	 *
+	 * @return the data
+	 */
+	inline const char *data() const noexcept
+	{
+		return m_data.data() + m_begin;
+	}
+
+	/**
+	 * Get the number of pending bytes.
+	 *
+	 * @return the size
+	 */
+	inline std::size_t size() const noexcept
+	{
+		return m_end - m_begin;
+	}
+
+	/**
+	 * Check if there is no pending data.
+	 *
+	 * @return true if empty
+	 */
+	inline bool empty() const noexcept
+	{
+		return m_begin == m_end;
+	}
+
+	/**
+	 * Get the allocated size.
+	 *
+	 * @return the capacity
+	 */
+	inline std::size_t capacity() const noexcept
+	{
+		return m_data.size();
+	}
+
+	/**
+	 * Get an area where to write at least length bytes, the pending data is moved to the beginning or the buffer is
+	 * grown if needed.
+	 *
+	 * @param length the number of bytes to write
+	 * @return the area to write
+	 * @post the area is valid until the next call to prepare
+	 */
+	char *prepare(std::size_t length)
+	{
+		if (m_data.size() - m_end < length && m_begin > 0) {
+			std::memmove(m_data.data(), m_data.data() + m_begin, m_end - m_begin);
+			m_end -= m_begin;
+			m_begin = 0;
+		}
+		if (m_data.size() - m_end < length) {
+			m_data.resize(std::max(m_data.size() * 2, m_end + length));
+		}
+
+		return m_data.data() + m_end;
+	}
+
+	/**
+	 * Mark some bytes written to the area returned by prepare as pending data.
+	 *
+	 * @param length the number of bytes written
+	 * @pre length must not be greater than the length passed to prepare
+	 */
+	inline void commit(std::size_t length) noexcept
+	{
+		assert(m_end + length <= m_data.size());
+
+		m_end += length;
+	}
+
+	/**
+	 * Remove data that has been processed.
+	 *
+	 * @param length the number of bytes
+	 * @pre length <= size()
+	 */
+	inline void consume(std::size_t length) noexcept
+	{
+		assert(length <= size());
+
+		m_begin += length;
+
+		if (m_begin == m_end) {
+			m_begin = m_end = 0;
+		}
+	}
+
+	/**
+	 * Remove all the pending data, the memory is kept.
+	 */
+	inline void clear() noexcept
+	{
+		m_begin = m_end = 0;
+	}
+
+	/**
+	 * Get a copy of the pending data.
+	 *
+	 * @return the data
+	 */
+	inline std::string str() const
+	{
+		return std::string(data(), size());
+	}
+};
+
+/* }}} */
+
 /*
  * Base Socket class
  * ------------------------------------------------------------------
@@ -1011,14 +1478,14 @@ public:
 	}
 
 	/**
-	 * Accept a new client. If there are no pending connection, throws an error.
+	 * Accept a new client.
 	 *
 	 * If the client cannot be accepted immediately, the client is returned and accept with no arguments
 	 * must be called on it. See the underlying protocol for more information.
 	 *
 	 * @pre state must be State::Bound
 	 * @param info the address where to store client's information (optional)
-	 * @return the new socket
+	 * @return the new socket, invalid if the socket is non-blocking and no client is pending
 	 * @throw Error on errors
 	 * @post returned client's state is set to State::Accepting or State::Accepted
 	 * @note For non-blocking sockets, see the underlying protocol function for more details
@@ -1035,6 +1502,13 @@ public:
 
 		Socket<Address, Protocol> sc = m_proto.accept(*this, reinterpret_cast<sockaddr *>(&storage), &length);
 
+		/* No client pending */
+		if (sc.handle() == Invalid) {
+			assert(m_condition == Condition::Readable);
+
+			return sc;
+		}
+
 		if (info) {
 			*info = Address{&storage, length};
 		}
@@ -1177,17 +1651,38 @@ public:
 	}
 
 	/**
-	 * Send data to an end point.
+	 * Send as much data as possible from the queue in one operation.
 	 *
-	 * If the operation cannot be complete immediately, 0 is returned and user must call the function
-	 * again when ready. See the underlying protocol for more information.
+	 * The queue is not modified, the caller must consume the number of bytes returned. Same rules as send apply.
 	 *
-	 * @param data the buffer
-	 * @param length the buffer length
-	 * @param address the client address
-	 * @param addrlen the address length
-	 * @return the number of bytes sent
-	 * @throw net::Error on errors
+	 * @param queue the data to send
+	 * @return the number of bytes sent or 0
+	 * @pre action() must not be Flag::Receive
+	 * @throw Error on error
+	 * @note For non-blocking sockets, see the underlying protocol function for more details
+	 */
+	unsigned send(const OutputQueue &queue)
+	{
+		assert(m_action != Action::Receive);
+
+		m_action = Action::None;
+		m_condition = Condition::None;
+
+		return m_proto.send(*this, queue);
+	}
+
+	/**
+	 * Send data to an end point.
+	 *
+	 * If the operation cannot be complete immediately, 0 is returned and user must call the function
+	 * again when ready. See the underlying protocol for more information.
+	 *
+	 * @param data the buffer
+	 * @param length the buffer length
+	 * @param address the client address
+	 * @param addrlen the address length
+	 * @return the number of bytes sent
+	 * @throw net::Error on errors
 	 * @note For non-blocking sockets, see the underlying protocol function for more details
 	 */
 	inline unsigned sendto(const void *data, unsigned length, const sockaddr *address, socklen_t addrlen)
@@ -1540,6 +2035,48 @@ public:
 	}
 };
 
+#if defined(SO_REUSEPORT)
+
+/**
+ * @class SockReusePort
+ * @brief Let several sockets bind the same port, must be used before calling Socket::bind
+ *
+ * On Linux, incoming connections are distributed between all the listening sockets bound to the same port.
+ */
+class SockReusePort {
+public:
+	/**
+	 * Set to true if you want to set the SOL_SOCKET/SO_REUSEPORT option.
+	 */
+	bool value{true};
+
+	/**
+	 * Set the option.
+	 *
+	 * @param sc the socket
+	 * @throw Error on errors
+	 */
+	template <typename Address, typename Protocol>
+	inline void set(Socket<Address, Protocol> &sc) const
+	{
+		sc.set(SOL_SOCKET, SO_REUSEPORT, value ? 1 : 0);
+	}
+
+	/**
+	 * Get the option.
+	 *
+	 * @return the value
+	 * @throw Error on errors
+	 */
+	template <typename Address, typename Protocol>
+	inline bool get(Socket<Address, Protocol> &sc) const
+	{
+		return static_cast<bool>(sc.template get<int>(SOL_SOCKET, SO_REUSEPORT));
+	}
+};
+
+#endif
+
 /**
  * @class SockSendBuffer
  * @brief Set or get the output buffer.
@@ -1965,6 +2502,9 @@ namespace protocol {
  * C functions.
  */
 class Tcp {
+private:
+	bool m_acceptNonBlocking{false};
+
 public:
 	/**
 	 * Socket type.
@@ -1976,6 +2516,17 @@ public:
 		return SOCK_STREAM;
 	}
 
+	/**
+	 * Make the sockets returned by accept non-blocking. On Linux, this is done by accept4(2) itself, other systems
+	 * need another system call.
+	 *
+	 * @param enable true to enable
+	 */
+	inline void setAcceptNonBlocking(bool enable = true) noexcept
+	{
+		m_acceptNonBlocking = enable;
+	}
+
 	/**
 	 * Do nothing.
 	 *
@@ -2071,34 +2622,65 @@ public:
 	/**
 	 * Accept a clear client.
 	 *
-	 * If the socket is marked non-blocking and there are no pending connection, this function throws an
-	 * error. The user must wait that the socket is readable before calling this function.
-	 *
 	 * If the socket is blocking, this function blocks until a new client is connected or throws an error on
 	 * errors.
 	 *
-	 * If the socket is correctly returned, its state is set to State::Accepted and its action and condition
-	 * are not set.
+	 * If the socket is marked non-blocking and no client is pending, an invalid socket is returned and the
+	 * condition of this socket is set to Condition::Readable.
 	 *
-	 * In any case, action and condition of this socket are not set.
+	 * If the socket is correctly returned, its state is set to State::Accepted and its action and condition
+	 * are not set. The returned socket is close-on-exec, see also setAcceptNonBlocking.
 	 *
 	 * @param sc the socket
 	 * @param address the address destination
 	 * @param length the address length
 	 * @return the socket
 	 * @throw net::Error on errors
-	 * @note Wrapper of accept(2)
+	 * @note Wrapper of accept(2) or accept4(2) on Linux
 	 */
 	template <typename Address, typename Protocol>
 	Socket<Address, Protocol> accept(Socket<Address, Protocol> &sc, sockaddr *address, socklen_t *length)
 	{
+#if defined(__linux__)
+		Handle handle = ::accept4(sc.handle(), address, length, SOCK_CLOEXEC | (m_acceptNonBlocking ? SOCK_NONBLOCK : 0));
+#else
 		Handle handle = ::accept(sc.handle(), address, length);
+#endif
 
 		if (handle == Invalid) {
+#if defined(_WIN32)
+			int error = WSAGetLastError();
+
+			if (error == WSAEWOULDBLOCK) {
+				sc.setCondition(Condition::Readable);
+
+				return Socket<Address, Protocol>{nullptr};
+			}
+
+			throw Error{Error::System, "accept", error};
+#else
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				sc.setCondition(Condition::Readable);
+
+				return Socket<Address, Protocol>{nullptr};
+			}
+
 			throw Error{Error::System, "accept"};
+#endif
+		}
+
+		Socket<Address, Protocol> client{handle, State::Accepted};
+
+#if !defined(__linux__)
+		if (m_acceptNonBlocking) {
+#  if !defined(_WIN32)
+			::fcntl(handle, F_SETFD, FD_CLOEXEC);
+#  endif
+			client.set(option::SockBlockMode{false});
 		}
+#endif
 
-		return Socket<Address, Protocol>{handle, State::Accepted};
+		return client;
 	}
 
 	/**
@@ -2148,6 +2730,7 @@ public:
 			}
 #else
 			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				nbread = 0;
 				sc.setCondition(Condition::Readable);
 			} else {
 				sc.setState(State::Disconnected);
@@ -2207,6 +2790,78 @@ public:
 
 		return static_cast<unsigned>(nbsent);
 	}
+
+	/**
+	 * Send several segments at once.
+	 *
+	 * Same as send but use writev(2) like functions to send all the segments of the queue with only one system
+	 * call.
+	 *
+	 * @param sc the socket
+	 * @param queue the data to send
+	 * @return the number of bytes sent
+	 * @throw net::Error on errors
+	 * @note Wrapper of sendmsg(2) or WSASend
+	 */
+	template <typename Address, typename Protocol>
+	unsigned send(Socket<Address, Protocol> &sc, const OutputQueue &queue)
+	{
+		constexpr std::size_t max = 64;
+
+		auto count = std::min(max, queue.count());
+
+		if (count == 0) {
+			return 0;
+		}
+
+#if defined(_WIN32)
+		WSABUF buffers[max];
+		DWORD nbsent = 0;
+
+		for (std::size_t i = 0; i < count; ++i) {
+			buffers[i].buf = const_cast<char *>(queue.data(i));
+			buffers[i].len = static_cast<ULONG>(queue.length(i));
+		}
+
+		if (WSASend(sc.handle(), buffers, static_cast<DWORD>(count), &nbsent, 0, nullptr, nullptr) == Failure) {
+			int error = WSAGetLastError();
+
+			if (error == WSAEWOULDBLOCK) {
+				nbsent = 0;
+				sc.setCondition(Condition::Writable);
+			} else {
+				sc.setState(State::Disconnected);
+				throw Error{Error::System, "send", error};
+			}
+		}
+#else
+		iovec buffers[max];
+		msghdr msg;
+
+		for (std::size_t i = 0; i < count; ++i) {
+			buffers[i].iov_base = const_cast<char *>(queue.data(i));
+			buffers[i].iov_len = queue.length(i);
+		}
+
+		std::memset(&msg, 0, sizeof (msghdr));
+		msg.msg_iov = buffers;
+		msg.msg_iovlen = count;
+
+		auto nbsent = ::sendmsg(sc.handle(), &msg, 0);
+
+		if (nbsent == Failure) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				nbsent = 0;
+				sc.setCondition(Condition::Writable);
+			} else {
+				sc.setState(State::Disconnected);
+				throw Error{Error::System, "send"};
+			}
+		}
+#endif
+
+		return static_cast<unsigned>(nbsent);
+	}
 };
 
 /* }}} */
@@ -2369,8 +3024,28 @@ private:
 	ssl::Method m_method{ssl::Tlsv1};
 	std::string m_key;
 	std::string m_certificate;
+	std::string m_keyData;
+	std::string m_certificateData;
 	bool m_verify{false};
 
+	/*
+	 * Session resumption, shared with the accepted clients.
+	 */
+	long m_cacheSize{4096};
+	long m_cacheTimeout{300};
+	bool m_tickets{true};
+	std::shared_ptr<ssl::TicketKeys> m_ticketKeys;
+	std::shared_ptr<ssl::Statistics> m_statistics;
+	std::shared_ptr<SSL_SESSION> m_session;
+
+	/* Handshake of the accepted clients started by the caller */
+	bool m_deferred{false};
+
+	/* Kernel TLS, requested and enabled by OpenSSL after the handshake */
+	bool m_ktls{false};
+	bool m_ktlsSend{false};
+	bool m_ktlsRecv{false};
+
 	/*
 	 * Construct with a context and ssl, for Tls::accept.
 	 */
@@ -2390,6 +3065,35 @@ private:
 		return msg == nullptr ? "" : msg;
 	}
 
+	/*
+	 * Free the SSL object. The shutdown flags are set so that OpenSSL does not invalidate the session of a
+	 * connection closed without close_notify, this is common for clients that lose the network.
+	 */
+	static void release(SSL *ssl) noexcept
+	{
+		SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+		SSL_free(ssl);
+	}
+
+	/*
+	 * Count the handshake once complete and check if OpenSSL has enabled kernel TLS.
+	 */
+	inline void handshaked() noexcept
+	{
+#if defined(SOCKET_HAVE_KTLS)
+		m_ktlsSend = BIO_get_ktls_send(SSL_get_wbio(m_ssl.get()));
+		m_ktlsRecv = BIO_get_ktls_recv(SSL_get_rbio(m_ssl.get()));
+#endif
+
+		if (m_statistics) {
+			if (SSL_session_reused(m_ssl.get())) {
+				++m_statistics->resumed;
+			} else {
+				++m_statistics->full;
+			}
+		}
+	}
+
 	/*
 	 * Update the states after an uncompleted operation.
 	 */
@@ -2427,6 +3131,7 @@ private:
 			}
 		} else {
 			sc.setState(State::Connected);
+			handshaked();
 		}
 	}
 
@@ -2449,6 +3154,7 @@ private:
 			}
 		} else {
 			sc.setState(State::Accepted);
+			handshaked();
 		}
 	}
 
@@ -2461,6 +3167,11 @@ public:
 		return SOCK_STREAM;
 	}
 
+	/**
+	 * @copydoc Tcp::setAcceptNonBlocking
+	 */
+	using Tcp::setAcceptNonBlocking;
+
 	/**
 	 * Empty TLS constructor.
 	 */
@@ -2505,6 +3216,26 @@ public:
 		m_certificate = std::move(file);
 	}
 
+	/**
+	 * Use the specified private key, instead of a file.
+	 *
+	 * @param pem the private key in PEM format
+	 */
+	inline void setPrivateKeyData(std::string pem) noexcept
+	{
+		m_keyData = std::move(pem);
+	}
+
+	/**
+	 * Use the specified certificate, instead of a file.
+	 *
+	 * @param pem the certificate in PEM format
+	 */
+	inline void setCertificateData(std::string pem) noexcept
+	{
+		m_certificateData = std::move(pem);
+	}
+
 	/**
 	 * Set to true if we must verify the certificate and private key.
 	 *
@@ -2516,95 +3247,351 @@ public:
 	}
 
 	/**
-	 * Initialize the SSL objects after have created.
+	 * Set the server session cache parameters, use a size of 0 to disable the cache.
 	 *
-	 * @param sc the socket
-	 * @throw net::Error on errors
+	 * Each server socket has its own cache, use tickets to resume sessions across several servers.
+	 *
+	 * @param size the maximum number of sessions (default: 4096)
+	 * @param timeout the session lifetime in seconds (default: 300)
+	 * @pre the socket must not be already created
 	 */
-	template <typename Address>
-	inline void create(Socket<Address, Tls> &sc)
+	inline void setSessionCache(long size, long timeout = 300) noexcept
 	{
-		auto method = (m_method == ssl::Tlsv1) ? TLSv1_method() : SSLv23_method();
+		assert(!m_context);
+		assert(size >= 0 && timeout > 0);
 
-		m_context = {SSL_CTX_new(method), SSL_CTX_free};
-		m_ssl = {SSL_new(m_context.get()), SSL_free};
+		m_cacheSize = size;
+		m_cacheTimeout = timeout;
+	}
 
-		SSL_set_fd(m_ssl.get(), sc.handle());
+	/**
+	 * Enable or disable the session tickets (default: enabled).
+	 *
+	 * @param enable true to enable
+	 * @pre the socket must not be already created
+	 */
+	inline void setTickets(bool enable = true) noexcept
+	{
+		assert(!m_context);
 
-		/* Load certificates */
-		if (m_certificate.size() > 0) {
-			SSL_CTX_use_certificate_file(m_context.get(), m_certificate.c_str(), SSL_FILETYPE_PEM);
-		}
-		if (m_key.size() > 0) {
-			SSL_CTX_use_PrivateKey_file(m_context.get(), m_key.c_str(), SSL_FILETYPE_PEM);
-		}
-		if (m_verify && !SSL_CTX_check_private_key(m_context.get())) {
-			throw Error{Error::System, "(openssl)", "unable to verify key"};
-		}
+		m_tickets = enable;
 	}
 
 	/**
-	 * Connect to a secure host.
-	 *
-	 * If the socket is marked non-blocking and the connection cannot be established yet, then the state is set
-	 * to State::Connecting, the condition is set to Condition::Readable or Condition::Writable, the user must
-	 * wait for the appropriate condition before calling the overload connect which takes 0 argument.
-	 *
-	 * If the socket is blocking, this functions blocks until the connection is complete.
-	 *
-	 * If the connection was completed correctly the state is set to State::Connected.
+	 * Use the specified ticket keys, they may be shared with other server sockets. If not set, each server creates
+	 * its own keys.
 	 *
-	 * @param sc the socket
-	 * @param address the address
-	 * @param length the address length
-	 * @throw net::Error on errors
+	 * @param keys the keys
+	 * @pre the socket must not be already created
 	 */
-	template <typename Address, typename Protocol>
-	void connect(Socket<Address, Protocol> &sc, const sockaddr *address, socklen_t length)
+	inline void setTicketKeys(std::shared_ptr<ssl::TicketKeys> keys) noexcept
 	{
-		/* 1. Connect using raw TCP */
-		Tcp::connect(sc, address, length);
+		assert(!m_context);
 
-		/* 2. If the connection is complete (e.g. non-blocking), try handshake */
-		if (sc.state() == State::Connected) {
-			m_tcpconnected = true;
-			processConnect(sc);
-		}
+		m_ticketKeys = std::move(keys);
 	}
 
 	/**
-	 * Continue the connection.
+	 * Get the ticket keys.
 	 *
-	 * This function must be called when the socket is ready for reading or writing (check with Socket::condition),
-	 * the state may change exactly like the initial connect call.
+	 * @return the keys, may be null if tickets are disabled or the socket is not created yet
+	 */
+	inline const std::shared_ptr<ssl::TicketKeys> &ticketKeys() const noexcept
+	{
+		return m_ticketKeys;
+	}
+
+	/**
+	 * Use the specified statistics, they may be shared with other sockets. If not set, each socket creates its own
+	 * and the accepted clients share the server ones.
 	 *
-	 * @param sc the socket
-	 * @throw net::Error on errors
+	 * @param statistics the statistics
+	 * @pre the socket must not be already created
 	 */
-	template <typename Address, typename Protocol>
-	void connect(Socket<Address, Protocol> &sc)
+	inline void setStatistics(std::shared_ptr<ssl::Statistics> statistics) noexcept
 	{
-		/* 1. Be sure to complete standard connect before */
-		if (!m_tcpconnected) {
-			Tcp::connect(sc);
-			m_tcpconnected = sc.state() == State::Connected;
-		}
+		assert(!m_context);
 
-		if (m_tcpconnected) {
-			processConnect(sc);
-		}
+		m_statistics = std::move(statistics);
 	}
 
 	/**
-	 * Accept a secure client.
-	 *
-	 * Because SSL needs several round-trips, if the socket is marked non-blocking and the connection is not
-	 * completed yet, a new socket is returned but with the State::Accepting state. Its condition is set to
-	 * Condition::Readable or Condition::Writable, the user is responsible of calling accept overload which takes
-	 * 0 arguments on the returned socket when the condition is met.
+	 * Get the handshake statistics.
+	 *
+	 * @return the statistics
+	 */
+	inline const std::shared_ptr<ssl::Statistics> &statistics() const noexcept
+	{
+		return m_statistics;
+	}
+
+	/**
+	 * Do not start the handshake in accept, the returned clients are in the State::Accepting state and the caller
+	 * must call accept on them, possibly from another thread. This is used by HandshakePool.
+	 *
+	 * @param deferred true to defer
+	 */
+	inline void setDeferredAccept(bool deferred = true) noexcept
+	{
+		m_deferred = deferred;
+	}
+
+	/**
+	 * Let OpenSSL enable kernel TLS (Linux only, see SOCKET_HAVE_KTLS) once the handshake is complete, the
+	 * encryption is then done by the kernel without copying the data in user space. Clients accepted by this socket
+	 * inherit the setting. This has no effect if unsupported by OpenSSL, the kernel (tls module) or the cipher, see
+	 * kernelSend and kernelReceive.
+	 *
+	 * @param enable true to enable
+	 * @pre the socket must not be already created
+	 */
+	inline void setKernelTls(bool enable = true) noexcept
+	{
+		assert(!m_context);
+
+		m_ktls = enable;
+	}
+
+	/**
+	 * Check if the kernel encrypts the data sent. In that case, send(const OutputQueue &) writes all the segments
+	 * with one system call and plain data may be written to the handle, for example with sendfile(2).
+	 *
+	 * @return true if enabled
+	 */
+	inline bool kernelSend() const noexcept
+	{
+		return m_ktlsSend;
+	}
+
+	/**
+	 * Check if the kernel decrypts the data received. The records are still read with OpenSSL because the
+	 * non-application records (alerts, tickets, key updates) must be handled.
+	 *
+	 * @return true if enabled
+	 */
+	inline bool kernelReceive() const noexcept
+	{
+		return m_ktlsRecv;
+	}
+
+	/**
+	 * Get the session negotiated by a client, it can be given to setSession for the next connection.
+	 *
+	 * With TLS 1.3, the session is only resumable once the server ticket has been received, which happens on the
+	 * first recv after the handshake.
+	 *
+	 * @return the session or null if none
+	 */
+	inline std::shared_ptr<SSL_SESSION> session() const
+	{
+		if (!m_ssl) {
+			return nullptr;
+		}
+
+		return {SSL_get1_session(m_ssl.get()), SSL_SESSION_free};
+	}
+
+	/**
+	 * Try to resume a previous session on the next connect.
+	 *
+	 * @param session the session returned by session()
+	 * @pre the socket must not be connected
+	 */
+	inline void setSession(std::shared_ptr<SSL_SESSION> session) noexcept
+	{
+		m_session = std::move(session);
+
+		if (m_ssl && m_session) {
+			SSL_set_session(m_ssl.get(), m_session.get());
+		}
+	}
+
+	/**
+	 * Derive secret material from the session (RFC 5705), both peers get the same bytes. This is used to bind
+	 * another channel to this authenticated session, see DatagramChannel::derive.
+	 *
+	 * @param label the label, one per usage
+	 * @param length the number of bytes
+	 * @return the material
+	 * @throw net::Error if the handshake is not complete
+	 */
+	std::string exportKeyingMaterial(const std::string &label, std::size_t length) const
+	{
+		std::string material(length, '\0');
+
+		if (!m_ssl || SSL_export_keying_material(m_ssl.get(), reinterpret_cast<unsigned char *>(&material[0]), length,
+							 label.c_str(), label.length(), nullptr, 0, 0) != 1) {
+			auto msg = ERR_reason_error_string(ERR_get_error());
+
+			throw Error{Error::System, "SSL_export_keying_material", msg == nullptr ? "handshake not complete" : msg};
+		}
+
+		return material;
+	}
+
+	/**
+	 * Initialize the SSL objects after have created.
+	 *
+	 * @param sc the socket
+	 * @throw net::Error on errors
+	 */
+	template <typename Address>
+	inline void create(Socket<Address, Tls> &sc)
+	{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		/* TLSv1_method only speaks TLS 1.0, negotiate and refuse the versions before 1.2 instead */
+		m_context = {SSL_CTX_new(TLS_method()), SSL_CTX_free};
+
+		if (m_method == ssl::Tlsv1) {
+			SSL_CTX_set_min_proto_version(m_context.get(), TLS1_2_VERSION);
+		}
+#else
+		auto method = (m_method == ssl::Tlsv1) ? TLSv1_method() : SSLv23_method();
+
+		m_context = {SSL_CTX_new(method), SSL_CTX_free};
+#endif
+
+		/* Required to send the output queue segment by segment */
+		SSL_CTX_set_mode(m_context.get(), SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+		/* Session resumption, only used by servers */
+		if (m_cacheSize > 0) {
+			static const unsigned char id[] = "malikania";
+
+			SSL_CTX_set_session_cache_mode(m_context.get(), SSL_SESS_CACHE_SERVER);
+			SSL_CTX_sess_set_cache_size(m_context.get(), m_cacheSize);
+			SSL_CTX_set_timeout(m_context.get(), m_cacheTimeout);
+			SSL_CTX_set_session_id_context(m_context.get(), id, sizeof (id) - 1);
+
+#if defined(SSL_OP_IGNORE_UNEXPECTED_EOF)
+			/* Otherwise a client closing without close_notify is an error and its session is removed */
+			SSL_CTX_set_options(m_context.get(), SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+		} else {
+			SSL_CTX_set_session_cache_mode(m_context.get(), SSL_SESS_CACHE_OFF);
+		}
+
+		if (m_tickets) {
+			if (!m_ticketKeys) {
+				m_ticketKeys = std::make_shared<ssl::TicketKeys>();
+			}
+
+			m_ticketKeys->install(m_context.get());
+		} else {
+			SSL_CTX_set_options(m_context.get(), SSL_OP_NO_TICKET);
+		}
+
+		if (!m_statistics) {
+			m_statistics = std::make_shared<ssl::Statistics>();
+		}
+
+#if defined(SOCKET_HAVE_KTLS)
+		if (m_ktls) {
+			SSL_CTX_set_options(m_context.get(), SSL_OP_ENABLE_KTLS);
+		}
+#endif
+
+		m_ssl = {SSL_new(m_context.get()), release};
+
+		SSL_set_fd(m_ssl.get(), sc.handle());
+
+		if (m_session) {
+			SSL_set_session(m_ssl.get(), m_session.get());
+		}
+
+		/* Load certificates */
+		if (m_certificate.size() > 0) {
+			SSL_CTX_use_certificate_file(m_context.get(), m_certificate.c_str(), SSL_FILETYPE_PEM);
+		}
+		if (m_key.size() > 0) {
+			SSL_CTX_use_PrivateKey_file(m_context.get(), m_key.c_str(), SSL_FILETYPE_PEM);
+		}
+		if (m_certificateData.size() > 0) {
+			std::unique_ptr<BIO, void (*)(BIO *)> bio{BIO_new_mem_buf(m_certificateData.data(), static_cast<int>(m_certificateData.size())), BIO_free_all};
+			std::unique_ptr<X509, void (*)(X509 *)> x509{PEM_read_bio_X509(bio.get(), nullptr, nullptr, nullptr), X509_free};
+
+			if (x509) {
+				SSL_CTX_use_certificate(m_context.get(), x509.get());
+			}
+		}
+		if (m_keyData.size() > 0) {
+			std::unique_ptr<BIO, void (*)(BIO *)> bio{BIO_new_mem_buf(m_keyData.data(), static_cast<int>(m_keyData.size())), BIO_free_all};
+			std::unique_ptr<EVP_PKEY, void (*)(EVP_PKEY *)> pkey{PEM_read_bio_PrivateKey(bio.get(), nullptr, nullptr, nullptr), EVP_PKEY_free};
+
+			if (pkey) {
+				SSL_CTX_use_PrivateKey(m_context.get(), pkey.get());
+			}
+		}
+		if (m_verify && !SSL_CTX_check_private_key(m_context.get())) {
+			throw Error{Error::System, "(openssl)", "unable to verify key"};
+		}
+	}
+
+	/**
+	 * Connect to a secure host.
+	 *
+	 * If the socket is marked non-blocking and the connection cannot be established yet, then the state is set
+	 * to State::Connecting, the condition is set to Condition::Readable or Condition::Writable, the user must
+	 * wait for the appropriate condition before calling the overload connect which takes 0 argument.
+	 *
+	 * If the socket is blocking, this functions blocks until the connection is complete.
+	 *
+	 * If the connection was completed correctly the state is set to State::Connected.
+	 *
+	 * @param sc the socket
+	 * @param address the address
+	 * @param length the address length
+	 * @throw net::Error on errors
+	 */
+	template <typename Address, typename Protocol>
+	void connect(Socket<Address, Protocol> &sc, const sockaddr *address, socklen_t length)
+	{
+		/* 1. Connect using raw TCP */
+		Tcp::connect(sc, address, length);
+
+		/* 2. If the connection is complete (e.g. non-blocking), try handshake */
+		if (sc.state() == State::Connected) {
+			m_tcpconnected = true;
+			processConnect(sc);
+		}
+	}
+
+	/**
+	 * Continue the connection.
+	 *
+	 * This function must be called when the socket is ready for reading or writing (check with Socket::condition),
+	 * the state may change exactly like the initial connect call.
+	 *
+	 * @param sc the socket
+	 * @throw net::Error on errors
+	 */
+	template <typename Address, typename Protocol>
+	void connect(Socket<Address, Protocol> &sc)
+	{
+		/* 1. Be sure to complete standard connect before */
+		if (!m_tcpconnected) {
+			Tcp::connect(sc);
+			m_tcpconnected = sc.state() == State::Connected;
+		}
+
+		if (m_tcpconnected) {
+			processConnect(sc);
+		}
+	}
+
+	/**
+	 * Accept a secure client.
+	 *
+	 * Because SSL needs several round-trips, if the socket is marked non-blocking and the connection is not
+	 * completed yet, a new socket is returned but with the State::Accepting state. Its condition is set to
+	 * Condition::Readable or Condition::Writable, the user is responsible of calling accept overload which takes
+	 * 0 arguments on the returned socket when the condition is met.
 	 *
 	 * If the socket is blocking, this function blocks until the client is accepted and returned.
 	 *
+	 * Like Tcp::accept, an invalid socket is returned if the socket is marked non-blocking and no client is
+	 * pending.
+	 *
 	 * If the client is accepted correctly, its state is set to State::Accepted. This instance does not change.
 	 *
 	 * @param sc the socket
@@ -2617,17 +3604,30 @@ public:
 	Socket<Address, Tls> accept(Socket<Address, Tls> &sc, sockaddr *address, socklen_t *length)
 	{
 		Socket<Address, Tls> client = Tcp::accept(sc, address, length);
+
+		if (client.handle() == Invalid) {
+			return client;
+		}
+
 		Tls &proto = client.protocol();
 
 		/* 1. Share the context */
 		proto.m_context = m_context;
+		proto.m_ticketKeys = m_ticketKeys;
+		proto.m_statistics = m_statistics;
 
 		/* 2. Create new SSL instance */
-		proto.m_ssl = Ssl{SSL_new(m_context.get()), SSL_free};
+		proto.m_ssl = Ssl{SSL_new(m_context.get()), release};
 		SSL_set_fd(proto.m_ssl.get(), client.handle());
 
-		/* 3. Try accept process on the **new** client */
-		proto.processAccept(client);
+		/* 3. Try accept process on the **new** client, unless it is done elsewhere */
+		if (m_deferred) {
+			client.setState(State::Accepting);
+			client.setAction(Action::Accept);
+			client.setCondition(Condition::Readable);
+		} else {
+			proto.processAccept(client);
+		}
 
 		return client;
 	}
@@ -2711,6 +3711,50 @@ public:
 
 		return nbsent;
 	}
+
+	/**
+	 * Send the segments one after the other.
+	 *
+	 * OpenSSL has no scatter/gather write, so SSL_write is called for each segment until one of them is not
+	 * completely written. If some data has already been sent, the count is returned and action is not set so that
+	 * the caller consumes the data, otherwise it is the same as send.
+	 *
+	 * If the kernel encrypts the data (see kernelSend), all the segments are written with one system call like
+	 * Tcp::send(Socket<Address, Protocol> &, const OutputQueue &).
+	 *
+	 * @param sc the socket
+	 * @param queue the data to send
+	 * @return the number of bytes sent
+	 * @throw net::Error on errors
+	 */
+	template <typename Address>
+	unsigned send(Socket<Address, Tls> &sc, const OutputQueue &queue)
+	{
+		/* The kernel builds the records, write everything at once like Tcp */
+		if (m_ktlsSend) {
+			return Tcp::send(sc, queue);
+		}
+
+		unsigned total = 0;
+
+		for (std::size_t i = 0; i < queue.count(); ++i) {
+			auto length = static_cast<unsigned>(queue.length(i));
+			auto nbsent = send(sc, queue.data(i), length);
+
+			if (nbsent == 0 && total > 0) {
+				sc.setAction(Action::None);
+				sc.setCondition(Condition::None);
+			}
+
+			total += nbsent;
+
+			if (nbsent < length) {
+				break;
+			}
+		}
+
+		return total;
+	}
 };
 
 #endif // !SOCKET_NO_SSL
@@ -2803,76 +3847,384 @@ public:
 };
 
 /**
- * Table used in the socket listener to store which sockets have been
- * set in which directions.
- */
-using ListenerTable = std::map<Handle, Condition>;
-
-/**
- * @class Select
- * @brief Implements select(2)
+ * @class HandleTable
+ * @brief Associative table keyed by socket handles
  *
- * This class is the fallback of any other method, it is not preferred at all for many reasons.
+ * The values are stored contiguously and an index maps each handle to its position so that lookup, insertion and
+ * removal are O(1). On Unix, handles are small integers so the index is a vector indexed by the handle itself, on
+ * Windows it is a hash table.
+ *
+ * Removal moves the last element into the removed slot, iterators and references to the last element are
+ * invalidated and the iteration order is not the handle order.
  */
-class Select {
+template <typename T>
+class HandleTable {
 public:
 	/**
-	 * No-op, uses the ListenerTable directly.
+	 * Pair of handle and value, like std::map.
 	 */
-	inline void set(const ListenerTable &, Handle, Condition, bool) noexcept {}
+	using value_type = std::pair<Handle, T>;
 
 	/**
-	 * No-op, uses the ListenerTable directly.
+	 * Storage type.
 	 */
-	inline void unset(const ListenerTable &, Handle, Condition, bool) noexcept {}
+	using container_type = std::vector<value_type>;
 
 	/**
-	 * Return the sockets
+	 * Iterator.
 	 */
-	std::vector<ListenerStatus> wait(const ListenerTable &table, int ms);
+	using iterator = typename container_type::iterator;
 
 	/**
-	 * Backend identifier
+	 * Const iterator.
 	 */
-	inline const char *name() const noexcept
-	{
-		return "select";
-	}
-};
+	using const_iterator = typename container_type::const_iterator;
 
-#if defined(SOCKET_HAVE_POLL)
+	/**
+	 * Size type.
+	 */
+	using size_type = typename container_type::size_type;
 
-/**
- * @class Poll
- * @brief Implements poll(2).
- *
- * Poll is widely supported and is better than select(2). It is still not the
- * best option as selecting the sockets is O(n).
- */
-class Poll {
 private:
-	std::vector<pollfd> m_fds;
+	static constexpr size_type npos{static_cast<size_type>(-1)};
 
-	short toPoll(Condition flags) const noexcept;
-	Condition toCondition(short &event) const noexcept;
+	container_type m_values;
 
-public:
-	/**
-	 * Set the handle.
-	 */
-	void set(const ListenerTable &, Handle, Condition, bool);
+#if defined(_WIN32)
+	std::unordered_map<Handle, size_type> m_index;
 
-	/**
-	 * Unset the handle.
-	 */
-	void unset(const ListenerTable &, Handle, Condition, bool);
+	inline size_type lookup(Handle h) const noexcept
+	{
+		auto it = m_index.find(h);
 
-	/**
-	 * Wait for events.
-	 */
-	std::vector<ListenerStatus> wait(const ListenerTable &, int ms);
+		return it == m_index.end() ? npos : it->second;
+	}
 
-	/**
+	inline void store(Handle h, size_type position)
+	{
+		m_index[h] = position;
+	}
+
+	inline void forget(Handle h) noexcept
+	{
+		m_index.erase(h);
+	}
+#else
+	std::vector<size_type> m_index;
+
+	inline size_type lookup(Handle h) const noexcept
+	{
+		return (h < 0 || static_cast<size_type>(h) >= m_index.size()) ? npos : m_index[h];
+	}
+
+	inline void store(Handle h, size_type position)
+	{
+		assert(h >= 0);
+
+		if (static_cast<size_type>(h) >= m_index.size()) {
+			m_index.resize(std::max<size_type>(h + 1, m_index.size() * 2), npos);
+		}
+
+		m_index[h] = position;
+	}
+
+	inline void forget(Handle h) noexcept
+	{
+		m_index[h] = npos;
+	}
+#endif
+
+public:
+	/**
+	 * Get an iterator to the first element.
+	 *
+	 * @return the iterator
+	 */
+	inline iterator begin() noexcept
+	{
+		return m_values.begin();
+	}
+
+	/**
+	 * Overloaded function.
+	 *
+	 * @return the iterator
+	 */
+	inline const_iterator begin() const noexcept
+	{
+		return m_values.begin();
+	}
+
+	/**
+	 * Overloaded function.
+	 *
+	 * @return the iterator
+	 */
+	inline const_iterator cbegin() const noexcept
+	{
+		return m_values.cbegin();
+	}
+
+	/**
+	 * Get an iterator past the last element.
+	 *
+	 * @return the iterator
+	 */
+	inline iterator end() noexcept
+	{
+		return m_values.end();
+	}
+
+	/**
+	 * Overloaded function.
+	 *
+	 * @return the iterator
+	 */
+	inline const_iterator end() const noexcept
+	{
+		return m_values.end();
+	}
+
+	/**
+	 * Overloaded function.
+	 *
+	 * @return the iterator
+	 */
+	inline const_iterator cend() const noexcept
+	{
+		return m_values.cend();
+	}
+
+	/**
+	 * Check if the table is empty.
+	 *
+	 * @return true if empty
+	 */
+	inline bool empty() const noexcept
+	{
+		return m_values.empty();
+	}
+
+	/**
+	 * Get the number of elements.
+	 *
+	 * @return the size
+	 */
+	inline size_type size() const noexcept
+	{
+		return m_values.size();
+	}
+
+	/**
+	 * Find an element.
+	 *
+	 * @param h the handle
+	 * @return the iterator or end() if not found
+	 */
+	inline iterator find(Handle h) noexcept
+	{
+		auto position = lookup(h);
+
+		return position == npos ? m_values.end() : m_values.begin() + position;
+	}
+
+	/**
+	 * Overloaded function.
+	 *
+	 * @param h the handle
+	 * @return the iterator or end() if not found
+	 */
+	inline const_iterator find(Handle h) const noexcept
+	{
+		auto position = lookup(h);
+
+		return position == npos ? m_values.end() : m_values.begin() + position;
+	}
+
+	/**
+	 * Get an element.
+	 *
+	 * @param h the handle
+	 * @return the value
+	 * @throw std::out_of_range if not found
+	 */
+	inline const T &at(Handle h) const
+	{
+		auto position = lookup(h);
+
+		if (position == npos) {
+			throw std::out_of_range("handle not found");
+		}
+
+		return m_values[position].second;
+	}
+
+	/**
+	 * Insert an element if not already present.
+	 *
+	 * @param h the handle
+	 * @param value the value
+	 * @return the iterator to the element and true if inserted
+	 */
+	std::pair<iterator, bool> emplace(Handle h, T value)
+	{
+		auto position = lookup(h);
+
+		if (position != npos) {
+			return std::make_pair(m_values.begin() + position, false);
+		}
+
+		m_values.emplace_back(h, std::move(value));
+
+		try {
+			store(h, m_values.size() - 1);
+		} catch (...) {
+			m_values.pop_back();
+			throw;
+		}
+
+		return std::make_pair(m_values.end() - 1, true);
+	}
+
+	/**
+	 * Overloaded function.
+	 *
+	 * @param value the pair
+	 * @return the iterator to the element and true if inserted
+	 */
+	inline std::pair<iterator, bool> insert(value_type value)
+	{
+		return emplace(value.first, std::move(value.second));
+	}
+
+	/**
+	 * Remove an element.
+	 *
+	 * @pre it must be valid
+	 * @param it the iterator
+	 */
+	void erase(iterator it) noexcept
+	{
+		auto position = static_cast<size_type>(it - m_values.begin());
+
+		forget(it->first);
+
+		if (position != m_values.size() - 1) {
+			*it = std::move(m_values.back());
+			store(it->first, position);
+		}
+
+		m_values.pop_back();
+	}
+
+	/**
+	 * Overloaded function.
+	 *
+	 * @param h the handle
+	 * @return the number of elements removed
+	 */
+	inline size_type erase(Handle h) noexcept
+	{
+		auto it = find(h);
+
+		if (it == m_values.end()) {
+			return 0;
+		}
+
+		erase(it);
+
+		return 1;
+	}
+};
+
+template <typename T>
+constexpr typename HandleTable<T>::size_type HandleTable<T>::npos;
+
+/**
+ * Table used in the socket listener to store which sockets have been
+ * set in which directions.
+ */
+using ListenerTable = HandleTable<Condition>;
+
+/**
+ * @class Select
+ * @brief Implements select(2)
+ *
+ * This class is the fallback of any other method, it is not preferred at all for many reasons.
+ */
+class Select {
+public:
+	/**
+	 * No-op, uses the ListenerTable directly.
+	 */
+	inline void set(const ListenerTable &, Handle, Condition, bool) noexcept {}
+
+	/**
+	 * No-op, uses the ListenerTable directly.
+	 */
+	inline void unset(const ListenerTable &, Handle, Condition, bool) noexcept {}
+
+	/**
+	 * No-op, uses the ListenerTable directly.
+	 */
+	inline void modify(const ListenerTable &, Handle, Condition) noexcept {}
+
+	/**
+	 * Return the sockets
+	 */
+	std::vector<ListenerStatus> wait(const ListenerTable &table, int ms);
+
+	/**
+	 * Backend identifier
+	 */
+	inline const char *name() const noexcept
+	{
+		return "select";
+	}
+};
+
+#if defined(SOCKET_HAVE_POLL)
+
+/**
+ * @class Poll
+ * @brief Implements poll(2).
+ *
+ * Poll is widely supported and is better than select(2). It is still not the
+ * best option as selecting the sockets is O(n).
+ *
+ * The position of each handle in the pollfd array is indexed so that set and
+ * unset are O(1), removed entries are replaced by the last one.
+ */
+class Poll {
+private:
+	std::vector<pollfd> m_fds;
+	HandleTable<std::size_t> m_positions;
+
+	short toPoll(Condition flags) const noexcept;
+	Condition toCondition(short &event) const noexcept;
+
+public:
+	/**
+	 * Set the handle.
+	 */
+	void set(const ListenerTable &, Handle, Condition, bool);
+
+	/**
+	 * Unset the handle.
+	 */
+	void unset(const ListenerTable &, Handle, Condition, bool);
+
+	/**
+	 * Replace the condition of the handle.
+	 */
+	void modify(const ListenerTable &, Handle, Condition);
+
+	/**
+	 * Wait for events.
+	 */
+	std::vector<ListenerStatus> wait(const ListenerTable &, int ms);
+
+	/**
 	 * Backend identifier
 	 */
 	inline const char *name() const noexcept
@@ -2924,6 +4276,11 @@ public:
 	 */
 	void unset(const ListenerTable &, Handle, Condition, bool);
 
+	/**
+	 * Replace the condition of the handle.
+	 */
+	void modify(const ListenerTable &, Handle, Condition);
+
 	/**
 	 * Wait for events.
 	 */
@@ -2940,37 +4297,62 @@ public:
 
 #endif
 
-#if defined(SOCKET_HAVE_KQUEUE)
+#if defined(SOCKET_HAVE_IO_URING)
 
 /**
- * @class Kqueue
- * @brief Implements kqueue(2).
+ * @class IoUring
+ * @brief Linux's io_uring used as a readiness notifier.
  *
- * This implementation is available on all BSD and Mac OS X. It is better than
- * poll(2) because it's O(1), however it's a bit more memory consuming.
+ * Each socket has one one-shot poll request in the ring. The set and unset functions only record the changes, they
+ * are submitted by the next wait in the same io_uring_enter(2) call that waits for the completions, together with
+ * the requests of the sockets reported by the previous wait. The number of system calls per wait does not depend
+ * on the number of sockets modified anymore.
+ *
+ * A one-shot poll request completes immediately if the socket is already ready, so a socket that was not handled
+ * is reported again on the next wait like with the other backends.
+ *
+ * Only readiness is taken from the ring, the sockets are still read and written with the usual non-blocking calls.
  */
-class Kqueue {
+class IoUring {
 private:
-	std::vector<struct kevent> m_result;
-	int m_handle;
+	class Entry {
+	public:
+		Condition condition{Condition::None};	//!< requested condition
+		std::uint32_t generation{0};		//!< generation of the armed request, 0 if none
+		bool queued{false};			//!< in m_pending
+	};
 
-	Kqueue(const Kqueue &) = delete;
-	Kqueue &operator=(const Kqueue &) = delete;
-	Kqueue(Kqueue &&) = delete;
-	Kqueue &operator=(Kqueue &&) = delete;
+	io_uring m_ring;
+	HandleTable<Entry> m_entries;
+	std::vector<Handle> m_pending;
+	std::uint32_t m_generation{0};
 
-	void update(Handle sc, int filter, int kflags);
+	IoUring(const IoUring &) = delete;
+	IoUring &operator=(const IoUring &) = delete;
+	IoUring(const IoUring &&) = delete;
+	IoUring &operator=(const IoUring &&) = delete;
+
+	unsigned toPoll(Condition condition) const noexcept;
+	Condition toCondition(int mask) const noexcept;
+	io_uring_sqe *sqe();
+	void queue(Handle h, Entry &entry);
+	void cancel(Handle h, Entry &entry);
+	void arm(Handle h, Entry &entry);
+	std::vector<ListenerStatus> reap();
 
 public:
 	/**
-	 * Construct the kqueue instance.
+	 * Create the ring.
+	 *
+	 * @param entries the submission queue size
+	 * @throw Error if io_uring is not available
 	 */
-	Kqueue();
+	IoUring(unsigned entries = 4096);
 
 	/**
-	 * Destroy the kqueue instance.
+	 * Destroy the ring.
 	 */
-	~Kqueue();
+	~IoUring();
 
 	/**
 	 * Set the handle.
@@ -2982,6 +4364,11 @@ public:
 	 */
 	void unset(const ListenerTable &, Handle, Condition, bool);
 
+	/**
+	 * Replace the condition of the handle.
+	 */
+	void modify(const ListenerTable &, Handle, Condition);
+
 	/**
 	 * Wait for events.
 	 */
@@ -2992,7 +4379,70 @@ public:
 	 */
 	inline const char *name() const noexcept
 	{
-		return "kqueue";
+		return "io_uring";
+	}
+};
+
+#endif
+
+#if defined(SOCKET_HAVE_KQUEUE)
+
+/**
+ * @class Kqueue
+ * @brief Implements kqueue(2).
+ *
+ * This implementation is available on all BSD and Mac OS X. It is better than
+ * poll(2) because it's O(1), however it's a bit more memory consuming.
+ */
+class Kqueue {
+private:
+	std::vector<struct kevent> m_result;
+	int m_handle;
+
+	Kqueue(const Kqueue &) = delete;
+	Kqueue &operator=(const Kqueue &) = delete;
+	Kqueue(Kqueue &&) = delete;
+	Kqueue &operator=(Kqueue &&) = delete;
+
+	void update(Handle sc, int filter, int kflags);
+
+public:
+	/**
+	 * Construct the kqueue instance.
+	 */
+	Kqueue();
+
+	/**
+	 * Destroy the kqueue instance.
+	 */
+	~Kqueue();
+
+	/**
+	 * Set the handle.
+	 */
+	void set(const ListenerTable &, Handle, Condition, bool);
+
+	/**
+	 * Unset the handle.
+	 */
+	void unset(const ListenerTable &, Handle, Condition, bool);
+
+	/**
+	 * Replace the condition of the handle.
+	 */
+	void modify(const ListenerTable &, Handle, Condition);
+
+	/**
+	 * Wait for events.
+	 */
+	std::vector<ListenerStatus> wait(const ListenerTable &, int);
+
+	/**
+	 * Backend identifier
+	 */
+	inline const char *name() const noexcept
+	{
+		return "kqueue";
 	}
 };
 
@@ -3011,7 +4461,14 @@ public:
  * main loop as it can be extremely costly. Instead use the same listener that
  * you can safely modify on the fly.
  *
- * Currently, poll, epoll, select and kqueue are available.
+ * Currently, poll, epoll, select, kqueue and io_uring are available.
+ *
+ * Changes of conditions are not applied immediately to the backend, they are recorded and applied once before the
+ * next wait so that a condition set and unset between two waits costs nothing and a socket modified several times
+ * costs at most one add or modification. Complete removals are the exception, they are applied immediately because
+ * the socket is usually closed just after.
+ *
+ * The backend functions receive the table of conditions currently applied.
  *
  * To implement the backend, the following functions must be available:
  *
@@ -3041,6 +4498,16 @@ public:
  * Also like set, an optional remove argument is set if the socket is being
  * completely removed (e.g no more flags are set for this socket).
  *
+ * ### Modify
+ *
+ * @code
+ * void modify(const ListenerTable &, Handle sc, Condition condition);
+ * @endcode
+ *
+ * Replace the condition of a socket already set, only called when some flags are added and others removed at the
+ * same time (e.g. Readable to Writable) so that the change is a single operation. The table still contains the
+ * previous condition.
+ *
  * ### Wait
  *
  * @code
@@ -3063,6 +4530,95 @@ class Listener {
 private:
 	Backend m_backend;
 	ListenerTable m_table;
+	ListenerTable m_applied;
+	std::vector<Handle> m_dirty;
+	std::uint64_t m_requests{0};
+	std::uint64_t m_calls{0};
+
+	/*
+	 * Record the new condition of a socket, None removes it.
+	 */
+	void change(Handle sc, Condition condition)
+	{
+		auto it = m_table.find(sc);
+		auto current = (it == m_table.end()) ? Condition::None : it->second;
+
+		if (condition == current) {
+			return;
+		}
+
+		auto applied = m_applied.find(sc);
+		auto effective = (applied == m_applied.end()) ? Condition::None : applied->second;
+
+		if (condition == Condition::None) {
+			/* The socket may be closed just after, remove it now */
+			if (applied != m_applied.end()) {
+				m_backend.unset(m_applied, sc, effective, true);
+				m_applied.erase(applied);
+				m_calls ++;
+			}
+
+			m_table.erase(it);
+		} else {
+			/* Not yet in the dirty list if it was in sync */
+			if (current == effective) {
+				m_dirty.push_back(sc);
+			}
+
+			if (it == m_table.end()) {
+				m_table.emplace(sc, condition);
+			} else {
+				it->second = condition;
+			}
+		}
+
+		m_requests ++;
+	}
+
+	/*
+	 * Apply the transition from the applied condition to the requested one.
+	 */
+	void apply(Handle sc)
+	{
+		auto it = m_table.find(sc);
+		auto applied = m_applied.find(sc);
+
+		/* Removed since, already applied */
+		if (it == m_table.end()) {
+			return;
+		}
+
+		if (applied == m_applied.end()) {
+			m_backend.set(m_applied, sc, it->second, true);
+			m_applied.emplace(sc, it->second);
+			m_calls ++;
+
+			return;
+		}
+
+		auto removed = applied->second & ~(it->second);
+		auto added = it->second & ~(applied->second);
+
+		/* Flags added and removed (e.g. Readable to Writable), one modification */
+		if (removed != Condition::None && added != Condition::None) {
+			m_backend.modify(m_applied, sc, it->second);
+			applied->second = it->second;
+			m_calls ++;
+
+			return;
+		}
+
+		if (removed != Condition::None) {
+			m_backend.unset(m_applied, sc, removed, false);
+			applied->second &= ~(removed);
+			m_calls ++;
+		}
+		if (added != Condition::None) {
+			m_backend.set(m_applied, sc, added, false);
+			applied->second |= added;
+			m_calls ++;
+		}
+	}
 
 public:
 	/**
@@ -3140,7 +4696,7 @@ public:
 	 *
 	 * @param sc the socket
 	 * @param condition the condition (may be OR'ed)
-	 * @throw Error if the backend failed to set
+	 * @note the change is applied by the next wait or flush
 	 */
 	void set(Handle sc, Condition condition)
 	{
@@ -3150,30 +4706,25 @@ public:
 
 		auto it = m_table.find(sc);
 
-		/*
-		 * Do not update the table if the backend failed to add
-		 * or update.
-		 */
-		if (it == m_table.end()) {
-			m_backend.set(m_table, sc, condition, true);
-			m_table.emplace(sc, condition);
-		} else {
-			/* Remove flag if already present */
-			if ((condition & Condition::Readable) == Condition::Readable &&
-			    (it->second & Condition::Readable) == Condition::Readable) {
-				condition &= ~(Condition::Readable);
-			}
-			if ((condition & Condition::Writable) == Condition::Writable &&
-			    (it->second & Condition::Writable) == Condition::Writable) {
-				condition &= ~(Condition::Writable);
-			}
+		change(sc, (it == m_table.end()) ? condition : (it->second | condition));
+	}
 
-			/* Still need a call? */
-			if (condition != Condition::None) {
-				m_backend.set(m_table, sc, condition, false);
-				it->second |= condition;
-			}
-		}
+	/**
+	 * Replace the flags of a socket, the socket is removed if condition is None.
+	 *
+	 * This is the same as unsetting the flags not in condition and setting the others.
+	 *
+	 * @param sc the socket
+	 * @param condition the condition (may be OR'ed)
+	 * @throw Error if the backend failed to remove
+	 */
+	void assign(Handle sc, Condition condition)
+	{
+		/* Invalid flags */
+		if (static_cast<int>(condition) > 0x3)
+			return;
+
+		change(sc, condition);
 	}
 
 	/**
@@ -3185,6 +4736,7 @@ public:
 	 *
 	 * @param sc the socket
 	 * @param condition the condition (may be OR'ed)
+	 * @throw Error if the backend failed to remove
 	 * @see remove
 	 */
 	void unset(Handle sc, Condition condition)
@@ -3195,31 +4747,59 @@ public:
 		if (condition == Condition::None || static_cast<int>(condition) > 0x3 || it == m_table.end())
 			return;
 
-		/*
-		 * Like set, do not update if the socket is already at the appropriate
-		 * state.
-		 */
-		if ((condition & Condition::Readable) == Condition::Readable &&
-		    (it->second & Condition::Readable) != Condition::Readable) {
-			condition &= ~(Condition::Readable);
-		}
-		if ((condition & Condition::Writable) == Condition::Writable &&
-		    (it->second & Condition::Writable) != Condition::Writable) {
-			condition &= ~(Condition::Writable);
-		}
-
-		if (condition != Condition::None) {
-			/* Determine if it's a complete removal */
-			bool removal = ((it->second) & ~(condition)) == Condition::None;
+		change(sc, it->second & ~(condition));
+	}
 
-			m_backend.unset(m_table, sc, condition, removal);
+	/**
+	 * Apply the pending changes to the backend, this is done automatically by wait functions.
+	 *
+	 * @throw Error if the backend failed to set, the failing change is dropped
+	 */
+	void flush()
+	{
+		std::size_t i = 0;
 
-			if (removal) {
-				m_table.erase(it);
-			} else {
-				it->second &= ~(condition);
+		try {
+			for (; i < m_dirty.size(); ++i) {
+				apply(m_dirty[i]);
 			}
+		} catch (...) {
+			m_dirty.erase(m_dirty.begin(), m_dirty.begin() + i + 1);
+			throw;
 		}
+
+		m_dirty.clear();
+	}
+
+	/**
+	 * Get the number of changes requested that would have required a backend call if they were not
+	 * coalesced.
+	 *
+	 * @return the number of requests
+	 */
+	inline std::uint64_t requests() const noexcept
+	{
+		return m_requests;
+	}
+
+	/**
+	 * Get the number of backend calls (usually one system call each).
+	 *
+	 * @return the number of calls
+	 */
+	inline std::uint64_t calls() const noexcept
+	{
+		return m_calls;
+	}
+
+	/**
+	 * Get the number of backend calls saved by coalescing the changes.
+	 *
+	 * @return requests() - calls()
+	 */
+	inline std::uint64_t saved() const noexcept
+	{
+		return m_requests - m_calls;
 	}
 
 	/**
@@ -3263,7 +4843,9 @@ public:
 	{
 		auto cvt = std::chrono::duration_cast<std::chrono::milliseconds>(duration);
 
-		return m_backend.wait(m_table, cvt.count())[0];
+		flush();
+
+		return m_backend.wait(m_applied, cvt.count())[0];
 	}
 
 	/**
@@ -3288,7 +4870,9 @@ public:
 	{
 		auto cvt = std::chrono::duration_cast<std::chrono::milliseconds>(duration);
 
-		return m_backend.wait(m_table, cvt.count());
+		flush();
+
+		return m_backend.wait(m_applied, cvt.count());
 	}
 
 	/**
@@ -3305,489 +4889,4208 @@ public:
 /* }}} */
 
 /*
- * Callback
+ * Wakeup
  * ------------------------------------------------------------------
  *
- * Function owner with tests.
+ * Interrupt a listener from another thread.
  */
 
-/* {{{ Callback */
+/* {{{ Wakeup */
 
 /**
- * @class Callback
- * @brief Convenient signal owner that checks if the target is valid.
+ * @class Wakeup
+ * @brief Handle that becomes readable when notified, to interrupt a Listener from another thread.
  *
- * This class also catch all errors thrown from signals to avoid interfering with our process.
+ * The implementation uses an eventfd on Linux, a pipe on other Unix systems and a UDP socket connected to itself on
+ * Windows. Several notifications before the handle is cleared only wake up the listener once.
  */
-template <typename... Args>
-class Callback : public std::function<void (Args...)> {
+class Wakeup {
+private:
+	Handle m_read{Invalid};
+	Handle m_write{Invalid};
+
 public:
 	/**
-	 * Inherited constructors.
+	 * Create the handles.
+	 *
+	 * @throw net::Error on errors
 	 */
-	using std::function<void (Args...)>::function;
+	Wakeup();
 
 	/**
-	 * Execute the callback only if a target is set.
+	 * Close the handles.
 	 */
-	void operator()(Args... args) const
+	~Wakeup();
+
+	/**
+	 * Deleted copy constructor.
+	 */
+	Wakeup(const Wakeup &) = delete;
+
+	/**
+	 * Deleted copy assignment.
+	 *
+	 * @return *this
+	 */
+	Wakeup &operator=(const Wakeup &) = delete;
+
+	/**
+	 * Get the handle to add to the listener with Condition::Readable.
+	 *
+	 * @return the handle
+	 */
+	inline Handle handle() const noexcept
 	{
-		if (*this) {
-			try {
-				std::function<void (Args...)>::operator()(args...);
-			} catch (...) {
-			}
-		}
+		return m_read;
 	}
+
+	/**
+	 * Make the handle readable, this function is thread safe.
+	 */
+	void notify() noexcept;
+
+	/**
+	 * Consume the notifications, must be called by the listener thread when the handle is readable.
+	 */
+	void clear() noexcept;
 };
 
 /* }}} */
 
 /*
- * StreamConnection
+ * MpscQueue
  * ------------------------------------------------------------------
  *
- * Client connected on the server side.
+ * Pass values from any thread to the listener thread.
  */
 
-/* {{{ StreamConnection */
+/* {{{ MpscQueue */
 
 /**
- * @class StreamConnection
- * @brief Connected client on the server side.
+ * @class MpscQueue
+ * @brief Unbounded lock-free queue with several producers and one consumer.
  *
- * This object is created from StreamServer when a new client is connected, it is the higher
- * level object of sockets and completely asynchronous.
+ * Each value is stored in its own node, push links it with one atomic exchange so producers never wait for each
+ * other nor for the consumer. The consumer always keeps the last node consumed as the head, its value is already
+ * moved out.
+ *
+ * A push is only visible once it has returned, a producer interrupted in the middle of it makes pop return false
+ * until it completes, the queue must be paired with a Wakeup notified after push.
  */
-template <typename Address, typename Protocol>
-class StreamConnection {
-public:
-	/**
-	 * Called when the output has changed.
-	 */
-	using WriteHandler = Callback<>;
-
+template <typename T>
+class MpscQueue {
 private:
-	/* Signals */
-	WriteHandler m_onWrite;
+	class Node {
+	public:
+		std::atomic<Node *> next{nullptr};
+		T value;
 
-	/* Sockets and output buffer */
-	Socket<Address, Protocol> m_socket;
-	std::string m_output;
+		inline Node() = default;
+
+		inline Node(T v)
+			: value(std::move(v))
+		{
+		}
+	};
+
+	/* Written by the producers */
+	std::atomic<Node *> m_back;
+
+	/* Only used by the consumer */
+	Node *m_front;
 
 public:
 	/**
-	 * Create the connection.
-	 *
-	 * @param s the socket
+	 * Create an empty queue.
 	 */
-	StreamConnection(Socket<Address, Protocol> s)
-		: m_socket{std::move(s)}
+	inline MpscQueue()
+		: m_front(new Node)
 	{
-		m_socket.set(net::option::SockBlockMode{false});
+		m_back = m_front;
 	}
 
 	/**
-	 * Access the underlying socket.
-	 *
-	 * @return the socket
-	 * @warning use with care
+	 * Destroy the values not consumed.
 	 */
-	inline Socket<Address, Protocol> &socket() noexcept
+	~MpscQueue()
 	{
-		return m_socket;
+		while (m_front) {
+			auto next = m_front->next.load(std::memory_order_relaxed);
+
+			delete m_front;
+			m_front = next;
+		}
 	}
 
 	/**
-	 * Access the current output.
-	 *
-	 * @return the output
+	 * Deleted copy constructor.
 	 */
-	inline const std::string &output() const noexcept
-	{
-		return m_output;
-	}
+	MpscQueue(const MpscQueue &) = delete;
 
 	/**
-	 * Overloaded function
+	 * Deleted copy assignment.
 	 *
-	 * @return the output
-	 * @warning use with care, avoid modifying the output if you don't know what you're doing
+	 * @return *this
 	 */
-	inline std::string &output() noexcept
-	{
-		return m_output;
-	}
+	MpscQueue &operator=(const MpscQueue &) = delete;
 
 	/**
-	 * Post some data to be sent asynchronously.
+	 * Add a value, this function is thread safe.
 	 *
-	 * @param str the data to append
+	 * @param value the value
 	 */
-	inline void send(std::string str)
+	void push(T value)
 	{
-		m_output += str;
-		m_onWrite();
+		auto node = new Node{std::move(value)};
+		auto prev = m_back.exchange(node, std::memory_order_acq_rel);
+
+		prev->next.store(node, std::memory_order_release);
+	}
+
+	/**
+	 * Take the oldest value, must only be called by the consumer thread.
+	 *
+	 * @param value the value replaced
+	 * @return false if the queue is empty
+	 */
+	bool pop(T &value)
+	{
+		auto next = m_front->next.load(std::memory_order_acquire);
+
+		if (next == nullptr) {
+			return false;
+		}
+
+		value = std::move(next->value);
+		delete m_front;
+		m_front = next;
+
+		return true;
+	}
+};
+
+/* }}} */
+
+/*
+ * TimerWheel
+ * ------------------------------------------------------------------
+ *
+ * Timers owned by a reactor.
+ */
+
+/* {{{ TimerWheel */
+
+/**
+ * @class TimerWheel
+ * @brief Hierarchical timing wheel.
+ *
+ * The time is divided in ticks of a fixed resolution. The timers are stored in 4 levels of 64 slots, a timer expiring
+ * in the current block of 64 ticks is in the first level, a timer expiring in the current block of 64 * 64 ticks is
+ * in the second level and so on. When the first level has been consumed, the next slot of the second level is
+ * distributed to the first level. Timers beyond the last level (about 46 hours with the default resolution) are kept
+ * in an overflow list distributed the same way.
+ *
+ * Scheduling, rescheduling and cancelling are O(1). The wheel only advances when advance is called, usually after
+ * each wait of the listener with timeout() as the listener timeout.
+ *
+ * The handlers may schedule or cancel any timer, including themselves. This class is not thread safe.
+ */
+class TimerWheel {
+public:
+	/**
+	 * Clock used.
+	 */
+	using Clock = std::chrono::steady_clock;
+
+	/**
+	 * Timer identifier, 0 is never used.
+	 */
+	using Id = std::uint64_t;
+
+	/**
+	 * Function called when the timer expires.
+	 */
+	using Handler = std::function<void ()>;
+
+private:
+	static constexpr unsigned bits{6};
+	static constexpr unsigned slots{1U << bits};
+	static constexpr unsigned levels{4};
+	static constexpr std::uint32_t npos{static_cast<std::uint32_t>(-1)};
+
+	/* Pseudo slots after the levels, only overflow is a list */
+	static constexpr std::uint32_t overflow{levels * slots};
+	static constexpr std::uint32_t running{overflow + 1};
+	static constexpr std::uint32_t cancelled{overflow + 2};
+	static constexpr std::uint32_t rescheduled{overflow + 3};
+	static constexpr std::uint32_t none{overflow + 4};
+
+	class Node {
+	public:
+		Handler handler;
+		std::uint64_t deadline{0};
+		std::uint64_t period{0};
+		std::uint32_t prev{npos};
+		std::uint32_t next{npos};
+		std::uint32_t generation{1};
+		std::uint32_t slot{none};
+	};
+
+	std::chrono::nanoseconds m_resolution;
+	Clock::time_point m_origin;
+	std::uint64_t m_current{0};
+	std::size_t m_size{0};
+
+	std::vector<Node> m_nodes;
+	std::vector<std::uint32_t> m_free;
+	std::uint32_t m_heads[levels * slots + 1];
+	std::uint64_t m_bitmaps[levels]{};
+
+	std::uint64_t ticks(std::chrono::milliseconds delay) const noexcept;
+	std::uint64_t tick(Clock::time_point when) const noexcept;
+	std::uint32_t find(Id id) const noexcept;
+	Id create(std::chrono::milliseconds delay, std::uint64_t period, Handler handler);
+	void link(std::uint32_t index, std::uint32_t slot) noexcept;
+	void unlink(std::uint32_t index) noexcept;
+	void insert(std::uint32_t index) noexcept;
+	void release(std::uint32_t index) noexcept;
+	void cascade(std::uint32_t slot) noexcept;
+	void finish(std::uint32_t index, Handler handler) noexcept;
+	unsigned fire();
+
+public:
+	/**
+	 * Create the wheel.
+	 *
+	 * @param resolution the tick duration, timers are rounded up to it
+	 * @param origin the start time
+	 */
+	TimerWheel(std::chrono::milliseconds resolution = std::chrono::milliseconds{10}, Clock::time_point origin = Clock::now());
+
+	/**
+	 * Get the number of active timers.
+	 *
+	 * @return the number of timers
+	 */
+	inline std::size_t size() const noexcept
+	{
+		return m_size;
+	}
+
+	/**
+	 * Call a function once after a delay.
+	 *
+	 * @param delay the delay, relative to the last call to advance
+	 * @param handler the function
+	 * @return the timer id
+	 */
+	Id schedule(std::chrono::milliseconds delay, Handler handler);
+
+	/**
+	 * Call a function periodically.
+	 *
+	 * @param period the period, the first call is after one period
+	 * @param handler the function
+	 * @return the timer id
+	 * @pre period must not be 0
+	 */
+	Id schedulePeriodic(std::chrono::milliseconds period, Handler handler);
+
+	/**
+	 * Move the next expiration of a timer.
+	 *
+	 * @param id the timer id
+	 * @param delay the new delay, relative to the last call to advance
+	 * @return false if the timer does not exist anymore
+	 */
+	bool reschedule(Id id, std::chrono::milliseconds delay) noexcept;
+
+	/**
+	 * Cancel a timer, the handler is destroyed immediately unless it is running.
+	 *
+	 * @param id the timer id (0 is ignored)
+	 * @return false if the timer does not exist anymore
+	 */
+	bool cancel(Id id) noexcept;
+
+	/**
+	 * Check if a timer is still active.
+	 *
+	 * @param id the timer id
+	 * @return true if active
+	 */
+	bool active(Id id) const noexcept;
+
+	/**
+	 * Get the time until the next expiration, to use as the listener timeout.
+	 *
+	 * The value may be earlier than the real expiration when timers must be moved between levels.
+	 *
+	 * @param max the value returned if there are no timers (-1 for indefinitely)
+	 * @param now the current time
+	 * @return the number of milliseconds, rounded up
+	 */
+	int timeout(int max = -1, Clock::time_point now = Clock::now()) const noexcept;
+
+	/**
+	 * Call the handlers of the expired timers.
+	 *
+	 * @param now the current time
+	 * @return the number of handlers called
+	 */
+	unsigned advance(Clock::time_point now = Clock::now());
+};
+
+/* }}} */
+
+/*
+ * Callback
+ * ------------------------------------------------------------------
+ *
+ * Function owner with tests.
+ */
+
+/* {{{ Callback */
+
+/**
+ * @class Callback
+ * @brief Convenient signal owner that checks if the target is valid.
+ *
+ * This class also catch all errors thrown from signals to avoid interfering with our process.
+ */
+template <typename... Args>
+class Callback : public std::function<void (Args...)> {
+public:
+	/**
+	 * Inherited constructors.
+	 */
+	using std::function<void (Args...)>::function;
+
+	/**
+	 * Execute the callback only if a target is set.
+	 */
+	void operator()(Args... args) const
+	{
+		if (*this) {
+			try {
+				std::function<void (Args...)>::operator()(args...);
+			} catch (...) {
+			}
+		}
+	}
+};
+
+/* }}} */
+
+/*
+ * Datagrams
+ * ------------------------------------------------------------------
+ *
+ * Unreliable packets next to a stream connection.
+ */
+
+/* {{{ DatagramChannel */
+
+/**
+ * @class DatagramStatistics
+ * @brief Counters of a DatagramChannel.
+ */
+class DatagramStatistics {
+public:
+	std::uint64_t sent{0};			//!< packets sent
+	std::uint64_t received{0};		//!< packets accepted
+	std::uint64_t acked{0};			//!< packets sent and acknowledged by the peer
+	std::uint64_t lost{0};			//!< packets sent and never acknowledged
+	std::uint64_t duplicated{0};		//!< packets received twice or too late
+	std::uint64_t rejected{0};		//!< packets with a wrong size, token or authentication tag
+	std::chrono::milliseconds rtt{0};	//!< smoothed round trip time of the acknowledged packets
+};
+
+/**
+ * @class DatagramChannel
+ * @brief Unreliable and unordered packets between two peers.
+ *
+ * A channel is identified by a token, usually bound to an authenticated stream connection, see derive. Each packet
+ * starts with a header of 20 bytes, in network byte order:
+ *
+ * - the token (8 bytes),
+ * - the sequence number of the packet (4 bytes),
+ * - the last sequence number received from the peer (4 bytes),
+ * - a bitfield of the 32 sequence numbers received before the last one (4 bytes).
+ *
+ * As every packet acknowledges the previous ones, the sender knows which packets were received without sending
+ * anything else, see setAckHandler. A packet that has not been acknowledged once the peer has received 32 newer
+ * ones is counted as lost. Packets older than the last 32 received and duplicated packets are discarded.
+ *
+ * If a key is set, the payload is encrypted with AES-256-GCM and the header is authenticated, a 16 bytes tag is
+ * appended. The nonce is made of the sequence number and the side so each side can use the same key, a channel
+ * can not send more than 2^32 packets with one key.
+ *
+ * This class is not thread safe.
+ */
+class DatagramChannel {
+public:
+	/**
+	 * Handler when a packet sent has been acknowledged, the sequence number is passed.
+	 */
+	using AckHandler = Callback<std::uint32_t>;
+
+	/**
+	 * @enum Side
+	 * @brief Which peer owns the channel.
+	 */
+	enum class Side {
+		Server,		//!< the channel is owned by a DatagramServer
+		Client		//!< the channel is owned by a DatagramClient
+	};
+
+	/**
+	 * Size of the header.
+	 */
+	static constexpr std::size_t headerSize{20};
+
+	/**
+	 * Size of the authentication tag of the encrypted packets.
+	 */
+	static constexpr std::size_t tagSize{16};
+
+	/**
+	 * Size of the key.
+	 */
+	static constexpr std::size_t keySize{32};
+
+private:
+	/* Sent packets, indexed by the sequence number */
+	class Sent {
+	public:
+		std::uint32_t sequence{0};
+		bool pending{false};
+		std::chrono::steady_clock::time_point time;
+	};
+
+	static constexpr std::uint32_t window{256};
+
+	Side m_side;
+	std::uint64_t m_token;
+	std::string m_key;
+	AckHandler m_onAck;
+	DatagramStatistics m_statistics;
+
+	/* Local sequence numbers */
+	std::uint64_t m_next{0};
+	std::uint32_t m_checked{0};
+	std::vector<Sent> m_sent;
+
+	/* Sequence numbers received */
+	bool m_remoteValid{false};
+	std::uint32_t m_remote{0};
+	std::uint32_t m_remoteBits{0};
+
+#if !defined(SOCKET_NO_SSL)
+	std::unique_ptr<EVP_CIPHER_CTX, void (*)(EVP_CIPHER_CTX *)> m_encrypt{nullptr, nullptr};
+	std::unique_ptr<EVP_CIPHER_CTX, void (*)(EVP_CIPHER_CTX *)> m_decrypt{nullptr, nullptr};
+#endif
+
+	bool fresh(std::uint32_t sequence) const noexcept;
+	void receive(std::uint32_t sequence) noexcept;
+	void acknowledge(std::uint32_t ack, std::uint32_t bits);
+
+public:
+	/**
+	 * Label given to Tls::exportKeyingMaterial by derive.
+	 */
+	static const std::string label;
+
+	/**
+	 * Create a channel with a random token and key, the application must send them to the peer over the stream
+	 * connection.
+	 *
+	 * @param side the side
+	 * @param encrypted true to generate a key
+	 * @return the channel
+	 * @throw net::Error on errors
+	 */
+	static std::shared_ptr<DatagramChannel> random(Side side, bool encrypted = true);
+
+	/**
+	 * Create a channel from secret material known by both peers, usually the result of
+	 * Tls::exportKeyingMaterial(DatagramChannel::label, DatagramChannel::materialSize). Both peers get the same
+	 * token and key without sending anything.
+	 *
+	 * @param side the side
+	 * @param material the material, at least 40 bytes
+	 * @param encrypted true to use the key
+	 * @return the channel
+	 * @throw net::Error on errors
+	 */
+	static std::shared_ptr<DatagramChannel> derive(Side side, const std::string &material, bool encrypted = true);
+
+	/**
+	 * Size of the material required by derive.
+	 */
+	static constexpr std::size_t materialSize{8 + keySize};
+
+	/**
+	 * Get the token of a packet.
+	 *
+	 * @param packet the packet
+	 * @return the token
+	 * @pre the packet must be at least headerSize long
+	 */
+	static std::uint64_t token(const char *packet) noexcept;
+
+	/**
+	 * Create a channel.
+	 *
+	 * @param side the side
+	 * @param token the token
+	 * @param key the key (keySize bytes) or empty to send the packets in clear
+	 * @throw net::Error on invalid key or if encryption is not supported
+	 */
+	DatagramChannel(Side side, std::uint64_t token, std::string key = "");
+
+	/**
+	 * Deleted copy constructor.
+	 */
+	DatagramChannel(const DatagramChannel &) = delete;
+
+	/**
+	 * Deleted copy assignment.
+	 *
+	 * @return *this
+	 */
+	DatagramChannel &operator=(const DatagramChannel &) = delete;
+
+	/**
+	 * Get the side.
+	 *
+	 * @return the side
+	 */
+	inline Side side() const noexcept
+	{
+		return m_side;
+	}
+
+	/**
+	 * Get the token.
+	 *
+	 * @return the token
+	 */
+	inline std::uint64_t token() const noexcept
+	{
+		return m_token;
+	}
+
+	/**
+	 * Get the key.
+	 *
+	 * @return the key, empty if not encrypted
+	 */
+	inline const std::string &key() const noexcept
+	{
+		return m_key;
+	}
+
+	/**
+	 * Check if the packets are encrypted.
+	 *
+	 * @return true if encrypted
+	 */
+	inline bool encrypted() const noexcept
+	{
+		return !m_key.empty();
+	}
+
+	/**
+	 * Get the sequence number of the next packet.
+	 *
+	 * @return the sequence number
+	 */
+	inline std::uint32_t sequence() const noexcept
+	{
+		return static_cast<std::uint32_t>(m_next);
+	}
+
+	/**
+	 * Get the counters.
+	 *
+	 * @return the statistics
+	 */
+	inline const DatagramStatistics &statistics() const noexcept
+	{
+		return m_statistics;
+	}
+
+	/**
+	 * Set the handler called when a packet sent is acknowledged by the peer.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setAckHandler(AckHandler handler)
+	{
+		m_onAck = std::move(handler);
+	}
+
+	/**
+	 * Build the next packet.
+	 *
+	 * @param data the payload
+	 * @param length the payload length
+	 * @param packet the packet (replaced)
+	 * @return the sequence number of the packet
+	 * @throw net::Error if the encryption failed or all the sequence numbers have been used with the key
+	 */
+	std::uint32_t encode(const void *data, std::size_t length, std::string &packet);
+
+	/**
+	 * Check and read a packet received, the acknowledged packets are reported to the ack handler.
+	 *
+	 * @param packet the packet
+	 * @param length the packet length
+	 * @param payload the payload (replaced on success)
+	 * @return false if the packet was rejected or duplicated
+	 */
+	bool decode(const char *packet, std::size_t length, std::string &payload);
+};
+
+/* }}} */
+
+/* {{{ DatagramBatch */
+
+/**
+ * @class DatagramBatch
+ * @brief Fixed set of packets received or sent with one system call.
+ *
+ * On Linux (SOCKET_HAVE_MMSG), `recvmmsg(2)` and `sendmmsg(2)` are used, other systems do one call per packet. The
+ * handle should be non-blocking.
+ */
+class DatagramBatch {
+private:
+	unsigned m_capacity;
+	unsigned m_packetSize;
+	unsigned m_count{0};
+	std::vector<char> m_buffers;
+	std::vector<unsigned> m_lengths;
+	std::vector<sockaddr_storage> m_addresses;
+	std::vector<socklen_t> m_addressLengths;
+
+#if defined(SOCKET_HAVE_MMSG)
+	std::vector<mmsghdr> m_headers;
+	std::vector<iovec> m_vectors;
+#endif
+
+public:
+	/**
+	 * Allocate the buffers.
+	 *
+	 * @param capacity the maximum number of packets
+	 * @param packetSize the maximum size of one packet
+	 * @pre capacity > 0
+	 */
+	DatagramBatch(unsigned capacity = 64, unsigned packetSize = 1472);
+
+	/**
+	 * Get the maximum number of packets.
+	 *
+	 * @return the capacity
+	 */
+	inline unsigned capacity() const noexcept
+	{
+		return m_capacity;
+	}
+
+	/**
+	 * Get the maximum size of one packet.
+	 *
+	 * @return the size
+	 */
+	inline unsigned packetSize() const noexcept
+	{
+		return m_packetSize;
+	}
+
+	/**
+	 * Get the number of packets.
+	 *
+	 * @return the number
+	 */
+	inline unsigned size() const noexcept
+	{
+		return m_count;
+	}
+
+	/**
+	 * Check if there are no packets.
+	 *
+	 * @return true if empty
+	 */
+	inline bool empty() const noexcept
+	{
+		return m_count == 0;
+	}
+
+	/**
+	 * Check if no other packet can be added.
+	 *
+	 * @return true if full
+	 */
+	inline bool full() const noexcept
+	{
+		return m_count == m_capacity;
+	}
+
+	/**
+	 * Get a packet.
+	 *
+	 * @param index the index
+	 * @return the data
+	 * @pre index < size()
+	 */
+	inline const char *data(unsigned index) const noexcept
+	{
+		assert(index < m_count);
+
+		return m_buffers.data() + static_cast<std::size_t>(index) * m_packetSize;
+	}
+
+	/**
+	 * Get the length of a packet.
+	 *
+	 * @param index the index
+	 * @return the length
+	 * @pre index < size()
+	 */
+	inline unsigned length(unsigned index) const noexcept
+	{
+		assert(index < m_count);
+
+		return m_lengths[index];
+	}
+
+	/**
+	 * Get the source or destination of a packet.
+	 *
+	 * @param index the index
+	 * @return the address
+	 * @pre index < size()
+	 */
+	inline const sockaddr *address(unsigned index) const noexcept
+	{
+		assert(index < m_count);
+
+		return reinterpret_cast<const sockaddr *>(&m_addresses[index]);
+	}
+
+	/**
+	 * Get the length of the address of a packet.
+	 *
+	 * @param index the index
+	 * @return the length
+	 * @pre index < size()
+	 */
+	inline socklen_t addressLength(unsigned index) const noexcept
+	{
+		assert(index < m_count);
+
+		return m_addressLengths[index];
+	}
+
+	/**
+	 * Add a packet to send.
+	 *
+	 * @param data the data
+	 * @param length the length
+	 * @param address the destination
+	 * @param addrlen the destination length
+	 * @return false if full
+	 * @pre length <= packetSize()
+	 */
+	bool push(const void *data, unsigned length, const sockaddr *address, socklen_t addrlen) noexcept;
+
+	/**
+	 * Remove all packets.
+	 */
+	inline void clear() noexcept
+	{
+		m_count = 0;
+	}
+
+	/**
+	 * Replace the packets with the packets available on the handle.
+	 *
+	 * @param handle the handle
+	 * @return the number of packets received, 0 if none are available
+	 * @throw net::Error on errors
+	 */
+	unsigned receive(Handle handle);
+
+	/**
+	 * Send the packets and remove them. The packets that would block are dropped, like the network would do.
+	 *
+	 * @param handle the handle
+	 * @return the number of packets sent
+	 * @throw net::Error on errors
+	 */
+	unsigned send(Handle handle);
+};
+
+/* }}} */
+
+/* {{{ DatagramServer */
+
+/**
+ * @class DatagramServer
+ * @brief UDP socket shared by several DatagramChannel.
+ *
+ * The packets are dispatched to the channels by token. The address of a peer is learnt from its last valid packet,
+ * so a client must send a packet before receiving anything and may change of address (e.g. NAT rebinding).
+ *
+ * The packets sent are batched until flush is called, usually once per poll. This class is not thread safe.
+ */
+template <typename Address>
+class DatagramServer {
+public:
+	/**
+	 * Handler when a packet has been received on a channel.
+	 */
+	using ReadHandler = Callback<const std::shared_ptr<DatagramChannel> &, const std::string &>;
+
+private:
+	class Peer {
+	public:
+		std::shared_ptr<DatagramChannel> channel;
+		sockaddr_storage address;
+		socklen_t length{0};
+	};
+
+	ReadHandler m_onRead;
+	Socket<Address, protocol::Udp> m_socket;
+	std::unordered_map<std::uint64_t, Peer> m_peers;
+	DatagramBatch m_input;
+	DatagramBatch m_output;
+	std::string m_packet;
+	std::string m_payload;
+	std::uint64_t m_unknown{0};
+	std::uint64_t m_dropped{0};
+
+public:
+	/**
+	 * Create the socket, bound to the address.
+	 *
+	 * @param address the address
+	 * @param batch the number of packets per system call
+	 * @throw net::Error on errors
+	 */
+	DatagramServer(const Address &address, unsigned batch = 64)
+		: m_socket{protocol::Udp{}, address}
+		, m_input{batch}
+		, m_output{batch}
+	{
+		m_socket.set(SOL_SOCKET, SO_REUSEADDR, 1);
+		m_socket.bind(address);
+		m_socket.set(net::option::SockBlockMode{false});
+	}
+
+	/**
+	 * Get the socket.
+	 *
+	 * @return the socket
+	 */
+	inline Socket<Address, protocol::Udp> &socket() noexcept
+	{
+		return m_socket;
+	}
+
+	/**
+	 * Get the handle to add to the listener with Condition::Readable.
+	 *
+	 * @return the handle
+	 */
+	inline Handle handle() const noexcept
+	{
+		return m_socket.handle();
+	}
+
+	/**
+	 * Set the read handler.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setReadHandler(ReadHandler handler)
+	{
+		m_onRead = std::move(handler);
+	}
+
+	/**
+	 * Add a channel.
+	 *
+	 * @param channel the channel
+	 * @return false if a channel with the same token exists
+	 */
+	bool add(std::shared_ptr<DatagramChannel> channel)
+	{
+		assert(channel);
+
+		Peer peer;
+
+		peer.channel = std::move(channel);
+
+		return m_peers.emplace(peer.channel->token(), std::move(peer)).second;
+	}
+
+	/**
+	 * Remove a channel.
+	 *
+	 * @param token the token
+	 * @return true if removed
+	 */
+	inline bool remove(std::uint64_t token)
+	{
+		return m_peers.erase(token) > 0;
+	}
+
+	/**
+	 * Get the number of channels.
+	 *
+	 * @return the number
+	 */
+	inline std::size_t size() const noexcept
+	{
+		return m_peers.size();
+	}
+
+	/**
+	 * Get the number of packets received with an unknown token.
+	 *
+	 * @return the number
+	 */
+	inline std::uint64_t unknown() const noexcept
+	{
+		return m_unknown;
+	}
+
+	/**
+	 * Get the number of packets dropped because the socket would block or the peer address is not known yet.
+	 *
+	 * @return the number
+	 */
+	inline std::uint64_t dropped() const noexcept
+	{
+		return m_dropped;
+	}
+
+	/**
+	 * Check if the address of the peer is known, that is a valid packet has been received.
+	 *
+	 * @param token the token
+	 * @return true if known
+	 */
+	bool connected(std::uint64_t token) const noexcept
+	{
+		auto it = m_peers.find(token);
+
+		return it != m_peers.end() && it->second.length > 0;
+	}
+
+	/**
+	 * Queue a packet, it is sent with the next flush.
+	 *
+	 * @param channel the channel
+	 * @param data the payload
+	 * @param length the payload length
+	 * @return false if the peer address is not known yet
+	 * @throw net::Error on errors
+	 */
+	bool send(const DatagramChannel &channel, const void *data, std::size_t length)
+	{
+		auto it = m_peers.find(channel.token());
+
+		if (it == m_peers.end() || it->second.length == 0) {
+			m_dropped ++;
+			return false;
+		}
+
+		it->second.channel->encode(data, length, m_packet);
+
+		if (m_packet.size() > m_output.packetSize()) {
+			throw Error{Error::Other, "send", "packet too large"};
+		}
+		if (m_output.full()) {
+			flush();
+		}
+
+		return m_output.push(m_packet.data(), m_packet.size(),
+			reinterpret_cast<const sockaddr *>(&it->second.address), it->second.length);
+	}
+
+	/**
+	 * Overloaded function.
+	 *
+	 * @param channel the channel
+	 * @param data the payload
+	 * @return false if the peer address is not known yet
+	 * @throw net::Error on errors
+	 */
+	inline bool send(const DatagramChannel &channel, const std::string &data)
+	{
+		return send(channel, data.data(), data.size());
+	}
+
+	/**
+	 * Send the queued packets.
+	 *
+	 * @return the number of packets sent
+	 * @throw net::Error on errors
+	 */
+	unsigned flush()
+	{
+		auto count = m_output.size();
+		auto sent = m_output.send(m_socket.handle());
+
+		m_dropped += count - sent;
+
+		return sent;
+	}
+
+	/**
+	 * Receive the pending packets and call the read handler, must be called when the handle is readable.
+	 *
+	 * @return the number of packets accepted
+	 * @throw net::Error on errors
+	 */
+	unsigned receive()
+	{
+		unsigned accepted = 0;
+		unsigned count;
+
+		do {
+			count = m_input.receive(m_socket.handle());
+
+			for (unsigned i = 0; i < count; ++i) {
+				if (m_input.length(i) < DatagramChannel::headerSize) {
+					m_unknown ++;
+					continue;
+				}
+
+				auto it = m_peers.find(DatagramChannel::token(m_input.data(i)));
+
+				if (it == m_peers.end()) {
+					m_unknown ++;
+					continue;
+				}
+
+				/* Keep a reference, the handler may remove the channel */
+				auto channel = it->second.channel;
+
+				if (!channel->decode(m_input.data(i), m_input.length(i), m_payload)) {
+					continue;
+				}
+
+				std::memcpy(&it->second.address, m_input.address(i), m_input.addressLength(i));
+				it->second.length = m_input.addressLength(i);
+				accepted ++;
+
+				m_onRead(channel, m_payload);
+			}
+		} while (count == m_input.capacity());
+
+		return accepted;
+	}
+};
+
+/* }}} */
+
+/* {{{ DatagramClient */
+
+/**
+ * @class DatagramClient
+ * @brief UDP socket of one DatagramChannel.
+ *
+ * The packets sent are batched until flush is called. This class is not thread safe.
+ */
+template <typename Address>
+class DatagramClient {
+public:
+	/**
+	 * Handler when a packet has been received.
+	 */
+	using ReadHandler = Callback<const std::string &>;
+
+private:
+	ReadHandler m_onRead;
+	Socket<Address, protocol::Udp> m_socket;
+	Address m_server;
+	std::shared_ptr<DatagramChannel> m_channel;
+	DatagramBatch m_input;
+	DatagramBatch m_output;
+	std::string m_packet;
+	std::string m_payload;
+	std::uint64_t m_dropped{0};
+
+public:
+	/**
+	 * Create the socket.
+	 *
+	 * @param server the server address
+	 * @param channel the channel
+	 * @param batch the number of packets per system call
+	 * @throw net::Error on errors
+	 */
+	DatagramClient(Address server, std::shared_ptr<DatagramChannel> channel, unsigned batch = 16)
+		: m_socket{protocol::Udp{}, server}
+		, m_server{std::move(server)}
+		, m_channel{std::move(channel)}
+		, m_input{batch}
+		, m_output{batch}
+	{
+		assert(m_channel);
+
+		m_socket.set(net::option::SockBlockMode{false});
+	}
+
+	/**
+	 * Get the socket.
+	 *
+	 * @return the socket
+	 */
+	inline Socket<Address, protocol::Udp> &socket() noexcept
+	{
+		return m_socket;
+	}
+
+	/**
+	 * Get the handle to add to the listener with Condition::Readable.
+	 *
+	 * @return the handle
+	 */
+	inline Handle handle() const noexcept
+	{
+		return m_socket.handle();
+	}
+
+	/**
+	 * Get the channel.
+	 *
+	 * @return the channel
+	 */
+	inline const std::shared_ptr<DatagramChannel> &channel() const noexcept
+	{
+		return m_channel;
+	}
+
+	/**
+	 * Get the number of packets dropped because the socket would block.
+	 *
+	 * @return the number
+	 */
+	inline std::uint64_t dropped() const noexcept
+	{
+		return m_dropped;
+	}
+
+	/**
+	 * Set the read handler.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setReadHandler(ReadHandler handler)
+	{
+		m_onRead = std::move(handler);
+	}
+
+	/**
+	 * Queue a packet, it is sent with the next flush. An empty payload can be sent to let the server know the
+	 * address.
+	 *
+	 * @param data the payload
+	 * @param length the payload length
+	 * @throw net::Error on errors
+	 */
+	void send(const void *data, std::size_t length)
+	{
+		m_channel->encode(data, length, m_packet);
+
+		if (m_packet.size() > m_output.packetSize()) {
+			throw Error{Error::Other, "send", "packet too large"};
+		}
+		if (m_output.full()) {
+			flush();
+		}
+
+		m_output.push(m_packet.data(), m_packet.size(), m_server.address(), m_server.length());
+	}
+
+	/**
+	 * Overloaded function.
+	 *
+	 * @param data the payload
+	 * @throw net::Error on errors
+	 */
+	inline void send(const std::string &data)
+	{
+		send(data.data(), data.size());
+	}
+
+	/**
+	 * Send the queued packets.
+	 *
+	 * @return the number of packets sent
+	 * @throw net::Error on errors
+	 */
+	unsigned flush()
+	{
+		auto count = m_output.size();
+		auto sent = m_output.send(m_socket.handle());
+
+		m_dropped += count - sent;
+
+		return sent;
+	}
+
+	/**
+	 * Receive the pending packets and call the read handler, must be called when the handle is readable.
+	 *
+	 * @return the number of packets accepted
+	 * @throw net::Error on errors
+	 */
+	unsigned receive()
+	{
+		unsigned accepted = 0;
+		unsigned count;
+
+		do {
+			count = m_input.receive(m_socket.handle());
+
+			for (unsigned i = 0; i < count; ++i) {
+				if (m_channel->decode(m_input.data(i), m_input.length(i), m_payload)) {
+					accepted ++;
+					m_onRead(m_payload);
+				}
+			}
+		} while (count == m_input.capacity());
+
+		return accepted;
+	}
+};
+
+/* }}} */
+
+/*
+ * StreamConnection
+ * ------------------------------------------------------------------
+ *
+ * Client connected on the server side.
+ */
+
+/* {{{ StreamConnection */
+
+/**
+ * @enum Priority
+ * @brief Priority of a message sent to a StreamConnection.
+ */
+enum class Priority {
+	Normal,		//!< always queued unless the connection is being disconnected
+	Low		//!< may be dropped when the output is congested (e.g. position updates)
+};
+
+/**
+ * @enum OutputPolicy
+ * @brief What to do when the output of a StreamConnection reaches the high water mark.
+ *
+ * The connection is congested from the moment its output reaches the high water mark until it goes down to the low
+ * water mark.
+ */
+enum class OutputPolicy {
+	None,		//!< only notify (default)
+	DropLow,	//!< drop the low priority messages while congested
+	PauseReading,	//!< stop reading from the client while congested
+	Disconnect	//!< disconnect the client
+};
+
+/**
+ * @class OutputStatistics
+ * @brief Output counters of a StreamConnection.
+ */
+class OutputStatistics {
+public:
+	std::size_t peak{0};			//!< largest output size in bytes
+	std::uint64_t queued{0};		//!< bytes queued
+	std::uint64_t sent{0};			//!< bytes sent
+	std::uint64_t dropped{0};		//!< messages dropped
+	std::uint64_t droppedBytes{0};		//!< bytes dropped
+	std::uint64_t congestions{0};		//!< number of times the high water mark was reached
+};
+
+/**
+ * @class StreamConnection
+ * @brief Connected client on the server side.
+ *
+ * This object is created from StreamServer when a new client is connected, it is the higher
+ * level object of sockets and completely asynchronous.
+ */
+template <typename Address, typename Protocol>
+class StreamConnection {
+public:
+	/**
+	 * Called when the output has changed.
+	 */
+	using WriteHandler = Callback<>;
+
+	/**
+	 * Called when the connection becomes congested (true) or not congested anymore (false).
+	 */
+	using CongestionHandler = Callback<bool>;
+
+private:
+	/* Signals */
+	WriteHandler m_onWrite;
+	CongestionHandler m_onCongestion;
+
+	/* Sockets and buffers */
+	Socket<Address, Protocol> m_socket;
+	Address m_address;
+	InputBuffer m_input;
+	OutputQueue m_output;
+
+	/* Output limits, 0 for unlimited */
+	std::size_t m_high{0};
+	std::size_t m_low{0};
+	OutputPolicy m_policy{OutputPolicy::None};
+	bool m_congested{false};
+	OutputStatistics m_statistics;
+
+	/* Idle timeout, managed by StreamServer */
+	std::chrono::milliseconds m_idleTimeout{0};
+	TimerWheel::Id m_idleTimer{0};
+
+	/* Datagram channel, managed by StreamServer */
+	std::shared_ptr<DatagramChannel> m_channel;
+
+	bool admit(std::size_t size, Priority priority) noexcept
+	{
+		bool drop = m_congested &&
+			((m_policy == OutputPolicy::DropLow && priority == Priority::Low) || m_policy == OutputPolicy::Disconnect);
+
+		if (drop) {
+			m_statistics.dropped ++;
+			m_statistics.droppedBytes += size;
+		}
+
+		return !drop;
+	}
+
+	void queued(std::size_t size)
+	{
+		m_statistics.queued += size;
+		m_statistics.peak = std::max(m_statistics.peak, m_output.size());
+
+		if (m_high > 0 && !m_congested && m_output.size() >= m_high) {
+			m_congested = true;
+			m_statistics.congestions ++;
+			m_onCongestion(true);
+		}
+
+		m_onWrite();
+	}
+
+public:
+	/**
+	 * Create the connection.
+	 *
+	 * @param s the socket
+	 * @pre the socket must be non-blocking, StreamServer accepts non-blocking sockets directly
+	 */
+	StreamConnection(Socket<Address, Protocol> s)
+		: m_socket{std::move(s)}
+	{
+	}
+
+	/**
+	 * Access the underlying socket.
+	 *
+	 * @return the socket
+	 * @warning use with care
+	 */
+	inline Socket<Address, Protocol> &socket() noexcept
+	{
+		return m_socket;
+	}
+
+	/**
+	 * Get the client address, as returned by accept.
+	 *
+	 * @return the address
+	 */
+	inline const Address &address() const noexcept
+	{
+		return m_address;
+	}
+
+	/**
+	 * Set the client address.
+	 *
+	 * @param address the address
+	 * @warning you usually never need to set this yourself
+	 */
+	inline void setAddress(Address address) noexcept
+	{
+		m_address = std::move(address);
+	}
+
+	/**
+	 * Access the received data not yet consumed.
+	 *
+	 * @return the input
+	 */
+	inline const InputBuffer &input() const noexcept
+	{
+		return m_input;
+	}
+
+	/**
+	 * Overloaded function.
+	 *
+	 * @return the input
+	 */
+	inline InputBuffer &input() noexcept
+	{
+		return m_input;
+	}
+
+	/**
+	 * Access the current output.
+	 *
+	 * @return the output
+	 */
+	inline const OutputQueue &output() const noexcept
+	{
+		return m_output;
+	}
+
+	/**
+	 * Overloaded function
+	 *
+	 * @return the output
+	 * @warning use with care, avoid modifying the output if you don't know what you're doing
+	 */
+	inline OutputQueue &output() noexcept
+	{
+		return m_output;
+	}
+
+	/**
+	 * Post some data to be sent asynchronously.
+	 *
+	 * The data is dropped if the connection is congested and the policy is OutputPolicy::DropLow for low priority
+	 * data or OutputPolicy::Disconnect.
+	 *
+	 * @param str the data to append
+	 * @param priority the priority
+	 * @return true if the data was queued
+	 */
+	inline bool send(std::string str, Priority priority = Priority::Normal)
+	{
+		auto size = str.size();
+
+		if (!admit(size, priority)) {
+			return false;
+		}
+
+		m_output.append(std::move(str));
+		queued(size);
+
+		return true;
+	}
+
+	/**
+	 * Overloaded function, the segment is shared and not copied.
+	 *
+	 * @param segment the segment to append
+	 * @param priority the priority
+	 * @return true if the data was queued
+	 */
+	inline bool send(OutputQueue::Segment segment, Priority priority = Priority::Normal)
+	{
+		auto size = segment ? segment->size() : 0;
+
+		if (!admit(size, priority)) {
+			return false;
+		}
+
+		m_output.append(std::move(segment));
+		queued(size);
+
+		return true;
+	}
+
+	/**
+	 * Remove the data sent from the output, the connection is not congested anymore once the output is down to the
+	 * low water mark.
+	 *
+	 * @param length the number of bytes sent
+	 * @pre length <= output().size()
+	 * @note called by StreamServer
+	 */
+	void consume(std::size_t length)
+	{
+		m_output.consume(length);
+		m_statistics.sent += length;
+
+		if (m_congested && m_output.size() <= m_low) {
+			m_congested = false;
+			m_onCongestion(false);
+		}
+	}
+
+	/**
+	 * Set the output water marks.
+	 *
+	 * @param high the size in bytes from which the connection is congested (0 for unlimited)
+	 * @param low the size in bytes to which the output must go down to not be congested anymore
+	 * @param policy the policy while congested
+	 * @pre low < high or high is 0
+	 */
+	inline void setOutputLimits(std::size_t high, std::size_t low, OutputPolicy policy) noexcept
+	{
+		assert(high == 0 || low < high);
+
+		m_high = high;
+		m_low = low;
+		m_policy = policy;
+	}
+
+	/**
+	 * Get the output policy.
+	 *
+	 * @return the policy
+	 */
+	inline OutputPolicy outputPolicy() const noexcept
+	{
+		return m_policy;
+	}
+
+	/**
+	 * Check if the output is congested.
+	 *
+	 * @return true if congested
+	 */
+	inline bool congested() const noexcept
+	{
+		return m_congested;
+	}
+
+	/**
+	 * Get the output statistics, the current depth is given by output().
+	 *
+	 * @return the statistics
+	 */
+	inline const OutputStatistics &outputStatistics() const noexcept
+	{
+		return m_statistics;
 	}
 
 	/**
 	 * Kill the client.
 	 */
-	inline void close()
+	inline void close()
+	{
+		m_socket.close();
+	}
+
+	/**
+	 * Reuse the connection for a new socket, the buffers are emptied but their memory is kept.
+	 *
+	 * @param s the new socket
+	 * @pre the socket must be non-blocking
+	 */
+	void reset(Socket<Address, Protocol> s)
+	{
+		m_socket.close();
+		m_socket = std::move(s);
+		m_address = Address{};
+		m_input.clear();
+		m_output.clear();
+		m_onWrite = nullptr;
+		m_onCongestion = nullptr;
+		m_high = 0;
+		m_low = 0;
+		m_policy = OutputPolicy::None;
+		m_congested = false;
+		m_statistics = OutputStatistics();
+		m_idleTimeout = std::chrono::milliseconds{0};
+		m_idleTimer = 0;
+		m_channel = nullptr;
+	}
+
+	/**
+	 * Set the write handler, the signal is emitted when the output has changed so that the StreamServer owner
+	 * knows that there are some data to send.
+	 *
+	 * @param handler the handler
+	 * @warning you usually never need to set this yourself
+	 */
+	inline void setWriteHandler(WriteHandler handler)
+	{
+		m_onWrite = std::move(handler);
+	}
+
+	/**
+	 * Get the idle timeout.
+	 *
+	 * @return the timeout (0 if disabled)
+	 */
+	inline std::chrono::milliseconds idleTimeout() const noexcept
+	{
+		return m_idleTimeout;
+	}
+
+	/**
+	 * Get the idle timer.
+	 *
+	 * @return the timer id (0 if none)
+	 */
+	inline TimerWheel::Id idleTimer() const noexcept
+	{
+		return m_idleTimer;
+	}
+
+	/**
+	 * Set the idle timer.
+	 *
+	 * @param timeout the timeout
+	 * @param id the timer id
+	 * @warning you usually never need to set this yourself, see StreamServer::setIdleTimeout
+	 */
+	inline void setIdleTimer(std::chrono::milliseconds timeout, TimerWheel::Id id) noexcept
+	{
+		m_idleTimeout = timeout;
+		m_idleTimer = id;
+	}
+
+	/**
+	 * Get the datagram channel.
+	 *
+	 * @return the channel or null if not opened, see StreamServer::openChannel
+	 */
+	inline const std::shared_ptr<DatagramChannel> &channel() const noexcept
+	{
+		return m_channel;
+	}
+
+	/**
+	 * Set the datagram channel.
+	 *
+	 * @param channel the channel
+	 * @warning you usually never need to set this yourself, see StreamServer::openChannel
+	 */
+	inline void setChannel(std::shared_ptr<DatagramChannel> channel) noexcept
+	{
+		m_channel = std::move(channel);
+	}
+
+	/**
+	 * Set the congestion handler, the StreamServer owner uses it to apply the policy.
+	 *
+	 * @param handler the handler
+	 * @warning you usually never need to set this yourself
+	 */
+	inline void setCongestionHandler(CongestionHandler handler)
+	{
+		m_onCongestion = std::move(handler);
+	}
+};
+
+/* }}} */
+
+/*
+ * StreamConnectionPool
+ * ------------------------------------------------------------------
+ *
+ * Recycle StreamConnection objects.
+ */
+
+/* {{{ StreamConnectionPool */
+
+/**
+ * @class StreamConnectionPool
+ * @brief Keep released connections to reuse them and their buffers
+ *
+ * The connections are returned as std::shared_ptr with a deleter that gives the object back to the pool when the
+ * last reference is dropped, the socket is closed immediately. If the pool has been destroyed in the meantime,
+ * the connection is simply deleted.
+ *
+ * The pool must be created with std::make_shared. Releasing is thread safe.
+ */
+template <typename Address, typename Protocol>
+class StreamConnectionPool : public std::enable_shared_from_this<StreamConnectionPool<Address, Protocol>> {
+public:
+	/**
+	 * The connection type.
+	 */
+	using Connection = StreamConnection<Address, Protocol>;
+
+private:
+	std::mutex m_mutex;
+	std::vector<std::unique_ptr<Connection>> m_free;
+	std::size_t m_max;
+
+	void release(Connection *connection) noexcept
+	{
+		std::unique_ptr<Connection> ptr{connection};
+
+		/* Close now and drop shared output segments */
+		ptr->close();
+		ptr->input().clear();
+		ptr->output().clear();
+		ptr->setWriteHandler(nullptr);
+
+		std::lock_guard<std::mutex> lock{m_mutex};
+
+		if (m_free.size() < m_max) {
+			try {
+				m_free.push_back(std::move(ptr));
+			} catch (...) {
+				/* Not kept, deleted */
+			}
+		}
+	}
+
+public:
+	/**
+	 * Create the pool.
+	 *
+	 * @param max the maximum number of connections kept
+	 */
+	inline StreamConnectionPool(std::size_t max = 1024) noexcept
+		: m_max(max)
+	{
+	}
+
+	/**
+	 * Get a connection for the new socket.
+	 *
+	 * @param s the socket
+	 * @return the connection
+	 */
+	std::shared_ptr<Connection> acquire(Socket<Address, Protocol> s)
+	{
+		std::unique_ptr<Connection> connection;
+
+		{
+			std::lock_guard<std::mutex> lock{m_mutex};
+
+			if (!m_free.empty()) {
+				connection = std::move(m_free.back());
+				m_free.pop_back();
+			}
+		}
+
+		if (connection) {
+			connection->reset(std::move(s));
+		} else {
+			connection.reset(new Connection(std::move(s)));
+		}
+
+		std::weak_ptr<StreamConnectionPool> pool = this->shared_from_this();
+
+		return std::shared_ptr<Connection>(connection.release(), [pool] (Connection *c) {
+			auto ptr = pool.lock();
+
+			if (ptr) {
+				ptr->release(c);
+			} else {
+				delete c;
+			}
+		});
+	}
+
+	/**
+	 * Get the number of connections available for reuse.
+	 *
+	 * @return the number
+	 */
+	inline std::size_t available()
+	{
+		std::lock_guard<std::mutex> lock{m_mutex};
+
+		return m_free.size();
+	}
+
+	/**
+	 * Set the maximum number of connections kept, exceeding connections are deleted.
+	 *
+	 * @param max the maximum
+	 */
+	inline void setMax(std::size_t max)
+	{
+		std::lock_guard<std::mutex> lock{m_mutex};
+
+		m_max = max;
+
+		if (m_free.size() > max) {
+			m_free.resize(max);
+		}
+	}
+};
+
+/* }}} */
+
+/*
+ * HandshakePool
+ * ------------------------------------------------------------------
+ *
+ * Complete the accept of new clients in worker threads.
+ */
+
+/* {{{ HandshakePool */
+
+/**
+ * @class HandshakePool
+ * @brief Worker threads that complete the accept of new clients.
+ *
+ * With Tls, the handshake of a new client requires asymmetric cryptography, a burst of new clients would delay every
+ * client already connected to the same thread. The server socket must not start the handshake itself (see
+ * Tls::setDeferredAccept), the new sockets are given to add and one of the workers completes the handshake with its
+ * own listener.
+ *
+ * The owner adds handle() to its listener and calls take when it is readable, the completed sockets and the errors
+ * of the failed handshakes are then returned in the owner thread.
+ *
+ * All functions must be called from the owner thread.
+ */
+template <typename Address, typename Protocol>
+class HandshakePool {
+public:
+	/**
+	 * The socket type.
+	 */
+	using Client = Socket<Address, Protocol>;
+
+	/**
+	 * A client with its address.
+	 */
+	using Entry = std::pair<Client, Address>;
+
+private:
+	class Worker {
+	public:
+		Wakeup wakeup;
+		std::mutex mutex;
+		std::vector<Entry> incoming;
+		std::thread thread;
+	};
+
+	std::vector<std::unique_ptr<Worker>> m_workers;
+	std::size_t m_next{0};
+	std::atomic<bool> m_running{true};
+	std::atomic<std::size_t> m_pending{0};
+
+	/* Results, protected by the mutex */
+	Wakeup m_wakeup;
+	std::mutex m_mutex;
+	std::vector<Entry> m_done;
+	std::vector<Error> m_errors;
+
+	void complete(Entry client)
+	{
+		{
+			std::lock_guard<std::mutex> lock{m_mutex};
+
+			m_done.push_back(std::move(client));
+		}
+
+		--m_pending;
+		m_wakeup.notify();
+	}
+
+	void fail(const Error &error)
+	{
+		{
+			std::lock_guard<std::mutex> lock{m_mutex};
+
+			m_errors.push_back(error);
+		}
+
+		--m_pending;
+		m_wakeup.notify();
+	}
+
+	/*
+	 * Continue the accept of one client, it is removed once completed or failed.
+	 */
+	void handshake(Listener<> &listener, HandleTable<Entry> &clients, Handle handle)
+	{
+		auto it = clients.find(handle);
+
+		if (it == clients.end()) {
+			return;
+		}
+
+		try {
+			it->second.first.accept();
+
+			if (it->second.first.state() == State::Accepted) {
+				listener.remove(handle);
+				complete(std::move(it->second));
+				clients.erase(it);
+			} else {
+				listener.assign(handle, it->second.first.condition());
+			}
+		} catch (const Error &error) {
+			listener.remove(handle);
+			clients.erase(it);
+			fail(error);
+		}
+	}
+
+	void run(Worker &worker)
+	{
+		Listener<> listener;
+		HandleTable<Entry> clients;
+
+		listener.set(worker.wakeup.handle(), Condition::Readable);
+
+		while (m_running) {
+			std::vector<ListenerStatus> events;
+
+			try {
+				events = listener.waitMultiple(-1);
+			} catch (const Error &) {
+				continue;
+			}
+
+			for (const auto &st : events) {
+				if (st.socket != worker.wakeup.handle()) {
+					handshake(listener, clients, st.socket);
+					continue;
+				}
+
+				std::vector<Entry> incoming;
+
+				worker.wakeup.clear();
+
+				{
+					std::lock_guard<std::mutex> lock{worker.mutex};
+
+					incoming.swap(worker.incoming);
+				}
+
+				/* The client data is usually already there, start immediately */
+				for (auto &client : incoming) {
+					auto handle = client.first.handle();
+
+					try {
+						client.first.set(option::SockBlockMode{false});
+						clients.emplace(handle, std::move(client));
+						handshake(listener, clients, handle);
+					} catch (const Error &error) {
+						fail(error);
+					}
+				}
+			}
+		}
+	}
+
+public:
+	/**
+	 * Start the workers.
+	 *
+	 * @param count the number of workers (0 for the number of cores)
+	 * @throw Error on errors
+	 */
+	HandshakePool(unsigned count = 0)
+	{
+		if (count == 0) {
+			count = std::max(1U, std::thread::hardware_concurrency());
+		}
+
+		for (unsigned i = 0; i < count; ++i) {
+			m_workers.emplace_back(new Worker);
+		}
+		for (auto &worker : m_workers) {
+			worker->thread = std::thread(&HandshakePool::run, this, std::ref(*worker));
+		}
+	}
+
+	/**
+	 * Stop the workers, the clients not yet accepted are closed.
+	 */
+	~HandshakePool()
+	{
+		m_running = false;
+
+		for (auto &worker : m_workers) {
+			worker->wakeup.notify();
+		}
+		for (auto &worker : m_workers) {
+			worker->thread.join();
+		}
+	}
+
+	/**
+	 * Get the number of workers.
+	 *
+	 * @return the number of workers
+	 */
+	inline unsigned size() const noexcept
+	{
+		return static_cast<unsigned>(m_workers.size());
+	}
+
+	/**
+	 * Get the number of clients given to add and not yet returned by take.
+	 *
+	 * @return the number of clients
+	 */
+	inline std::size_t pending() const noexcept
+	{
+		return m_pending;
+	}
+
+	/**
+	 * Get the handle that becomes readable when take must be called.
+	 *
+	 * @return the handle
+	 */
+	inline Handle handle() const noexcept
+	{
+		return m_wakeup.handle();
+	}
+
+	/**
+	 * Give a new client to the next worker.
+	 *
+	 * @param client the client, in the State::Accepting state
+	 * @param address the client address, returned with it by take
+	 */
+	void add(Client client, Address address = {})
+	{
+		assert(client.state() == State::Accepting);
+
+		auto &worker = *m_workers[m_next++ % m_workers.size()];
+
+		++m_pending;
+
+		{
+			std::lock_guard<std::mutex> lock{worker.mutex};
+
+			worker.incoming.emplace_back(std::move(client), std::move(address));
+		}
+
+		worker.wakeup.notify();
+	}
+
+	/**
+	 * Get the results, call it when handle() is readable.
+	 *
+	 * @param clients the completely accepted clients and their address (appended)
+	 * @param errors the errors of the clients that failed (appended)
+	 */
+	void take(std::vector<Entry> &clients, std::vector<Error> &errors)
+	{
+		std::lock_guard<std::mutex> lock{m_mutex};
+
+		m_wakeup.clear();
+
+		for (auto &client : m_done) {
+			clients.push_back(std::move(client));
+		}
+		for (auto &error : m_errors) {
+			errors.push_back(std::move(error));
+		}
+
+		m_done.clear();
+		m_errors.clear();
+	}
+};
+
+/* }}} */
+
+/*
+ * Handoff
+ * ------------------------------------------------------------------
+ *
+ * Pass the sockets of a server to another process.
+ */
+
+/* {{{ Handoff */
+
+#if !defined(_WIN32)
+
+/**
+ * @class Handoff
+ * @brief Sockets and connection state passed to another process over a Unix socket.
+ *
+ * The descriptors are passed with SCM_RIGHTS, one per message along with the state of the connection, so both
+ * processes share the same kernel sockets and no client is disconnected. This is how StreamServer::handoff and
+ * StreamServer::resume restart a server without downtime.
+ *
+ * This class does not own the handles, the receiver must either resume them or call close.
+ */
+class Handoff {
+public:
+	/**
+	 * @class Client
+	 * @brief State of a connection.
+	 */
+	class Client {
+	public:
+		Handle handle{Invalid};	//!< the socket
+		std::string address;	//!< the peer address as a raw sockaddr
+		std::string input;	//!< data received and not yet consumed
+		std::string output;	//!< data queued and not yet sent
+		std::string state;	//!< application state
+	};
+
+	/**
+	 * The server socket, bound and listening.
+	 */
+	Handle master{Invalid};
+
+	/**
+	 * The connections.
+	 */
+	std::vector<Client> clients;
+
+	/**
+	 * Send everything over a connected Unix stream socket, the handles are duplicated by the kernel and remain
+	 * open in this process.
+	 *
+	 * @param channel the blocking socket
+	 * @throw net::Error on errors
+	 */
+	void send(Handle channel) const;
+
+	/**
+	 * Receive what the other process has sent with send.
+	 *
+	 * @param channel the blocking socket
+	 * @return the handoff
+	 * @throw net::Error on errors, the handles already received are closed
+	 */
+	static Handoff receive(Handle channel);
+
+	/**
+	 * Get the server socket, it is not owned by the handoff anymore.
+	 *
+	 * @param protocol the protocol, Tls must have its certificate and private key
+	 * @return the socket
+	 * @pre master must be valid
+	 */
+	template <typename Address, typename Protocol>
+	Socket<Address, Protocol> takeMaster(Protocol protocol = {})
+	{
+		assert(master != Invalid);
+
+		Socket<Address, Protocol> socket{master, State::Bound, std::move(protocol)};
+
+		master = Invalid;
+
+		return socket;
+	}
+
+	/**
+	 * Close the handles that are still owned.
+	 */
+	void close() noexcept;
+};
+
+#endif // !_WIN32
+
+/* }}} */
+
+/*
+ * StreamServer
+ * ------------------------------------------------------------------
+ *
+ * Convenient stream oriented server.
+ */
+
+/* {{{ StreamServer */
+
+/**
+ * @class AcceptStatistics
+ * @brief Accept counters of a StreamServer.
+ *
+ * The accept queue values come from TCP_INFO and are only available on Linux, they are 0 otherwise.
+ */
+class AcceptStatistics {
+public:
+	std::uint64_t accepted{0};		//!< clients accepted
+	std::uint64_t wakeups{0};		//!< wakeups of the server socket
+	std::uint64_t limited{0};		//!< wakeups that reached the accept limit, the rest waits for the next poll
+	std::uint64_t errors{0};		//!< accept errors (e.g. too many open files)
+	unsigned peakBatch{0};			//!< most clients accepted in one wakeup
+	unsigned queued{0};			//!< accept queue length at the last wakeup
+	unsigned peakQueued{0};			//!< longest accept queue seen
+	unsigned backlog{0};			//!< accept queue capacity
+	std::uint64_t overflows{0};		//!< wakeups that found the accept queue full, the kernel was dropping clients
+};
+
+/**
+ * @class StreamHandler
+ * @brief Handler of a StreamServer that does nothing.
+ *
+ * The StreamServer calls the functions of its handler type directly, without std::function and without catching
+ * the exceptions, so they can be inlined. Derive from this class and hide the functions needed, the other events
+ * are ignored.
+ *
+ * The functions must not throw, an exception would leave the server in an undefined state.
+ */
+template <typename Address, typename Protocol>
+class StreamHandler {
+public:
+	/**
+	 * A new client is connected.
+	 */
+	inline void onConnection(const std::shared_ptr<StreamConnection<Address, Protocol>> &) noexcept
+	{
+	}
+
+	/**
+	 * A client is disconnected.
+	 */
+	inline void onDisconnection(const std::shared_ptr<StreamConnection<Address, Protocol>> &) noexcept
+	{
+	}
+
+	/**
+	 * Data has been received from a client, the handler must consume what it has processed.
+	 */
+	inline void onRead(const std::shared_ptr<StreamConnection<Address, Protocol>> &, InputBuffer &input) noexcept
+	{
+		input.clear();
+	}
+
+	/**
+	 * Data has been sent to a client.
+	 */
+	inline void onWrite(const std::shared_ptr<StreamConnection<Address, Protocol>> &, unsigned) noexcept
+	{
+	}
+
+	/**
+	 * The output of a client becomes congested or not congested anymore.
+	 */
+	inline void onCongestion(const std::shared_ptr<StreamConnection<Address, Protocol>> &, bool) noexcept
+	{
+	}
+
+	/**
+	 * A datagram has been received from a client.
+	 */
+	inline void onDatagram(const std::shared_ptr<StreamConnection<Address, Protocol>> &, const std::string &) noexcept
+	{
+	}
+
+	/**
+	 * An error occured.
+	 */
+	inline void onError(const Error &) noexcept
+	{
+	}
+
+	/**
+	 * The poll has timed out.
+	 */
+	inline void onTimeout() noexcept
+	{
+	}
+};
+
+/**
+ * @class StreamCallbacks
+ * @brief Default handler of a StreamServer, each event calls a Callback.
+ *
+ * The callbacks are given with the set*Handler functions of StreamServer, they may be changed at any time and their
+ * exceptions are ignored.
+ */
+template <typename Address, typename Protocol>
+class StreamCallbacks {
+public:
+	/**
+	 * Handler when a new client is connected.
+	 */
+	using ConnectionHandler = Callback<const std::shared_ptr<StreamConnection<Address, Protocol>> &>;
+
+	/**
+	 * Handler when a client is disconnected.
+	 */
+	using DisconnectionHandler = Callback<const std::shared_ptr<StreamConnection<Address, Protocol>> &>;
+
+	/**
+	 * Handler when data has been received from a client.
+	 */
+	using ReadHandler = Callback<const std::shared_ptr<StreamConnection<Address, Protocol>> &, InputBuffer &>;
+
+	/**
+	 * Handler when data has been correctly sent to a client.
+	 */
+	using WriteHandler = Callback<const std::shared_ptr<StreamConnection<Address, Protocol>> &, unsigned>;
+
+	/**
+	 * Handler when the output of a client becomes congested or not congested anymore.
+	 */
+	using CongestionHandler = Callback<const std::shared_ptr<StreamConnection<Address, Protocol>> &, bool>;
+
+	/**
+	 * Handler when a datagram has been received from a client.
+	 */
+	using DatagramHandler = Callback<const std::shared_ptr<StreamConnection<Address, Protocol>> &, const std::string &>;
+
+	/**
+	 * Handler when an error occured.
+	 */
+	using ErrorHandler = Callback<const Error &>;
+
+	/**
+	 * Handler when there was a timeout.
+	 */
+	using TimeoutHandler = Callback<>;
+
+private:
+	ConnectionHandler m_onConnection;
+	DisconnectionHandler m_onDisconnection;
+	ReadHandler m_onRead;
+	WriteHandler m_onWrite;
+	CongestionHandler m_onCongestion;
+	DatagramHandler m_onDatagram;
+	ErrorHandler m_onError;
+	TimeoutHandler m_onTimeout;
+
+public:
+	/**
+	 * Set the connection handler.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setConnectionHandler(ConnectionHandler handler)
+	{
+		m_onConnection = std::move(handler);
+	}
+
+	/**
+	 * Set the disconnection handler.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setDisconnectionHandler(DisconnectionHandler handler)
+	{
+		m_onDisconnection = std::move(handler);
+	}
+
+	/**
+	 * Set the receive handler.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setReadHandler(ReadHandler handler)
+	{
+		m_onRead = std::move(handler);
+	}
+
+	/**
+	 * Set the writing handler.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setWriteHandler(WriteHandler handler)
+	{
+		m_onWrite = std::move(handler);
+	}
+
+	/**
+	 * Set the congestion handler.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setCongestionHandler(CongestionHandler handler)
+	{
+		m_onCongestion = std::move(handler);
+	}
+
+	/**
+	 * Set the datagram handler.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setDatagramHandler(DatagramHandler handler)
+	{
+		m_onDatagram = std::move(handler);
+	}
+
+	/**
+	 * Set the error handler.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setErrorHandler(ErrorHandler handler)
+	{
+		m_onError = std::move(handler);
+	}
+
+	/**
+	 * Set the timeout handler.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setTimeoutHandler(TimeoutHandler handler)
+	{
+		m_onTimeout = std::move(handler);
+	}
+
+	/**
+	 * Call the connection handler.
+	 */
+	inline void onConnection(const std::shared_ptr<StreamConnection<Address, Protocol>> &client) const
+	{
+		m_onConnection(client);
+	}
+
+	/**
+	 * Call the disconnection handler.
+	 */
+	inline void onDisconnection(const std::shared_ptr<StreamConnection<Address, Protocol>> &client) const
+	{
+		m_onDisconnection(client);
+	}
+
+	/**
+	 * Call the receive handler.
+	 */
+	inline void onRead(const std::shared_ptr<StreamConnection<Address, Protocol>> &client, InputBuffer &input) const
+	{
+		m_onRead(client, input);
+	}
+
+	/**
+	 * Call the writing handler.
+	 */
+	inline void onWrite(const std::shared_ptr<StreamConnection<Address, Protocol>> &client, unsigned nsent) const
+	{
+		m_onWrite(client, nsent);
+	}
+
+	/**
+	 * Call the congestion handler.
+	 */
+	inline void onCongestion(const std::shared_ptr<StreamConnection<Address, Protocol>> &client, bool congested) const
+	{
+		m_onCongestion(client, congested);
+	}
+
+	/**
+	 * Call the datagram handler.
+	 */
+	inline void onDatagram(const std::shared_ptr<StreamConnection<Address, Protocol>> &client, const std::string &data) const
+	{
+		m_onDatagram(client, data);
+	}
+
+	/**
+	 * Call the error handler.
+	 */
+	inline void onError(const Error &error) const
+	{
+		m_onError(error);
+	}
+
+	/**
+	 * Call the timeout handler.
+	 */
+	inline void onTimeout() const
+	{
+		m_onTimeout();
+	}
+};
+
+/**
+ * @class StreamServer
+ * @brief Convenient stream server for TCP and TLS.
+ *
+ * This class does all the things for you as accepting new clients, listening for it and sending data. It works
+ * asynchronously without blocking to let you control your process workflow.
+ *
+ * The events are passed to the Handler type, by default StreamCallbacks which calls the functions given to the
+ * set*Handler functions. Another handler, usually derived from StreamHandler, is called directly so that the compiler
+ * can inline it, the set*Handler functions are then not available.
+ *
+ * This class is not thread safe and you must not call any of the functions from different threads.
+ */
+template <typename Address, typename Protocol, typename Handler = StreamCallbacks<Address, Protocol>>
+class StreamServer {
+public:
+	/**
+	 * Handler when a new client is connected.
+	 */
+	using ConnectionHandler = typename StreamCallbacks<Address, Protocol>::ConnectionHandler;
+
+	/**
+	 * Handler when a client is disconnected.
+	 */
+	using DisconnectionHandler = typename StreamCallbacks<Address, Protocol>::DisconnectionHandler;
+
+	/**
+	 * Handler when data has been received from a client.
+	 *
+	 * The buffer contains all the data received and not yet consumed, the handler must consume what it has
+	 * processed, the remaining data is passed again with the next received data.
+	 */
+	using ReadHandler = typename StreamCallbacks<Address, Protocol>::ReadHandler;
+
+	/**
+	 * Handler when data has been correctly sent to a client, the number of bytes sent is passed.
+	 */
+	using WriteHandler = typename StreamCallbacks<Address, Protocol>::WriteHandler;
+
+	/**
+	 * Handler when the output of a client becomes congested (true) or not congested anymore (false), see
+	 * setOutputLimits.
+	 */
+	using CongestionHandler = typename StreamCallbacks<Address, Protocol>::CongestionHandler;
+
+	/**
+	 * Handler when a datagram has been received from a client, see openChannel.
+	 */
+	using DatagramHandler = typename StreamCallbacks<Address, Protocol>::DatagramHandler;
+
+	/**
+	 * Handler when an error occured.
+	 */
+	using ErrorHandler = typename StreamCallbacks<Address, Protocol>::ErrorHandler;
+
+	/**
+	 * Handler when there was a timeout.
+	 */
+	using TimeoutHandler = typename StreamCallbacks<Address, Protocol>::TimeoutHandler;
+
+	/**
+	 * Function returning the application state of a client passed to another process, see handoff.
+	 */
+	using SaveHandler = std::function<std::string (const std::shared_ptr<StreamConnection<Address, Protocol>> &)>;
+
+	/**
+	 * Handler when a client passed by another process is resumed with its application state, see resume.
+	 */
+	using ResumeHandler = Callback<const std::shared_ptr<StreamConnection<Address, Protocol>> &, const std::string &>;
+
+	/**
+	 * Function posted from another thread, see post.
+	 */
+	using PostHandler = Callback<>;
+
+private:
+	using ClientMap = HandleTable<std::shared_ptr<StreamConnection<Address, Protocol>>>;
+	using Pool = StreamConnectionPool<Address, Protocol>;
+
+	/* Signals */
+	Handler m_handler;
+
+	/* Sockets */
+	Socket<Address, Protocol> m_master;
+	Listener<> m_listener;
+	ClientMap m_clients;
+	std::shared_ptr<Pool> m_pool{std::make_shared<Pool>()};
+
+	/* Maximum number of events dispatched per wakeup, 0 for unlimited */
+	unsigned m_maxEvents{0};
+
+	/* Last handle dispatched when the events were limited, the next poll starts after it */
+	Handle m_lastEvent{Invalid};
+
+	/* Maximum number of clients accepted per wakeup, 0 for unlimited */
+	unsigned m_acceptLimit{64};
+	AcceptStatistics m_acceptStatistics;
+
+	/* Size of one recv and maximum read from one client per wakeup */
+	unsigned m_readSize{4096};
+	std::size_t m_readLimit{65536};
+
+	/* Output limits of new clients */
+	std::size_t m_outputHigh{0};
+	std::size_t m_outputLow{0};
+	OutputPolicy m_outputPolicy{OutputPolicy::None};
+
+	/* Clients disconnected by the output policy, removed outside of the handlers */
+	std::vector<std::shared_ptr<StreamConnection<Address, Protocol>>> m_closing;
+
+	/* Timers and idle timeout of new clients */
+	TimerWheel m_timers;
+	std::chrono::milliseconds m_idleTimeout{0};
+
+	/* Optional handshake workers */
+	std::unique_ptr<HandshakePool<Address, Protocol>> m_handshakes;
+
+	/* Optional datagram channels, by token */
+	std::unique_ptr<DatagramServer<Address>> m_datagrams;
+	std::unordered_map<std::uint64_t, std::shared_ptr<StreamConnection<Address, Protocol>>> m_channels;
+
+	/* Functions posted from other threads, the wakeup is only notified once until they are run */
+	Wakeup m_wakeup;
+	MpscQueue<PostHandler> m_posted;
+	std::atomic<bool> m_notified{false};
+
+	/*
+	 * Only Tls needs to be told to not start the handshake in accept.
+	 */
+	template <typename Proto>
+	static inline void setDeferredAccept(Proto &, bool) noexcept
+	{
+	}
+
+#if !defined(SOCKET_NO_SSL)
+	static inline void setDeferredAccept(protocol::Tls &tls, bool deferred) noexcept
+	{
+		tls.setDeferredAccept(deferred);
+	}
+#endif
+
+	/*
+	 * With Tls, the channel is derived from the session so the client gets it without any message.
+	 */
+	template <typename Proto>
+	static inline std::shared_ptr<DatagramChannel> createChannel(Proto &, bool encrypted)
+	{
+		return DatagramChannel::random(DatagramChannel::Side::Server, encrypted);
+	}
+
+#if !defined(SOCKET_NO_SSL)
+	static inline std::shared_ptr<DatagramChannel> createChannel(protocol::Tls &tls, bool encrypted)
+	{
+		auto material = tls.exportKeyingMaterial(DatagramChannel::label, DatagramChannel::materialSize);
+
+		return DatagramChannel::derive(DatagramChannel::Side::Server, material, encrypted);
+	}
+#endif
+
+	/*
+	 * Tls connections can not be passed to another process, the state of the session is in OpenSSL.
+	 */
+	template <typename Proto>
+	static inline bool canHandoff(const Proto &) noexcept
+	{
+		return true;
+	}
+
+#if !defined(SOCKET_NO_SSL)
+	static inline bool canHandoff(const protocol::Tls &) noexcept
+	{
+		return false;
+	}
+#endif
+
+	/*
+	 * Update flags depending on the required condition.
+	 */
+	void updateFlags(std::shared_ptr<StreamConnection<Address, Protocol>> &client)
+	{
+		assert(client->socket().action() != Action::None);
+
+		m_listener.assign(client->socket().handle(), client->socket().condition());
+	}
+
+	/*
+	 * Continue accept process.
+	 */
+	template <typename AcceptCall>
+	void processAccept(std::shared_ptr<StreamConnection<Address, Protocol>> &client, const AcceptCall &acceptFunc)
+	{
+		try {
+			/* Do the accept */
+			acceptFunc();
+
+			/* 1. If accept is not finished, wait for the appropriate condition */
+			if (client->socket().state() == State::Accepted) {
+				/* 2. Client is accepted, notify the user */
+				m_listener.assign(client->socket().handle(), Condition::Readable);
+				m_handler.onConnection(client);
+			} else {
+				/* Operation still in progress */
+				updateFlags(client);
+			}
+		} catch (const Error &error) {
+			remove(client);
+			m_handler.onError(error);
+		}
+	}
+
+	/*
+	 * Remove a client from the listener, the table, the timers and the datagram channels.
+	 */
+	void remove(const std::shared_ptr<StreamConnection<Address, Protocol>> &client)
+	{
+		m_listener.remove(client->socket().handle());
+		m_clients.erase(client->socket().handle());
+		m_timers.cancel(client->idleTimer());
+
+		if (client->channel()) {
+			m_datagrams->remove(client->channel()->token());
+			m_channels.erase(client->channel()->token());
+		}
+	}
+
+	/*
+	 * Send the datagrams queued by the handlers.
+	 */
+	void processDatagrams() noexcept
+	{
+		if (m_datagrams) {
+			try {
+				m_datagrams->flush();
+			} catch (const Error &error) {
+				m_handler.onError(error);
+			}
+		}
+	}
+
+	/*
+	 * Get the accept queue of the master socket, Linux reports it in TCP_INFO for listening sockets.
+	 */
+	void processAcceptQueue() noexcept
+	{
+#if defined(__linux__)
+		tcp_info info;
+		socklen_t length = sizeof (info);
+
+		if (::getsockopt(m_master.handle(), IPPROTO_TCP, TCP_INFO, &info, &length) == Failure) {
+			return;
+		}
+
+		m_acceptStatistics.queued = info.tcpi_unacked;
+		m_acceptStatistics.peakQueued = std::max(m_acceptStatistics.peakQueued, m_acceptStatistics.queued);
+		m_acceptStatistics.backlog = info.tcpi_sacked;
+
+		if (info.tcpi_sacked > 0 && info.tcpi_unacked >= info.tcpi_sacked) {
+			m_acceptStatistics.overflows ++;
+		}
+#endif
+	}
+
+	/*
+	 * Process initial accept of master socket, this is the initial accepting process. The clients are accepted
+	 * until the backlog is empty or the accept limit is reached. Except on errors, the socket is stored but the
+	 * user will be notified only once the socket is completely accepted.
+	 */
+	void processInitialAccept()
+	{
+		unsigned count = 0;
+
+		m_acceptStatistics.wakeups ++;
+		processAcceptQueue();
+
+		try {
+			while (m_acceptLimit == 0 || count < m_acceptLimit) {
+				Address address;
+				Socket<Address, Protocol> socket = m_master.accept(&address);
+
+				/* Backlog drained */
+				if (socket.handle() == Invalid) {
+					break;
+				}
+
+				count ++;
+				m_acceptStatistics.accepted ++;
+
+				/* The client is added once a worker has completed the handshake */
+				if (m_handshakes && socket.state() == State::Accepting) {
+					m_handshakes->add(std::move(socket), std::move(address));
+				} else {
+					addClient(std::move(socket), std::move(address));
+				}
+			}
+		} catch (const Error &) {
+			m_acceptStatistics.errors ++;
+			throw;
+		}
+
+		m_acceptStatistics.peakBatch = std::max(m_acceptStatistics.peakBatch, count);
+
+		if (m_acceptLimit > 0 && count == m_acceptLimit) {
+			m_acceptStatistics.limited ++;
+		}
+	}
+
+	/*
+	 * Get the clients accepted by the handshake workers.
+	 */
+	void processHandshakes()
+	{
+		std::vector<typename HandshakePool<Address, Protocol>::Entry> sockets;
+		std::vector<Error> errors;
+
+		m_handshakes->take(sockets, errors);
+
+		for (auto &socket : sockets) {
+			addClient(std::move(socket.first), std::move(socket.second));
+		}
+		for (const auto &error : errors) {
+			m_handler.onError(error);
+		}
+	}
+
+	/*
+	 * Add a new client, notify the user if it is already accepted.
+	 */
+	void addClient(Socket<Address, Protocol> socket, Address address)
+	{
+		auto client = createClient(std::move(socket), std::move(address));
+
+		/*
+		 * Do an initial check to set the listener flags, at this moment the socket may or not be completely
+		 * accepted.
+		 */
+		processAccept(client, [&] () {});
+	}
+
+	/*
+	 * Create the connection and add it to the table, the listener is not updated.
+	 */
+	std::shared_ptr<StreamConnection<Address, Protocol>> createClient(Socket<Address, Protocol> socket, Address address)
+	{
+		std::shared_ptr<StreamConnection<Address, Protocol>> client = m_pool->acquire(std::move(socket));
+		std::weak_ptr<StreamConnection<Address, Protocol>> ptr{client};
+
+		client->setAddress(std::move(address));
+
+		/* 1. Register output changed to update listener */
+		client->setWriteHandler([this, ptr] () {
+			auto client = ptr.lock();
+
+			/* Do not update the listener immediately if an action is pending */
+			if (client && client->socket().action() == Action::None && !client->output().empty()) {
+				m_listener.set(client->socket().handle(), Condition::Writable);
+			}
+		});
+		client->setOutputLimits(m_outputHigh, m_outputLow, m_outputPolicy);
+		setIdleTimeout(client, m_idleTimeout);
+		client->setCongestionHandler([this, ptr] (bool congested) {
+			auto client = ptr.lock();
+
+			if (client) {
+				processCongestion(client, congested);
+			}
+		});
+
+		/* 2. Add the client */
+		m_clients.insert(std::make_pair(client->socket().handle(), client));
+
+		return client;
+	}
+
+	/*
+	 * Apply the output policy, this may be called from any handler so the clients are not removed immediately.
+	 */
+	void processCongestion(const std::shared_ptr<StreamConnection<Address, Protocol>> &client, bool congested)
+	{
+		switch (client->outputPolicy()) {
+		case OutputPolicy::PauseReading:
+			if (congested) {
+				m_listener.unset(client->socket().handle(), Condition::Readable);
+			} else {
+				m_listener.set(client->socket().handle(), Condition::Readable);
+			}
+			break;
+		case OutputPolicy::Disconnect:
+			if (congested) {
+				m_closing.push_back(client);
+			}
+			break;
+		default:
+			break;
+		}
+
+		m_handler.onCongestion(client, congested);
+	}
+
+	/*
+	 * Remove the clients disconnected by the output policy.
+	 */
+	void processClosing()
+	{
+		auto closing = std::move(m_closing);
+
+		m_closing.clear();
+
+		for (auto &client : closing) {
+			auto it = m_clients.find(client->socket().handle());
+
+			if (it != m_clients.end() && it->second == client) {
+				remove(client);
+				client->close();
+				m_handler.onDisconnection(client);
+			}
+		}
+	}
+
+	/*
+	 * Read or complete the read operation.
+	 */
+	void processRead(std::shared_ptr<StreamConnection<Address, Protocol>> &client)
+	{
+		auto &input = client->input();
+		std::size_t total = 0;
+		unsigned nread;
+
+		/*
+		 * Read because there is something to read or because the pending operation is
+		 * read and must complete. Continue while the kernel fills the whole area to not
+		 * wait for another wakeup.
+		 */
+		do {
+			nread = client->socket().recv(input.prepare(m_readSize), m_readSize);
+			input.commit(nread);
+			total += nread;
+		} while (nread == m_readSize && total < m_readLimit);
+
+		/* The peer may have closed just after the data, the next recv returned 0 */
+		auto disconnected = total > 0 && client->socket().state() == State::Disconnected;
+
+		/*
+		 * Now the receive operation may be completed, in that case, two possibilities:
+		 *
+		 * 1. The action is set to None (completed)
+		 * 2. The action is still not complete, update the flags
+		 */
+		if (client->socket().action() == Action::None) {
+			/* Empty mean normal disconnection, unless the socket was not ready yet */
+			if (total == 0) {
+				if (client->socket().condition() == Condition::None) {
+					remove(client);
+					m_handler.onDisconnection(client);
+				}
+
+				return;
+			}
+
+			/*
+			 * At this step, it is possible that we were completing a receive operation, in this
+			 * case the write flag may be removed, add it if required.
+			 */
+			if (!disconnected && !client->output().empty()) {
+				m_listener.set(client->socket().handle(), Condition::Writable);
+			}
+		} else {
+			/* Operation in progress */
+			updateFlags(client);
+		}
+
+		if (total > 0) {
+			m_timers.reschedule(client->idleTimer(), client->idleTimeout());
+			m_handler.onRead(client, input);
+		}
+
+		/* Deliver the data first, the handler may have removed the client already */
+		if (disconnected) {
+			auto it = m_clients.find(client->socket().handle());
+
+			if (it != m_clients.end() && it->second == client) {
+				remove(client);
+				m_handler.onDisconnection(client);
+			}
+		}
+	}
+
+	/*
+	 * Flush the output buffer.
+	 */
+	void processWrite(std::shared_ptr<StreamConnection<Address, Protocol>> &client)
+	{
+		auto &output = client->output();
+		auto nsent = client->socket().send(output);
+
+		if (client->socket().action() == Action::None) {
+			/* 1. Erase the content sent, this may resume the reading */
+			client->consume(nsent);
+
+			/* 2. Update listener */
+			if (output.empty()) {
+				m_listener.unset(client->socket().handle(), Condition::Writable);
+			}
+
+			/* 3. Notify user */
+			m_handler.onWrite(client, nsent);
+		} else {
+			updateFlags(client);
+		}
+	}
+
+	void processSync(std::shared_ptr<StreamConnection<Address, Protocol>> &client, Condition flags)
+	{
+		try {
+			auto action = client->socket().action();
+
+			if (action == Action::Receive ||
+			    (action == Action::None && (flags & Condition::Readable) == Condition::Readable)) {
+				processRead(client);
+			} else if ((flags & Condition::Writable) == Condition::Writable) {
+				processWrite(client);
+			}
+		} catch (const Error &error) {
+			m_handler.onDisconnection(client);
+			remove(client);
+		}
+	}
+
+	/*
+	 * Run the functions posted, the flag is reset first so that a post made meanwhile notifies again.
+	 */
+	void processPosted()
+	{
+		PostHandler function;
+
+		m_wakeup.clear();
+		m_notified = false;
+
+		while (m_posted.pop(function)) {
+			function();
+		}
+	}
+
+	/*
+	 * Dispatch one event returned by the listener.
+	 */
+	void dispatch(const ListenerStatus &st)
+	{
+		try {
+			if (st.socket == m_master.handle()) {
+				/* New client */
+				processInitialAccept();
+			} else if (m_handshakes && st.socket == m_handshakes->handle()) {
+				/* Clients accepted by the workers */
+				processHandshakes();
+			} else if (m_datagrams && st.socket == m_datagrams->handle()) {
+				/* Datagrams from any client, see openChannel */
+				m_datagrams->receive();
+			} else if (st.socket == m_wakeup.handle()) {
+				/* Functions posted from other threads */
+				processPosted();
+			} else {
+				/*
+				 * Recv / Send / Accept on a client, the client may have been removed by a previous
+				 * event of the same wakeup.
+				 */
+				auto it = m_clients.find(st.socket);
+
+				if (it == m_clients.end()) {
+					return;
+				}
+
+				auto client = it->second;
+
+				if (client->socket().state() == State::Accepted) {
+					processSync(client, st.flags);
+				} else {
+					processAccept(client, [&] () { client->socket().accept(); });
+				}
+			}
+		} catch (const Error &error) {
+			m_handler.onError(error);
+		}
+	}
+
+public:
+	/**
+	 * Create a stream server with the specified address to bind.
+	 *
+	 * @param protocol the protocol (Tcp or Tls)
+	 * @param address the address to bind
+	 * @param max the max number to listen
+	 * @throw Error on errors
+	 */
+	StreamServer(Protocol protocol, const Address &address, int max = 128)
+		: m_master{std::move(protocol), address}
+	{
+		// TODO: onError
+		m_master.set(SOL_SOCKET, SO_REUSEADDR, 1);
+		m_master.set(net::option::SockBlockMode{false});
+		m_master.protocol().setAcceptNonBlocking();
+		m_master.bind(address);
+		m_master.listen(max);
+		m_listener.set(m_master.handle(), Condition::Readable);
+		m_listener.set(m_wakeup.handle(), Condition::Readable);
+	}
+
+	/**
+	 * Create a stream server from an already bound and listening socket.
+	 *
+	 * @param master the master socket
+	 * @pre master must be bound and listening
+	 * @throw Error on errors
+	 */
+	StreamServer(Socket<Address, Protocol> master)
+		: m_master{std::move(master)}
+	{
+		assert(m_master.state() == State::Bound);
+
+		m_master.set(net::option::SockBlockMode{false});
+		m_master.protocol().setAcceptNonBlocking();
+		m_listener.set(m_master.handle(), Condition::Readable);
+		m_listener.set(m_wakeup.handle(), Condition::Readable);
+	}
+
+	/**
+	 * Get the handler.
+	 *
+	 * @return the handler
+	 */
+	inline Handler &handler() noexcept
+	{
+		return m_handler;
+	}
+
+	/**
+	 * Set the connection handler, called when a new client is connected.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setConnectionHandler(ConnectionHandler handler)
+	{
+		m_handler.setConnectionHandler(std::move(handler));
+	}
+
+	/**
+	 * Set the disconnection handler, called when a client died.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setDisconnectionHandler(DisconnectionHandler handler)
+	{
+		m_handler.setDisconnectionHandler(std::move(handler));
+	}
+
+	/**
+	 * Set the receive handler, called when a client has sent something.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setReadHandler(ReadHandler handler)
+	{
+		m_handler.setReadHandler(std::move(handler));
+	}
+
+	/**
+	 * Set the writing handler, called when some data has been sent to a client.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setWriteHandler(WriteHandler handler)
+	{
+		m_handler.setWriteHandler(std::move(handler));
+	}
+
+	/**
+	 * Set the congestion handler, called when the output of a client reaches the high water mark and when it goes
+	 * down to the low water mark.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setCongestionHandler(CongestionHandler handler)
+	{
+		m_handler.setCongestionHandler(std::move(handler));
+	}
+
+	/**
+	 * Set the datagram handler, called when a client has sent a datagram, see openChannel.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setDatagramHandler(DatagramHandler handler)
+	{
+		m_handler.setDatagramHandler(std::move(handler));
+	}
+
+	/**
+	 * Set the error handler, called when unrecoverable error has occured.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setErrorHandler(ErrorHandler handler)
+	{
+		m_handler.setErrorHandler(std::move(handler));
+	}
+
+	/**
+	 * Set the timeout handler, called when the selection has timeout.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setTimeoutHandler(TimeoutHandler handler)
+	{
+		m_handler.setTimeoutHandler(std::move(handler));
+	}
+
+	/**
+	 * Get the listener, for statistics.
+	 *
+	 * @return the listener
+	 */
+	inline const Listener<> &listener() const noexcept
+	{
+		return m_listener;
+	}
+
+	/**
+	 * Complete the handshake of the new clients in worker threads, see HandshakePool. This is only useful with
+	 * Tls, the connection handler is still called from this thread once the client is completely accepted.
+	 *
+	 * The clients whose handshake is in progress are dropped if the workers are changed.
+	 *
+	 * @param count the number of workers (0 to do the handshakes in this thread)
+	 * @throw Error on errors
+	 */
+	void setHandshakeWorkers(unsigned count)
+	{
+		if (m_handshakes) {
+			m_listener.remove(m_handshakes->handle());
+			m_handshakes = nullptr;
+		}
+		if (count > 0) {
+			m_handshakes.reset(new HandshakePool<Address, Protocol>{count});
+			m_listener.set(m_handshakes->handle(), Condition::Readable);
+		}
+
+		setDeferredAccept(m_master.protocol(), count > 0);
+	}
+
+	/**
+	 * Get the number of clients whose handshake is in progress in the workers.
+	 *
+	 * @return the number of clients
+	 */
+	inline std::size_t handshaking() const noexcept
+	{
+		return m_handshakes ? m_handshakes->pending() : 0;
+	}
+
+	/**
+	 * Set the output water marks of the new clients, see StreamConnection::setOutputLimits.
+	 *
+	 * With OutputPolicy::Disconnect, the client is disconnected at the end of the current handler and the
+	 * disconnection handler is called.
+	 *
+	 * @param high the size in bytes from which a client is congested (0 for unlimited)
+	 * @param low the size in bytes to which the output must go down to not be congested anymore
+	 * @param policy the policy while congested
+	 * @pre low < high or high is 0
+	 */
+	inline void setOutputLimits(std::size_t high, std::size_t low, OutputPolicy policy) noexcept
+	{
+		assert(high == 0 || low < high);
+
+		m_outputHigh = high;
+		m_outputLow = low;
+		m_outputPolicy = policy;
+	}
+
+	/**
+	 * Access the timers of this server, the handlers are called from poll.
+	 *
+	 * @return the timers
+	 */
+	inline TimerWheel &timers() noexcept
+	{
+		return m_timers;
+	}
+
+	/**
+	 * Set the idle timeout of the new clients, a client that has sent nothing during this time is disconnected
+	 * and the disconnection handler is called.
+	 *
+	 * @param timeout the timeout (0 to disable)
+	 */
+	inline void setIdleTimeout(std::chrono::milliseconds timeout) noexcept
+	{
+		m_idleTimeout = timeout;
+	}
+
+	/**
+	 * Change the idle timeout of one client, the time is counted from now.
+	 *
+	 * @param client the client
+	 * @param timeout the timeout (0 to disable)
+	 */
+	void setIdleTimeout(const std::shared_ptr<StreamConnection<Address, Protocol>> &client, std::chrono::milliseconds timeout)
+	{
+		std::weak_ptr<StreamConnection<Address, Protocol>> ptr{client};
+		TimerWheel::Id id = 0;
+
+		m_timers.cancel(client->idleTimer());
+
+		if (timeout.count() > 0) {
+			id = m_timers.schedule(timeout, [this, ptr] () {
+				auto client = ptr.lock();
+
+				if (client) {
+					m_closing.push_back(client);
+				}
+			});
+		}
+
+		client->setIdleTimer(timeout, id);
+	}
+
+	/**
+	 * Receive datagrams on a UDP socket bound to the address, it may be the same address as the stream server.
+	 * The channels of the clients are opened with openChannel.
+	 *
+	 * @param address the address
+	 * @param batch the number of packets per system call
+	 * @throw net::Error on errors
+	 */
+	void bindDatagrams(const Address &address, unsigned batch = 64)
+	{
+		if (m_datagrams) {
+			m_listener.remove(m_datagrams->handle());
+		}
+
+		for (auto &pair : m_channels) {
+			pair.second->setChannel(nullptr);
+		}
+
+		m_channels.clear();
+		m_datagrams.reset(new DatagramServer<Address>{address, batch});
+		m_datagrams->setReadHandler([this] (const std::shared_ptr<DatagramChannel> &channel, const std::string &data) {
+			auto it = m_channels.find(channel->token());
+
+			if (it != m_channels.end()) {
+				m_handler.onDatagram(it->second, data);
+			}
+		});
+		m_listener.set(m_datagrams->handle(), Condition::Readable);
+	}
+
+	/**
+	 * Get the datagram server.
+	 *
+	 * @return the server or null if bindDatagrams was not called
+	 */
+	inline DatagramServer<Address> *datagrams() noexcept
+	{
+		return m_datagrams.get();
+	}
+
+	/**
+	 * Open the datagram channel of a client, it is closed with the client.
+	 *
+	 * With Tls, the token and the key are derived from the TLS session, the client gets the same channel with
+	 * StreamClient::openChannel(address, encrypted). Otherwise they are random and must be sent to the client,
+	 * see DatagramChannel::token and DatagramChannel::key.
+	 *
+	 * The client must send a datagram before the server can send any.
+	 *
+	 * @param client the client, completely accepted
+	 * @param encrypted true to encrypt the datagrams
+	 * @return the channel
+	 * @pre bindDatagrams must have been called
+	 * @throw net::Error on errors
+	 */
+	std::shared_ptr<DatagramChannel> openChannel(const std::shared_ptr<StreamConnection<Address, Protocol>> &client,
+						     bool encrypted = true)
+	{
+		assert(m_datagrams);
+
+		if (client->channel()) {
+			return client->channel();
+		}
+
+		auto channel = createChannel(client->socket().protocol(), encrypted);
+
+		if (!m_datagrams->add(channel)) {
+			throw Error{Error::Other, "openChannel", "token already used"};
+		}
+
+		client->setChannel(channel);
+		m_channels.emplace(channel->token(), client);
+
+		return channel;
+	}
+
+	/**
+	 * Queue a datagram for a client, the datagrams are sent at the end of poll.
+	 *
+	 * @param client the client
+	 * @param data the payload
+	 * @return false if the channel is not opened or if the client has not sent any datagram yet
+	 * @throw net::Error on errors
+	 */
+	bool sendDatagram(const std::shared_ptr<StreamConnection<Address, Protocol>> &client, const std::string &data)
+	{
+		if (!m_datagrams || !client->channel()) {
+			return false;
+		}
+
+		return m_datagrams->send(*client->channel(), data);
+	}
+
+	/**
+	 * Set the maximum number of released connections kept for reuse.
+	 *
+	 * @param max the maximum (0 to disable)
+	 */
+	inline void setPoolSize(std::size_t max)
+	{
+		m_pool->setMax(max);
+	}
+
+	/**
+	 * Get the number of connected clients, including those not yet completely accepted.
+	 *
+	 * @return the number of clients
+	 */
+	inline std::size_t size() const noexcept
+	{
+		return m_clients.size();
+	}
+
+	/**
+	 * Set the maximum number of events to dispatch per call to poll.
+	 *
+	 * Events that are not dispatched because of the budget are not lost, they are reported again on the next
+	 * call to poll as the listener is level-triggered. The limited events are dispatched in the order of their
+	 * handles, starting after the last handle dispatched by the previous call so that every client gets its turn.
+	 *
+	 * @param max the maximum number of events (0 for unlimited)
+	 */
+	inline void setMaxEvents(unsigned max) noexcept
+	{
+		m_maxEvents = max;
+	}
+
+	/**
+	 * Get the maximum number of events dispatched per call to poll.
+	 *
+	 * @return the maximum number of events (0 for unlimited)
+	 */
+	inline unsigned maxEvents() const noexcept
+	{
+		return m_maxEvents;
+	}
+
+	/**
+	 * Set the maximum number of clients accepted per wakeup of the server socket. The clients are accepted until
+	 * none is pending or this limit is reached, so that a burst of new clients can not starve the connected ones.
+	 *
+	 * @param limit the limit (default: 64, 0 for unlimited)
+	 */
+	inline void setAcceptLimit(unsigned limit) noexcept
+	{
+		m_acceptLimit = limit;
+	}
+
+	/**
+	 * Get the accept counters.
+	 *
+	 * @return the statistics
+	 */
+	inline const AcceptStatistics &acceptStatistics() const noexcept
+	{
+		return m_acceptStatistics;
+	}
+
+	/**
+	 * Set the number of bytes requested to each recv call.
+	 *
+	 * @param size the size
+	 * @pre size > 0
+	 */
+	inline void setReadSize(unsigned size) noexcept
+	{
+		assert(size > 0);
+
+		m_readSize = size;
+	}
+
+	/**
+	 * Set the maximum number of bytes read from one client per event, recv is called until the socket would block
+	 * or this limit is reached so that one client can not starve the others.
+	 *
+	 * @param limit the limit
+	 */
+	inline void setReadLimit(std::size_t limit) noexcept
+	{
+		m_readLimit = limit;
+	}
+
+	/**
+	 * Send the same data to all connected clients.
+	 *
+	 * The data is stored once and shared by the output queue of every client, it is released when the last client
+	 * has sent it.
+	 *
+	 * @param data the data to send
+	 * @param priority the priority, see StreamConnection::send
+	 * @return the number of clients the data was queued for
+	 */
+	std::size_t broadcast(std::string data, Priority priority = Priority::Normal)
+	{
+		auto segment = std::make_shared<const std::string>(std::move(data));
+		std::size_t count = 0;
+
+		for (const auto &pair : m_clients) {
+			if (pair.second->socket().state() == State::Accepted && pair.second->send(segment, priority)) {
+				count ++;
+			}
+		}
+
+		return count;
+	}
+
+	/**
+	 * Send the same data to a subset of clients, the data is shared like broadcast(std::string).
+	 *
+	 * The range must contain std::shared_ptr<StreamConnection> of this server, clients that are not connected
+	 * anymore are skipped.
+	 *
+	 * @param first the first client
+	 * @param last the end of the range
+	 * @param data the data to send
+	 * @param priority the priority, see StreamConnection::send
+	 * @return the number of clients the data was queued for
+	 */
+	template <typename InputIt>
+	std::size_t broadcast(InputIt first, InputIt last, std::string data, Priority priority = Priority::Normal)
+	{
+		auto segment = std::make_shared<const std::string>(std::move(data));
+		std::size_t count = 0;
+
+		for (; first != last; ++first) {
+			const auto &client = *first;
+			auto it = m_clients.find(client->socket().handle());
+
+			if (it != m_clients.end() && it->second == client && client->socket().state() == State::Accepted &&
+			    client->send(segment, priority)) {
+				count ++;
+			}
+		}
+
+		return count;
+	}
+
+	/**
+	 * Run a function in the thread which polls this server, this function is thread safe.
+	 *
+	 * This is the only way to use the server from another thread. The functions are run in order by the next poll
+	 * (or the current one if it is waiting), several posts before it only wake it up once. The exceptions are
+	 * ignored.
+	 *
+	 * @param function the function
+	 */
+	void post(PostHandler function)
+	{
+		m_posted.push(std::move(function));
+
+		if (!m_notified.exchange(true)) {
+			m_wakeup.notify();
+		}
+	}
+
+	/**
+	 * Send data to a client from another thread, this function is thread safe.
+	 *
+	 * The data is queued by the thread which polls this server, nothing is sent if the client has disconnected
+	 * meanwhile.
+	 *
+	 * @param client the client
+	 * @param data the data to send
+	 * @param priority the priority, see StreamConnection::send
+	 */
+	void post(std::shared_ptr<StreamConnection<Address, Protocol>> client, std::string data, Priority priority = Priority::Normal)
 	{
-		m_socket.close();
+		post([this, client, data, priority] () mutable {
+			auto it = m_clients.find(client->socket().handle());
+
+			if (it != m_clients.end() && it->second == client && client->socket().state() == State::Accepted) {
+				client->send(std::move(data), priority);
+			}
+		});
 	}
 
+#if !defined(_WIN32)
+
 	/**
-	 * Set the write handler, the signal is emitted when the output has changed so that the StreamServer owner
-	 * knows that there are some data to send.
+	 * Pass the server socket and the clients to another process, which calls Handoff::receive and resume.
 	 *
-	 * @param handler the handler
-	 * @warning you usually never need to set this yourself
+	 * The server stops accepting and the clients passed are removed from this server without calling the
+	 * disconnection handler, save is the last call for each of them. The data received and not yet consumed and
+	 * the data not yet sent are passed with them.
+	 *
+	 * Tls connections can not be passed, they stay in this server until they disconnect so that the process can
+	 * exit once size() is 0. The clients with a pending operation or a datagram channel are also kept.
+	 *
+	 * @param channel a blocking and connected Unix stream socket
+	 * @param save the function returning the application state of a client (optional)
+	 * @throw Error on errors, nothing has been changed in that case
 	 */
-	inline void setWriteHandler(WriteHandler handler)
+	void handoff(Handle channel, const SaveHandler &save = nullptr)
 	{
-		m_onWrite = std::move(handler);
+		std::vector<std::shared_ptr<StreamConnection<Address, Protocol>>> clients;
+		Handoff handoff;
+
+		handoff.master = m_master.handle();
+
+		if (canHandoff(m_master.protocol())) {
+			for (const auto &pair : m_clients) {
+				const auto &client = pair.second;
+
+				if (client->socket().state() != State::Accepted || client->socket().action() != Action::None ||
+				    client->channel()) {
+					continue;
+				}
+
+				Handoff::Client state;
+				const auto &address = client->address();
+				const auto &output = client->output();
+
+				state.handle = client->socket().handle();
+				state.address.assign(reinterpret_cast<const char *>(address.address()), address.length());
+				state.input = client->input().str();
+
+				for (std::size_t i = 0; i < output.count(); ++i) {
+					state.output.append(output.data(i), output.length(i));
+				}
+
+				if (save) {
+					state.state = save(client);
+				}
+
+				handoff.clients.push_back(std::move(state));
+				clients.push_back(client);
+			}
+		}
+
+		handoff.send(channel);
+
+		/* The other process has its own descriptors now */
+		m_listener.remove(m_master.handle());
+		m_master.close();
+
+		for (auto &client : clients) {
+			remove(client);
+			client->close();
+		}
+	}
+
+	/**
+	 * Add the clients passed by another process with handoff, the server socket is given to the constructor with
+	 * Handoff::takeMaster.
+	 *
+	 * For each client, the resume handler is called instead of the connection handler, then the read handler if
+	 * some data was received and not consumed by the other process. The handles taken are set to Invalid in
+	 * handoff.
+	 *
+	 * @param handoff the handoff received
+	 * @param handler the handler restoring the application state (optional)
+	 */
+	void resume(Handoff &handoff, const ResumeHandler &handler = nullptr)
+	{
+		for (auto &state : handoff.clients) {
+			if (state.handle == Invalid) {
+				continue;
+			}
+
+			Socket<Address, Protocol> socket{state.handle, State::Accepted, Protocol{}};
+			sockaddr_storage storage;
+
+			/* The state comes from another process, never trust its address length */
+			auto length = std::min(state.address.size(), sizeof (storage));
+
+			state.handle = Invalid;
+			socket.set(net::option::SockBlockMode{false});
+			std::memset(&storage, 0, sizeof (storage));
+			std::memcpy(&storage, state.address.data(), length);
+
+			auto client = createClient(std::move(socket), Address{&storage, static_cast<socklen_t>(length)});
+			auto &input = client->input();
+
+			m_listener.assign(client->socket().handle(), Condition::Readable);
+
+			if (!state.input.empty()) {
+				std::memcpy(input.prepare(state.input.size()), state.input.data(), state.input.size());
+				input.commit(state.input.size());
+			}
+			if (!state.output.empty()) {
+				client->send(std::move(state.output));
+			}
+
+			handler(client, state.state);
+
+			if (!input.empty()) {
+				m_handler.onRead(client, input);
+			}
+		}
+	}
+
+#endif // !_WIN32
+
+	/**
+	 * Poll for the next events.
+	 *
+	 * All the events returned by one wakeup of the listener are dispatched, up to the limit set with
+	 * setMaxEvents. The listener waits at most until the next timer and the timeout handler is only called if the
+	 * timeout given here has elapsed.
+	 *
+	 * The timers are advanced as soon as the listener returns, before the events, so that the timers scheduled
+	 * by the handlers (e.g. the idle timeout of a new client) count from now and not from the previous wakeup.
+	 * They are advanced again after the events for the timers that expired meanwhile.
+	 *
+	 * @param timeout the timeout (-1 for indefinitely)
+	 * @throw Error on errors
+	 */
+	void poll(int timeout = -1)
+	{
+		std::vector<ListenerStatus> events;
+
+		/* Clients disconnected and datagrams queued from outside of the handlers */
+		processClosing();
+		processDatagrams();
+
+		/* Wake up for the next timer */
+		auto wait = m_timers.timeout(timeout);
+
+		try {
+			events = m_listener.waitMultiple(wait);
+		} catch (const Error &error) {
+			if (error.code() != Error::Timeout) {
+				m_handler.onError(error);
+			} else if (wait == timeout) {
+				/* Not when woken up for a timer */
+				m_handler.onTimeout();
+			}
+		}
+
+		/* The wheel may be behind by the whole wait, sync it before the handlers schedule anything */
+		m_timers.advance();
+
+		if (m_maxEvents > 0 && events.size() > m_maxEvents) {
+			/*
+			 * Some backends always report the lowest handles first, rotate from the last handle dispatched
+			 * so that the higher ones are not starved.
+			 */
+			auto lower = [] (const ListenerStatus &s1, const ListenerStatus &s2) {
+				return s1.socket < s2.socket;
+			};
+
+			std::sort(events.begin(), events.end(), lower);
+
+			auto start = std::upper_bound(events.begin(), events.end(), ListenerStatus{m_lastEvent, Condition::None}, lower);
+
+			std::rotate(events.begin(), start, events.end());
+			events.resize(m_maxEvents);
+			m_lastEvent = events.back().socket;
+		}
+
+		for (const auto &st : events) {
+			dispatch(st);
+		}
+
+		m_timers.advance();
+		processClosing();
+		processDatagrams();
 	}
 };
 
 /* }}} */
 
 /*
- * StreamServer
+ * MultiStreamServer
  * ------------------------------------------------------------------
  *
- * Convenient stream oriented server.
+ * Several StreamServer running in their own threads.
  */
 
-/* {{{ StreamServer */
+/* {{{ MultiStreamServer */
+
+#if defined(SO_REUSEPORT)
 
 /**
- * @class StreamServer
- * @brief Convenient stream server for TCP and TLS.
+ * @class MultiStreamServer
+ * @brief Stream server sharded across several threads.
  *
- * This class does all the things for you as accepting new clients, listening for it and sending data. It works
- * asynchronously without blocking to let you control your process workflow.
+ * This class runs one StreamServer per thread (called a reactor). Each reactor has its own master socket bound to
+ * the same address with SO_REUSEPORT, its own listener and its own clients so that the kernel distributes the new
+ * connections between the reactors and nothing is shared between the threads.
  *
- * This class is not thread safe and you must not call any of the functions from different threads.
+ * The handlers are copied to every reactor and are always called from the thread which owns the connection, this
+ * means that a connection must only be used from the handlers that receive it. However, handlers of different
+ * connections may run concurrently so any shared data must be protected by the user.
+ *
+ * The handlers and reactors settings must be set before calling start.
  */
-template <typename Address, typename Protocol>
-class StreamServer {
+template <typename Address, typename Protocol, typename Handler = StreamCallbacks<Address, Protocol>>
+class MultiStreamServer {
 public:
 	/**
-	 * Handler when a new client is connected.
+	 * The server type run in each thread.
 	 */
-	using ConnectionHandler = Callback<const std::shared_ptr<StreamConnection<Address, Protocol>> &>;
+	using Server = StreamServer<Address, Protocol, Handler>;
 
 	/**
-	 * Handler when a client is disconnected.
+	 * Function called to create the protocol of each master socket.
 	 */
-	using DisconnectionHandler = Callback<const std::shared_ptr<StreamConnection<Address, Protocol>> &>;
+	using ProtocolFactory = std::function<Protocol ()>;
+
+private:
+	std::vector<std::unique_ptr<Server>> m_servers;
+	std::vector<std::thread> m_threads;
+	std::atomic<bool> m_running{false};
+	int m_interval{250};
 
+public:
 	/**
-	 * Handler when data has been received from a client.
+	 * Create the reactors, the servers are not started until start is called.
+	 *
+	 * With Tls, the factory should give the same ssl::TicketKeys to every protocol so that a session can be resumed
+	 * on any reactor, the session caches are not shared.
+	 *
+	 * @param factory the function which creates the protocol for each master socket (Tcp or Tls)
+	 * @param address the address to bind
+	 * @param count the number of reactors (0 for the number of cores)
+	 * @param max the max number to listen
+	 * @throw Error on errors
 	 */
-	using ReadHandler = Callback<const std::shared_ptr<StreamConnection<Address, Protocol>> &, const std::string &>;
+	MultiStreamServer(const ProtocolFactory &factory, const Address &address, unsigned count = 0, int max = 128)
+	{
+		if (count == 0) {
+			count = std::max(1U, std::thread::hardware_concurrency());
+		}
+
+		for (unsigned i = 0; i < count; ++i) {
+			Socket<Address, Protocol> master{factory(), address};
+
+			master.set(option::SockReuseAddress{});
+			master.set(option::SockReusePort{});
+			master.bind(address);
+			master.listen(max);
+
+			m_servers.emplace_back(new Server{std::move(master)});
+		}
+	}
 
 	/**
-	 * Handler when data has been correctly sent to a client.
+	 * Overloaded function, use a default constructed protocol.
+	 *
+	 * @param address the address to bind
+	 * @param count the number of reactors (0 for the number of cores)
+	 * @param max the max number to listen
+	 * @throw Error on errors
 	 */
-	using WriteHandler = Callback<const std::shared_ptr<StreamConnection<Address, Protocol>> &, const std::string &>;
+	MultiStreamServer(const Address &address, unsigned count = 0, int max = 128)
+		: MultiStreamServer{[] () { return Protocol{}; }, address, count, max}
+	{
+	}
 
 	/**
-	 * Handler when an error occured.
+	 * Stop the reactors.
 	 */
-	using ErrorHandler = Callback<const Error &>;
+	~MultiStreamServer()
+	{
+		stop();
+	}
 
 	/**
-	 * Handler when there was a timeout.
+	 * Get the number of reactors.
+	 *
+	 * @return the number of reactors
 	 */
-	using TimeoutHandler = Callback<>;
-
-private:
-	using ClientMap = std::map<Handle, std::shared_ptr<StreamConnection<Address, Protocol>>>;
+	inline unsigned size() const noexcept
+	{
+		return m_servers.size();
+	}
 
-	/* Signals */
-	ConnectionHandler m_onConnection;
-	DisconnectionHandler m_onDisconnection;
-	ReadHandler m_onRead;
-	WriteHandler m_onWrite;
-	ErrorHandler m_onError;
-	TimeoutHandler m_onTimeout;
+	/**
+	 * Access a reactor, can be used to tune it before calling start.
+	 *
+	 * @param index the reactor index
+	 * @return the server
+	 * @pre index < size()
+	 * @warning do not use the reactor once the servers are started, except with Server::post
+	 */
+	inline Server &server(unsigned index) noexcept
+	{
+		assert(index < m_servers.size());
 
-	/* Sockets */
-	Socket<Address, Protocol> m_master;
-	Listener<> m_listener;
-	ClientMap m_clients;
+		return *m_servers[index];
+	}
 
-	/*
-	 * Update flags depending on the required condition.
+	/**
+	 * Run a function in the thread of a reactor, this function is thread safe.
+	 *
+	 * @param index the reactor index
+	 * @param function the function
+	 * @pre index < size()
+	 * @see StreamServer::post
 	 */
-	void updateFlags(std::shared_ptr<StreamConnection<Address, Protocol>> &client)
+	inline void post(unsigned index, typename Server::PostHandler function)
 	{
-		assert(client->socket().action() != Action::None);
+		assert(index < m_servers.size());
 
-		m_listener.remove(client->socket().handle());
-		m_listener.set(client->socket().handle(), client->socket().condition());
+		m_servers[index]->post(std::move(function));
 	}
 
-	/*
-	 * Continue accept process.
+	/**
+	 * Set the maximum time in milliseconds a reactor waits before checking if it must stop.
+	 *
+	 * @param interval the interval
 	 */
-	template <typename AcceptCall>
-	void processAccept(std::shared_ptr<StreamConnection<Address, Protocol>> &client, const AcceptCall &acceptFunc)
+	inline void setInterval(int interval) noexcept
 	{
-		try {
-			/* Do the accept */
-			acceptFunc();
-
-			/* 1. First remove completely the client */
-			m_listener.remove(client->socket().handle());
+		m_interval = interval;
+	}
 
-			/* 2. If accept is not finished, wait for the appropriate condition */
-			if (client->socket().state() == State::Accepted) {
-				/* 3. Client is accepted, notify the user */
-				m_listener.set(client->socket().handle(), Condition::Readable);
-				m_onConnection(client);
-			} else {
-				/* Operation still in progress */
-				updateFlags(client);
-			}
-		} catch (const Error &error) {
-			m_clients.erase(client->socket().handle());
-			m_listener.remove(client->socket().handle());
-			m_onError(error);
+	/**
+	 * Set the connection handler on every reactor.
+	 *
+	 * @param handler the handler
+	 */
+	void setConnectionHandler(typename Server::ConnectionHandler handler)
+	{
+		for (auto &server : m_servers) {
+			server->setConnectionHandler(handler);
 		}
 	}
 
-	/*
-	 * Process initial accept of master socket, this is the initial accepting process. Except on errors, the
-	 * socket is stored but the user will be notified only once the socket is completely accepted.
+	/**
+	 * Set the disconnection handler on every reactor.
+	 *
+	 * @param handler the handler
 	 */
-	void processInitialAccept()
+	void setDisconnectionHandler(typename Server::DisconnectionHandler handler)
 	{
-		// TODO: store address too.
-		std::shared_ptr<StreamConnection<Address, Protocol>> client = std::make_shared<StreamConnection<Address, Protocol>>(m_master.accept(nullptr));
-		std::weak_ptr<StreamConnection<Address, Protocol>> ptr{client};
-
-		/* 1. Register output changed to update listener */
-		client->setWriteHandler([this, ptr] () {
-			auto client = ptr.lock();
-
-			/* Do not update the listener immediately if an action is pending */
-			if (client && client->socket().action() == Action::None && !client->output().empty()) {
-				m_listener.set(client->socket().handle(), Condition::Writable);
-			}
-		});
+		for (auto &server : m_servers) {
+			server->setDisconnectionHandler(handler);
+		}
+	}
 
-		/* 2. Add the client */
-		m_clients.insert(std::make_pair(client->socket().handle(), client));
+	/**
+	 * Set the receive handler on every reactor.
+	 *
+	 * @param handler the handler
+	 */
+	void setReadHandler(typename Server::ReadHandler handler)
+	{
+		for (auto &server : m_servers) {
+			server->setReadHandler(handler);
+		}
+	}
 
-		/*
-		 * 2. Do an initial check to set the listener flags, at this moment the socket may or not be
-		 *    completely accepted.
-		 */
-		processAccept(client, [&] () {});
+	/**
+	 * Set the writing handler on every reactor.
+	 *
+	 * @param handler the handler
+	 */
+	void setWriteHandler(typename Server::WriteHandler handler)
+	{
+		for (auto &server : m_servers) {
+			server->setWriteHandler(handler);
+		}
 	}
 
-	/*
-	 * Read or complete the read operation.
+	/**
+	 * Set the error handler on every reactor.
+	 *
+	 * @param handler the handler
 	 */
-	void processRead(std::shared_ptr<StreamConnection<Address, Protocol>> &client)
+	void setErrorHandler(typename Server::ErrorHandler handler)
 	{
-		/*
-		 * Read because there is something to read or because the pending operation is
-		 * read and must complete.
-		 */
-		auto buffer = client->socket().recv(512);
+		for (auto &server : m_servers) {
+			server->setErrorHandler(handler);
+		}
+	}
 
-		/*
-		 * Now the receive operation may be completed, in that case, two possibilities:
-		 *
-		 * 1. The action is set to None (completed)
-		 * 2. The action is still not complete, update the flags
-		 */
-		if (client->socket().action() == Action::None) {
-			/* Empty mean normal disconnection */
-			if (buffer.empty()) {
-				m_listener.remove(client->socket().handle());
-				m_clients.erase(client->socket().handle());
-				m_onDisconnection(client);
-			} else {
-				/*
-				 * At this step, it is possible that we were completing a receive operation, in this
-				 * case the write flag may be removed, add it if required.
-				 */
-				if (!client->output().empty()) {
-					m_listener.set(client->socket().handle(), Condition::Writable);
-				}
+	/**
+	 * Set the congestion handler on every reactor.
+	 *
+	 * @param handler the handler
+	 * @see StreamServer::setCongestionHandler
+	 */
+	void setCongestionHandler(typename Server::CongestionHandler handler)
+	{
+		for (auto &server : m_servers) {
+			server->setCongestionHandler(handler);
+		}
+	}
 
-				m_onRead(client, buffer);
-			}
-		} else {
-			/* Operation in progress */
-			updateFlags(client);
+	/**
+	 * Set the timeout handler on every reactor, it is called each time a reactor has waited for the whole
+	 * interval without any event.
+	 *
+	 * @param handler the handler
+	 * @see setInterval
+	 */
+	void setTimeoutHandler(typename Server::TimeoutHandler handler)
+	{
+		for (auto &server : m_servers) {
+			server->setTimeoutHandler(handler);
 		}
 	}
 
-	/*
-	 * Flush the output buffer.
+	/**
+	 * Set the idle timeout of the new clients on every reactor.
+	 *
+	 * @param timeout the timeout (0 to disable)
+	 * @see StreamServer::setIdleTimeout
 	 */
-	void processWrite(std::shared_ptr<StreamConnection<Address, Protocol>> &client)
+	void setIdleTimeout(std::chrono::milliseconds timeout) noexcept
 	{
-		auto &output = client->output();
-		auto nsent = client->socket().send(output);
-
-		if (client->socket().action() == Action::None) {
-			/* 1. Create a copy of content that has been sent */
-			auto sent = output.substr(0, nsent);
-
-			/* 2. Erase the content sent */
-			output.erase(0, nsent);
-
-			/* 3. Update listener */
-			if (output.empty()) {
-				m_listener.unset(client->socket().handle(), Condition::Writable);
-			}
-
-			/* 4. Notify user */
-			m_onWrite(client, sent);
-		} else {
-			updateFlags(client);
+		for (auto &server : m_servers) {
+			server->setIdleTimeout(timeout);
 		}
 	}
 
-	void processSync(std::shared_ptr<StreamConnection<Address, Protocol>> &client, Condition flags)
+	/**
+	 * Set the output water marks of the new clients on every reactor.
+	 *
+	 * @param high the size in bytes from which a client is congested (0 for unlimited)
+	 * @param low the size in bytes to which the output must go down to not be congested anymore
+	 * @param policy the policy while congested
+	 * @pre low < high or high is 0
+	 * @see StreamServer::setOutputLimits
+	 */
+	void setOutputLimits(std::size_t high, std::size_t low, OutputPolicy policy) noexcept
 	{
-		try {
-			auto action = client->socket().action();
-
-			if (action == Action::Receive ||
-			    (action == Action::None && (flags & Condition::Readable) == Condition::Readable)) {
-				processRead(client);
-			} else if ((flags & Condition::Writable) == Condition::Writable) {
-				processWrite(client);
-			}
-		} catch (const Error &error) {
-			m_onDisconnection(client);
-			m_listener.remove(client->socket().handle());
-			m_clients.erase(client->socket().handle());
+		for (auto &server : m_servers) {
+			server->setOutputLimits(high, low, policy);
 		}
 	}
 
-public:
 	/**
-	 * Create a stream server with the specified address to bind.
+	 * Set the handshake workers of every reactor, each reactor has its own workers.
 	 *
-	 * @param protocol the protocol (Tcp or Tls)
-	 * @param address the address to bind
-	 * @param max the max number to listen
+	 * @param count the number of workers per reactor (0 to do the handshakes in the reactors)
 	 * @throw Error on errors
+	 * @see StreamServer::setHandshakeWorkers
 	 */
-	StreamServer(Protocol protocol, const Address &address, int max = 128)
-		: m_master{std::move(protocol), address}
+	void setHandshakeWorkers(unsigned count)
 	{
-		// TODO: m_onError
-		m_master.set(SOL_SOCKET, SO_REUSEADDR, 1);
-		m_master.bind(address);
-		m_master.listen(max);
-		m_listener.set(m_master.handle(), Condition::Readable);
+		for (auto &server : m_servers) {
+			server->setHandshakeWorkers(count);
+		}
 	}
 
 	/**
-	 * Set the connection handler, called when a new client is connected.
+	 * Set the maximum number of events dispatched per poll on every reactor.
 	 *
-	 * @param handler the handler
+	 * @param max the maximum number of events (0 for unlimited)
+	 * @see StreamServer::setMaxEvents
 	 */
-	inline void setConnectionHandler(ConnectionHandler handler)
+	void setMaxEvents(unsigned max) noexcept
 	{
-		m_onConnection = std::move(handler);
+		for (auto &server : m_servers) {
+			server->setMaxEvents(max);
+		}
 	}
 
 	/**
-	 * Set the disconnection handler, called when a client died.
+	 * Set the maximum number of clients accepted per wakeup on every reactor.
 	 *
-	 * @param handler the handler
+	 * @param limit the limit (0 for unlimited)
+	 * @see StreamServer::setAcceptLimit
 	 */
-	inline void setDisconnectionHandler(DisconnectionHandler handler)
+	void setAcceptLimit(unsigned limit) noexcept
 	{
-		m_onDisconnection = std::move(handler);
+		for (auto &server : m_servers) {
+			server->setAcceptLimit(limit);
+		}
 	}
 
 	/**
-	 * Set the receive handler, called when a client has sent something.
+	 * Set the number of bytes requested to each recv call on every reactor.
 	 *
-	 * @param handler the handler
+	 * @param size the size
+	 * @pre size > 0
+	 * @see StreamServer::setReadSize
 	 */
-	inline void setReadHandler(ReadHandler handler)
+	void setReadSize(unsigned size) noexcept
 	{
-		m_onRead = std::move(handler);
+		for (auto &server : m_servers) {
+			server->setReadSize(size);
+		}
 	}
 
 	/**
-	 * Set the writing handler, called when some data has been sent to a client.
+	 * Set the maximum number of bytes read from one client per event on every reactor.
 	 *
-	 * @param handler the handler
+	 * @param limit the limit
+	 * @see StreamServer::setReadLimit
 	 */
-	inline void setWriteHandler(WriteHandler handler)
+	void setReadLimit(std::size_t limit) noexcept
 	{
-		m_onWrite = std::move(handler);
+		for (auto &server : m_servers) {
+			server->setReadLimit(limit);
+		}
 	}
 
 	/**
-	 * Set the error handler, called when unrecoverable error has occured.
+	 * Set the maximum number of released connections kept for reuse on every reactor.
 	 *
-	 * @param handler the handler
+	 * @param max the maximum (0 to disable)
+	 * @see StreamServer::setPoolSize
 	 */
-	inline void setErrorHandler(ErrorHandler handler)
+	void setPoolSize(std::size_t max)
 	{
-		m_onError = std::move(handler);
+		for (auto &server : m_servers) {
+			server->setPoolSize(max);
+		}
 	}
 
 	/**
-	 * Set the timeout handler, called when the selection has timeout.
+	 * Call a function on every reactor to apply the settings that are not forwarded, must be called before start.
 	 *
-	 * @param handler the handler
+	 * @param function the function, called with the reactor index and the reactor
 	 */
-	inline void setTimeoutHandler(TimeoutHandler handler)
+	void configure(const std::function<void (unsigned, Server &)> &function)
 	{
-		m_onTimeout = std::move(handler);
+		for (unsigned i = 0; i < m_servers.size(); ++i) {
+			function(i, *m_servers[i]);
+		}
 	}
 
 	/**
-	 * Poll for the next event.
+	 * Start one thread per reactor.
 	 *
-	 * @param timeout the timeout (-1 for indefinitely)
-	 * @throw Error on errors
+	 * @pre the servers must not be already started
 	 */
-	void poll(int timeout = -1)
+	void start()
 	{
-		try {
-			auto st = m_listener.wait(timeout);
+		assert(!m_running);
 
-			if (st.socket == m_master.handle()) {
-				/* New client */
-				processInitialAccept();
-			} else {
-				/* Recv / Send / Accept on a client */
-				auto client = m_clients[st.socket];
+		m_running = true;
 
-				if (client->socket().state() == State::Accepted) {
-					processSync(client, st.flags);
-				} else {
-					processAccept(client, [&] () { client->socket().accept(); });
+		for (auto &server : m_servers) {
+			Server *ptr = server.get();
+
+			m_threads.emplace_back([this, ptr] () {
+				while (m_running) {
+					ptr->poll(m_interval);
 				}
-			}
-		} catch (const Error &error) {
-			if (error.code() == Error::Timeout) {
-				m_onTimeout();
-			} else {
-				m_onError(error);
+			});
+		}
+	}
+
+	/**
+	 * Stop the reactors and wait for the threads to terminate.
+	 */
+	void stop()
+	{
+		m_running = false;
+
+		/* Wake up the reactors without waiting for the interval */
+		if (!m_threads.empty()) {
+			for (auto &server : m_servers) {
+				server->post(nullptr);
 			}
 		}
+
+		for (auto &thread : m_threads) {
+			thread.join();
+		}
+
+		m_threads.clear();
 	}
 };
 
+#endif // !SO_REUSEPORT
+
 /* }}} */
 
 /*
@@ -3802,6 +9105,9 @@ public:
  * @brief Client side connection to a server.
  *
  * This class is not thread safe and you must not call any of the functions from different threads.
+ *
+ * Each client waits on its own listener in poll. To drive many clients from one thread, create them with a shared
+ * listener instead, wait on it and pass each event to the client that owns the handle with dispatch.
  */
 template <typename Address, typename Protocol>
 class StreamClient {
@@ -3813,19 +9119,27 @@ public:
 
 	/**
 	 * Handler when data has been received.
+	 *
+	 * The buffer contains all the data received and not yet consumed, the handler must consume what it has
+	 * processed, the remaining data is passed again with the next received data.
 	 */
-	using ReadHandler = Callback<const std::string &>;
+	using ReadHandler = Callback<InputBuffer &>;
 
 	/**
-	 * Handler when data has been sent correctly.
+	 * Handler when data has been sent correctly, the number of bytes sent is passed.
 	 */
-	using WriteHandler = Callback<const std::string &>;
+	using WriteHandler = Callback<unsigned>;
 
 	/**
 	 * Handler when disconnected.
 	 */
 	using DisconnectionHandler = Callback<>;
 
+	/**
+	 * Handler when a datagram has been received, see openChannel.
+	 */
+	using DatagramHandler = Callback<const std::string &>;
+
 	/**
 	 * Handler on unrecoverable error.
 	 */
@@ -3842,15 +9156,41 @@ private:
 	ReadHandler m_onRead;
 	WriteHandler m_onWrite;
 	DisconnectionHandler m_onDisconnection;
+	DatagramHandler m_onDatagram;
 	ErrorHandler m_onError;
 	TimeoutHandler m_onTimeout;
 
-	/* Socket */
+	/* Socket, the listener is owned or shared with other clients */
 	Socket<Address, Protocol> m_socket;
-	Listener<> m_listener;
+	std::unique_ptr<Listener<>> m_owned;
+	Listener<> *m_listener;
+
+	/* Buffers */
+	InputBuffer m_input;
+	OutputQueue m_output;
+	unsigned m_readSize{4096};
+	std::size_t m_readLimit{65536};
+
+	/* Optional datagram channel */
+	std::unique_ptr<DatagramClient<Address>> m_datagrams;
+
+	/*
+	 * Only Tls can derive the channel opened by the server.
+	 */
+	template <typename Proto>
+	static inline std::shared_ptr<DatagramChannel> createChannel(Proto &, bool)
+	{
+		throw Error{Error::Other, "openChannel", "the channel must be given with this protocol"};
+	}
+
+#if !defined(SOCKET_NO_SSL)
+	static inline std::shared_ptr<DatagramChannel> createChannel(protocol::Tls &tls, bool encrypted)
+	{
+		auto material = tls.exportKeyingMaterial(DatagramChannel::label, DatagramChannel::materialSize);
 
-	/* Output buffer */
-	std::string m_output;
+		return DatagramChannel::derive(DatagramChannel::Side::Client, material, encrypted);
+	}
+#endif
 
 	/*
 	 * Update the flags after an uncompleted operation. This function must only be called when the operation
@@ -3860,8 +9200,8 @@ private:
 	{
 		assert(m_socket.action() != Action::None);
 
-		m_listener.remove(m_socket.handle());
-		m_listener.set(m_socket.handle(), m_socket.condition());
+		m_listener->remove(m_socket.handle());
+		m_listener->set(m_socket.handle(), m_socket.condition());
 	}
 
 	/*
@@ -3880,11 +9220,11 @@ private:
 		connectFunc();
 
 		/* Remove entirely */
-		m_listener.remove(m_socket.handle());
+		m_listener->remove(m_socket.handle());
 
 		if (m_socket.state() == State::Connected) {
 			m_onConnection();
-			m_listener.set(m_socket.handle(), Condition::Readable);
+			m_listener->set(m_socket.handle(), Condition::Readable);
 		} else {
 			/* Connection still in progress */
 			updateFlags();
@@ -3897,27 +9237,50 @@ private:
 	 */
 	void processRead()
 	{
-		auto received = m_socket.recv(512);
+		std::size_t total = 0;
+		unsigned nread;
+
+		do {
+			nread = m_socket.recv(m_input.prepare(m_readSize), m_readSize);
+			m_input.commit(nread);
+			total += nread;
+		} while (nread == m_readSize && total < m_readLimit);
+
+		/* The server may have closed just after the data, the next recv returned 0 */
+		auto disconnected = total > 0 && m_socket.state() == State::Disconnected;
 
 		if (m_socket.action() == Action::None) {
-			/* 0 means disconnection */
-			if (received.empty()) {
-				m_onDisconnection();
-			} else {
-				/*
-				 * At this step, it is possible that we were completing a receive operation, in this
-				 * case the write flag may be removed, add it if required.
-				 */
-				if (m_output.empty()) {
-					m_listener.unset(m_socket.handle(), Condition::Writable);
+			/* 0 means disconnection, unless the socket was not ready yet */
+			if (total == 0) {
+				if (m_socket.condition() == Condition::None) {
+					m_listener->remove(m_socket.handle());
+					m_onDisconnection();
 				}
 
-				m_onRead(received);
+				return;
+			}
+
+			/*
+			 * At this step, it is possible that we were completing a receive operation, in this
+			 * case the write flag may be removed, add it if required.
+			 */
+			if (m_output.empty()) {
+				m_listener->unset(m_socket.handle(), Condition::Writable);
 			}
 		} else {
 			/* Receive operation in progress */
 			updateFlags();
 		}
+
+		if (total > 0) {
+			m_onRead(m_input);
+		}
+
+		/* Deliver the data first, then stop listening like on errors */
+		if (disconnected) {
+			m_listener->remove(m_socket.handle());
+			m_onDisconnection();
+		}
 	}
 
 	/*
@@ -3929,19 +9292,16 @@ private:
 		auto nsent = m_socket.send(m_output);
 
 		if (m_socket.action() == Action::None) {
-			/* 1. Make a copy of what has been sent */
-			auto sent = m_output.substr(0, nsent);
-
-			/* 2. Erase sent content */
-			m_output.erase(0, nsent);
+			/* 1. Erase sent content */
+			m_output.consume(nsent);
 
-			/* 3. Update flags if needed */
+			/* 2. Update flags if needed */
 			if (m_output.empty()) {
-				m_listener.unset(m_socket.handle(), Condition::Writable);
+				m_listener->unset(m_socket.handle(), Condition::Writable);
 			}
 
-			/* 4. Notify user */
-			m_onWrite(sent);
+			/* 3. Notify user */
+			m_onWrite(nsent);
 		} else {
 			/* Send operation in progress */
 			updateFlags();
@@ -3961,6 +9321,22 @@ private:
 		}
 	}
 
+	/*
+	 * Receive and send the datagrams, the errors do not close the connection.
+	 */
+	void processDatagrams(bool readable) noexcept
+	{
+		try {
+			if (readable) {
+				m_datagrams->receive();
+			}
+
+			m_datagrams->flush();
+		} catch (const Error &error) {
+			m_onError(error);
+		}
+	}
+
 public:
 	/**
 	 * Create a client. The client is automatically marked as non-blocking.
@@ -3971,9 +9347,49 @@ public:
 	 */
 	StreamClient(Protocol protocol = {}, const Address &address = {})
 		: m_socket{std::move(protocol), address}
+		, m_owned{new Listener<>}
+		, m_listener{m_owned.get()}
+	{
+		m_socket.set(net::option::SockBlockMode{false});
+		m_listener->set(m_socket.handle(), Condition::Readable);
+	}
+
+	/**
+	 * Create a client using a listener shared with other clients, the events must be given to dispatch and
+	 * poll must not be called.
+	 *
+	 * @param listener the listener, must outlive the client
+	 * @param protocol the protocol (Tcp or Tls)
+	 * @param address the optional address
+	 * @throw net::Error on failures
+	 */
+	StreamClient(Listener<> &listener, Protocol protocol = {}, const Address &address = {})
+		: m_socket{std::move(protocol), address}
+		, m_listener{&listener}
 	{
 		m_socket.set(net::option::SockBlockMode{false});
-		m_listener.set(m_socket.handle(), Condition::Readable);
+		m_listener->set(m_socket.handle(), Condition::Readable);
+	}
+
+	/**
+	 * Remove the socket from a shared listener.
+	 */
+	~StreamClient()
+	{
+		if (!m_owned && m_socket.handle() != Invalid) {
+			m_listener->remove(m_socket.handle());
+		}
+	}
+
+	/**
+	 * Get the handle of the connection, the events of a shared listener for this handle must be given to
+	 * dispatch.
+	 *
+	 * @return the handle
+	 */
+	inline Handle handle() const noexcept
+	{
+		return m_socket.handle();
 	}
 
 	/**
@@ -4006,6 +9422,29 @@ public:
 		m_onRead = std::move(handler);
 	}
 
+	/**
+	 * Set the number of bytes requested to each recv call.
+	 *
+	 * @param size the size
+	 * @pre size > 0
+	 */
+	inline void setReadSize(unsigned size) noexcept
+	{
+		assert(size > 0);
+
+		m_readSize = size;
+	}
+
+	/**
+	 * Set the maximum number of bytes read per event.
+	 *
+	 * @param limit the limit
+	 */
+	inline void setReadLimit(std::size_t limit) noexcept
+	{
+		m_readLimit = limit;
+	}
+
 	/**
 	 * Set the write handler, called when we successfully sent data.
 	 *
@@ -4016,6 +9455,16 @@ public:
 		m_onWrite = std::move(handler);
 	}
 
+	/**
+	 * Set the datagram handler, called when a datagram has been received, see openChannel.
+	 *
+	 * @param handler the handler
+	 */
+	inline void setDatagramHandler(DatagramHandler handler)
+	{
+		m_onDatagram = std::move(handler);
+	}
+
 	/**
 	 * Set the error handler, called when unexpected error occurs.
 	 *
@@ -4026,6 +9475,71 @@ public:
 		m_onError = std::move(handler);
 	}
 
+	/**
+	 * Open a datagram channel with the given token and key, see StreamServer::openChannel.
+	 *
+	 * @param address the address of the server datagrams, see StreamServer::bindDatagrams
+	 * @param channel the channel, with the Side::Client side
+	 * @pre the listener must not be shared
+	 * @throw net::Error on errors
+	 */
+	void openChannel(const Address &address, std::shared_ptr<DatagramChannel> channel)
+	{
+		assert(channel && channel->side() == DatagramChannel::Side::Client);
+		assert(m_owned);
+
+		if (m_datagrams) {
+			m_listener->remove(m_datagrams->handle());
+		}
+
+		m_datagrams.reset(new DatagramClient<Address>{address, std::move(channel)});
+		m_datagrams->setReadHandler([this] (const std::string &data) {
+			m_onDatagram(data);
+		});
+		m_listener->set(m_datagrams->handle(), Condition::Readable);
+	}
+
+	/**
+	 * Open the datagram channel derived from the TLS session, the server must open it with
+	 * StreamServer::openChannel(client, encrypted) with the same encrypted value.
+	 *
+	 * An empty datagram is sent so that the server learns the address of this client.
+	 *
+	 * @param address the address of the server datagrams, see StreamServer::bindDatagrams
+	 * @param encrypted true to encrypt the datagrams
+	 * @pre the connection must be complete
+	 * @throw net::Error on errors or if the protocol is not Tls
+	 */
+	void openChannel(const Address &address, bool encrypted = true)
+	{
+		openChannel(address, createChannel(m_socket.protocol(), encrypted));
+		m_datagrams->send(nullptr, 0);
+	}
+
+	/**
+	 * Get the datagram channel.
+	 *
+	 * @return the channel or null if not opened
+	 */
+	inline std::shared_ptr<DatagramChannel> channel() const noexcept
+	{
+		return m_datagrams ? m_datagrams->channel() : nullptr;
+	}
+
+	/**
+	 * Queue a datagram, the datagrams are sent by poll.
+	 *
+	 * @param data the payload
+	 * @throw net::Error on errors
+	 * @pre openChannel must have been called
+	 */
+	void sendDatagram(const std::string &data)
+	{
+		assert(m_datagrams);
+
+		m_datagrams->send(data);
+	}
+
 	/**
 	 * Connect to a server, this function may connect immediately or not in any case the connection handler
 	 * will be called when the connection completed.
@@ -4046,11 +9560,11 @@ public:
 	 */
 	void send(std::string str)
 	{
-		m_output += str;
+		m_output.append(std::move(str));
 
 		/* Don't update the listener if there is a pending operation */
 		if (m_socket.state() == State::Connected && m_socket.action() == Action::None && !m_output.empty()) {
-			m_listener.set(m_socket.handle(), Condition::Writable);
+			m_listener->set(m_socket.handle(), Condition::Writable);
 		}
 	}
 
@@ -4062,10 +9576,42 @@ public:
 	 */
 	void poll(int timeout = -1) noexcept
 	{
+		assert(m_owned);
+
+		/* Datagrams queued since the last poll */
+		if (m_datagrams) {
+			processDatagrams(false);
+		}
+
+		ListenerStatus st;
+
 		try {
-			auto st = m_listener.wait(timeout);
+			st = m_listener->wait(timeout);
+		} catch (const Error &error) {
+			if (error.code() == Error::Timeout) {
+				m_onTimeout();
+			} else {
+				m_listener->remove(m_socket.handle());
+				m_onError(error);
+			}
 
-			if (m_socket.state() != State::Connected) {
+			return;
+		}
+
+		dispatch(st);
+	}
+
+	/**
+	 * Process one event of the listener, this is called by poll or by the owner of a shared listener.
+	 *
+	 * @param st the event, for handle()
+	 */
+	void dispatch(const ListenerStatus &st) noexcept
+	{
+		try {
+			if (m_datagrams && st.socket == m_datagrams->handle()) {
+				processDatagrams(true);
+			} else if (m_socket.state() != State::Connected) {
 				/* Continue the connection */
 				processConnect([&] () { m_socket.connect(); });
 			} else {
@@ -4073,12 +9619,8 @@ public:
 				processSync(st.flags);
 			}
 		} catch (const Error &error) {
-			if (error.code() == Error::Timeout) {
-				m_onTimeout();
-			} else {
-				m_listener.remove(m_socket.handle());
-				m_onError(error);
-			}
+			m_listener->remove(m_socket.handle());
+			m_onError(error);
 		}
 	}
 };
@@ -16,21 +16,147 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define MALIKANIA_HAVE_SSE2
+#  include <emmintrin.h>
+#  if defined(_MSC_VER)
+#    include <intrin.h>
+#  endif
+#endif
+
 #include "Util.h"
 
 namespace malikania {
 
 namespace util {
 
+namespace {
+
+#if defined(MALIKANIA_HAVE_SSE2)
+
+inline unsigned lowestBit(unsigned mask) noexcept
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+
+	_BitScanForward(&index, mask);
+
+	return static_cast<unsigned>(index);
+#else
+	return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+#endif
+
+/*
+ * Find the first \r\n\r\n in the data, returns npos if not found.
+ *
+ * With SSE2, 16 positions are tested at once by comparing the first (\r) and
+ * the last (\n) character of the delimiter, the remaining ones are only
+ * checked on candidates.
+ */
+std::size_t find(const char *data, std::size_t size) noexcept
+{
+	if (size < Framer::delimiter) {
+		return Framer::npos;
+	}
+
+	std::size_t i = 0;
+	const std::size_t last = size - Framer::delimiter;
+
+#if defined(MALIKANIA_HAVE_SSE2)
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+
+	for (; i + 16 <= last + 1; i += 16) {
+		__m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+		__m128i third = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 3));
+		unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+			_mm_and_si128(_mm_cmpeq_epi8(first, cr), _mm_cmpeq_epi8(third, lf))));
+
+		while (mask != 0) {
+			unsigned bit = lowestBit(mask);
+
+			if (data[i + bit + 1] == '\n' && data[i + bit + 2] == '\r') {
+				return i + bit;
+			}
+
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	while (i <= last) {
+		auto p = static_cast<const char *>(std::memchr(data + i, '\r', last - i + 1));
+
+		if (p == nullptr) {
+			break;
+		}
+
+		i = static_cast<std::size_t>(p - data);
+
+		if (std::memcmp(p, "\r\n\r\n", Framer::delimiter) == 0) {
+			return i;
+		}
+
+		++ i;
+	}
+
+	return Framer::npos;
+}
+
+} // !namespace
+
+constexpr std::size_t Framer::npos;
+constexpr std::size_t Framer::delimiter;
+
+std::size_t Framer::next(const char *data, std::size_t size)
+{
+	/* Restart a bit before the end of the last scan, the delimiter may be split */
+	std::size_t start = m_scanned < Framer::delimiter ? 0 : m_scanned - (Framer::delimiter - 1);
+
+	if (start > size) {
+		start = 0;
+	}
+
+	std::size_t pos = find(data + start, size - start);
+
+	if (pos == npos) {
+		if (size > m_max + delimiter - 1) {
+			m_scanned = 0;
+			throw std::length_error("message exceeds maximum size");
+		}
+
+		m_scanned = size;
+
+		return npos;
+	}
+
+	pos += start;
+	m_scanned = 0;
+
+	if (pos > m_max) {
+		throw std::length_error("message exceeds maximum size");
+	}
+
+	return pos;
+}
+
 std::vector<std::string> netsplit(std::string &input)
 {
 	std::vector<std::string> ret;
-	std::string::size_type pos;
+	Framer framer{std::numeric_limits<std::size_t>::max() - Framer::delimiter};
 
-	while ((pos = input.find("\r\n\r\n")) != std::string::npos) {
-		ret.push_back(input.substr(0U, pos));
-		input.erase(0U, pos + 4);
-	}
+	auto n = framer.split(input.data(), input.size(), [&] (const char *msg, std::size_t length) {
+		ret.emplace_back(msg, length);
+	});
+
+	input.erase(0U, n);
 
 	return ret;
 }
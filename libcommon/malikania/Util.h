@@ -24,6 +24,7 @@
  * @brief Some utilities
  */
 
+#include <cstddef>
 #include <string>
 #include <vector>
 
@@ -33,10 +34,130 @@ namespace malikania {
 
 namespace util {
 
+/**
+ * @class Framer
+ * @brief Incremental splitter for network messages
+ *
+ * This class splits a stream of network messages delimited by \r\n\r\n
+ * without copying them. It remembers how much of the pending data has already
+ * been scanned so that a message received in several chunks is never scanned
+ * twice.
+ *
+ * The data given to next() and split() must always start at the beginning of
+ * the first pending message, the caller is responsible of removing the bytes
+ * returned by split() (or the message length plus the delimiter for next())
+ * from its buffer before the next call.
+ *
+ * Example with a net::InputBuffer:
+ *
+ * @code
+ * auto n = framer.split(input.data(), input.size(), [&] (const char *msg, std::size_t length) {
+ *	handle(std::string(msg, length));
+ * });
+ *
+ * input.consume(n);
+ * @endcode
+ */
+class MALIKANIA_COMMON_EXPORT Framer {
+public:
+	/**
+	 * Value returned by next() when no message is complete.
+	 */
+	static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+	/**
+	 * Size of the delimiter.
+	 */
+	static constexpr std::size_t delimiter = 4;
+
+private:
+	std::size_t m_scanned{0};
+	std::size_t m_max;
+
+public:
+	/**
+	 * Create the framer.
+	 *
+	 * @param max the maximum message size (delimiter excluded)
+	 */
+	inline Framer(std::size_t max = 65536) noexcept
+		: m_max(max)
+	{
+	}
+
+	/**
+	 * Get the maximum message size.
+	 *
+	 * @return the size
+	 */
+	inline std::size_t max() const noexcept
+	{
+		return m_max;
+	}
+
+	/**
+	 * Set the maximum message size.
+	 *
+	 * @param max the size (delimiter excluded)
+	 */
+	inline void setMax(std::size_t max) noexcept
+	{
+		m_max = max;
+	}
+
+	/**
+	 * Forget the scanning state, must be called if the pending data is
+	 * discarded by the caller.
+	 */
+	inline void reset() noexcept
+	{
+		m_scanned = 0;
+	}
+
+	/**
+	 * Find the next complete message.
+	 *
+	 * @param data the pending data
+	 * @param size the data size
+	 * @return the message length (delimiter excluded) or npos if not complete
+	 * @throw std::length_error if the message exceeds the maximum size
+	 */
+	std::size_t next(const char *data, std::size_t size);
+
+	/**
+	 * Call a function for every complete message.
+	 *
+	 * The function is called with the message start and its length, the
+	 * message is only valid until the data is modified.
+	 *
+	 * @param data the pending data
+	 * @param size the data size
+	 * @param func the function to call
+	 * @return the number of bytes to remove from the pending data
+	 * @throw std::length_error if a message exceeds the maximum size
+	 */
+	template <typename Func>
+	std::size_t split(const char *data, std::size_t size, Func &&func)
+	{
+		std::size_t offset = 0;
+		std::size_t length;
+
+		while ((length = next(data + offset, size - offset)) != npos) {
+			func(data + offset, length);
+			offset += length + delimiter;
+		}
+
+		return offset;
+	}
+};
+
 /**
  * Split the network message buffer by \r\n\r\n and update the
  * buffer in-place.
  *
+ * The buffer is only shifted once whatever the number of messages, for
+ * repeated calls on the same growing buffer, prefer Framer.
+ *
  * @param input the buffer to split and update
  * @return the list of received message or empty if not ready
  */
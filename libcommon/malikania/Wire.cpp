@@ -0,0 +1,768 @@
+/*
+ * Wire.cpp -- network protocol encoding
+ *
+ * Copyright (c) 2013-2016 Malikania Authors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include <zlib.h>
+
+#include "Wire.h"
+
+namespace malikania {
+
+namespace wire {
+
+namespace {
+
+/*
+ * Must follow the Command order, see the network specifications.
+ */
+const std::vector<Schema> schemas{
+	{ Command::Protocol, "protocol", {
+		{ "mode", FieldType::String },
+		{ "compression", FieldType::String }
+	}},
+	{ Command::AccountCreate, "account-create", {
+		{ "login", FieldType::String },
+		{ "first-name", FieldType::String },
+		{ "last-name", FieldType::String },
+		{ "password", FieldType::String },
+		{ "email", FieldType::String }
+	}},
+	{ Command::AccountIdentify, "account-identify", {
+		{ "login", FieldType::String },
+		{ "password", FieldType::String }
+	}},
+	{ Command::CharacterCreate, "character-create", {
+		{ "nickname", FieldType::String },
+		{ "class", FieldType::String },
+		{ "gender", FieldType::String }
+	}},
+	{ Command::CharacterDelete, "character-delete", {
+		{ "id", FieldType::Int }
+	}},
+	{ Command::CharacterList, "character-list", {
+	}},
+	{ Command::CharacterSelect, "character-select", {
+		{ "id", FieldType::Int }
+	}},
+	{ Command::ExchangeAdd, "exchange-add", {
+		{ "id", FieldType::Int }
+	}},
+	{ Command::ExchangeStart, "exchange-start", {
+		{ "id", FieldType::Int }
+	}},
+	{ Command::ServerInfo, "server-info", {
+		{ "version", FieldType::Real },
+		{ "engine", FieldType::Real },
+		{ "admins", FieldType::Value },
+		{ "motd", FieldType::String },
+		{ "download", FieldType::Value }
+	}},
+	{ Command::ServerMessage, "server-message", {
+		{ "origin", FieldType::String },
+		{ "message", FieldType::String }
+	}}
+};
+
+/*
+ * Optional field of every command, after the schema fields.
+ */
+const Field request{ "request", FieldType::Int };
+
+/*
+ * Optional object with the properties that are not in the schema, after the request field.
+ */
+const Field extra{ "extra", FieldType::Value };
+
+void write(std::string &out, std::uint64_t value)
+{
+	while (value >= 0x80) {
+		out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+		value >>= 7;
+	}
+
+	out.push_back(static_cast<char>(value));
+}
+
+/*
+ * Read a varint, returns false if incomplete.
+ */
+bool read(const char *data, std::size_t size, std::size_t &position, std::uint64_t &value)
+{
+	value = 0;
+
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		if (position >= size) {
+			return false;
+		}
+
+		auto byte = static_cast<unsigned char>(data[position++]);
+
+		value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+
+		if ((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+
+	throw std::length_error("varint too long");
+}
+
+void packField(Writer &writer, const Field &field, const json::Value &value)
+{
+	switch (field.type) {
+	case FieldType::Boolean:
+		if (!value.isBool()) {
+			throw std::invalid_argument("field '" + field.name + "' must be a boolean");
+		}
+
+		writer.boolean(value.toBool());
+		break;
+	case FieldType::Int:
+		if (!value.isInt()) {
+			throw std::invalid_argument("field '" + field.name + "' must be an integer");
+		}
+
+		writer.integer(value.toInt());
+		break;
+	case FieldType::Real:
+		if (!value.isNumber()) {
+			throw std::invalid_argument("field '" + field.name + "' must be a number");
+		}
+
+		writer.real(value.isInt() ? value.toInt() : value.toReal());
+		break;
+	case FieldType::String:
+		if (!value.isString()) {
+			throw std::invalid_argument("field '" + field.name + "' must be a string");
+		}
+
+		writer.string(value.toString());
+		break;
+	case FieldType::Value:
+		writer.string(value.toJson(0));
+		break;
+	default:
+		break;
+	}
+}
+
+json::Value unpackField(Reader &reader, const Field &field)
+{
+	switch (field.type) {
+	case FieldType::Boolean:
+		return reader.boolean();
+	case FieldType::Int:
+	{
+		/* The JSON values are int, do not truncate what another writer sent */
+		auto value = reader.integer();
+
+		if (value < std::numeric_limits<int>::min() || value > std::numeric_limits<int>::max()) {
+			throw std::out_of_range("field '" + field.name + "' out of range");
+		}
+
+		return static_cast<int>(value);
+	}
+	case FieldType::Real:
+		return reader.real();
+	case FieldType::String:
+		return reader.string();
+	case FieldType::Value:
+		return json::fromString(reader.string());
+	default:
+		return nullptr;
+	}
+}
+
+/*
+ * Keys used inside the value fields, see the network specifications.
+ */
+const std::vector<std::string> keys{
+	"enabled", "sites"
+};
+
+std::string makeDictionary()
+{
+	std::string dictionary = "truefalsenull";
+
+	/* zlib favors the end of the dictionary, put the command names last */
+	for (const auto &key : keys) {
+		dictionary += "\"" + key + "\":";
+	}
+	dictionary += "\"" + request.name + "\":";
+
+	for (const auto &s : schemas) {
+		for (const auto &field : s.fields) {
+			dictionary += "\"" + field.name + "\":";
+		}
+	}
+	for (const auto &s : schemas) {
+		dictionary += "{\"command\":\"" + s.name + "\",";
+	}
+
+	return dictionary;
+}
+
+} // !namespace
+
+const Schema &schema(Command command)
+{
+	auto index = static_cast<std::size_t>(command);
+
+	if (index >= schemas.size()) {
+		throw std::invalid_argument("unknown command " + std::to_string(index));
+	}
+
+	return schemas[index];
+}
+
+const Schema *find(const std::string &name) noexcept
+{
+	for (const auto &s : schemas) {
+		if (s.name == name) {
+			return &s;
+		}
+	}
+
+	return nullptr;
+}
+
+/*
+ * Writer
+ * ------------------------------------------------------------------
+ */
+
+Writer::Writer(Command command)
+{
+	write(m_payload, static_cast<std::uint64_t>(command));
+}
+
+void Writer::varint(std::uint64_t value)
+{
+	write(m_payload, value);
+}
+
+void Writer::boolean(bool value)
+{
+	m_payload.push_back(value ? 1 : 0);
+}
+
+void Writer::integer(std::int64_t value)
+{
+	write(m_payload, (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63));
+}
+
+void Writer::real(double value)
+{
+	std::uint64_t bits;
+
+	std::memcpy(&bits, &value, sizeof (bits));
+
+	for (int i = 0; i < 8; ++i) {
+		m_payload.push_back(static_cast<char>((bits >> (i * 8)) & 0xff));
+	}
+}
+
+void Writer::string(const std::string &value)
+{
+	write(m_payload, value.size());
+	m_payload.append(value);
+}
+
+std::string Writer::finish() const
+{
+	std::string frame;
+
+	frame.reserve(m_payload.size() + 5);
+	write(frame, m_payload.size());
+	frame.append(m_payload);
+
+	return frame;
+}
+
+/*
+ * Reader
+ * ------------------------------------------------------------------
+ */
+
+void Reader::require(std::size_t length) const
+{
+	if (m_size - m_position < length) {
+		throw std::out_of_range("truncated message");
+	}
+}
+
+std::uint64_t Reader::varint()
+{
+	std::uint64_t value;
+
+	if (!read(m_data, m_size, m_position, value)) {
+		throw std::out_of_range("truncated message");
+	}
+
+	return value;
+}
+
+bool Reader::boolean()
+{
+	require(1);
+
+	return m_data[m_position++] != 0;
+}
+
+std::int64_t Reader::integer()
+{
+	auto value = varint();
+
+	return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+}
+
+double Reader::real()
+{
+	std::uint64_t bits = 0;
+	double value;
+
+	require(8);
+
+	for (int i = 0; i < 8; ++i) {
+		bits |= static_cast<std::uint64_t>(static_cast<unsigned char>(m_data[m_position++])) << (i * 8);
+	}
+
+	std::memcpy(&value, &bits, sizeof (value));
+
+	return value;
+}
+
+std::string Reader::string()
+{
+	auto length = varint();
+
+	require(length);
+
+	std::string value(m_data + m_position, length);
+
+	m_position += length;
+
+	return value;
+}
+
+/*
+ * Functions
+ * ------------------------------------------------------------------
+ */
+
+std::size_t frame(const char *data, std::size_t size, std::size_t max, Command &command, Reader &payload)
+{
+	std::size_t position = 0;
+	std::uint64_t length;
+
+	if (!read(data, size, position, length)) {
+		return 0;
+	}
+	if (length > max) {
+		throw std::length_error("message exceeds maximum size");
+	}
+	if (size - position < length) {
+		return 0;
+	}
+
+	/* The payload starts after the command id */
+	std::size_t end = position + length;
+	std::uint64_t id;
+
+	if (!read(data, end, position, id)) {
+		throw std::out_of_range("truncated message");
+	}
+
+	command = static_cast<Command>(id);
+	payload = Reader(data + position, end - position);
+
+	return end;
+}
+
+std::string pack(const json::Value &message)
+{
+	auto name = message.valueOr("command", json::Type::String, "").toString();
+	auto s = find(name);
+
+	if (s == nullptr) {
+		throw std::invalid_argument("unknown command '" + name + "'");
+	}
+
+	Writer writer(s->command);
+	std::uint64_t present = 0;
+
+	for (std::size_t i = 0; i < s->fields.size(); ++i) {
+		auto it = message.find(s->fields[i].name);
+
+		if (it != message.end() && !it->isNull()) {
+			present |= std::uint64_t(1) << i;
+		}
+	}
+
+	auto id = message.find(request.name);
+
+	if (id != message.end() && !id->isNull()) {
+		present |= std::uint64_t(1) << s->fields.size();
+	}
+
+	/* Everything else is kept as is, the message is the same as in JSON mode */
+	json::Value others(json::Type::Object);
+
+	for (auto it = message.begin(); it != message.end(); ++it) {
+		if (it.key() != "command" && it.key() != request.name &&
+		    std::none_of(s->fields.begin(), s->fields.end(), [&] (const Field &f) { return f.name == it.key(); })) {
+			others.insert(it.key(), *it);
+		}
+	}
+
+	if (others.size() > 0) {
+		present |= std::uint64_t(1) << (s->fields.size() + 1);
+	}
+
+	writer.varint(present);
+
+	for (std::size_t i = 0; i < s->fields.size(); ++i) {
+		if (present & (std::uint64_t(1) << i)) {
+			packField(writer, s->fields[i], message.at(s->fields[i].name));
+		}
+	}
+
+	if (present & (std::uint64_t(1) << s->fields.size())) {
+		packField(writer, request, *id);
+	}
+	if (present & (std::uint64_t(1) << (s->fields.size() + 1))) {
+		packField(writer, extra, others);
+	}
+
+	return writer.finish();
+}
+
+json::Value unpack(Command command, Reader &payload)
+{
+	const auto &s = schema(command);
+	auto present = payload.varint();
+	auto message = json::object({{ "command", s.name }});
+
+	for (std::size_t i = 0; i < s.fields.size(); ++i) {
+		if (present & (std::uint64_t(1) << i)) {
+			message.insert(s.fields[i].name, unpackField(payload, s.fields[i]));
+		}
+	}
+
+	if (present & (std::uint64_t(1) << s.fields.size())) {
+		message.insert(request.name, unpackField(payload, request));
+	}
+	if (present & (std::uint64_t(1) << (s.fields.size() + 1))) {
+		auto others = unpackField(payload, extra);
+
+		if (!others.isObject()) {
+			throw std::invalid_argument("field '" + extra.name + "' must be an object");
+		}
+
+		/* The schema fields are not overridden */
+		for (auto it = others.begin(); it != others.end(); ++it) {
+			if (message.find(it.key()) == message.end()) {
+				message.insert(it.key(), *it);
+			}
+		}
+	}
+
+	return message;
+}
+
+std::string encode(const json::Value &message, Mode mode)
+{
+	if (mode == Mode::Binary) {
+		return pack(message);
+	}
+
+	return message.toJson(0) + "\r\n\r\n";
+}
+
+const std::string &dictionary()
+{
+	static const std::string dictionary = makeDictionary();
+
+	return dictionary;
+}
+
+/*
+ * Deflate
+ * ------------------------------------------------------------------
+ */
+
+class Deflate::Streams {
+public:
+	z_stream deflate{};
+	z_stream inflate{};
+};
+
+Deflate::Deflate(std::size_t threshold, int level, std::string dictionary)
+	: m_streams(new Streams)
+	, m_threshold(threshold)
+	, m_dictionary(std::move(dictionary))
+	, m_statistics(schemas.size())
+{
+	/* Negative window bits, raw deflate without header nor checksum */
+	if (deflateInit2(&m_streams->deflate, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		throw std::runtime_error("could not initialize deflate");
+	}
+	if (inflateInit2(&m_streams->inflate, -15) != Z_OK) {
+		deflateEnd(&m_streams->deflate);
+		throw std::runtime_error("could not initialize inflate");
+	}
+}
+
+Deflate::~Deflate()
+{
+	deflateEnd(&m_streams->deflate);
+	inflateEnd(&m_streams->inflate);
+}
+
+DeflateStatistics *Deflate::find(std::uint64_t command) noexcept
+{
+	return command < m_statistics.size() ? &m_statistics[command] : nullptr;
+}
+
+std::string Deflate::compress(const std::string &frame)
+{
+	std::size_t position = 0;
+	std::uint64_t length, command;
+
+	if (!read(frame.data(), frame.size(), position, length) || frame.size() - position != length) {
+		throw std::invalid_argument("invalid frame");
+	}
+
+	auto body = position;
+
+	if (!read(frame.data(), frame.size(), position, command)) {
+		throw std::invalid_argument("invalid frame");
+	}
+
+	auto stats = find(command);
+
+	if (stats) {
+		stats->sent ++;
+		stats->sentRaw += length;
+	}
+
+	if (length < m_threshold) {
+		if (stats) {
+			stats->sentWire += length;
+		}
+
+		return frame;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	auto &stream = m_streams->deflate;
+
+	deflateReset(&stream);
+	deflateSetDictionary(&stream, reinterpret_cast<const Bytef *>(m_dictionary.data()), m_dictionary.size());
+
+	m_buffer.resize(deflateBound(&stream, length));
+	stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(frame.data() + body));
+	stream.avail_in = length;
+	stream.next_out = reinterpret_cast<Bytef *>(&m_buffer[0]);
+	stream.avail_out = m_buffer.size();
+
+	auto result = deflate(&stream, Z_FINISH);
+	auto compressed = m_buffer.size() - stream.avail_out;
+
+	/* Command id, original length and the data */
+	std::string inner;
+
+	if (result == Z_STREAM_END) {
+		write(inner, static_cast<std::uint64_t>(Command::Compressed));
+		write(inner, length);
+		inner.append(m_buffer, 0, compressed);
+	}
+
+	if (stats) {
+		stats->deflateTime += std::chrono::steady_clock::now() - start;
+	}
+
+	if (inner.empty() || inner.size() >= length) {
+		if (stats) {
+			stats->sentWire += length;
+		}
+
+		return frame;
+	}
+
+	std::string out;
+
+	out.reserve(inner.size() + 5);
+	write(out, inner.size());
+	out.append(inner);
+
+	if (stats) {
+		stats->deflated ++;
+		stats->sentWire += inner.size();
+	}
+
+	return out;
+}
+
+std::size_t Deflate::frame(const char *data, std::size_t size, std::size_t max, Command &command, Reader &payload)
+{
+	auto length = wire::frame(data, size, max, command, payload);
+
+	if (length == 0) {
+		return 0;
+	}
+
+	/* Length of the frame without the length itself */
+	std::size_t position = 0;
+	std::uint64_t body;
+
+	read(data, size, position, body);
+
+	if (command != Command::Compressed) {
+		auto stats = find(static_cast<std::uint64_t>(command));
+
+		if (stats) {
+			stats->received ++;
+			stats->receivedRaw += body;
+			stats->receivedWire += body;
+		}
+
+		return length;
+	}
+
+	auto original = payload.varint();
+
+	if (original > max) {
+		throw std::length_error("message exceeds maximum size");
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	auto &stream = m_streams->inflate;
+	auto offset = length - payload.remaining();
+
+	inflateReset(&stream);
+	inflateSetDictionary(&stream, reinterpret_cast<const Bytef *>(m_dictionary.data()), m_dictionary.size());
+
+	m_buffer.resize(original);
+	stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data + offset));
+	stream.avail_in = payload.remaining();
+	stream.next_out = reinterpret_cast<Bytef *>(&m_buffer[0]);
+	stream.avail_out = m_buffer.size();
+
+	if (inflate(&stream, Z_FINISH) != Z_STREAM_END || stream.avail_out != 0 || stream.avail_in != 0) {
+		throw std::invalid_argument("invalid compressed frame");
+	}
+
+	/* The original frame starts with its command id */
+	std::uint64_t id;
+
+	position = 0;
+
+	if (!read(m_buffer.data(), m_buffer.size(), position, id)) {
+		throw std::out_of_range("truncated message");
+	}
+	if (static_cast<Command>(id) == Command::Compressed) {
+		throw std::invalid_argument("invalid compressed frame");
+	}
+
+	command = static_cast<Command>(id);
+	payload = Reader(m_buffer.data() + position, m_buffer.size() - position);
+
+	auto stats = find(id);
+
+	if (stats) {
+		stats->received ++;
+		stats->inflated ++;
+		stats->receivedRaw += original;
+		stats->receivedWire += body;
+		stats->inflateTime += std::chrono::steady_clock::now() - start;
+	}
+
+	return length;
+}
+
+const DeflateStatistics &Deflate::statistics(Command command) const
+{
+	auto index = static_cast<std::size_t>(command);
+
+	if (index >= m_statistics.size()) {
+		throw std::invalid_argument("unknown command " + std::to_string(index));
+	}
+
+	return m_statistics[index];
+}
+
+DeflateStatistics Deflate::total() const noexcept
+{
+	DeflateStatistics total;
+
+	for (const auto &s : m_statistics) {
+		total.sent += s.sent;
+		total.deflated += s.deflated;
+		total.sentRaw += s.sentRaw;
+		total.sentWire += s.sentWire;
+		total.deflateTime += s.deflateTime;
+		total.received += s.received;
+		total.inflated += s.inflated;
+		total.receivedRaw += s.receivedRaw;
+		total.receivedWire += s.receivedWire;
+		total.inflateTime += s.inflateTime;
+	}
+
+	return total;
+}
+
+/*
+ * Decoder
+ * ------------------------------------------------------------------
+ */
+
+std::size_t Decoder::next(const char *data, std::size_t size, json::Value &message)
+{
+	if (m_mode == Mode::Binary) {
+		Command command;
+		Reader payload;
+		std::size_t length = m_deflate
+			? m_deflate->frame(data, size, m_framer.max(), command, payload)
+			: frame(data, size, m_framer.max(), command, payload);
+
+		if (length != 0) {
+			message = unpack(command, payload);
+		}
+
+		return length;
+	}
+
+	std::size_t length = m_framer.next(data, size);
+
+	if (length == util::Framer::npos) {
+		return 0;
+	}
+
+	message = json::fromString(std::string(data, length));
+
+	return length + util::Framer::delimiter;
+}
+
+} // !wire
+
+} // !malikania
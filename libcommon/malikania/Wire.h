@@ -0,0 +1,622 @@
+/*
+ * Wire.h -- network protocol encoding
+ *
+ * Copyright (c) 2013-2016 Malikania Authors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _MALIKANIA_WIRE_H_
+#define _MALIKANIA_WIRE_H_
+
+/**
+ * @file Wire.h
+ * @brief Network protocol encoding, JSON or binary
+ *
+ * The network commands can be exchanged either as JSON messages terminated by
+ * an empty line or as binary frames. The binary mode is negotiated with the
+ * protocol command, see the network specifications.
+ *
+ * A binary frame is made of:
+ *
+ * - the frame length as a varint, command id included,
+ * - the command id as a varint,
+ * - a varint bitmask of the fields present, in the schema order,
+ * - the present fields packed in the schema order.
+ *
+ * Every command also accepts an optional "request" integer, packed after the
+ * schema fields. It correlates a response with its request, see
+ * RequestClient. The properties that are not in the schema, like the
+ * character list of a response, are packed last in an optional "extra"
+ * object so that nothing is lost compared to the JSON mode.
+ *
+ * In binary mode, large frames may also be compressed with deflate and a
+ * preset dictionary, see Deflate.
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Common.h"
+#include "Json.h"
+#include "Util.h"
+
+namespace malikania {
+
+/**
+ * Network protocol namespace.
+ */
+namespace wire {
+
+/**
+ * @enum Mode
+ * @brief Encoding used on a connection
+ */
+enum class Mode {
+	Json,		//!< JSON messages terminated by an empty line (default)
+	Binary		//!< Length prefixed binary frames
+};
+
+/**
+ * @enum Command
+ * @brief Command identifiers, they are part of the protocol and must never be reordered
+ */
+enum class Command : std::uint16_t {
+	Protocol = 0,		//!< protocol
+	AccountCreate = 1,	//!< account-create
+	AccountIdentify = 2,	//!< account-identify
+	CharacterCreate = 3,	//!< character-create
+	CharacterDelete = 4,	//!< character-delete
+	CharacterList = 5,	//!< character-list
+	CharacterSelect = 6,	//!< character-select
+	ExchangeAdd = 7,	//!< exchange-add
+	ExchangeStart = 8,	//!< exchange-start
+	ServerInfo = 9,		//!< server-info
+	ServerMessage = 10,	//!< server-message
+	Compressed = 127	//!< compressed frame, not a command (see Deflate)
+};
+
+/**
+ * @enum FieldType
+ * @brief How a field is packed
+ */
+enum class FieldType {
+	Boolean,	//!< one byte
+	Int,		//!< zig-zag varint
+	Real,		//!< IEEE 754 double, little endian
+	String,		//!< varint length followed by the bytes
+	Value		//!< any JSON value, packed as a compact JSON string
+};
+
+/**
+ * @class Field
+ * @brief Field description
+ */
+class Field {
+public:
+	std::string name;	//!< the JSON property name
+	FieldType type;		//!< the packed type
+};
+
+/**
+ * @class Schema
+ * @brief Command description
+ */
+class Schema {
+public:
+	Command command;		//!< the command id
+	std::string name;		//!< the JSON command name
+	std::vector<Field> fields;	//!< the fields in the packed order
+};
+
+/**
+ * Get the schema of a command.
+ *
+ * @param command the command
+ * @return the schema
+ * @throw std::invalid_argument if the command is unknown
+ */
+MALIKANIA_COMMON_EXPORT const Schema &schema(Command command);
+
+/**
+ * Find a schema by its JSON name.
+ *
+ * @param name the command name
+ * @return the schema or nullptr if not found
+ */
+MALIKANIA_COMMON_EXPORT const Schema *find(const std::string &name) noexcept;
+
+/**
+ * @class Writer
+ * @brief Build a binary frame
+ *
+ * This can be used directly for high frequency commands to avoid building
+ * json::Value objects.
+ */
+class MALIKANIA_COMMON_EXPORT Writer {
+private:
+	std::string m_payload;
+
+public:
+	/**
+	 * Start a frame for the given command.
+	 *
+	 * @param command the command id
+	 */
+	Writer(Command command);
+
+	/**
+	 * Append an unsigned varint.
+	 *
+	 * @param value the value
+	 */
+	void varint(std::uint64_t value);
+
+	/**
+	 * Append a boolean.
+	 *
+	 * @param value the value
+	 */
+	void boolean(bool value);
+
+	/**
+	 * Append a signed integer.
+	 *
+	 * @param value the value
+	 */
+	void integer(std::int64_t value);
+
+	/**
+	 * Append a real.
+	 *
+	 * @param value the value
+	 */
+	void real(double value);
+
+	/**
+	 * Append a string.
+	 *
+	 * @param value the value
+	 */
+	void string(const std::string &value);
+
+	/**
+	 * Get the complete frame, length included.
+	 *
+	 * @return the frame
+	 */
+	std::string finish() const;
+};
+
+/**
+ * @class Reader
+ * @brief Read the fields of a binary frame
+ *
+ * The reader does not own the data.
+ */
+class MALIKANIA_COMMON_EXPORT Reader {
+private:
+	const char *m_data{nullptr};
+	std::size_t m_size{0};
+	std::size_t m_position{0};
+
+	void require(std::size_t length) const;
+
+public:
+	/**
+	 * Create an empty reader.
+	 */
+	Reader() = default;
+
+	/**
+	 * Create a reader on the payload.
+	 *
+	 * @param data the payload
+	 * @param size the payload size
+	 */
+	inline Reader(const char *data, std::size_t size) noexcept
+		: m_data(data)
+		, m_size(size)
+	{
+	}
+
+	/**
+	 * Check if all the payload has been read.
+	 *
+	 * @return true if at end
+	 */
+	inline bool atEnd() const noexcept
+	{
+		return m_position == m_size;
+	}
+
+	/**
+	 * Get the number of bytes not read yet.
+	 *
+	 * @return the remaining size
+	 */
+	inline std::size_t remaining() const noexcept
+	{
+		return m_size - m_position;
+	}
+
+	/**
+	 * Read an unsigned varint.
+	 *
+	 * @return the value
+	 * @throw std::out_of_range if the payload is truncated
+	 */
+	std::uint64_t varint();
+
+	/**
+	 * Read a boolean.
+	 *
+	 * @return the value
+	 * @throw std::out_of_range if the payload is truncated
+	 */
+	bool boolean();
+
+	/**
+	 * Read a signed integer.
+	 *
+	 * @return the value
+	 * @throw std::out_of_range if the payload is truncated
+	 */
+	std::int64_t integer();
+
+	/**
+	 * Read a real.
+	 *
+	 * @return the value
+	 * @throw std::out_of_range if the payload is truncated
+	 */
+	double real();
+
+	/**
+	 * Read a string.
+	 *
+	 * @return the value
+	 * @throw std::out_of_range if the payload is truncated
+	 */
+	std::string string();
+};
+
+/**
+ * Extract the next binary frame.
+ *
+ * @param data the pending data
+ * @param size the data size
+ * @param max the maximum frame length
+ * @param command the command id (set on success)
+ * @param payload the payload reader (set on success)
+ * @return the number of bytes of the frame or 0 if not complete
+ * @throw std::length_error if the frame exceeds max
+ */
+MALIKANIA_COMMON_EXPORT std::size_t frame(const char *data, std::size_t size, std::size_t max, Command &command, Reader &payload);
+
+/**
+ * Pack a JSON command as a binary frame.
+ *
+ * The null schema fields are omitted, the properties that are not in the
+ * schema are packed as is in the extra field.
+ *
+ * @param message the message, must have a known "command" property
+ * @return the frame
+ * @throw std::invalid_argument if the command is unknown or a field has a wrong type
+ */
+MALIKANIA_COMMON_EXPORT std::string pack(const json::Value &message);
+
+/**
+ * Unpack a binary payload into a JSON command.
+ *
+ * @param command the command id
+ * @param payload the payload
+ * @return the message
+ * @throw std::invalid_argument if the command is unknown or the extra field is not an object
+ * @throw std::out_of_range if the payload is truncated or an integer does not fit in an int
+ */
+MALIKANIA_COMMON_EXPORT json::Value unpack(Command command, Reader &payload);
+
+/**
+ * Encode a message for the given mode.
+ *
+ * @param message the message
+ * @param mode the mode
+ * @return the data to send
+ * @throw std::invalid_argument in binary mode, see pack
+ */
+MALIKANIA_COMMON_EXPORT std::string encode(const json::Value &message, Mode mode);
+
+/**
+ * Get the preset dictionary for the compressed frames.
+ *
+ * It is built from the command names, the field names of the schemas and the
+ * keys of their value fields. Both sides must use the same one, changing it
+ * is a protocol change.
+ *
+ * @return the dictionary
+ */
+MALIKANIA_COMMON_EXPORT const std::string &dictionary();
+
+/**
+ * @class DeflateStatistics
+ * @brief Bandwidth and time spent in compression for one command
+ *
+ * The bytes are counted without the frame length, in both directions the
+ * raw size is the uncompressed frame and the wire size is what was actually
+ * transmitted.
+ */
+class DeflateStatistics {
+public:
+	std::uint64_t sent{0};				//!< frames encoded
+	std::uint64_t deflated{0};			//!< frames sent compressed
+	std::uint64_t sentRaw{0};			//!< bytes before compression
+	std::uint64_t sentWire{0};			//!< bytes sent
+	std::chrono::nanoseconds deflateTime{0};	//!< time spent compressing
+
+	std::uint64_t received{0};			//!< frames decoded
+	std::uint64_t inflated{0};			//!< frames received compressed
+	std::uint64_t receivedRaw{0};			//!< bytes after decompression
+	std::uint64_t receivedWire{0};			//!< bytes received
+	std::chrono::nanoseconds inflateTime{0};	//!< time spent decompressing
+
+	/**
+	 * Get the ratio of bytes sent over the uncompressed size.
+	 *
+	 * @return the ratio, 1 if nothing was sent
+	 */
+	inline double ratio() const noexcept
+	{
+		return sentRaw == 0 ? 1.0 : static_cast<double>(sentWire) / static_cast<double>(sentRaw);
+	}
+};
+
+/**
+ * @class Deflate
+ * @brief Per-message compression of binary frames
+ *
+ * Every frame is compressed independently with raw deflate and the preset
+ * dictionary, so frames can be decoded in any order and no window is kept
+ * between messages. Frames smaller than the threshold or that would not be
+ * smaller once compressed are sent unchanged.
+ *
+ * A compressed frame uses the Compressed command id followed by the size of
+ * the original frame as a varint and the deflate data. The original frame
+ * does not include its length.
+ *
+ * The compression is negotiated with the compression field of the protocol
+ * command and one object is used per connection for both directions. It is
+ * not thread safe.
+ */
+class MALIKANIA_COMMON_EXPORT Deflate {
+private:
+	class Streams;
+
+	std::unique_ptr<Streams> m_streams;
+	std::size_t m_threshold;
+	std::string m_dictionary;
+	std::string m_buffer;
+	std::vector<DeflateStatistics> m_statistics;
+
+	DeflateStatistics *find(std::uint64_t command) noexcept;
+
+public:
+	/**
+	 * Create the compression streams.
+	 *
+	 * @param threshold the minimum frame size to compress
+	 * @param level the zlib compression level
+	 * @param dictionary the preset dictionary
+	 * @throw std::runtime_error if zlib can not be initialized
+	 */
+	Deflate(std::size_t threshold = 256, int level = 6, std::string dictionary = wire::dictionary());
+
+	/**
+	 * Release the streams.
+	 */
+	~Deflate();
+
+	/**
+	 * Get the threshold.
+	 *
+	 * @return the minimum frame size to compress
+	 */
+	inline std::size_t threshold() const noexcept
+	{
+		return m_threshold;
+	}
+
+	/**
+	 * Set the threshold.
+	 *
+	 * @param threshold the minimum frame size to compress
+	 */
+	inline void setThreshold(std::size_t threshold) noexcept
+	{
+		m_threshold = threshold;
+	}
+
+	/**
+	 * Compress a frame if it is worth it.
+	 *
+	 * @param frame the complete frame, as returned by pack or Writer::finish
+	 * @return the frame to send
+	 */
+	std::string compress(const std::string &frame);
+
+	/**
+	 * Pack and compress a JSON command.
+	 *
+	 * @param message the message
+	 * @return the frame to send
+	 * @throw std::invalid_argument see pack
+	 */
+	inline std::string encode(const json::Value &message)
+	{
+		return compress(pack(message));
+	}
+
+	/**
+	 * Extract the next frame, decompressing it if needed.
+	 *
+	 * For a compressed frame, the payload refers to an internal buffer that is
+	 * valid until the next call.
+	 *
+	 * @param data the pending data
+	 * @param size the data size
+	 * @param max the maximum frame length, compressed or not
+	 * @param command the command id (set on success)
+	 * @param payload the payload reader (set on success)
+	 * @return the number of bytes of the frame or 0 if not complete
+	 * @throw std::length_error if a frame exceeds max
+	 * @throw std::invalid_argument if the compressed data is invalid
+	 * @throw std::out_of_range if the frame is truncated
+	 */
+	std::size_t frame(const char *data, std::size_t size, std::size_t max, Command &command, Reader &payload);
+
+	/**
+	 * Get the statistics of a command.
+	 *
+	 * @param command the command
+	 * @return the statistics
+	 * @throw std::invalid_argument if the command is unknown
+	 */
+	const DeflateStatistics &statistics(Command command) const;
+
+	/**
+	 * Get the statistics of all commands.
+	 *
+	 * @return the sum
+	 */
+	DeflateStatistics total() const noexcept;
+};
+
+/**
+ * @class Decoder
+ * @brief Split incoming data into messages for the current mode
+ *
+ * Like util::Framer, the data must always start at the first pending message
+ * and the caller removes the bytes returned by split().
+ *
+ * The mode may be changed from the split() callback, the remaining data is
+ * then decoded with the new mode. This is how the protocol command is
+ * applied.
+ */
+class MALIKANIA_COMMON_EXPORT Decoder {
+private:
+	Mode m_mode;
+	util::Framer m_framer;
+	std::shared_ptr<Deflate> m_deflate;
+
+public:
+	/**
+	 * Create the decoder.
+	 *
+	 * @param mode the initial mode
+	 * @param max the maximum message size
+	 */
+	inline Decoder(Mode mode = Mode::Json, std::size_t max = 65536) noexcept
+		: m_mode(mode)
+		, m_framer(max)
+	{
+	}
+
+	/**
+	 * Get the current mode.
+	 *
+	 * @return the mode
+	 */
+	inline Mode mode() const noexcept
+	{
+		return m_mode;
+	}
+
+	/**
+	 * Change the mode for the next messages.
+	 *
+	 * @param mode the mode
+	 */
+	inline void setMode(Mode mode) noexcept
+	{
+		m_mode = mode;
+		m_framer.reset();
+	}
+
+	/**
+	 * Get the compression.
+	 *
+	 * @return the compression or nullptr if not negotiated
+	 */
+	inline const std::shared_ptr<Deflate> &deflate() const noexcept
+	{
+		return m_deflate;
+	}
+
+	/**
+	 * Accept compressed frames in binary mode.
+	 *
+	 * The same object should be used to encode the messages sent on the
+	 * connection.
+	 *
+	 * @param deflate the compression or nullptr to refuse compressed frames
+	 */
+	inline void setDeflate(std::shared_ptr<Deflate> deflate) noexcept
+	{
+		m_deflate = std::move(deflate);
+	}
+
+	/**
+	 * Decode the next message.
+	 *
+	 * @param data the pending data
+	 * @param size the data size
+	 * @param message the message (set on success)
+	 * @return the number of bytes used or 0 if not complete
+	 * @throw json::Error, std::length_error, std::invalid_argument or std::out_of_range on invalid data
+	 */
+	std::size_t next(const char *data, std::size_t size, json::Value &message);
+
+	/**
+	 * Call a function for every complete message.
+	 *
+	 * @param data the pending data
+	 * @param size the data size
+	 * @param func the function to call with the json::Value
+	 * @return the number of bytes to remove from the pending data
+	 * @throw same as next
+	 */
+	template <typename Func>
+	std::size_t split(const char *data, std::size_t size, Func &&func)
+	{
+		std::size_t offset = 0;
+		std::size_t length;
+		json::Value message;
+
+		while ((length = next(data + offset, size - offset, message)) != 0) {
+			offset += length;
+			func(std::move(message));
+		}
+
+		return offset;
+	}
+};
+
+} // !wire
+
+} // !malikania
+
+#endif // !_MALIKANIA_WIRE_H_
@@ -0,0 +1,636 @@
+/*
+ * main.cpp -- loopback load generator for StreamServer
+ *
+ * Copyright (c) 2013-2016 Malikania Authors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if !defined(_WIN32)
+#  include <sys/resource.h>
+#endif
+
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <malikania/RequestClient.h>
+
+using namespace malikania;
+
+using namespace std::chrono;
+
+namespace {
+
+/*
+ * Options
+ * ------------------------------------------------------------------
+ */
+
+class Options {
+public:
+	unsigned connections{1000};
+	unsigned threads{4};
+	unsigned window{1};
+	unsigned duration{10};
+	std::uint16_t port{16900};
+	bool tls{false};
+	wire::Mode mode{wire::Mode::Json};
+	std::string script;
+};
+
+void usage()
+{
+	std::cerr << "usage: malikania-loadgen [-b] [-c connections] [-d seconds] [-p port] [-s script]" << std::endl;
+	std::cerr << "                         [-t threads] [-T] [-w window]" << std::endl;
+	std::exit(1);
+}
+
+unsigned number(const char *arg)
+{
+	try {
+		return std::stoul(arg);
+	} catch (...) {
+		usage();
+	}
+
+	return 0;
+}
+
+Options parse(int argc, char **argv)
+{
+	Options options;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+
+		if (arg == "-b") {
+			options.mode = wire::Mode::Binary;
+		} else if (arg == "-T") {
+			options.tls = true;
+		} else if (i + 1 < argc && arg == "-c") {
+			options.connections = number(argv[++i]);
+		} else if (i + 1 < argc && arg == "-d") {
+			options.duration = number(argv[++i]);
+		} else if (i + 1 < argc && arg == "-p") {
+			options.port = static_cast<std::uint16_t>(number(argv[++i]));
+		} else if (i + 1 < argc && arg == "-s") {
+			options.script = argv[++i];
+		} else if (i + 1 < argc && arg == "-t") {
+			options.threads = number(argv[++i]);
+		} else if (i + 1 < argc && arg == "-w") {
+			options.window = number(argv[++i]);
+		} else {
+			usage();
+		}
+	}
+
+	if (options.connections == 0 || options.threads == 0 || options.window == 0) {
+		usage();
+	}
+
+	options.threads = std::min(options.threads, options.connections);
+
+	return options;
+}
+
+/*
+ * Script
+ * ------------------------------------------------------------------
+ *
+ * A script is a JSON array of commands, each one may have a "weight" property
+ * to send it more often than the others (default: 1).
+ */
+
+class Script {
+public:
+	std::vector<json::Value> commands;
+	std::vector<double> weights;
+};
+
+/*
+ * The default mix follows a player session, see the network specifications.
+ */
+const char *mix = R"([
+	{ "command": "account-identify", "login": "player", "password": "secret", "weight": 1 },
+	{ "command": "character-list", "weight": 2 },
+	{ "command": "character-select", "id": 1, "weight": 2 },
+	{ "command": "exchange-start", "id": 2, "weight": 1 },
+	{ "command": "exchange-add", "id": 3, "weight": 4 }
+])";
+
+Script load(const Options &options)
+{
+	auto value = options.script.empty() ? json::fromString(mix) : json::fromFile(options.script);
+	Script script;
+
+	if (!value.isArray() || value.size() == 0) {
+		throw std::invalid_argument("the script must be a non empty array of commands");
+	}
+
+	for (auto command : value) {
+		if (!command.isObject() || wire::find(command.valueOr("command", json::Type::String, "").toString()) == nullptr) {
+			throw std::invalid_argument("invalid command in script: " + command.toJson(0));
+		}
+
+		script.weights.push_back(command.valueOr("weight", json::Type::Int, 1).toInt());
+		command.erase("weight");
+		script.commands.push_back(std::move(command));
+	}
+
+	return script;
+}
+
+/*
+ * Histogram
+ * ------------------------------------------------------------------
+ *
+ * Latencies in microseconds, exact below 64 us then 32 buckets per power of
+ * two, so the error is at most 1/32 of the value.
+ */
+
+class Histogram {
+private:
+	static constexpr unsigned linear = 64;
+	static constexpr unsigned buckets = 32;
+
+	std::vector<std::uint64_t> m_counts = std::vector<std::uint64_t>(linear + 58 * buckets);
+	std::uint64_t m_total{0};
+	std::uint64_t m_min{UINT64_MAX};
+	std::uint64_t m_max{0};
+
+	static unsigned index(std::uint64_t value) noexcept
+	{
+		if (value < linear) {
+			return static_cast<unsigned>(value);
+		}
+
+		unsigned msb = 63;
+
+		while ((value & (std::uint64_t(1) << msb)) == 0) {
+			msb --;
+		}
+
+		auto shift = msb - 5;
+
+		return linear + (msb - 6) * buckets + static_cast<unsigned>((value >> shift) - buckets);
+	}
+
+	static std::uint64_t upper(unsigned index) noexcept
+	{
+		if (index < linear) {
+			return index;
+		}
+
+		auto shift = (index - linear) / buckets + 1;
+		auto sub = (index - linear) % buckets + buckets;
+
+		return ((sub + 1) << shift) - 1;
+	}
+
+public:
+	void add(std::uint64_t value) noexcept
+	{
+		m_counts[index(value)] ++;
+		m_total ++;
+		m_min = std::min(m_min, value);
+		m_max = std::max(m_max, value);
+	}
+
+	void merge(const Histogram &other) noexcept
+	{
+		for (std::size_t i = 0; i < m_counts.size(); ++i) {
+			m_counts[i] += other.m_counts[i];
+		}
+
+		m_total += other.m_total;
+		m_min = std::min(m_min, other.m_min);
+		m_max = std::max(m_max, other.m_max);
+	}
+
+	std::uint64_t total() const noexcept
+	{
+		return m_total;
+	}
+
+	std::uint64_t min() const noexcept
+	{
+		return m_total == 0 ? 0 : m_min;
+	}
+
+	std::uint64_t max() const noexcept
+	{
+		return m_max;
+	}
+
+	/*
+	 * Upper bound of the bucket containing the percentile, never above the maximum seen.
+	 */
+	std::uint64_t percentile(double p) const noexcept
+	{
+		auto rank = static_cast<std::uint64_t>(p * m_total + 0.5);
+		std::uint64_t count = 0;
+
+		rank = std::max<std::uint64_t>(rank, 1);
+
+		for (unsigned i = 0; i < m_counts.size(); ++i) {
+			count += m_counts[i];
+
+			if (count >= rank) {
+				return std::min(upper(i), m_max);
+			}
+		}
+
+		return m_max;
+	}
+};
+
+/*
+ * Results of a client thread.
+ */
+class Results {
+public:
+	Histogram latency;
+	std::vector<Histogram> commands;
+	unsigned connected{0};
+	unsigned failures{0};
+	unsigned disconnections{0};
+	unsigned errors{0};
+};
+
+/*
+ * Server
+ * ------------------------------------------------------------------
+ *
+ * Echo every command with its request id, in its own thread.
+ */
+
+/*
+ * Self signed certificate for the Tls server, kept in memory.
+ */
+class Credentials {
+public:
+	std::string key;
+	std::string certificate;
+};
+
+std::string pem(const std::function<int (BIO *)> &write)
+{
+	std::unique_ptr<BIO, void (*)(BIO *)> bio{BIO_new(BIO_s_mem()), BIO_free_all};
+	char *data = nullptr;
+
+	if (!bio || !write(bio.get())) {
+		throw std::runtime_error("could not generate the certificate");
+	}
+
+	auto length = BIO_get_mem_data(bio.get(), &data);
+
+	return std::string(data, length);
+}
+
+Credentials generate()
+{
+	std::unique_ptr<EVP_PKEY_CTX, void (*)(EVP_PKEY_CTX *)> ctx{EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr), EVP_PKEY_CTX_free};
+	EVP_PKEY *raw = nullptr;
+
+	EVP_PKEY_keygen_init(ctx.get());
+	EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx.get(), NID_X9_62_prime256v1);
+	EVP_PKEY_keygen(ctx.get(), &raw);
+
+	std::unique_ptr<EVP_PKEY, void (*)(EVP_PKEY *)> pkey{raw, EVP_PKEY_free};
+	std::unique_ptr<X509, void (*)(X509 *)> x509{X509_new(), X509_free};
+
+	X509_set_version(x509.get(), 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x509.get()), 1);
+	X509_gmtime_adj(X509_getm_notBefore(x509.get()), 0);
+	X509_gmtime_adj(X509_getm_notAfter(x509.get()), 3600);
+	X509_set_pubkey(x509.get(), pkey.get());
+
+	auto name = X509_get_subject_name(x509.get());
+
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char *>("localhost"), -1, -1, 0);
+	X509_set_issuer_name(x509.get(), name);
+	X509_sign(x509.get(), pkey.get(), EVP_sha256());
+
+	Credentials credentials;
+
+	credentials.key = pem([&] (BIO *bio) {
+		return PEM_write_bio_PrivateKey(bio, pkey.get(), nullptr, nullptr, 0, nullptr, nullptr);
+	});
+	credentials.certificate = pem([&] (BIO *bio) {
+		return PEM_write_bio_X509(bio, x509.get());
+	});
+
+	return credentials;
+}
+
+template <typename Protocol>
+void serve(net::StreamServer<net::address::Ip, Protocol> &server, wire::Mode mode, const std::atomic<bool> &running)
+{
+	using Connection = net::StreamConnection<net::address::Ip, Protocol>;
+
+	std::unordered_map<const Connection *, wire::Decoder> decoders;
+
+	server.setConnectionHandler([&] (const std::shared_ptr<Connection> &connection) {
+		decoders.emplace(connection.get(), wire::Decoder{mode});
+	});
+	server.setDisconnectionHandler([&] (const std::shared_ptr<Connection> &connection) {
+		decoders.erase(connection.get());
+	});
+	server.setReadHandler([&] (const std::shared_ptr<Connection> &connection, net::InputBuffer &input) {
+		auto &decoder = decoders[connection.get()];
+
+		input.consume(decoder.split(input.data(), input.size(), [&] (json::Value message) {
+			connection->send(wire::encode(message, mode));
+		}));
+	});
+
+	try {
+		while (running) {
+			server.poll(50);
+		}
+	} catch (const net::Error &error) {
+		std::cerr << "server: " << error.what() << std::endl;
+	}
+}
+
+/*
+ * Clients
+ * ------------------------------------------------------------------
+ */
+
+/*
+ * All the clients of a thread share one listener, the thread only wakes up when one of them is ready.
+ */
+template <typename Protocol>
+void run(const Options &options, const std::function<Protocol ()> &factory, unsigned count, Script script, unsigned seed,
+	 steady_clock::time_point end, Results &results)
+{
+	using Client = wire::RequestClient<net::address::Ip, Protocol>;
+
+	class Slot {
+	public:
+		std::unique_ptr<Client> client;
+		unsigned inflight{0};
+		bool connected{false};
+		bool closed{false};
+	};
+
+	net::Listener<> listener;
+	std::vector<Slot> slots(count);
+	std::unordered_map<net::Handle, Slot *> handles;
+	std::mt19937 random{seed};
+	std::discrete_distribution<std::size_t> choose(script.weights.begin(), script.weights.end());
+
+	results.commands.resize(script.commands.size());
+
+	/* Keep the window full, the responses are received by dispatch */
+	auto fill = [&] (Slot &slot) {
+		while (!slot.closed && slot.connected && slot.inflight < options.window) {
+			auto index = choose(random);
+			auto start = steady_clock::now();
+			auto ptr = &slot;
+
+			slot.inflight ++;
+			slot.client->request(script.commands[index], [ptr, index, start, &results] (const json::Value &) {
+				auto latency = duration_cast<microseconds>(steady_clock::now() - start).count();
+
+				ptr->inflight --;
+				results.latency.add(latency);
+				results.commands[index].add(latency);
+			}, [ptr, &results] (const net::Error &) {
+				ptr->inflight --;
+				results.failures ++;
+			});
+		}
+	};
+
+	for (auto &slot : slots) {
+		auto ptr = &slot;
+
+		slot.client.reset(new Client{listener, factory()});
+		slot.client->decoder().setMode(options.mode);
+		slot.client->setTimeout(seconds{10});
+		slot.client->client().setConnectionHandler([ptr, &results] () {
+			ptr->connected = true;
+			results.connected ++;
+		});
+		slot.client->setDisconnectionHandler([ptr, &results] () {
+			ptr->closed = true;
+			results.disconnections ++;
+		});
+		slot.client->setErrorHandler([ptr, &results] (const net::Error &) {
+			ptr->closed = true;
+			results.errors ++;
+		});
+		slot.client->client().connect(net::address::Ip{"127.0.0.1", options.port});
+		handles.emplace(slot.client->client().handle(), ptr);
+		fill(slot);
+	}
+
+	auto timeouts = steady_clock::now();
+
+	while (listener.size() > 0) {
+		auto now = steady_clock::now();
+
+		if (now >= end) {
+			break;
+		}
+
+		std::vector<net::ListenerStatus> events;
+
+		try {
+			events = listener.waitMultiple(static_cast<int>(std::min<long long>(100, duration_cast<milliseconds>(end - now).count() + 1)));
+		} catch (const net::Error &error) {
+			if (error.code() != net::Error::Timeout) {
+				results.errors ++;
+				break;
+			}
+		}
+
+		for (const auto &st : events) {
+			auto it = handles.find(st.socket);
+
+			if (it != handles.end() && !it->second->closed) {
+				it->second->client->dispatch(st);
+				fill(*it->second);
+			}
+		}
+
+		/* Request timeouts of the clients without events */
+		if (steady_clock::now() - timeouts >= milliseconds{100}) {
+			for (auto &slot : slots) {
+				slot.client->advance();
+			}
+
+			timeouts = steady_clock::now();
+		}
+	}
+}
+
+template <typename Protocol>
+void start(const Options &options, Protocol protocol, std::function<Protocol ()> factory, const Script &script, std::vector<Results> &results)
+{
+	std::atomic<bool> running{true};
+	std::vector<std::thread> threads;
+
+	net::StreamServer<net::address::Ip, Protocol> server{std::move(protocol), net::address::Ip{"127.0.0.1", options.port}, 4096};
+	std::thread thread([&] () {
+		serve(server, options.mode, running);
+	});
+
+	auto end = steady_clock::now() + seconds{options.duration};
+
+	for (unsigned i = 0; i < options.threads; ++i) {
+		auto count = options.connections / options.threads + (i < options.connections % options.threads ? 1 : 0);
+
+		threads.emplace_back(run<Protocol>, std::cref(options), std::cref(factory), count, script, i + 1, end, std::ref(results[i]));
+	}
+
+	for (auto &t : threads) {
+		t.join();
+	}
+
+	running = false;
+	thread.join();
+}
+
+void raiseLimit(const Options &options)
+{
+#if !defined(_WIN32)
+	/* One socket per client, plus the server side */
+	rlimit limit;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < options.connections * 2 + 64) {
+		std::cerr << "warning: the open files limit (" << limit.rlim_cur << ") is too low for "
+			  << options.connections << " connections" << std::endl;
+	}
+#else
+	(void)options;
+#endif
+}
+
+void print(const std::string &name, const Histogram &histogram, double seconds)
+{
+	std::cout << std::left << std::setw(18) << name << std::right
+		  << std::setw(10) << histogram.total()
+		  << std::setw(12) << std::fixed << std::setprecision(1) << histogram.total() / seconds
+		  << std::setw(8) << histogram.min()
+		  << std::setw(8) << histogram.percentile(0.5)
+		  << std::setw(8) << histogram.percentile(0.99)
+		  << std::setw(8) << histogram.percentile(0.999)
+		  << std::setw(8) << histogram.max() << std::endl;
+}
+
+} // !namespace
+
+int main(int argc, char **argv)
+{
+	auto options = parse(argc, argv);
+
+	try {
+		auto script = load(options);
+		std::vector<Results> results(options.threads);
+
+		raiseLimit(options);
+		net::init();
+
+		std::cout << "malikania-loadgen: " << options.connections << " " << (options.tls ? "tls" : "tcp")
+			  << " connections, " << options.threads << " threads, window " << options.window << ", "
+			  << (options.mode == wire::Mode::Binary ? "binary" : "json") << ", "
+			  << options.duration << " s" << std::endl;
+
+		if (options.tls) {
+			net::protocol::Tls tls;
+			auto credentials = generate();
+
+			tls.setMethod(net::ssl::Tlsv1);
+			tls.setCertificateData(credentials.certificate);
+			tls.setPrivateKeyData(credentials.key);
+			tls.setVerify(false);
+
+			start<net::protocol::Tls>(options, std::move(tls), [] () {
+				net::protocol::Tls tls;
+
+				tls.setMethod(net::ssl::Tlsv1);
+
+				return tls;
+			}, script, results);
+		} else {
+			start<net::protocol::Tcp>(options, net::protocol::Tcp{}, [] () {
+				return net::protocol::Tcp{};
+			}, script, results);
+		}
+
+		/* Merge the threads */
+		Results total;
+
+		total.commands.resize(script.commands.size());
+
+		for (const auto &r : results) {
+			total.latency.merge(r.latency);
+			total.connected += r.connected;
+			total.failures += r.failures;
+			total.disconnections += r.disconnections;
+			total.errors += r.errors;
+
+			for (std::size_t i = 0; i < r.commands.size(); ++i) {
+				total.commands[i].merge(r.commands[i]);
+			}
+		}
+
+		std::cout << "connected: " << total.connected << "/" << options.connections
+			  << ", failed requests: " << total.failures
+			  << ", disconnections: " << total.disconnections
+			  << ", errors: " << total.errors << std::endl << std::endl;
+		std::cout << std::left << std::setw(18) << "command" << std::right
+			  << std::setw(10) << "requests" << std::setw(12) << "req/s"
+			  << std::setw(8) << "min" << std::setw(8) << "p50" << std::setw(8) << "p99"
+			  << std::setw(8) << "p999" << std::setw(8) << "max" << "  (us)" << std::endl;
+
+		for (std::size_t i = 0; i < script.commands.size(); ++i) {
+			print(script.commands[i]["command"].toString(), total.commands[i], options.duration);
+		}
+
+		print("total", total.latency, options.duration);
+
+		if (total.latency.total() == 0 || total.connected != options.connections || total.failures != 0) {
+			return 1;
+		}
+	} catch (const std::exception &ex) {
+		std::cerr << "abort: " << ex.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
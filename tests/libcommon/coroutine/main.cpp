@@ -0,0 +1,398 @@
+/*
+ * main.cpp -- test coroutines
+ *
+ * Copyright (c) 2013-2016 Malikania Authors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <gtest/gtest.h>
+
+#include <malikania/Coroutines.h>
+
+using namespace malikania;
+using namespace malikania::net;
+
+namespace {
+
+const std::string key{"test-coroutine-key.pem"};
+const std::string certificate{"test-coroutine-certificate.pem"};
+
+/*
+ * Generate a self signed certificate, no files are shipped with the tests.
+ */
+void generate()
+{
+	std::unique_ptr<EVP_PKEY_CTX, void (*)(EVP_PKEY_CTX *)> ctx{EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr), EVP_PKEY_CTX_free};
+	EVP_PKEY *raw = nullptr;
+
+	EVP_PKEY_keygen_init(ctx.get());
+	EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx.get(), NID_X9_62_prime256v1);
+	EVP_PKEY_keygen(ctx.get(), &raw);
+
+	std::unique_ptr<EVP_PKEY, void (*)(EVP_PKEY *)> pkey{raw, EVP_PKEY_free};
+	std::unique_ptr<X509, void (*)(X509 *)> x509{X509_new(), X509_free};
+
+	X509_set_version(x509.get(), 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x509.get()), 1);
+	X509_gmtime_adj(X509_getm_notBefore(x509.get()), 0);
+	X509_gmtime_adj(X509_getm_notAfter(x509.get()), 3600);
+	X509_set_pubkey(x509.get(), pkey.get());
+
+	auto name = X509_get_subject_name(x509.get());
+
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char *>("localhost"), -1, -1, 0);
+	X509_set_issuer_name(x509.get(), name);
+	X509_sign(x509.get(), pkey.get(), EVP_sha256());
+
+	std::FILE *fp;
+
+	fp = std::fopen(key.c_str(), "w");
+	PEM_write_PrivateKey(fp, pkey.get(), nullptr, nullptr, 0, nullptr, nullptr);
+	std::fclose(fp);
+
+	fp = std::fopen(certificate.c_str(), "w");
+	PEM_write_X509(fp, x509.get());
+	std::fclose(fp);
+}
+
+/*
+ * Non-blocking listening socket.
+ */
+template <typename Protocol>
+Socket<address::Ip, Protocol> listen(Protocol protocol, std::uint16_t port)
+{
+	Socket<address::Ip, Protocol> master{std::move(protocol), address::Ip{}};
+
+	master.set(option::SockReuseAddress{true});
+	master.bind(address::Ip{"127.0.0.1", port});
+	master.listen();
+	master.set(option::SockBlockMode{false});
+
+	return master;
+}
+
+/*
+ * Echo until the client disconnects, Tls reports it as an error.
+ */
+template <typename Protocol>
+Task<> echo(Reactor<> &reactor, Socket<address::Ip, Protocol> client)
+{
+	char buffer[512];
+	unsigned n;
+
+	try {
+		while ((n = co_await reactor.recv(client, buffer, sizeof (buffer))) > 0) {
+			co_await reactor.send(client, buffer, n);
+		}
+	} catch (const Error &) {
+	}
+}
+
+template <typename Protocol>
+Task<> serve(Reactor<> &reactor, Socket<address::Ip, Protocol> &master, unsigned count)
+{
+	for (unsigned i = 0; i < count; ++i) {
+		reactor.spawn(echo(reactor, co_await reactor.accept(master)));
+	}
+}
+
+/*
+ * Read exactly length bytes.
+ */
+template <typename Protocol>
+Task<std::string> read(Reactor<> &reactor, Socket<address::Ip, Protocol> &socket, unsigned length)
+{
+	std::string result(length, '\0');
+	unsigned total = 0;
+
+	while (total < length) {
+		auto n = co_await reactor.recv(socket, &result[total], length - total);
+
+		if (n == 0) {
+			throw std::runtime_error("disconnected");
+		}
+
+		total += n;
+	}
+
+	co_return result;
+}
+
+template <typename Protocol>
+Task<> client(Reactor<> &reactor, Protocol protocol, std::uint16_t port, std::string message, unsigned rounds, std::string &received)
+{
+	Socket<address::Ip, Protocol> socket{std::move(protocol), address::Ip{}};
+
+	socket.set(option::SockBlockMode{false});
+	co_await reactor.connect(socket, address::Ip{"127.0.0.1", port});
+
+	for (unsigned i = 0; i < rounds; ++i) {
+		co_await reactor.send(socket, message);
+		received = co_await read(reactor, socket, message.size());
+	}
+}
+
+template <typename Predicate>
+void run(Reactor<> &reactor, Predicate done)
+{
+	auto end = std::chrono::steady_clock::now() + std::chrono::seconds{10};
+
+	while (!done() && std::chrono::steady_clock::now() < end) {
+		reactor.poll(10);
+	}
+}
+
+} // !namespace
+
+/*
+ * Task
+ * ------------------------------------------------------------------
+ */
+
+namespace {
+
+Task<int> add(int x, int y)
+{
+	co_return x + y;
+}
+
+Task<int> sum(int count)
+{
+	int total = 0;
+
+	for (int i = 0; i < count; ++i) {
+		total += co_await add(total, 1);
+	}
+
+	co_return total;
+}
+
+Task<> fail()
+{
+	co_await add(1, 2);
+
+	throw std::runtime_error("failed");
+}
+
+Task<> check(int &result, bool &caught)
+{
+	result = co_await sum(10);
+
+	try {
+		co_await fail();
+	} catch (const std::runtime_error &) {
+		caught = true;
+	}
+}
+
+} // !namespace
+
+TEST(Task, values)
+{
+	Reactor<> reactor;
+	int result = 0;
+	bool caught = false;
+
+	/* No socket involved, complete before spawn returns */
+	reactor.spawn(check(result, caught));
+
+	ASSERT_EQ(1023, result);
+	ASSERT_TRUE(caught);
+	ASSERT_EQ(0U, reactor.running());
+}
+
+TEST(Task, spawnedException)
+{
+	Reactor<> reactor;
+
+	reactor.spawn(fail());
+
+	try {
+		reactor.poll(0);
+		FAIL() << "expected the exception of the task";
+	} catch (const std::runtime_error &ex) {
+		ASSERT_STREQ("failed", ex.what());
+	}
+
+	/* Reported once */
+	reactor.poll(0);
+}
+
+TEST(Task, framePool)
+{
+	Reactor<> reactor;
+	int result = 0;
+	bool caught = false;
+
+	reactor.spawn(check(result, caught));
+
+	auto allocated = FramePool::local().allocated();
+	auto reused = FramePool::local().reused();
+
+	for (int i = 0; i < 100; ++i) {
+		reactor.spawn(check(result, caught));
+	}
+
+	ASSERT_EQ(allocated, FramePool::local().allocated());
+	ASSERT_LT(reused, FramePool::local().reused());
+}
+
+/*
+ * Reactor
+ * ------------------------------------------------------------------
+ */
+
+TEST(Reactor, echo)
+{
+	Reactor<> reactor;
+	auto master = listen(protocol::Tcp{}, 16530);
+	std::string first, second;
+
+	reactor.spawn(serve(reactor, master, 2));
+	reactor.spawn(client(reactor, protocol::Tcp{}, 16530, "hello", 3, first));
+	reactor.spawn(client(reactor, protocol::Tcp{}, 16530, std::string(100000, 'a'), 3, second));
+
+	/* The two echo tasks remain until the clients disconnect */
+	run(reactor, [&] () { return reactor.running() == 0; });
+
+	ASSERT_EQ(0U, reactor.running());
+	ASSERT_EQ(0U, reactor.size());
+	ASSERT_EQ("hello", first);
+	ASSERT_EQ(std::string(100000, 'a'), second);
+}
+
+TEST(Reactor, tls)
+{
+	Reactor<> reactor;
+	protocol::Tls server, tls;
+
+	generate();
+	server.setMethod(ssl::Sslv3);
+	server.setCertificate(certificate);
+	server.setPrivateKey(key);
+	server.setVerify(false);
+	tls.setMethod(ssl::Sslv3);
+
+	auto master = listen(std::move(server), 16531);
+	std::string received;
+
+	std::remove(key.c_str());
+	std::remove(certificate.c_str());
+
+	reactor.spawn(serve(reactor, master, 1));
+	reactor.spawn(client(reactor, std::move(tls), 16531, std::string(50000, 'x'), 2, received));
+
+	run(reactor, [&] () { return reactor.running() == 0; });
+
+	ASSERT_EQ(0U, reactor.running());
+	ASSERT_EQ(std::string(50000, 'x'), received);
+}
+
+TEST(Reactor, pending)
+{
+	Reactor<> reactor;
+	auto master = listen(protocol::Tcp{}, 16532);
+
+	/* Two accepts on the same socket */
+	reactor.spawn(serve(reactor, master, 1));
+
+	try {
+		reactor.spawn(serve(reactor, master, 1));
+		reactor.poll(0);
+		FAIL() << "expected an error";
+	} catch (const Error &error) {
+		ASSERT_EQ(Error::Other, error.code());
+	}
+
+	/* The first task is destroyed with the reactor */
+	ASSERT_EQ(1U, reactor.running());
+	ASSERT_EQ(1U, reactor.size());
+}
+
+TEST(Reactor, destroyPending)
+{
+	Reactor<> reactor;
+	auto master = listen(protocol::Tcp{}, 16534);
+	SocketTcpIp socket{protocol::Tcp{}, address::Ip{}};
+
+	socket.connect(address::Ip{"127.0.0.1", 16534});
+	socket.set(option::SockBlockMode{false});
+
+	auto peer = master.accept(nullptr);
+
+	{
+		auto task = read(reactor, socket, 4);
+
+		/* Start it by hand so that it is owned here, it suspends in recv */
+		task.operator co_await().await_suspend(std::noop_coroutine()).resume();
+
+		ASSERT_FALSE(task.done());
+		ASSERT_EQ(1U, reactor.size());
+		ASSERT_EQ(1U, reactor.listener().size());
+	}
+
+	/* The operation is gone with the task */
+	ASSERT_EQ(0U, reactor.size());
+	ASSERT_EQ(0U, reactor.listener().size());
+
+	peer.set(option::SockBlockMode{true});
+	peer.send("abcd");
+
+	ASSERT_EQ(0U, reactor.poll(100));
+}
+
+/*
+ * Benchmark, ping pong of small messages on one connection.
+ */
+TEST(Reactor, benchmark)
+{
+	constexpr unsigned rounds = 20000;
+
+	Reactor<> reactor;
+	auto master = listen(protocol::Tcp{}, 16533);
+	std::string received;
+
+	reactor.spawn(serve(reactor, master, 1));
+
+	auto allocated = FramePool::local().allocated();
+	auto start = std::chrono::steady_clock::now();
+
+	reactor.spawn(client(reactor, protocol::Tcp{}, 16533, "ping", rounds, received));
+	run(reactor, [&] () { return reactor.running() == 0; });
+
+	auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+	std::cout << "coroutines: " << rounds << " round trips in " << elapsed.count() << " us, "
+		  << (FramePool::local().allocated() - allocated) << " frames allocated" << std::endl;
+
+	ASSERT_EQ("ping", received);
+}
+
+int main(int argc, char **argv)
+{
+	testing::InitGoogleTest(&argc, argv);
+
+	return RUN_ALL_TESTS();
+}
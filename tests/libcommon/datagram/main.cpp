@@ -0,0 +1,315 @@
+/*
+ * main.cpp -- test DatagramChannel, DatagramServer and DatagramClient
+ *
+ * Copyright (c) 2013-2016 Malikania Authors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <malikania/Sockets.h>
+
+using namespace malikania;
+using namespace malikania::net;
+
+using Server = StreamServer<address::Ip, protocol::Tcp>;
+using Client = StreamClient<address::Ip, protocol::Tcp>;
+using Connection = StreamConnection<address::Ip, protocol::Tcp>;
+
+/*
+ * Two channels exchanging packets in memory.
+ */
+class TestDatagramChannel : public testing::Test {
+protected:
+	std::string m_key{std::string(DatagramChannel::keySize, 'k')};
+	DatagramChannel m_server{DatagramChannel::Side::Server, 42};
+	DatagramChannel m_client{DatagramChannel::Side::Client, 42};
+	std::string m_packet;
+	std::string m_payload;
+};
+
+TEST_F(TestDatagramChannel, roundTrip)
+{
+	ASSERT_EQ(1U, m_client.encode("position", 8, m_packet));
+	ASSERT_EQ(DatagramChannel::headerSize + 8, m_packet.size());
+	ASSERT_EQ(42U, DatagramChannel::token(m_packet.data()));
+	ASSERT_TRUE(m_server.decode(m_packet.data(), m_packet.size(), m_payload));
+	ASSERT_EQ("position", m_payload);
+	ASSERT_EQ(2U, m_client.sequence());
+}
+
+TEST_F(TestDatagramChannel, duplicated)
+{
+	std::vector<std::string> packets(40);
+
+	for (auto &packet : packets) {
+		m_client.encode("a", 1, packet);
+	}
+
+	/* Out of order is accepted, the same packet twice or too late is not */
+	ASSERT_TRUE(m_server.decode(packets[35].data(), packets[35].size(), m_payload));
+	ASSERT_TRUE(m_server.decode(packets[30].data(), packets[30].size(), m_payload));
+	ASSERT_FALSE(m_server.decode(packets[30].data(), packets[30].size(), m_payload));
+	ASSERT_FALSE(m_server.decode(packets[35].data(), packets[35].size(), m_payload));
+	ASSERT_FALSE(m_server.decode(packets[2].data(), packets[2].size(), m_payload));
+	ASSERT_TRUE(m_server.decode(packets[39].data(), packets[39].size(), m_payload));
+	ASSERT_EQ(3U, m_server.statistics().received);
+	ASSERT_EQ(3U, m_server.statistics().duplicated);
+}
+
+TEST_F(TestDatagramChannel, rejected)
+{
+	DatagramChannel other{DatagramChannel::Side::Client, 43};
+
+	other.encode("a", 1, m_packet);
+
+	ASSERT_FALSE(m_server.decode(m_packet.data(), m_packet.size(), m_payload));
+	ASSERT_FALSE(m_server.decode(m_packet.data(), DatagramChannel::headerSize - 1, m_payload));
+	ASSERT_EQ(2U, m_server.statistics().rejected);
+}
+
+TEST_F(TestDatagramChannel, acks)
+{
+	std::vector<std::uint32_t> acked;
+
+	m_client.setAckHandler([&] (std::uint32_t sequence) {
+		acked.push_back(sequence);
+	});
+
+	/* The second packet is lost */
+	for (int i = 0; i < 3; ++i) {
+		m_client.encode("a", 1, m_packet);
+
+		if (i != 1) {
+			m_server.decode(m_packet.data(), m_packet.size(), m_payload);
+		}
+	}
+
+	/* Any packet of the server acknowledges what it has received */
+	m_server.encode("b", 1, m_packet);
+	m_client.decode(m_packet.data(), m_packet.size(), m_payload);
+
+	ASSERT_EQ(2U, acked.size());
+	ASSERT_EQ(3U, acked[0]);
+	ASSERT_EQ(1U, acked[1]);
+
+	/* Acknowledged only once */
+	m_server.encode("b", 1, m_packet);
+	m_client.decode(m_packet.data(), m_packet.size(), m_payload);
+
+	ASSERT_EQ(2U, m_client.statistics().acked);
+	ASSERT_EQ(0U, m_client.statistics().lost);
+}
+
+TEST_F(TestDatagramChannel, lost)
+{
+	/* 10 packets lost followed by 40 received */
+	for (int i = 0; i < 50; ++i) {
+		m_client.encode("a", 1, m_packet);
+
+		if (i >= 10) {
+			m_server.decode(m_packet.data(), m_packet.size(), m_payload);
+		}
+	}
+
+	m_server.encode("b", 1, m_packet);
+	m_client.decode(m_packet.data(), m_packet.size(), m_payload);
+
+	/* The 33 last are acknowledged, the older ones can not be anymore even if they were received */
+	ASSERT_EQ(33U, m_client.statistics().acked);
+	ASSERT_EQ(17U, m_client.statistics().lost);
+}
+
+TEST_F(TestDatagramChannel, encrypted)
+{
+	DatagramChannel server{DatagramChannel::Side::Server, 42, m_key};
+	DatagramChannel client{DatagramChannel::Side::Client, 42, m_key};
+
+	client.encode("position", 8, m_packet);
+
+	ASSERT_EQ(DatagramChannel::headerSize + 8 + DatagramChannel::tagSize, m_packet.size());
+	ASSERT_EQ(std::string::npos, m_packet.find("position"));
+
+	/* A tampered packet, header or payload, is rejected without changing the state */
+	auto tampered = m_packet;
+
+	tampered[DatagramChannel::headerSize] ^= 1;
+	ASSERT_FALSE(server.decode(tampered.data(), tampered.size(), m_payload));
+
+	tampered = m_packet;
+	tampered[12] ^= 1;
+	ASSERT_FALSE(server.decode(tampered.data(), tampered.size(), m_payload));
+
+	ASSERT_TRUE(server.decode(m_packet.data(), m_packet.size(), m_payload));
+	ASSERT_EQ("position", m_payload);
+	ASSERT_EQ(2U, server.statistics().rejected);
+
+	/* Packets encrypted by the same side are not accepted */
+	DatagramChannel other{DatagramChannel::Side::Server, 42, m_key};
+
+	other.encode("a", 1, m_packet);
+	other.encode("a", 1, m_packet);
+	ASSERT_FALSE(server.decode(m_packet.data(), m_packet.size(), m_payload));
+
+	/* Empty payloads are authenticated too */
+	server.encode(nullptr, 0, m_packet);
+	ASSERT_TRUE(client.decode(m_packet.data(), m_packet.size(), m_payload));
+	ASSERT_TRUE(m_payload.empty());
+}
+
+TEST_F(TestDatagramChannel, derive)
+{
+	auto material = std::string(DatagramChannel::materialSize, 'm');
+	auto server = DatagramChannel::derive(DatagramChannel::Side::Server, material);
+	auto client = DatagramChannel::derive(DatagramChannel::Side::Client, material);
+
+	ASSERT_EQ(server->token(), client->token());
+	ASSERT_EQ(server->key(), client->key());
+	ASSERT_TRUE(server->encrypted());
+	ASSERT_FALSE(DatagramChannel::derive(DatagramChannel::Side::Server, material, false)->encrypted());
+	ASSERT_THROW(DatagramChannel::derive(DatagramChannel::Side::Server, "short"), Error);
+	ASSERT_THROW(DatagramChannel(DatagramChannel::Side::Server, 1, "short"), Error);
+}
+
+TEST(DatagramServer, batch)
+{
+	auto channel = DatagramChannel::random(DatagramChannel::Side::Server);
+	auto copy = std::make_shared<DatagramChannel>(DatagramChannel::Side::Client, channel->token(), channel->key());
+
+	DatagramServer<address::Ip> server{address::Ip{"127.0.0.1", 16700}, 16};
+	DatagramClient<address::Ip> client{address::Ip{"127.0.0.1", 16700}, copy};
+	DatagramClient<address::Ip> stranger{address::Ip{"127.0.0.1", 16700}, DatagramChannel::random(DatagramChannel::Side::Client)};
+	unsigned received = 0, replies = 0;
+
+	server.add(channel);
+	server.setReadHandler([&] (const std::shared_ptr<DatagramChannel> &ch, const std::string &data) {
+		if (ch == channel && data == "update") {
+			received ++;
+		}
+	});
+	client.setReadHandler([&] (const std::string &data) {
+		if (data == "reply") {
+			replies ++;
+		}
+	});
+
+	/* The address of the client is not known yet */
+	ASSERT_FALSE(server.send(*channel, "reply"));
+
+	/* More packets than the batch size, one flush may need several system calls */
+	for (int i = 0; i < 100; ++i) {
+		client.send("update");
+	}
+
+	stranger.send("update");
+	stranger.flush();
+	client.flush();
+
+	for (int i = 0; i < 100 && received < 100; ++i) {
+		server.receive();
+		std::this_thread::sleep_for(std::chrono::milliseconds{1});
+	}
+
+	ASSERT_EQ(100U, received);
+	ASSERT_EQ(1U, server.unknown());
+	ASSERT_TRUE(server.connected(channel->token()));
+
+	for (int i = 0; i < 10; ++i) {
+		ASSERT_TRUE(server.send(*channel, "reply"));
+	}
+
+	ASSERT_EQ(10U, server.flush());
+
+	for (int i = 0; i < 100 && replies < 10; ++i) {
+		client.receive();
+		std::this_thread::sleep_for(std::chrono::milliseconds{1});
+	}
+
+	ASSERT_EQ(10U, replies);
+}
+
+/*
+ * The token and key are given by the server over the stream connection, like an application would do without Tls.
+ */
+TEST(DatagramStream, channel)
+{
+	Server server{protocol::Tcp{}, address::Ip{"127.0.0.1", 16701}};
+	std::unique_ptr<Client> client{new Client{protocol::Tcp{}, address::Ip{}}};
+	std::shared_ptr<Connection> connection;
+	std::string received, reply;
+	bool disconnected = false;
+
+	server.bindDatagrams(address::Ip{"127.0.0.1", 16701});
+	server.setConnectionHandler([&] (const std::shared_ptr<Connection> &c) {
+		connection = c;
+	});
+	server.setDisconnectionHandler([&] (const std::shared_ptr<Connection> &) {
+		disconnected = true;
+	});
+	server.setDatagramHandler([&] (const std::shared_ptr<Connection> &c, const std::string &data) {
+		received = data;
+		server.sendDatagram(c, "pong");
+	});
+	client->setDatagramHandler([&] (const std::string &data) {
+		reply = data;
+	});
+	client->connect(address::Ip{"127.0.0.1", 16701});
+
+	for (int i = 0; i < 100 && !connection; ++i) {
+		server.poll(10);
+		client->poll(10);
+	}
+
+	ASSERT_TRUE(connection != nullptr);
+
+	auto channel = server.openChannel(connection);
+
+	ASSERT_EQ(channel, server.openChannel(connection));
+	ASSERT_EQ(1U, server.datagrams()->size());
+
+	client->openChannel(address::Ip{"127.0.0.1", 16701},
+		std::make_shared<DatagramChannel>(DatagramChannel::Side::Client, channel->token(), channel->key()));
+	client->sendDatagram("ping");
+
+	for (int i = 0; i < 100 && reply.empty(); ++i) {
+		client->poll(10);
+		server.poll(10);
+	}
+
+	ASSERT_EQ("ping", received);
+	ASSERT_EQ("pong", reply);
+
+	/* The channel is closed with the connection */
+	client = nullptr;
+
+	for (int i = 0; i < 100 && !disconnected; ++i) {
+		server.poll(10);
+	}
+
+	ASSERT_TRUE(disconnected);
+	ASSERT_EQ(0U, server.datagrams()->size());
+}
+
+int main(int argc, char **argv)
+{
+	testing::InitGoogleTest(&argc, argv);
+
+	return RUN_ALL_TESTS();
+}
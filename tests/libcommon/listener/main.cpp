@@ -0,0 +1,378 @@
+/*
+ * main.cpp -- test Listener backends
+ *
+ * Copyright (c) 2013-2016 Malikania Authors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <set>
+#include <type_traits>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <malikania/Sockets.h>
+
+#if !defined(_WIN32)
+#  include <sys/resource.h>
+#endif
+
+using namespace malikania;
+using namespace malikania::net;
+
+#if !defined(_WIN32)
+
+namespace {
+
+/*
+ * Set of UDP sockets bound on the loopback, one datagram makes a socket readable. They use only one descriptor
+ * each so that 10000 sockets fit in the usual limits.
+ */
+class Sockets {
+public:
+	std::vector<Handle> listened;
+	std::vector<sockaddr_in> addresses;
+	Handle sender;
+
+	Handle create()
+	{
+		Handle h = ::socket(AF_INET, SOCK_DGRAM, 0);
+
+		if (h < 0) {
+			throw Error{Error::System, "socket"};
+		}
+
+		return h;
+	}
+
+	Sockets(unsigned count)
+		: sender(create())
+	{
+		for (unsigned i = 0; i < count; ++i) {
+			sockaddr_in sin{};
+			socklen_t length = sizeof (sin);
+
+			sin.sin_family = AF_INET;
+			sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+			listened.push_back(create());
+
+			if (::bind(listened.back(), reinterpret_cast<sockaddr *>(&sin), sizeof (sin)) < 0 ||
+			    ::getsockname(listened.back(), reinterpret_cast<sockaddr *>(&sin), &length) < 0) {
+				throw Error{Error::System, "bind"};
+			}
+
+			addresses.push_back(sin);
+		}
+	}
+
+	~Sockets()
+	{
+		for (auto h : listened) {
+			::close(h);
+		}
+
+		::close(sender);
+	}
+
+	void ready(unsigned index)
+	{
+		::sendto(sender, "a", 1, 0, reinterpret_cast<const sockaddr *>(&addresses[index]), sizeof (sockaddr_in));
+	}
+};
+
+template <typename Backend>
+void checkBackend()
+{
+	Sockets sockets(8);
+	Listener<Backend> listener;
+
+	for (auto h : sockets.listened) {
+		listener.set(h, Condition::Readable);
+	}
+
+	/* Remove in the middle and at the end to move entries around */
+	listener.remove(sockets.listened[2]);
+	listener.remove(sockets.listened[7]);
+	listener.set(sockets.listened[2], Condition::Readable);
+	listener.set(sockets.listened[5], Condition::Writable);
+	listener.unset(sockets.listened[5], Condition::Readable);
+
+	for (unsigned i : { 2U, 3U, 7U }) {
+		sockets.ready(i);
+	}
+
+	std::set<Handle> ready;
+
+	for (const auto &st : listener.waitMultiple(1000)) {
+		ready.insert(st.socket);
+
+		if (st.socket == sockets.listened[5]) {
+			ASSERT_EQ(Condition::Writable, st.flags);
+		} else {
+			ASSERT_EQ(Condition::Readable, st.flags);
+		}
+	}
+
+	ASSERT_EQ(7U, listener.size());
+	ASSERT_EQ((std::set<Handle>{sockets.listened[2], sockets.listened[3], sockets.listened[5]}), ready);
+
+	/* Readable to Writable on a socket already applied, still readable */
+	listener.assign(sockets.listened[3], Condition::Writable);
+
+	for (const auto &st : listener.waitMultiple(1000)) {
+		if (st.socket == sockets.listened[3]) {
+			ASSERT_EQ(Condition::Writable, st.flags);
+		}
+	}
+}
+
+} // !namespace
+
+TEST(Backend, select)
+{
+	checkBackend<Select>();
+}
+
+#if defined(SOCKET_HAVE_POLL)
+
+TEST(Backend, poll)
+{
+	checkBackend<Poll>();
+}
+
+#endif
+
+#if defined(SOCKET_HAVE_EPOLL)
+
+TEST(Backend, epoll)
+{
+	checkBackend<Epoll>();
+}
+
+#endif
+
+#if defined(SOCKET_HAVE_IO_URING)
+
+TEST(Backend, iouring)
+{
+	checkBackend<IoUring>();
+}
+
+TEST(Backend, iouringStale)
+{
+	Sockets sockets(2);
+	Listener<IoUring> listener;
+
+	listener.set(sockets.listened[0], Condition::Readable);
+	listener.set(sockets.listened[1], Condition::Readable);
+
+	/* Arm both requests */
+	try {
+		listener.waitMultiple(0);
+	} catch (const Error &) {
+	}
+
+	/* Only the cancellation completes in the next wait, it must not end it */
+	listener.remove(sockets.listened[0]);
+
+	auto start = std::chrono::steady_clock::now();
+
+	try {
+		listener.waitMultiple(200);
+		FAIL() << "expected a timeout";
+	} catch (const Error &error) {
+		ASSERT_EQ(Error::Timeout, error.code());
+	}
+
+	ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds{190});
+}
+
+#endif
+
+#if defined(SOCKET_HAVE_KQUEUE)
+
+TEST(Backend, kqueue)
+{
+	checkBackend<Kqueue>();
+}
+
+#endif
+
+TEST(Listener, coalesce)
+{
+	Sockets sockets(2);
+	Listener<> listener;
+
+	listener.set(sockets.listened[0], Condition::Readable);
+	listener.set(sockets.listened[1], Condition::Readable);
+
+	/* Toggled several times between two waits */
+	for (int i = 0; i < 30; ++i) {
+		listener.set(sockets.listened[0], Condition::Writable);
+		listener.unset(sockets.listened[0], Condition::Writable);
+	}
+
+	listener.set(sockets.listened[0], Condition::Writable);
+	listener.flush();
+
+	/* One add for each socket */
+	ASSERT_EQ(2U, listener.calls());
+	ASSERT_EQ(63U, listener.requests());
+	ASSERT_EQ(61U, listener.saved());
+
+	/* Removal is applied immediately */
+	listener.remove(sockets.listened[1]);
+
+	ASSERT_EQ(3U, listener.calls());
+	ASSERT_EQ(1U, listener.size());
+
+	/* Readable | Writable to Writable only */
+	listener.assign(sockets.listened[0], Condition::Writable);
+	sockets.ready(0);
+
+	auto events = listener.waitMultiple(1000);
+
+	ASSERT_EQ(4U, listener.calls());
+	ASSERT_EQ(1U, events.size());
+	ASSERT_EQ(Condition::Writable, events[0].flags);
+}
+
+TEST(Listener, flip)
+{
+	Sockets sockets(1);
+	Listener<> listener;
+
+	listener.set(sockets.listened[0], Condition::Readable);
+	listener.flush();
+
+	auto before = listener.calls();
+
+	/* The usual Tls want write, one modification instead of an unset and a set */
+	listener.assign(sockets.listened[0], Condition::Writable);
+	listener.flush();
+
+	ASSERT_EQ(1U, listener.calls() - before);
+
+	auto events = listener.waitMultiple(1000);
+
+	ASSERT_EQ(1U, events.size());
+	ASSERT_EQ(Condition::Writable, events[0].flags);
+}
+
+/*
+ * Benchmark, wait and interest changes with 10 ready sockets among 100, 1000 and 10000.
+ */
+namespace {
+
+template <typename Backend>
+void benchmark(unsigned count)
+{
+	constexpr unsigned rounds = 200;
+
+	/* Select can't go past FD_SETSIZE */
+	if (std::is_same<Backend, Select>::value && count + 16 > FD_SETSIZE) {
+		std::cout << Listener<Backend>{}.backend().name() << " " << count << " sockets: skipped" << std::endl;
+		return;
+	}
+
+	Sockets sockets(count);
+	Listener<Backend> listener;
+
+	for (auto h : sockets.listened) {
+		listener.set(h, Condition::Readable);
+	}
+	for (unsigned i = 0; i < 10; ++i) {
+		sockets.ready(i * (count / 10));
+	}
+
+	std::size_t events = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	for (unsigned i = 0; i < rounds; ++i) {
+		events += listener.waitMultiple(0).size();
+	}
+
+	auto middle = std::chrono::steady_clock::now();
+
+	/* Toggle write interest on every socket */
+	for (unsigned i = 0; i < rounds; ++i) {
+		auto h = sockets.listened[(i * 7919) % count];
+
+		listener.set(h, Condition::Writable);
+		listener.unset(h, Condition::Writable);
+	}
+
+	auto end = std::chrono::steady_clock::now();
+
+	std::cout << listener.backend().name() << " " << count << " sockets: "
+		  << std::chrono::duration_cast<std::chrono::microseconds>(middle - start).count() / rounds << " us per wait, "
+		  << std::chrono::duration_cast<std::chrono::nanoseconds>(end - middle).count() / rounds << " ns per set/unset" << std::endl;
+
+	ASSERT_EQ(rounds * 10, events);
+}
+
+bool raiseLimit(unsigned count)
+{
+	rlimit limit;
+
+	if (::getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+		return false;
+	}
+	if (limit.rlim_cur >= count + 64) {
+		return true;
+	}
+
+	limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, count + 64);
+
+	return ::setrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur >= count + 64;
+}
+
+} // !namespace
+
+TEST(Backend, benchmark)
+{
+	for (unsigned count : { 100U, 1000U, 10000U }) {
+		if (!raiseLimit(count)) {
+			std::cout << count << " sockets: skipped, not enough file descriptors" << std::endl;
+			continue;
+		}
+
+		benchmark<Select>(count);
+#if defined(SOCKET_HAVE_POLL)
+		benchmark<Poll>(count);
+#endif
+#if defined(SOCKET_HAVE_EPOLL)
+		benchmark<Epoll>(count);
+#endif
+#if defined(SOCKET_HAVE_IO_URING)
+		benchmark<IoUring>(count);
+#endif
+#if defined(SOCKET_HAVE_KQUEUE)
+		benchmark<Kqueue>(count);
+#endif
+	}
+}
+
+#endif // !_WIN32
+
+int main(int argc, char **argv)
+{
+	testing::InitGoogleTest(&argc, argv);
+
+	return RUN_ALL_TESTS();
+}
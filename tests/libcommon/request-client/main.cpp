@@ -0,0 +1,238 @@
+/*
+ * main.cpp -- test RequestClient
+ *
+ * Copyright (c) 2013-2016 Malikania Authors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <malikania/RequestClient.h>
+
+using namespace malikania;
+using namespace malikania::net;
+
+using namespace std::chrono;
+
+using Server = StreamServer<address::Ip, protocol::Tcp>;
+using Connection = StreamConnection<address::Ip, protocol::Tcp>;
+using Client = wire::RequestClient<address::Ip, protocol::Tcp>;
+
+/*
+ * The server keeps the requests received, the tests decide when to reply.
+ */
+class TestRequestClient : public testing::Test {
+protected:
+	Server m_server{protocol::Tcp{}, address::Ip{"127.0.0.1", 16800}};
+	Client m_client;
+	wire::Decoder m_decoder;
+	std::shared_ptr<Connection> m_connection;
+	std::vector<json::Value> m_requests;
+	std::vector<json::Value> m_messages;
+
+	TestRequestClient()
+	{
+		m_server.setConnectionHandler([this] (const std::shared_ptr<Connection> &connection) {
+			m_connection = connection;
+		});
+		m_server.setReadHandler([this] (const std::shared_ptr<Connection> &, InputBuffer &input) {
+			input.consume(m_decoder.split(input.data(), input.size(), [this] (json::Value message) {
+				m_requests.push_back(std::move(message));
+			}));
+		});
+		m_client.setMessageHandler([this] (const json::Value &message) {
+			m_messages.push_back(message);
+		});
+		m_client.client().connect(address::Ip{"127.0.0.1", 16800});
+
+		poll([this] () { return m_connection != nullptr; });
+	}
+
+	void poll(const std::function<bool ()> &done)
+	{
+		for (int i = 0; i < 200 && !done(); ++i) {
+			m_server.poll(5);
+			m_client.poll(5);
+		}
+	}
+
+	/*
+	 * Reply to a request, the request field is copied like a server must do.
+	 */
+	void reply(const json::Value &request, json::Value response)
+	{
+		response.insert("request", request.at("request"));
+		m_connection->send(wire::encode(response, m_decoder.mode()));
+	}
+};
+
+TEST_F(TestRequestClient, pipelined)
+{
+	std::vector<std::string> responses;
+
+	ASSERT_TRUE(m_connection != nullptr);
+
+	/* The login sequence, sent without waiting */
+	for (auto name : { "account-identify", "character-list", "character-select" }) {
+		m_client.request(json::object({{ "command", name }}), [&responses, name] (const json::Value &response) {
+			ASSERT_EQ(name, response.at("command").toString());
+			responses.push_back(name);
+		});
+	}
+
+	ASSERT_EQ(3U, m_client.pending());
+
+	poll([this] () { return m_requests.size() == 3; });
+
+	ASSERT_EQ(3U, m_requests.size());
+
+	/* Replied out of order */
+	for (int i = 2; i >= 0; --i) {
+		reply(m_requests[i], json::object({{ "command", m_requests[i]["command"].toString() }}));
+	}
+
+	poll([&] () { return responses.size() == 3; });
+
+	ASSERT_EQ(3U, responses.size());
+	ASSERT_EQ("character-select", responses[0]);
+	ASSERT_EQ("account-identify", responses[2]);
+	ASSERT_EQ(0U, m_client.pending());
+	ASSERT_TRUE(m_messages.empty());
+}
+
+TEST_F(TestRequestClient, future)
+{
+	auto future = m_client.request(json::object({{ "command", "character-list" }}));
+
+	poll([this] () { return m_requests.size() == 1; });
+	reply(m_requests[0], json::object({{ "command", "character-list" }, { "id", 12 }}));
+	poll([&] () { return future.wait_for(seconds{0}) == std::future_status::ready; });
+
+	ASSERT_EQ(12, future.get()["id"].toInt());
+}
+
+TEST_F(TestRequestClient, timeout)
+{
+	bool failed = false;
+
+	auto slow = m_client.request(json::object({{ "command", "character-list" }}), milliseconds{50});
+
+	m_client.request(json::object({{ "command", "server-info" }}), nullptr, [&] (const Error &error) {
+		failed = error.code() == Error::Timeout;
+	}, milliseconds{50});
+
+	auto start = steady_clock::now();
+
+	poll([&] () { return m_client.pending() == 0; });
+
+	ASSERT_TRUE(failed);
+	ASSERT_GE(steady_clock::now() - start, milliseconds{40});
+	ASSERT_EQ(2U, m_requests.size());
+
+	try {
+		slow.get();
+		FAIL() << "expected a timeout";
+	} catch (const Error &error) {
+		ASSERT_EQ(Error::Timeout, error.code());
+	}
+
+	/* A late response is an ordinary message */
+	reply(m_requests[0], json::object({{ "command", "character-list" }}));
+	poll([this] () { return !m_messages.empty(); });
+
+	ASSERT_EQ(1U, m_messages.size());
+}
+
+TEST_F(TestRequestClient, cancel)
+{
+	bool called = false;
+
+	auto id = m_client.request(json::object({{ "command", "character-list" }}), [&] (const json::Value &) {
+		called = true;
+	});
+
+	ASSERT_TRUE(m_client.cancel(id));
+	ASSERT_FALSE(m_client.cancel(id));
+
+	poll([this] () { return m_requests.size() == 1; });
+	reply(m_requests[0], json::object({{ "command", "character-list" }}));
+	poll([this] () { return !m_messages.empty(); });
+
+	ASSERT_FALSE(called);
+	ASSERT_EQ(1U, m_messages.size());
+}
+
+TEST_F(TestRequestClient, disconnection)
+{
+	unsigned failed = 0;
+	bool disconnected = false;
+
+	m_client.setDisconnectionHandler([&] () {
+		disconnected = true;
+	});
+
+	for (int i = 0; i < 2; ++i) {
+		m_client.request(json::object({{ "command", "character-list" }}), nullptr, [&] (const Error &error) {
+			if (error.code() != Error::Timeout) {
+				failed ++;
+			}
+		});
+	}
+
+	/* Closed by the server */
+	m_server.setIdleTimeout(m_connection, milliseconds{20});
+	poll([&] () { return disconnected; });
+
+	ASSERT_TRUE(disconnected);
+	ASSERT_EQ(2U, failed);
+	ASSERT_EQ(0U, m_client.pending());
+}
+
+TEST_F(TestRequestClient, binary)
+{
+	json::Value response;
+
+	m_decoder.setMode(wire::Mode::Binary);
+	m_client.decoder().setMode(wire::Mode::Binary);
+	m_client.request(json::object({{ "command", "character-select" }, { "id", 4 }}), [&] (const json::Value &r) {
+		response = r;
+	});
+
+	/* Messages from the server without request id */
+	m_connection->send(wire::encode(json::object({{ "command", "server-message" }, { "message", "hello" }}), wire::Mode::Binary));
+
+	poll([this] () { return m_requests.size() == 1; });
+
+	ASSERT_EQ(4, m_requests[0]["id"].toInt());
+
+	reply(m_requests[0], json::object({{ "command", "character-select" }, { "id", 4 }}));
+	poll([&] () { return response.isObject(); });
+
+	ASSERT_EQ(4, response["id"].toInt());
+	ASSERT_EQ(1U, m_messages.size());
+	ASSERT_EQ("hello", m_messages[0]["message"].toString());
+}
+
+int main(int argc, char **argv)
+{
+	testing::InitGoogleTest(&argc, argv);
+
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,133 @@
+/*
+ * main.cpp -- test StreamClient
+ *
+ * Copyright (c) 2013-2016 Malikania Authors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <malikania/Sockets.h>
+
+using namespace malikania;
+using namespace malikania::net;
+
+using Client = StreamClient<address::Ip, protocol::Tcp>;
+
+TEST(StreamClient, closeAfterFullReads)
+{
+	SocketTcpIp master{protocol::Tcp{}, address::Ip{}};
+	Client client;
+	std::string received;
+	unsigned connected = 0;
+	unsigned disconnected = 0;
+
+	master.set(option::SockReuseAddress{true});
+	master.bind(address::Ip{"127.0.0.1", 16550});
+	master.listen();
+
+	client.setConnectionHandler([&] () {
+		connected ++;
+	});
+	client.setReadHandler([&] (InputBuffer &input) {
+		received += input.str();
+		input.clear();
+	});
+	client.setDisconnectionHandler([&] () {
+		disconnected ++;
+	});
+	client.connect(address::Ip{"127.0.0.1", 16550});
+
+	/* Exactly 2 reads of the default size, the third recv sees the end of stream */
+	auto peer = master.accept(nullptr);
+
+	peer.send(std::string(2 * 4096, 'x'));
+	peer.close();
+
+	for (int i = 0; i < 10 && disconnected == 0; ++i) {
+		client.poll(1000);
+	}
+
+	ASSERT_EQ(std::string(2 * 4096, 'x'), received);
+	ASSERT_EQ(1U, disconnected);
+
+	/* Not taken for a connection in progress */
+	client.poll(0);
+
+	ASSERT_EQ(1U, connected);
+	ASSERT_EQ(1U, disconnected);
+}
+
+TEST(StreamClient, sharedListener)
+{
+	SocketTcpIp master{protocol::Tcp{}, address::Ip{}};
+	Listener<> listener;
+	std::vector<std::unique_ptr<Client>> clients;
+	std::vector<std::string> received(4);
+
+	master.set(option::SockReuseAddress{true});
+	master.bind(address::Ip{"127.0.0.1", 16551});
+	master.listen();
+
+	for (unsigned i = 0; i < 4; ++i) {
+		clients.emplace_back(new Client{listener});
+		clients.back()->setReadHandler([&, i] (InputBuffer &input) {
+			received[i] += input.str();
+			input.clear();
+		});
+		clients.back()->connect(address::Ip{"127.0.0.1", 16551});
+	}
+
+	/* One message per client, in the reverse order */
+	std::vector<SocketTcpIp> peers;
+
+	for (unsigned i = 0; i < 4; ++i) {
+		peers.push_back(master.accept(nullptr));
+	}
+	for (unsigned i = 0; i < 4; ++i) {
+		peers[3 - i].send("client " + std::to_string(3 - i));
+	}
+
+	/* Only the listener is waited on, each event goes to the owner of the handle */
+	for (int n = 0; n < 20 && std::any_of(received.begin(), received.end(), [] (const std::string &s) { return s.empty(); }); ++n) {
+		for (const auto &st : listener.waitMultiple(1000)) {
+			for (auto &client : clients) {
+				if (client->handle() == st.socket) {
+					client->dispatch(st);
+				}
+			}
+		}
+	}
+
+	/* The accept order is the connect order */
+	for (unsigned i = 0; i < 4; ++i) {
+		ASSERT_EQ("client " + std::to_string(i), received[i]);
+	}
+
+	clients.clear();
+
+	ASSERT_EQ(0U, listener.size());
+}
+
+int main(int argc, char **argv)
+{
+	testing::InitGoogleTest(&argc, argv);
+
+	return RUN_ALL_TESTS();
+}
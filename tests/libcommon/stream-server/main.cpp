@@ -0,0 +1,1384 @@
+/*
+ * main.cpp -- test StreamServer
+ *
+ * Copyright (c) 2013-2016 Malikania Authors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <malikania/Sockets.h>
+
+using namespace malikania;
+using namespace malikania::net;
+
+using Server = StreamServer<address::Ip, protocol::Tcp>;
+using Connection = StreamConnection<address::Ip, protocol::Tcp>;
+
+/*
+ * Server with a set of blocking raw clients connected to it.
+ */
+class TestStreamServer : public testing::Test {
+protected:
+	Server m_server{protocol::Tcp{}, address::Ip{"127.0.0.1", 16500}};
+	std::vector<std::unique_ptr<SocketTcpIp>> m_clients;
+	unsigned m_connected{0};
+	unsigned m_reads{0};
+
+	TestStreamServer()
+	{
+		m_server.setConnectionHandler([this] (const std::shared_ptr<Connection> &) {
+			m_connected ++;
+		});
+		m_server.setReadHandler([this] (const std::shared_ptr<Connection> &, InputBuffer &input) {
+			m_reads ++;
+			input.clear();
+		});
+	}
+
+	void connect(unsigned count)
+	{
+		/* Accept them one by one to not overflow the listen backlog */
+		for (unsigned i = 0; i < count; ++i) {
+			m_clients.emplace_back(new SocketTcpIp{protocol::Tcp{}, address::Ip{}});
+			m_clients.back()->connect(address::Ip{"127.0.0.1", 16500});
+
+			while (m_connected < i + 1) {
+				m_server.poll(1000);
+			}
+		}
+	}
+
+	void sendAll()
+	{
+		for (auto &client : m_clients) {
+			client->send("a");
+		}
+	}
+};
+
+TEST_F(TestStreamServer, batch)
+{
+	connect(32);
+	sendAll();
+
+	/* All clients are ready at the same time, only one wakeup is needed */
+	m_server.poll(1000);
+
+	ASSERT_EQ(32U, m_reads);
+}
+
+TEST_F(TestStreamServer, maxEvents)
+{
+	connect(32);
+	sendAll();
+
+	m_server.setMaxEvents(4);
+	m_server.poll(1000);
+
+	ASSERT_EQ(4U, m_reads);
+
+	/* Remaining events are reported again */
+	while (m_reads < 32U) {
+		m_server.poll(1000);
+	}
+
+	ASSERT_EQ(32U, m_reads);
+}
+
+TEST_F(TestStreamServer, maxEventsFairness)
+{
+	std::set<int> ports;
+
+	m_server.setReadHandler([&] (const std::shared_ptr<Connection> &connection, InputBuffer &input) {
+		ports.insert(connection->address().port());
+		input.clear();
+	});
+
+	connect(32);
+	m_server.setMaxEvents(4);
+
+	/* Every client stays ready, each one must still get its turn */
+	for (int i = 0; i < 8; ++i) {
+		sendAll();
+		m_server.poll(1000);
+	}
+
+	ASSERT_EQ(32U, ports.size());
+}
+
+TEST_F(TestStreamServer, acceptBatch)
+{
+	std::vector<int> ports;
+
+	m_server.setConnectionHandler([&] (const std::shared_ptr<Connection> &connection) {
+		m_connected ++;
+		ports.push_back(connection->address().port());
+	});
+	m_server.setAcceptLimit(8);
+
+	/* The clients wait in the backlog */
+	for (int i = 0; i < 20; ++i) {
+		m_clients.emplace_back(new SocketTcpIp{protocol::Tcp{}, address::Ip{}});
+		m_clients.back()->connect(address::Ip{"127.0.0.1", 16500});
+	}
+
+	m_server.poll(1000);
+	ASSERT_EQ(8U, m_connected);
+
+	while (m_connected < 20U) {
+		m_server.poll(1000);
+	}
+
+	const auto &statistics = m_server.acceptStatistics();
+
+	ASSERT_EQ(20U, statistics.accepted);
+	ASSERT_EQ(8U, statistics.peakBatch);
+	ASSERT_EQ(2U, statistics.limited);
+	ASSERT_EQ(0U, statistics.errors);
+
+#if defined(__linux__)
+	/* Measured before the first batch */
+	ASSERT_EQ(128U, statistics.backlog);
+	ASSERT_EQ(20U, statistics.peakQueued);
+#endif
+
+	/* The address is the one of the client */
+	for (std::size_t i = 0; i < m_clients.size(); ++i) {
+		ASSERT_EQ(address::Ip{m_clients[i]->address()}.port(), ports[i]);
+	}
+}
+
+TEST_F(TestStreamServer, disconnection)
+{
+	unsigned disconnected = 0;
+
+	m_server.setDisconnectionHandler([&] (const std::shared_ptr<Connection> &) {
+		disconnected ++;
+	});
+
+	connect(16);
+	sendAll();
+	m_clients.clear();
+
+	while (disconnected < 16U) {
+		m_server.poll(1000);
+	}
+
+	ASSERT_EQ(16U, m_reads);
+	ASSERT_EQ(16U, disconnected);
+}
+
+TEST_F(TestStreamServer, closeAfterFullReads)
+{
+	std::string received;
+	unsigned disconnected = 0;
+
+	m_server.setReadHandler([&] (const std::shared_ptr<Connection> &, InputBuffer &input) {
+		received += input.str();
+		input.clear();
+	});
+	m_server.setDisconnectionHandler([&] (const std::shared_ptr<Connection> &) {
+		disconnected ++;
+	});
+
+	connect(1);
+
+	/* Exactly 3 reads of the default size, the fourth recv sees the end of stream */
+	m_clients[0]->send(std::string(3 * 4096, 'x'));
+	m_clients[0]->close();
+
+	for (int i = 0; i < 10 && disconnected == 0; ++i) {
+		m_server.poll(1000);
+	}
+
+	ASSERT_EQ(std::string(3 * 4096, 'x'), received);
+	ASSERT_EQ(1U, disconnected);
+	ASSERT_EQ(0U, m_server.size());
+}
+
+TEST_F(TestStreamServer, largeRead)
+{
+	std::string expected(100000, 'x');
+	std::string received;
+
+	m_server.setReadHandler([&] (const std::shared_ptr<Connection> &, InputBuffer &input) {
+		m_reads ++;
+
+		/* Keep the data in the buffer until everything is there */
+		if (input.size() == expected.size()) {
+			received = input.str();
+			input.consume(input.size());
+		}
+	});
+	m_server.setReadSize(1024);
+	m_server.setReadLimit(expected.size());
+
+	connect(1);
+	m_clients[0]->send(expected);
+
+	while (received.empty()) {
+		m_server.poll(1000);
+	}
+
+	ASSERT_EQ(expected, received);
+	ASSERT_LT(m_reads, expected.size() / 1024);
+}
+
+TEST_F(TestStreamServer, largeWrite)
+{
+	std::string expected;
+	std::string received;
+	std::size_t written = 0;
+
+	for (int i = 0; i < 64; ++i) {
+		expected += std::string(65536, static_cast<char>('a' + (i % 26)));
+	}
+
+	m_server.setConnectionHandler([&] (const std::shared_ptr<Connection> &client) {
+		m_connected ++;
+
+		for (int i = 0; i < 64; ++i) {
+			client->send(expected.substr(i * 65536, 65536));
+		}
+	});
+	m_server.setWriteHandler([&] (const std::shared_ptr<Connection> &, unsigned nsent) {
+		written += nsent;
+	});
+
+	connect(1);
+	m_clients[0]->set(option::SockBlockMode{false});
+
+	while (received.size() < expected.size()) {
+		m_server.poll(0);
+		received += m_clients[0]->recv(65536);
+	}
+
+	ASSERT_EQ(expected.size(), written);
+	ASSERT_EQ(expected, received);
+}
+
+TEST_F(TestStreamServer, broadcast)
+{
+	std::vector<std::shared_ptr<Connection>> connections;
+
+	m_server.setConnectionHandler([&] (const std::shared_ptr<Connection> &client) {
+		m_connected ++;
+		connections.push_back(client);
+	});
+
+	connect(8);
+
+	ASSERT_EQ(8U, m_server.broadcast("hello"));
+
+	/* Every output references the same buffer */
+	for (const auto &c : connections) {
+		ASSERT_EQ(connections[0]->output().data(0), c->output().data(0));
+	}
+
+	/* Only the first half */
+	ASSERT_EQ(4U, m_server.broadcast(connections.begin(), connections.begin() + 4, " world"));
+
+	for (unsigned i = 0; i < 8; ++i) {
+		std::string expected = i < 4 ? "hello world" : "hello";
+		std::string received;
+
+		while (received.size() < expected.size()) {
+			m_server.poll(0);
+			received += m_clients[i]->recv(512);
+		}
+
+		ASSERT_EQ(expected, received);
+	}
+}
+
+TEST_F(TestStreamServer, dropLow)
+{
+	std::shared_ptr<Connection> connection;
+	std::vector<bool> notifications;
+
+	m_server.setOutputLimits(1000, 100, OutputPolicy::DropLow);
+	m_server.setConnectionHandler([&] (const std::shared_ptr<Connection> &client) {
+		m_connected ++;
+		connection = client;
+	});
+	m_server.setCongestionHandler([&] (const std::shared_ptr<Connection> &, bool congested) {
+		notifications.push_back(congested);
+	});
+
+	connect(1);
+
+	ASSERT_TRUE(connection->send(std::string(600, 'a'), Priority::Low));
+	ASSERT_TRUE(connection->send(std::string(600, 'b')));
+	ASSERT_TRUE(connection->congested());
+
+	/* Only low priority messages are dropped */
+	ASSERT_FALSE(connection->send("c", Priority::Low));
+	ASSERT_EQ(0U, m_server.broadcast("d", Priority::Low));
+	ASSERT_TRUE(connection->send("e"));
+
+	std::string received;
+
+	while (received.size() < 1201U) {
+		m_server.poll(0);
+		received += m_clients[0]->recv(4096);
+	}
+
+	ASSERT_EQ(std::string(600, 'a') + std::string(600, 'b') + "e", received);
+	ASSERT_FALSE(connection->congested());
+	ASSERT_TRUE(connection->send("f", Priority::Low));
+
+	const auto &stats = connection->outputStatistics();
+
+	ASSERT_EQ(1201U, stats.peak);
+	ASSERT_EQ(1202U, stats.queued);
+	ASSERT_EQ(1201U, stats.sent);
+	ASSERT_EQ(2U, stats.dropped);
+	ASSERT_EQ(2U, stats.droppedBytes);
+	ASSERT_EQ(1U, stats.congestions);
+	ASSERT_EQ((std::vector<bool>{true, false}), notifications);
+}
+
+TEST_F(TestStreamServer, pauseReading)
+{
+	std::shared_ptr<Connection> connection;
+
+	m_server.setOutputLimits(1000, 0, OutputPolicy::PauseReading);
+	m_server.setConnectionHandler([&] (const std::shared_ptr<Connection> &client) {
+		m_connected ++;
+		connection = client;
+	});
+
+	connect(1);
+
+	connection->send(std::string(2000, 'a'));
+	m_clients[0]->send("hello");
+
+	/* The output is sent but the client is not read before it is not congested anymore */
+	m_server.poll(1000);
+
+	ASSERT_EQ(0U, m_reads);
+	ASSERT_FALSE(connection->congested());
+
+	while (m_reads == 0U) {
+		m_server.poll(1000);
+	}
+
+	ASSERT_EQ(1U, m_reads);
+}
+
+TEST_F(TestStreamServer, disconnectSlow)
+{
+	std::shared_ptr<Connection> connection;
+	unsigned disconnected = 0;
+
+	m_server.setOutputLimits(1000, 0, OutputPolicy::Disconnect);
+	m_server.setConnectionHandler([&] (const std::shared_ptr<Connection> &client) {
+		m_connected ++;
+		connection = client;
+	});
+	m_server.setDisconnectionHandler([&] (const std::shared_ptr<Connection> &) {
+		disconnected ++;
+	});
+
+	connect(2);
+
+	/* Only the second client is congested, nothing more is queued for it */
+	ASSERT_EQ(2U, m_server.broadcast(std::string(600, 'a')));
+	connection->send(std::string(600, 'b'));
+	ASSERT_EQ(1U, m_server.broadcast("c"));
+	ASSERT_EQ(1U, connection->outputStatistics().dropped);
+	ASSERT_EQ(0U, disconnected);
+
+	m_server.poll(0);
+
+	ASSERT_EQ(1U, disconnected);
+	ASSERT_EQ(1U, m_server.size());
+	ASSERT_EQ(State::Closed, connection->socket().state());
+}
+
+TEST_F(TestStreamServer, idleTimeoutAfterLongWait)
+{
+	unsigned disconnected = 0;
+
+	m_server.setIdleTimeout(std::chrono::milliseconds{300});
+	m_server.setDisconnectionHandler([&] (const std::shared_ptr<Connection> &) {
+		disconnected ++;
+	});
+
+	/* No timer is pending, the poll below blocks until the client connects */
+	std::thread thread([this] () {
+		std::this_thread::sleep_for(std::chrono::milliseconds{700});
+
+		m_clients.emplace_back(new SocketTcpIp{protocol::Tcp{}, address::Ip{}});
+		m_clients.back()->connect(address::Ip{"127.0.0.1", 16500});
+		m_clients.back()->send("a");
+	});
+
+	while (m_connected == 0) {
+		m_server.poll(-1);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	thread.join();
+
+	/* The idle timeout counts from the connection, not from the start of the wait */
+	while (m_reads == 0 && disconnected == 0) {
+		m_server.poll(50);
+	}
+
+	ASSERT_EQ(1U, m_reads);
+	ASSERT_EQ(0U, disconnected);
+	ASSERT_EQ(1U, m_server.size());
+
+	while (disconnected == 0) {
+		m_server.poll(50);
+	}
+
+	ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds{250});
+}
+
+TEST_F(TestStreamServer, idleTimeout)
+{
+	std::vector<std::shared_ptr<Connection>> connections;
+	unsigned disconnected = 0;
+
+	m_server.setIdleTimeout(std::chrono::milliseconds{200});
+	m_server.setConnectionHandler([&] (const std::shared_ptr<Connection> &client) {
+		m_connected ++;
+		connections.push_back(client);
+	});
+	m_server.setDisconnectionHandler([&] (const std::shared_ptr<Connection> &) {
+		disconnected ++;
+	});
+
+	connect(3);
+
+	/* The last one never expires */
+	m_server.setIdleTimeout(connections[2], std::chrono::milliseconds{0});
+
+	auto start = std::chrono::steady_clock::now();
+
+	/* The first client stays active */
+	while (disconnected == 0) {
+		m_clients[0]->send("a");
+		m_server.poll(50);
+	}
+
+	auto elapsed = std::chrono::steady_clock::now() - start;
+
+	ASSERT_EQ(1U, disconnected);
+	ASSERT_EQ(State::Closed, connections[1]->socket().state());
+	ASSERT_GE(elapsed, std::chrono::milliseconds{150});
+	ASSERT_EQ(2U, m_server.size());
+
+	/* Nothing expires anymore */
+	for (int i = 0; i < 5; ++i) {
+		m_clients[0]->send("a");
+		m_server.poll(50);
+	}
+
+	ASSERT_EQ(1U, disconnected);
+}
+
+TEST_F(TestStreamServer, timers)
+{
+	unsigned timeouts = 0, called = 0;
+
+	m_server.setTimeoutHandler([&] () {
+		timeouts ++;
+	});
+	m_server.timers().schedulePeriodic(std::chrono::milliseconds{20}, [&] () {
+		called ++;
+	});
+
+	/* The poll returns for the timers, not because of the timeout */
+	auto start = std::chrono::steady_clock::now();
+
+	while (called < 5U) {
+		m_server.poll(10000);
+	}
+
+	ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds{1});
+	ASSERT_EQ(0U, timeouts);
+
+	m_server.poll(0);
+
+	ASSERT_EQ(1U, timeouts);
+}
+
+TEST_F(TestStreamServer, pool)
+{
+	std::set<const Connection *> first, second;
+
+	m_server.setConnectionHandler([&] (const std::shared_ptr<Connection> &client) {
+		m_connected ++;
+		first.insert(client.get());
+	});
+	m_server.setDisconnectionHandler([&] (const std::shared_ptr<Connection> &) {
+		m_connected --;
+	});
+
+	connect(4);
+	m_clients.clear();
+
+	while (m_server.size() > 0) {
+		m_server.poll(1000);
+	}
+
+	/* New clients get the released objects */
+	m_server.setConnectionHandler([&] (const std::shared_ptr<Connection> &client) {
+		m_connected ++;
+		second.insert(client.get());
+	});
+
+	connect(4);
+
+	ASSERT_EQ(first, second);
+}
+
+TEST_F(TestStreamServer, coalesce)
+{
+	unsigned sent = 0;
+
+	/* Stream messages one by one, each write unsets the writable flag and the handler sets it again */
+	m_server.setConnectionHandler([&] (const std::shared_ptr<Connection> &client) {
+		m_connected ++;
+		client->send("message\r\n\r\n");
+	});
+	m_server.setWriteHandler([&] (const std::shared_ptr<Connection> &client, unsigned) {
+		if (++ sent < 30) {
+			client->send("message\r\n\r\n");
+		}
+	});
+
+	connect(1);
+
+	auto calls = m_server.listener().calls();
+	std::string received;
+
+	while (received.size() < 30 * 11) {
+		m_server.poll(0);
+		received += m_clients[0]->recv(512);
+	}
+
+	/* Only the final unset reaches the backend */
+	ASSERT_EQ(30U, sent);
+	ASSERT_GE(2U, m_server.listener().calls() - calls);
+	ASSERT_LE(58U, m_server.listener().saved());
+}
+
+/*
+ * Benchmark, show the number of events dispatched per listener wakeup.
+ */
+TEST_F(TestStreamServer, benchmarkEventsPerWakeup)
+{
+	constexpr unsigned clients = 256;
+	constexpr unsigned rounds = 20;
+
+	connect(clients);
+
+	for (unsigned max : { 1U, 0U }) {
+		unsigned wakeups = 0;
+		auto start = std::chrono::steady_clock::now();
+
+		m_reads = 0;
+		m_server.setMaxEvents(max);
+
+		for (unsigned i = 0; i < rounds; ++i) {
+			sendAll();
+
+			while (m_reads < clients * (i + 1)) {
+				m_server.poll(1000);
+				wakeups ++;
+			}
+		}
+
+		auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+		std::cout << "max events " << max << ": " << m_reads << " events, " << wakeups << " wakeups, "
+			  << (static_cast<double>(m_reads) / wakeups) << " events per wakeup, "
+			  << elapsed.count() << " us" << std::endl;
+
+		ASSERT_EQ(clients * rounds, m_reads);
+	}
+}
+
+TEST_F(TestStreamServer, post)
+{
+	constexpr unsigned threads = 4;
+	constexpr unsigned count = 1000;
+
+	std::vector<std::thread> producers;
+	std::vector<unsigned> next(threads, 0);
+	auto id = std::this_thread::get_id();
+	unsigned calls = 0;
+	unsigned errors = 0;
+	unsigned timeouts = 0;
+
+	m_server.setTimeoutHandler([&] () {
+		timeouts ++;
+	});
+
+	for (unsigned i = 0; i < threads; ++i) {
+		producers.emplace_back([&, i] () {
+			for (unsigned j = 0; j < count; ++j) {
+				m_server.post([&, i, j] () {
+					/* In the thread of poll and in the order of each producer */
+					if (std::this_thread::get_id() != id || next[i] ++ != j) {
+						errors ++;
+					}
+
+					calls ++;
+				});
+			}
+		});
+	}
+
+	for (auto &producer : producers) {
+		producer.join();
+	}
+
+	/* All of them in one wakeup, then nothing is left */
+	m_server.poll(1000);
+
+	ASSERT_EQ(threads * count, calls);
+	ASSERT_EQ(0U, errors);
+	ASSERT_EQ(0U, timeouts);
+
+	m_server.poll(0);
+
+	ASSERT_EQ(1U, timeouts);
+}
+
+TEST_F(TestStreamServer, postSend)
+{
+	std::shared_ptr<Connection> connection;
+
+	m_server.setConnectionHandler([&] (const std::shared_ptr<Connection> &client) {
+		m_connected ++;
+		connection = client;
+	});
+
+	connect(1);
+
+	/* The waiting poll returns as soon as the data is posted */
+	std::thread worker([&] () {
+		std::this_thread::sleep_for(std::chrono::milliseconds{50});
+		m_server.post(connection, "hello");
+	});
+
+	auto start = std::chrono::steady_clock::now();
+
+	m_server.poll(10000);
+	worker.join();
+
+	ASSERT_GT(std::chrono::seconds{5}, std::chrono::steady_clock::now() - start);
+	ASSERT_EQ(5U, connection->output().size());
+
+	std::string received;
+
+	while (received.size() < 5) {
+		m_server.poll(0);
+		received += m_clients[0]->recv(512);
+	}
+
+	ASSERT_EQ("hello", received);
+
+	/* Skipped once the client is disconnected */
+	m_clients[0]->close();
+
+	while (m_server.size() > 0) {
+		m_server.poll(1000);
+	}
+
+	m_server.post(connection, "world");
+	m_server.poll(1000);
+
+	ASSERT_EQ(0U, connection->output().size());
+}
+
+/*
+ * Benchmark, latency of a post to a waiting poll and number of closures run per wakeup under load.
+ */
+TEST_F(TestStreamServer, benchmarkPost)
+{
+	constexpr unsigned rounds = 10000;
+	constexpr unsigned threads = 4;
+	constexpr unsigned count = 100000;
+
+	std::atomic<unsigned> done{0};
+	std::atomic<bool> running{true};
+	std::thread reactor([&] () {
+		while (running) {
+			m_server.poll(1000);
+		}
+	});
+
+	/* One closure at a time, the reactor is always waiting */
+	auto start = std::chrono::steady_clock::now();
+
+	for (unsigned i = 0; i < rounds; ++i) {
+		m_server.post([&] () {
+			done ++;
+		});
+
+		while (done != i + 1) {
+			std::this_thread::yield();
+		}
+	}
+
+	auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+	std::cout << "post latency: " << (elapsed.count() / rounds) << " ns per round trip" << std::endl;
+
+	running = false;
+	m_server.post(nullptr);
+	reactor.join();
+
+	/* Several producers, the poll is counted from this thread */
+	std::vector<std::thread> producers;
+	unsigned calls = 0;
+	unsigned wakeups = 0;
+
+	start = std::chrono::steady_clock::now();
+
+	for (unsigned i = 0; i < threads; ++i) {
+		producers.emplace_back([&] () {
+			for (unsigned j = 0; j < count; ++j) {
+				m_server.post([&] () {
+					calls ++;
+				});
+			}
+		});
+	}
+
+	while (calls < threads * count) {
+		m_server.poll(1000);
+		wakeups ++;
+	}
+
+	elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+	for (auto &producer : producers) {
+		producer.join();
+	}
+
+	std::cout << "post throughput: " << calls << " closures, " << wakeups << " wakeups, "
+		  << (elapsed.count() / calls) << " ns per closure" << std::endl;
+
+	ASSERT_EQ(rounds, done);
+	ASSERT_EQ(threads * count, calls);
+}
+
+/*
+ * StreamHandler
+ * ------------------------------------------------------------------
+ */
+
+namespace {
+
+/*
+ * Echo server handler, called without Callback.
+ */
+class EchoHandler : public StreamHandler<address::Ip, protocol::Tcp> {
+public:
+	unsigned connected{0};
+	unsigned disconnected{0};
+	unsigned reads{0};
+
+	inline void onConnection(const std::shared_ptr<Connection> &) noexcept
+	{
+		connected ++;
+	}
+
+	inline void onDisconnection(const std::shared_ptr<Connection> &) noexcept
+	{
+		disconnected ++;
+	}
+
+	inline void onRead(const std::shared_ptr<Connection> &client, InputBuffer &input)
+	{
+		reads ++;
+		client->send(input.str());
+		input.clear();
+	}
+};
+
+/*
+ * Count the reads, like the callbacks of the benchmark.
+ */
+class CountHandler : public StreamHandler<address::Ip, protocol::Tcp> {
+public:
+	unsigned connected{0};
+	unsigned reads{0};
+
+	inline void onConnection(const std::shared_ptr<Connection> &) noexcept
+	{
+		connected ++;
+	}
+
+	inline void onRead(const std::shared_ptr<Connection> &, InputBuffer &input) noexcept
+	{
+		reads ++;
+		input.clear();
+	}
+};
+
+/*
+ * Send one byte from every client and wait for all the reads, returns the time spent.
+ */
+template <typename Server>
+std::chrono::microseconds roundTrips(Server &server, std::uint16_t port, const unsigned &connected, const unsigned &reads)
+{
+	constexpr unsigned clients = 64;
+	constexpr unsigned rounds = 500;
+
+	std::vector<std::unique_ptr<SocketTcpIp>> sockets;
+
+	for (unsigned i = 0; i < clients; ++i) {
+		sockets.emplace_back(new SocketTcpIp{protocol::Tcp{}, address::Ip{}});
+		sockets.back()->connect(address::Ip{"127.0.0.1", port});
+
+		while (connected < i + 1) {
+			server.poll(1000);
+		}
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (unsigned i = 0; i < rounds; ++i) {
+		for (auto &socket : sockets) {
+			socket->send("a");
+		}
+
+		while (reads < clients * (i + 1)) {
+			server.poll(1000);
+		}
+	}
+
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+}
+
+} // !namespace
+
+TEST(StreamHandler, echo)
+{
+	StreamServer<address::Ip, protocol::Tcp, EchoHandler> server{protocol::Tcp{}, address::Ip{"127.0.0.1", 16520}};
+	std::unique_ptr<SocketTcpIp> client{new SocketTcpIp{protocol::Tcp{}, address::Ip{}}};
+	std::string received;
+
+	client->connect(address::Ip{"127.0.0.1", 16520});
+	client->set(option::SockBlockMode{false});
+	client->send("hello");
+
+	for (int i = 0; i < 100 && received != "hello"; ++i) {
+		server.poll(10);
+		received += client->recv(512);
+	}
+
+	ASSERT_EQ("hello", received);
+	ASSERT_EQ(1U, server.handler().connected);
+	ASSERT_EQ(1U, server.handler().reads);
+
+	client = nullptr;
+
+	for (int i = 0; i < 100 && server.handler().disconnected == 0; ++i) {
+		server.poll(10);
+	}
+
+	ASSERT_EQ(1U, server.handler().disconnected);
+}
+
+/*
+ * Benchmark, the same server with the Callback adapter and with a handler called directly.
+ */
+TEST(StreamHandler, benchmark)
+{
+	constexpr unsigned calls = 10000000;
+
+	/* Dispatch only */
+	StreamCallbacks<address::Ip, protocol::Tcp> callbacks;
+	CountHandler counter;
+	InputBuffer input;
+	std::shared_ptr<Connection> none;
+	unsigned reads = 0;
+
+	callbacks.setReadHandler([&] (const std::shared_ptr<Connection> &, InputBuffer &input) {
+		reads ++;
+		input.clear();
+	});
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (unsigned i = 0; i < calls; ++i) {
+		input.commit(input.prepare(1) != nullptr);
+		callbacks.onRead(none, input);
+	}
+
+	auto middle = std::chrono::steady_clock::now();
+
+	for (unsigned i = 0; i < calls; ++i) {
+		input.commit(input.prepare(1) != nullptr);
+		counter.onRead(none, input);
+	}
+
+	auto end = std::chrono::steady_clock::now();
+
+	std::cout << "dispatch: callback " << std::chrono::duration_cast<std::chrono::nanoseconds>(middle - start).count() / (calls / 1000)
+		  << " ps/call, static " << std::chrono::duration_cast<std::chrono::nanoseconds>(end - middle).count() / (calls / 1000)
+		  << " ps/call" << std::endl;
+
+	ASSERT_EQ(calls, reads);
+	ASSERT_EQ(calls, counter.reads);
+
+	/* Through the server, the system calls dominate */
+	Server server{protocol::Tcp{}, address::Ip{"127.0.0.1", 16521}};
+	unsigned connected = 0;
+
+	reads = 0;
+	server.setConnectionHandler([&] (const std::shared_ptr<Connection> &) {
+		connected ++;
+	});
+	server.setReadHandler([&] (const std::shared_ptr<Connection> &, InputBuffer &input) {
+		reads ++;
+		input.clear();
+	});
+
+	auto dynamic = roundTrips(server, 16521, connected, reads);
+
+	StreamServer<address::Ip, protocol::Tcp, CountHandler> fast{protocol::Tcp{}, address::Ip{"127.0.0.1", 16522}};
+
+	auto direct = roundTrips(fast, 16522, fast.handler().connected, fast.handler().reads);
+
+	std::cout << "server: callback " << dynamic.count() << " us, static " << direct.count() << " us" << std::endl;
+}
+
+/*
+ * HandleTable
+ * ------------------------------------------------------------------
+ */
+
+TEST(HandleTable, basic)
+{
+	HandleTable<int> table;
+
+	ASSERT_TRUE(table.emplace(5, 50).second);
+	ASSERT_TRUE(table.emplace(1, 10).second);
+	ASSERT_TRUE(table.emplace(300, 3000).second);
+	ASSERT_FALSE(table.emplace(1, 0).second);
+	ASSERT_EQ(3U, table.size());
+	ASSERT_EQ(10, table.at(1));
+	ASSERT_EQ(table.end(), table.find(2));
+	ASSERT_THROW(table.at(2), std::out_of_range);
+
+	/* The last element is moved into the removed slot */
+	ASSERT_EQ(1U, table.erase(5));
+	ASSERT_EQ(0U, table.erase(5));
+	ASSERT_EQ(2U, table.size());
+	ASSERT_EQ(3000, table.at(300));
+	ASSERT_EQ(10, table.at(1));
+
+	table.erase(table.find(300));
+	table.erase(table.find(1));
+
+	ASSERT_TRUE(table.empty());
+}
+
+/*
+ * Benchmark, compare lookups with std::map.
+ */
+TEST(HandleTable, benchmark)
+{
+	constexpr int count = 10000;
+	constexpr int rounds = 100;
+
+	HandleTable<int> table;
+	std::map<Handle, int> map;
+	long long sum1 = 0, sum2 = 0;
+
+	for (int i = 0; i < count; ++i) {
+		table.emplace(i, i);
+		map.emplace(i, i);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (int r = 0; r < rounds; ++r) {
+		for (int i = 0; i < count; ++i) {
+			sum1 += table.find((i * 7919) % count)->second;
+		}
+	}
+
+	auto middle = std::chrono::steady_clock::now();
+
+	for (int r = 0; r < rounds; ++r) {
+		for (int i = 0; i < count; ++i) {
+			sum2 += map.find((i * 7919) % count)->second;
+		}
+	}
+
+	auto end = std::chrono::steady_clock::now();
+
+	std::cout << count * rounds << " lookups: HandleTable "
+		  << std::chrono::duration_cast<std::chrono::microseconds>(middle - start).count() << " us, std::map "
+		  << std::chrono::duration_cast<std::chrono::microseconds>(end - middle).count() << " us" << std::endl;
+
+	ASSERT_EQ(sum1, sum2);
+}
+
+/*
+ * OutputQueue
+ * ------------------------------------------------------------------
+ */
+
+TEST(OutputQueue, consume)
+{
+	OutputQueue queue;
+
+	queue.append("abc");
+	queue.append("");
+	queue.append("defg");
+	queue.append("hi");
+
+	ASSERT_EQ(9U, queue.size());
+	ASSERT_EQ(3U, queue.count());
+
+	queue.consume(2);
+
+	ASSERT_EQ(7U, queue.size());
+	ASSERT_EQ(3U, queue.count());
+	ASSERT_EQ(1U, queue.length(0));
+	ASSERT_EQ('c', *queue.data(0));
+
+	queue.consume(3);
+
+	ASSERT_EQ(2U, queue.count());
+	ASSERT_EQ(2U, queue.length(0));
+	ASSERT_EQ("fghi", queue.str());
+
+	queue.consume(4);
+
+	ASSERT_TRUE(queue.empty());
+	ASSERT_EQ(0U, queue.count());
+}
+
+TEST(OutputQueue, shared)
+{
+	auto segment = std::make_shared<const std::string>("hello");
+	OutputQueue q1, q2;
+
+	q1.append(segment);
+	q2.append(segment);
+	q1.consume(5);
+
+	ASSERT_TRUE(q1.empty());
+	ASSERT_EQ("hello", q2.str());
+	ASSERT_EQ(segment->data(), q2.data(0));
+}
+
+/*
+ * InputBuffer
+ * ------------------------------------------------------------------
+ */
+
+TEST(InputBuffer, prepare)
+{
+	InputBuffer input;
+
+	std::memcpy(input.prepare(5), "hello", 5);
+	input.commit(5);
+
+	ASSERT_EQ("hello", input.str());
+
+	input.consume(2);
+
+	ASSERT_EQ("llo", input.str());
+
+	/* Pending data is moved to the front instead of growing */
+	auto capacity = input.capacity();
+
+	std::memcpy(input.prepare(2), "!!", 2);
+	input.commit(2);
+
+	ASSERT_EQ(capacity, input.capacity());
+	ASSERT_EQ("llo!!", input.str());
+
+	/* Grow */
+	std::memcpy(input.prepare(100), std::string(100, 'a').c_str(), 100);
+	input.commit(100);
+
+	ASSERT_EQ(105U, input.size());
+	ASSERT_EQ("llo!!" + std::string(100, 'a'), input.str());
+
+	input.consume(105);
+
+	ASSERT_TRUE(input.empty());
+}
+
+/*
+ * Handoff
+ * ------------------------------------------------------------------
+ */
+
+#if !defined(_WIN32)
+
+TEST(Handoff, tcp)
+{
+	int fds[2];
+
+	ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+	/* The old process keeps incomplete lines and the name of each client */
+	std::unique_ptr<Server> old{new Server{protocol::Tcp{}, address::Ip{"127.0.0.1", 16524}}};
+	std::shared_ptr<Connection> connection;
+
+	old->setConnectionHandler([&] (const std::shared_ptr<Connection> &client) {
+		connection = client;
+	});
+	old->setReadHandler([] (const std::shared_ptr<Connection> &, InputBuffer &) {});
+
+	SocketTcpIp client{protocol::Tcp{}, address::Ip{}};
+
+	client.connect(address::Ip{"127.0.0.1", 16524});
+	client.send("hello ");
+
+	while (!connection || connection->input().size() < 6) {
+		old->poll(1000);
+	}
+
+	/* Not sent yet */
+	connection->send("queued\n");
+
+	Handoff handoff;
+	std::thread thread([&] () {
+		handoff = Handoff::receive(fds[1]);
+	});
+
+	old->handoff(fds[0], [] (const std::shared_ptr<Connection> &) {
+		return std::string{"player 1"};
+	});
+	thread.join();
+
+	ASSERT_EQ(0U, old->size());
+	ASSERT_EQ(1U, handoff.clients.size());
+	ASSERT_EQ("player 1", handoff.clients[0].state);
+
+	/* The old process is gone */
+	old = nullptr;
+	connection = nullptr;
+
+	Server fresh{handoff.takeMaster<address::Ip, protocol::Tcp>()};
+	std::string state, line;
+	unsigned connected = 0;
+
+	fresh.setConnectionHandler([&] (const std::shared_ptr<Connection> &) {
+		connected ++;
+	});
+	fresh.setReadHandler([&] (const std::shared_ptr<Connection> &client, InputBuffer &input) {
+		auto data = input.str();
+		auto pos = data.find('\n');
+
+		if (pos != std::string::npos) {
+			line = data.substr(0, pos);
+			input.consume(pos + 1);
+			client->send(line + "\n");
+		}
+	});
+	fresh.resume(handoff, [&] (const std::shared_ptr<Connection> &, const std::string &value) {
+		state = value;
+	});
+
+	ASSERT_EQ(Invalid, handoff.master);
+	ASSERT_EQ(Invalid, handoff.clients[0].handle);
+	ASSERT_EQ("player 1", state);
+	ASSERT_EQ(0U, connected);
+	ASSERT_EQ(1U, fresh.size());
+
+	/* The line started before the handoff is completed */
+	client.send("world\n");
+
+	std::string received;
+
+	while (received.find("hello world\n") == std::string::npos) {
+		fresh.poll(50);
+		client.set(option::SockBlockMode{false});
+		received += client.recv(512);
+	}
+
+	ASSERT_EQ("hello world", line);
+	ASSERT_EQ("queued\nhello world\n", received);
+
+	/* The server socket is still listening */
+	SocketTcpIp other{protocol::Tcp{}, address::Ip{}};
+
+	other.connect(address::Ip{"127.0.0.1", 16524});
+
+	while (connected == 0) {
+		fresh.poll(1000);
+	}
+
+	::close(fds[0]);
+	::close(fds[1]);
+}
+
+TEST(Handoff, oversizedAddress)
+{
+	SocketTcpIp master{protocol::Tcp{}, address::Ip{}};
+
+	master.set(option::SockReuseAddress{true});
+	master.bind(address::Ip{"127.0.0.1", 16526});
+	master.listen();
+
+	SocketTcpIp client{protocol::Tcp{}, address::Ip{}};
+
+	client.connect(address::Ip{"127.0.0.1", 16526});
+
+	address::Ip peer;
+	auto accepted = master.accept(&peer);
+
+	/* A broken or hostile sender, the address is longer than any sockaddr */
+	Handoff::Client state;
+
+	state.handle = ::dup(accepted.handle());
+	state.address.assign(reinterpret_cast<const char *>(peer.address()), peer.length());
+	state.address.resize(1024, 'x');
+
+	Handoff handoff;
+	Server server{protocol::Tcp{}, address::Ip{"127.0.0.1", 16527}};
+	std::shared_ptr<Connection> connection;
+
+	handoff.clients.push_back(std::move(state));
+	server.resume(handoff, [&] (const std::shared_ptr<Connection> &client, const std::string &) {
+		connection = client;
+	});
+
+	ASSERT_TRUE(connection != nullptr);
+	ASSERT_EQ(sizeof (sockaddr_in), static_cast<std::size_t>(connection->address().length()));
+	ASSERT_EQ(peer.port(), connection->address().port());
+}
+
+#endif
+
+/*
+ * MultiStreamServer
+ * ------------------------------------------------------------------
+ */
+
+#if defined(SO_REUSEPORT)
+
+TEST(MultiStreamServer, echo)
+{
+	constexpr unsigned clients = 64;
+
+	MultiStreamServer<address::Ip, protocol::Tcp> server{address::Ip{"127.0.0.1", 16510}, 2};
+	std::mutex mutex;
+	std::map<const Connection *, std::thread::id> owners;
+	std::set<std::thread::id> threads;
+	std::atomic<unsigned> mismatches{0};
+
+	server.setConnectionHandler([&] (const std::shared_ptr<Connection> &client) {
+		std::lock_guard<std::mutex> lock{mutex};
+
+		owners[client.get()] = std::this_thread::get_id();
+		threads.insert(std::this_thread::get_id());
+	});
+	server.setReadHandler([&] (const std::shared_ptr<Connection> &client, InputBuffer &input) {
+		std::lock_guard<std::mutex> lock{mutex};
+
+		if (owners[client.get()] != std::this_thread::get_id()) {
+			mismatches ++;
+		}
+
+		client->send(input.str());
+		input.clear();
+	});
+	server.setInterval(50);
+	server.start();
+
+	std::vector<std::unique_ptr<SocketTcpIp>> sockets;
+
+	for (unsigned i = 0; i < clients; ++i) {
+		sockets.emplace_back(new SocketTcpIp{protocol::Tcp{}, address::Ip{}});
+		sockets.back()->connect(address::Ip{"127.0.0.1", 16510});
+		sockets.back()->send("hello");
+
+		ASSERT_EQ("hello", sockets.back()->recv(512));
+	}
+
+	server.stop();
+
+	ASSERT_EQ(2U, server.size());
+	ASSERT_EQ(0U, mismatches);
+	ASSERT_EQ(clients, owners.size());
+	ASSERT_EQ(2U, threads.size());
+}
+
+TEST(MultiStreamServer, settings)
+{
+	MultiStreamServer<address::Ip, protocol::Tcp> server{address::Ip{"127.0.0.1", 16511}, 2};
+	std::atomic<unsigned> disconnected{0};
+	std::vector<unsigned> indexes;
+
+	server.setMaxEvents(8);
+	server.setAcceptLimit(4);
+	server.setIdleTimeout(std::chrono::milliseconds{100});
+	server.setDisconnectionHandler([&] (const std::shared_ptr<Connection> &) {
+		disconnected ++;
+	});
+	server.configure([&] (unsigned index, MultiStreamServer<address::Ip, protocol::Tcp>::Server &reactor) {
+		indexes.push_back(index);
+
+		ASSERT_EQ(8U, reactor.maxEvents());
+	});
+	server.setInterval(20);
+	server.start();
+
+	/* The idle clients are disconnected by the reactor that owns them */
+	std::vector<std::unique_ptr<SocketTcpIp>> sockets;
+
+	for (unsigned i = 0; i < 8; ++i) {
+		sockets.emplace_back(new SocketTcpIp{protocol::Tcp{}, address::Ip{}});
+		sockets.back()->connect(address::Ip{"127.0.0.1", 16511});
+	}
+	for (auto &socket : sockets) {
+		ASSERT_EQ("", socket->recv(512));
+	}
+
+	server.stop();
+
+	ASSERT_EQ((std::vector<unsigned>{0, 1}), indexes);
+	ASSERT_EQ(8U, disconnected);
+}
+
+#endif
+
+int main(int argc, char **argv)
+{
+	testing::InitGoogleTest(&argc, argv);
+
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,277 @@
+/*
+ * main.cpp -- test TimerWheel
+ *
+ * Copyright (c) 2013-2016 Malikania Authors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <malikania/Sockets.h>
+
+using namespace malikania;
+using namespace malikania::net;
+
+using namespace std::chrono;
+
+/*
+ * The time is simulated, the wheel is only advanced by the tests.
+ */
+class TestTimerWheel : public testing::Test {
+protected:
+	TimerWheel::Clock::time_point m_origin{TimerWheel::Clock::now()};
+	TimerWheel m_wheel{milliseconds{10}, m_origin};
+
+	unsigned advance(milliseconds time)
+	{
+		return m_wheel.advance(m_origin + time);
+	}
+};
+
+TEST_F(TestTimerWheel, schedule)
+{
+	unsigned called = 0;
+
+	m_wheel.schedule(milliseconds{50}, [&] () { called ++; });
+
+	ASSERT_EQ(1U, m_wheel.size());
+	ASSERT_EQ(0U, advance(milliseconds{49}));
+	ASSERT_EQ(1U, advance(milliseconds{50}));
+	ASSERT_EQ(1U, called);
+	ASSERT_EQ(0U, m_wheel.size());
+	ASSERT_EQ(0U, advance(milliseconds{1000}));
+}
+
+TEST_F(TestTimerWheel, cancel)
+{
+	unsigned called = 0;
+
+	auto id = m_wheel.schedule(milliseconds{50}, [&] () { called ++; });
+
+	ASSERT_TRUE(m_wheel.active(id));
+	ASSERT_TRUE(m_wheel.cancel(id));
+	ASSERT_FALSE(m_wheel.active(id));
+	ASSERT_FALSE(m_wheel.cancel(id));
+	ASSERT_FALSE(m_wheel.cancel(0));
+
+	/* The slot is reused but not the id */
+	auto other = m_wheel.schedule(milliseconds{50}, [&] () { called ++; });
+
+	ASSERT_NE(id, other);
+	ASSERT_FALSE(m_wheel.cancel(id));
+	ASSERT_EQ(1U, advance(milliseconds{100}));
+	ASSERT_EQ(1U, called);
+}
+
+TEST_F(TestTimerWheel, reschedule)
+{
+	unsigned called = 0;
+
+	auto id = m_wheel.schedule(milliseconds{50}, [&] () { called ++; });
+
+	/* Like an idle timeout touched by some activity */
+	advance(milliseconds{40});
+	ASSERT_TRUE(m_wheel.reschedule(id, milliseconds{50}));
+	ASSERT_EQ(0U, advance(milliseconds{80}));
+	ASSERT_EQ(1U, advance(milliseconds{90}));
+	ASSERT_FALSE(m_wheel.reschedule(id, milliseconds{50}));
+	ASSERT_EQ(1U, called);
+}
+
+TEST_F(TestTimerWheel, periodic)
+{
+	unsigned called = 0;
+
+	auto id = m_wheel.schedulePeriodic(milliseconds{100}, [&] () { called ++; });
+
+	/* Late wakeups do not skip calls */
+	advance(milliseconds{350});
+	ASSERT_EQ(3U, called);
+	advance(milliseconds{1000});
+	ASSERT_EQ(10U, called);
+
+	m_wheel.cancel(id);
+	advance(milliseconds{2000});
+	ASSERT_EQ(10U, called);
+	ASSERT_EQ(0U, m_wheel.size());
+}
+
+TEST_F(TestTimerWheel, fromHandler)
+{
+	TimerWheel::Id periodic, once;
+	unsigned periodicCalls = 0, onceCalls = 0, added = 0;
+
+	/* Cancel itself after 3 calls, add a timer each time */
+	periodic = m_wheel.schedulePeriodic(milliseconds{10}, [&] () {
+		m_wheel.schedule(milliseconds{5}, [&] () { added ++; });
+
+		if (++ periodicCalls == 3) {
+			m_wheel.cancel(periodic);
+		}
+	});
+
+	/* Reschedule itself once */
+	once = m_wheel.schedule(milliseconds{10}, [&] () {
+		if (++ onceCalls == 1) {
+			m_wheel.reschedule(once, milliseconds{100});
+		}
+	});
+
+	advance(milliseconds{1000});
+
+	ASSERT_EQ(3U, periodicCalls);
+	ASSERT_EQ(3U, added);
+	ASSERT_EQ(2U, onceCalls);
+	ASSERT_EQ(0U, m_wheel.size());
+}
+
+TEST_F(TestTimerWheel, timeout)
+{
+	ASSERT_EQ(-1, m_wheel.timeout(-1, m_origin));
+	ASSERT_EQ(500, m_wheel.timeout(500, m_origin));
+
+	m_wheel.schedule(milliseconds{250}, [] () {});
+
+	ASSERT_EQ(250, m_wheel.timeout(-1, m_origin));
+	ASSERT_EQ(100, m_wheel.timeout(100, m_origin));
+	ASSERT_EQ(50, m_wheel.timeout(-1, m_origin + milliseconds{200}));
+	ASSERT_EQ(0, m_wheel.timeout(-1, m_origin + milliseconds{300}));
+}
+
+TEST_F(TestTimerWheel, timeoutUpperLevels)
+{
+	bool called = false;
+	unsigned wakeups = 0;
+	auto now = m_origin;
+
+	m_wheel.schedule(minutes{10}, [&] () { called = true; });
+
+	/* Wait like a reactor, the timeout may be early when the timer changes level */
+	while (!called) {
+		auto timeout = m_wheel.timeout(-1, now);
+
+		ASSERT_GE(timeout, 0);
+
+		now += milliseconds{timeout};
+		m_wheel.advance(now);
+		wakeups ++;
+	}
+
+	ASSERT_GE(now, m_origin + minutes{10});
+	ASSERT_LT(now, m_origin + minutes{10} + milliseconds{10});
+	ASSERT_LE(wakeups, 4U);
+}
+
+TEST_F(TestTimerWheel, overflow)
+{
+	bool called = false;
+
+	/* Beyond the last level */
+	m_wheel.schedule(hours{50}, [&] () { called = true; });
+
+	advance(hours{50} - milliseconds{10});
+	ASSERT_FALSE(called);
+	advance(hours{50});
+	ASSERT_TRUE(called);
+}
+
+TEST_F(TestTimerWheel, random)
+{
+	std::mt19937 random{42};
+	std::uniform_int_distribution<int> delays{0, 3000000};
+	std::uniform_int_distribution<int> steps{1, 5000};
+	std::vector<milliseconds> fired;
+	milliseconds now{0};
+	milliseconds previous{0};
+	bool ordered = true, late = false;
+
+	for (int i = 0; i < 10000; ++i) {
+		milliseconds delay{delays(random)};
+		auto deadline = ((delay + milliseconds{9}) / milliseconds{10}) * milliseconds{10};
+
+		if (delay.count() == 0) {
+			deadline = milliseconds{10};
+		}
+
+		m_wheel.schedule(delay, [&, deadline] () {
+			ordered = ordered && previous <= deadline;
+			late = late || deadline > now || now - deadline >= milliseconds{5000};
+			previous = deadline;
+			fired.push_back(deadline);
+		});
+	}
+
+	while (m_wheel.size() > 0) {
+		now += milliseconds{steps(random)};
+		advance(now);
+	}
+
+	ASSERT_EQ(10000U, fired.size());
+	ASSERT_TRUE(ordered);
+	ASSERT_FALSE(late);
+}
+
+TEST_F(TestTimerWheel, benchmark)
+{
+	constexpr unsigned count = 100000;
+
+	std::vector<TimerWheel::Id> ids;
+	unsigned called = 0;
+
+	ids.reserve(count);
+
+	auto start = steady_clock::now();
+
+	for (unsigned i = 0; i < count; ++i) {
+		ids.push_back(m_wheel.schedule(seconds{30 + i % 30}, [&] () { called ++; }));
+	}
+
+	auto scheduled = steady_clock::now();
+
+	/* Activity on every connection */
+	for (unsigned round = 0; round < 10; ++round) {
+		for (auto id : ids) {
+			m_wheel.reschedule(id, seconds{30});
+		}
+	}
+
+	auto rescheduled = steady_clock::now();
+
+	for (unsigned i = 0; i < count; i += 2) {
+		m_wheel.cancel(ids[i]);
+	}
+
+	advance(minutes{2});
+
+	auto end = steady_clock::now();
+
+	std::cout << "schedule: " << duration_cast<nanoseconds>(scheduled - start).count() / count << "ns/timer, "
+		  << "reschedule: " << duration_cast<nanoseconds>(rescheduled - scheduled).count() / (count * 10) << "ns/timer, "
+		  << "cancel and expire: " << duration_cast<nanoseconds>(end - rescheduled).count() / count << "ns/timer"
+		  << std::endl;
+
+	ASSERT_EQ(count / 2, called);
+}
+
+int main(int argc, char **argv)
+{
+	testing::InitGoogleTest(&argc, argv);
+
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,420 @@
+/*
+ * main.cpp -- test TLS sessions
+ *
+ * Copyright (c) 2013-2016 Malikania Authors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <gtest/gtest.h>
+
+#include <malikania/Sockets.h>
+
+using namespace malikania;
+using namespace malikania::net;
+
+using Server = StreamServer<address::Ip, protocol::Tls>;
+using Connection = StreamConnection<address::Ip, protocol::Tls>;
+
+namespace {
+
+const std::string key{"test-tls-key.pem"};
+const std::string certificate{"test-tls-certificate.pem"};
+
+/*
+ * Generate a self signed certificate, no files are shipped with the tests.
+ */
+void generate()
+{
+	std::unique_ptr<EVP_PKEY_CTX, void (*)(EVP_PKEY_CTX *)> ctx{EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr), EVP_PKEY_CTX_free};
+	EVP_PKEY *raw = nullptr;
+
+	EVP_PKEY_keygen_init(ctx.get());
+	EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx.get(), NID_X9_62_prime256v1);
+	EVP_PKEY_keygen(ctx.get(), &raw);
+
+	std::unique_ptr<EVP_PKEY, void (*)(EVP_PKEY *)> pkey{raw, EVP_PKEY_free};
+	std::unique_ptr<X509, void (*)(X509 *)> x509{X509_new(), X509_free};
+
+	X509_set_version(x509.get(), 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x509.get()), 1);
+	X509_gmtime_adj(X509_getm_notBefore(x509.get()), 0);
+	X509_gmtime_adj(X509_getm_notAfter(x509.get()), 3600);
+	X509_set_pubkey(x509.get(), pkey.get());
+
+	auto name = X509_get_subject_name(x509.get());
+
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char *>("localhost"), -1, -1, 0);
+	X509_set_issuer_name(x509.get(), name);
+	X509_sign(x509.get(), pkey.get(), EVP_sha256());
+
+	std::FILE *fp;
+
+	fp = std::fopen(key.c_str(), "w");
+	PEM_write_PrivateKey(fp, pkey.get(), nullptr, nullptr, 0, nullptr, nullptr);
+	std::fclose(fp);
+
+	fp = std::fopen(certificate.c_str(), "w");
+	PEM_write_X509(fp, x509.get());
+	std::fclose(fp);
+}
+
+} // !namespace
+
+/*
+ * Server which sends a message on every connection, the client reads it so that the TLS 1.3 tickets are received
+ * before the session is saved.
+ */
+class TestTls : public testing::Test {
+protected:
+	std::shared_ptr<ssl::Statistics> m_statistics{std::make_shared<ssl::Statistics>()};
+	std::shared_ptr<ssl::TicketKeys> m_keys{std::make_shared<ssl::TicketKeys>(std::chrono::hours{1}, 2)};
+	std::unique_ptr<Server> m_server;
+	std::thread::id m_thread{std::this_thread::get_id()};
+
+	static void SetUpTestCase()
+	{
+		generate();
+	}
+
+	static void TearDownTestCase()
+	{
+		std::remove(key.c_str());
+		std::remove(certificate.c_str());
+	}
+
+	void start(long cache, bool tickets)
+	{
+		protocol::Tls tls;
+
+		tls.setMethod(ssl::Sslv3);
+		tls.setCertificate(certificate);
+		tls.setPrivateKey(key);
+		tls.setVerify();
+		tls.setSessionCache(cache);
+		tls.setTickets(tickets);
+		tls.setTicketKeys(m_keys);
+		tls.setStatistics(m_statistics);
+
+		m_server = nullptr;
+		m_server.reset(new Server{std::move(tls), address::Ip{"127.0.0.1", 16600}});
+		m_server->setConnectionHandler([] (const std::shared_ptr<Connection> &connection) {
+			connection->send("hello");
+		});
+	}
+
+	/*
+	 * Connect a blocking client, returns the session to reuse.
+	 */
+	std::shared_ptr<SSL_SESSION> connect(std::shared_ptr<SSL_SESSION> session = nullptr)
+	{
+		std::atomic<bool> done{false};
+		std::string received;
+
+		protocol::Tls tls;
+
+		tls.setMethod(ssl::Sslv3);
+		tls.setSession(session);
+
+		SocketTlsIp client{std::move(tls), address::Ip{}};
+
+		std::thread thread([&] () {
+			client.connect(address::Ip{"127.0.0.1", 16600});
+			received = client.recv(512);
+			done = true;
+		});
+
+		while (!done) {
+			m_server->poll(50);
+		}
+
+		thread.join();
+
+		EXPECT_EQ("hello", received);
+
+		return client.protocol().session();
+	}
+};
+
+TEST_F(TestTls, full)
+{
+	start(4096, true);
+	connect();
+	connect();
+
+	ASSERT_EQ(2U, m_statistics->full);
+	ASSERT_EQ(0U, m_statistics->resumed);
+}
+
+TEST_F(TestTls, sessionCache)
+{
+	/* No tickets, the server must find the session in its cache */
+	start(4096, false);
+
+	auto session = connect();
+
+	connect(session);
+
+	ASSERT_EQ(1U, m_statistics->full);
+	ASSERT_EQ(1U, m_statistics->resumed);
+}
+
+TEST_F(TestTls, tickets)
+{
+	/* No server cache, only the ticket can be used */
+	start(0, true);
+
+	auto session = connect();
+
+	connect(session);
+
+	ASSERT_EQ(1U, m_statistics->full);
+	ASSERT_EQ(1U, m_statistics->resumed);
+}
+
+TEST_F(TestTls, rotation)
+{
+	start(0, true);
+
+	auto session = connect();
+
+	/* The previous key is still known, the ticket is accepted and renewed */
+	m_keys->rotate();
+	session = connect(session);
+
+	ASSERT_EQ(1U, m_statistics->resumed);
+	ASSERT_EQ(2U, m_keys->size());
+
+	/* The renewed ticket uses the new key, two rotations later it is unknown */
+	m_keys->rotate();
+	m_keys->rotate();
+	connect(session);
+
+	ASSERT_EQ(2U, m_statistics->full);
+	ASSERT_EQ(1U, m_statistics->resumed);
+	ASSERT_EQ(3U, m_keys->rotations());
+}
+
+TEST_F(TestTls, sharedKeys)
+{
+	/* A session is resumed on another server using the same keys, like MultiStreamServer reactors */
+	start(0, true);
+
+	auto session = connect();
+
+	start(0, true);
+	connect(session);
+
+	ASSERT_EQ(1U, m_statistics->full);
+	ASSERT_EQ(1U, m_statistics->resumed);
+}
+
+TEST_F(TestTls, workers)
+{
+	std::vector<std::thread> threads;
+	std::atomic<unsigned> received{0};
+	unsigned connected = 0;
+	bool reactor = true;
+
+	start(4096, true);
+	m_server->setHandshakeWorkers(2);
+	m_server->setConnectionHandler([&] (const std::shared_ptr<Connection> &connection) {
+		connected ++;
+		reactor = reactor && std::this_thread::get_id() == m_thread;
+		connection->send("hello");
+	});
+
+	for (int i = 0; i < 8; ++i) {
+		threads.emplace_back([&] () {
+			protocol::Tls tls;
+
+			tls.setMethod(ssl::Sslv3);
+
+			SocketTlsIp client{std::move(tls), address::Ip{}};
+
+			client.connect(address::Ip{"127.0.0.1", 16600});
+
+			if (client.recv(512) == "hello") {
+				received ++;
+			}
+		});
+	}
+
+	while (received < 8U) {
+		m_server->poll(50);
+	}
+
+	for (auto &thread : threads) {
+		thread.join();
+	}
+
+	ASSERT_TRUE(reactor);
+	ASSERT_EQ(8U, connected);
+	ASSERT_EQ(8U, m_statistics->full);
+	ASSERT_EQ(0U, m_server->handshaking());
+}
+
+TEST_F(TestTls, stalled)
+{
+	start(4096, true);
+	m_server->setHandshakeWorkers(1);
+
+	/* This client never sends its hello, the reactor must not wait for it */
+	SocketTcpIp raw{protocol::Tcp{}, address::Ip{}};
+
+	raw.connect(address::Ip{"127.0.0.1", 16600});
+
+	while (m_server->handshaking() == 0) {
+		m_server->poll(50);
+	}
+
+	connect();
+
+	ASSERT_EQ(1U, m_statistics->full);
+	ASSERT_EQ(1U, m_server->handshaking());
+}
+
+TEST_F(TestTls, kernelTls)
+{
+	std::string expected;
+	std::string received;
+	std::shared_ptr<Connection> connection;
+
+	for (int i = 0; i < 64; ++i) {
+		expected += std::string(1000, static_cast<char>('a' + i % 26));
+	}
+
+	protocol::Tls tls;
+
+	tls.setMethod(ssl::Sslv3);
+	tls.setCertificate(certificate);
+	tls.setPrivateKey(key);
+	tls.setVerify();
+	tls.setKernelTls();
+	tls.setStatistics(m_statistics);
+
+	Server server{std::move(tls), address::Ip{"127.0.0.1", 16601}};
+
+	server.setConnectionHandler([&] (const std::shared_ptr<Connection> &client) {
+		connection = client;
+
+		/* Several segments, written at once if the kernel does the encryption */
+		for (int i = 0; i < 64; ++i) {
+			client->send(expected.substr(i * 1000, 1000));
+		}
+	});
+
+	std::thread thread([&] () {
+		protocol::Tls tls;
+
+		tls.setMethod(ssl::Sslv3);
+		tls.setKernelTls();
+
+		SocketTlsIp client{std::move(tls), address::Ip{}};
+
+		client.connect(address::Ip{"127.0.0.1", 16601});
+
+		while (received.size() < expected.size()) {
+			received += client.recv(4096);
+		}
+	});
+
+	while (!connection || !connection->output().empty()) {
+		server.poll(50);
+	}
+
+	thread.join();
+
+	if (!connection->socket().protocol().kernelSend()) {
+		std::cout << "kernel TLS not available, user space encryption used" << std::endl;
+	}
+
+	ASSERT_EQ(expected, received);
+}
+
+TEST_F(TestTls, datagrams)
+{
+	std::atomic<bool> done{false};
+	std::string received;
+	std::string reply;
+
+	start(4096, true);
+	m_server->bindDatagrams(address::Ip{"127.0.0.1", 16600});
+	m_server->setConnectionHandler([&] (const std::shared_ptr<Connection> &connection) {
+		m_server->openChannel(connection);
+		connection->send("hello");
+	});
+	m_server->setDatagramHandler([&] (const std::shared_ptr<Connection> &connection, const std::string &data) {
+		received = data;
+		m_server->sendDatagram(connection, "pong");
+	});
+
+	/* The client derives the same token and key from the session, nothing else is exchanged */
+	std::thread thread([&] () {
+		protocol::Tls tls;
+
+		tls.setMethod(ssl::Sslv3);
+
+		SocketTlsIp client{std::move(tls), address::Ip{}};
+
+		client.connect(address::Ip{"127.0.0.1", 16600});
+		client.recv(512);
+
+		auto material = client.protocol().exportKeyingMaterial(DatagramChannel::label, DatagramChannel::materialSize);
+		auto channel = DatagramChannel::derive(DatagramChannel::Side::Client, material);
+
+		DatagramClient<address::Ip> datagrams{address::Ip{"127.0.0.1", 16600}, channel};
+
+		datagrams.setReadHandler([&] (const std::string &data) {
+			reply = data;
+		});
+		datagrams.send("ping");
+		datagrams.flush();
+
+		for (int i = 0; i < 500 && reply.empty(); ++i) {
+			datagrams.receive();
+			std::this_thread::sleep_for(std::chrono::milliseconds{2});
+		}
+
+		done = true;
+	});
+
+	while (!done) {
+		m_server->poll(10);
+	}
+
+	thread.join();
+
+	ASSERT_EQ("ping", received);
+	ASSERT_EQ("pong", reply);
+}
+
+int main(int argc, char **argv)
+{
+	testing::InitGoogleTest(&argc, argv);
+
+	return RUN_ALL_TESTS();
+}
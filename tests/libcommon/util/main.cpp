@@ -1,5 +1,5 @@
 /*
- * main.cpp -- test NetworkUtil
+ * main.cpp -- test util functions
  *
  * Copyright (c) 2013-2016 Malikania Authors
  *
@@ -16,18 +16,23 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <gtest/gtest.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
 
-#if 0
+#include <gtest/gtest.h>
 
-#include <malikania/NetworkUtil.h>
+#include <malikania/Util.h>
 
 using namespace malikania;
 
 TEST(Basic, simple)
 {
 	std::string input = "hello world\r\n\r\n";
-	std::vector<std::string> messages = NetworkUtil::split(input);
+	std::vector<std::string> messages = util::netsplit(input);
 
 	ASSERT_EQ(1U, messages.size());
 	ASSERT_EQ("hello world", messages[0]);
@@ -37,7 +42,7 @@ TEST(Basic, simple)
 TEST(Basic, two)
 {
 	std::string input = "hello world\r\n\r\nhow are you?\r\n\r\n";
-	std::vector<std::string> messages = NetworkUtil::split(input);
+	std::vector<std::string> messages = util::netsplit(input);
 
 	ASSERT_EQ(2U, messages.size());
 	ASSERT_EQ("hello world", messages[0]);
@@ -48,7 +53,7 @@ TEST(Basic, two)
 TEST(Basic, imcomplete)
 {
 	std::string input = "hello world\r\n";
-	std::vector<std::string> messages = NetworkUtil::split(input);
+	std::vector<std::string> messages = util::netsplit(input);
 
 	ASSERT_EQ(0U, messages.size());
 	ASSERT_EQ("hello world\r\n", input);
@@ -57,7 +62,7 @@ TEST(Basic, imcomplete)
 TEST(Basic, empty)
 {
 	std::string input = "hello world\r\n\r\n\r\n\r\nhow are you?\r\n\r\n";
-	std::vector<std::string> messages = NetworkUtil::split(input);
+	std::vector<std::string> messages = util::netsplit(input);
 
 	ASSERT_EQ(3U, messages.size());
 	ASSERT_EQ("hello world", messages[0]);
@@ -66,7 +71,218 @@ TEST(Basic, empty)
 	ASSERT_TRUE(input.empty());
 }
 
-#endif
+/*
+ * Framer
+ * ------------------------------------------------------------------
+ */
+
+namespace {
+
+std::vector<std::string> feed(util::Framer &framer, std::string &input)
+{
+	std::vector<std::string> messages;
+
+	auto n = framer.split(input.data(), input.size(), [&] (const char *msg, std::size_t length) {
+		messages.emplace_back(msg, length);
+	});
+
+	input.erase(0, n);
+
+	return messages;
+}
+
+/*
+ * Previous netsplit implementation, used as reference.
+ */
+std::vector<std::string> legacySplit(std::string &input)
+{
+	std::vector<std::string> ret;
+	std::string::size_type pos;
+
+	while ((pos = input.find("\r\n\r\n")) != std::string::npos) {
+		ret.push_back(input.substr(0U, pos));
+		input.erase(0U, pos + 4);
+	}
+
+	return ret;
+}
+
+} // !namespace
+
+TEST(Framer, simple)
+{
+	util::Framer framer;
+	std::string input = "hello world\r\n\r\nhow are you?\r\n\r\n\r\n\r\n";
+	std::vector<std::string> messages = feed(framer, input);
+
+	ASSERT_EQ(3U, messages.size());
+	ASSERT_EQ("hello world", messages[0]);
+	ASSERT_EQ("how are you?", messages[1]);
+	ASSERT_TRUE(messages[2].empty());
+	ASSERT_TRUE(input.empty());
+}
+
+TEST(Framer, view)
+{
+	util::Framer framer;
+	std::string input = "abc\r\n\r\ndef\r\n\r\n";
+	std::vector<const char *> views;
+
+	framer.split(input.data(), input.size(), [&] (const char *msg, std::size_t) {
+		views.push_back(msg);
+	});
+
+	ASSERT_EQ(2U, views.size());
+	ASSERT_EQ(input.data(), views[0]);
+	ASSERT_EQ(input.data() + 7, views[1]);
+}
+
+TEST(Framer, incremental)
+{
+	util::Framer framer;
+	std::string input;
+	std::string message = std::string(100, 'x') + "\r\n\r\n";
+	std::vector<std::string> messages;
+
+	/* Byte per byte so that the delimiter is split between calls */
+	for (char c : message + message) {
+		input.push_back(c);
+
+		for (auto &m : feed(framer, input)) {
+			messages.push_back(m);
+		}
+	}
+
+	ASSERT_EQ(2U, messages.size());
+	ASSERT_EQ(std::string(100, 'x'), messages[0]);
+	ASSERT_EQ(std::string(100, 'x'), messages[1]);
+	ASSERT_TRUE(input.empty());
+}
+
+TEST(Framer, falsePositives)
+{
+	util::Framer framer;
+	std::string input = std::string(20, '\r') + "\n\r\r\n\n\r\n\r" + std::string(40, '\n') + "\r\n\r\n";
+	std::vector<std::string> messages = feed(framer, input);
+
+	/* Only the sequence starting at offset 25 and the last one are delimiters */
+	ASSERT_EQ(2U, messages.size());
+	ASSERT_EQ(std::string(20, '\r') + "\n\r\r\n\n", messages[0]);
+	ASSERT_EQ(std::string(39, '\n'), messages[1]);
+}
+
+TEST(Framer, random)
+{
+	const char alphabet[] = { '\r', '\n', 'a' };
+
+	std::srand(0);
+
+	for (int round = 0; round < 200; ++round) {
+		util::Framer framer{std::numeric_limits<std::size_t>::max() - util::Framer::delimiter};
+		std::string data, input, reference;
+		std::vector<std::string> expected, messages;
+
+		for (int i = 0; i < 512; ++i) {
+			data.push_back(alphabet[std::rand() % 3]);
+		}
+
+		reference = data;
+		expected = legacySplit(reference);
+
+		/* Feed in chunks of random size */
+		for (std::size_t i = 0; i < data.size(); ) {
+			std::size_t n = std::min<std::size_t>(1 + std::rand() % 40, data.size() - i);
+
+			input.append(data, i, n);
+			i += n;
+
+			for (auto &m : feed(framer, input)) {
+				messages.push_back(m);
+			}
+		}
+
+		ASSERT_EQ(expected, messages);
+		ASSERT_EQ(reference, input);
+	}
+}
+
+TEST(Framer, maximum)
+{
+	util::Framer framer{8};
+	std::string input = "12345678\r\n\r\n";
+
+	ASSERT_EQ(1U, feed(framer, input).size());
+
+	input = "123456789\r\n\r\n";
+
+	ASSERT_THROW(feed(framer, input), std::length_error);
+
+	/* Incomplete message already too large */
+	input = "123456789abc";
+
+	ASSERT_THROW(feed(framer, input), std::length_error);
+
+	/* Could still end with the delimiter */
+	input = "12345678\r\n\r";
+	framer.reset();
+
+	ASSERT_NO_THROW(feed(framer, input));
+}
+
+/*
+ * Benchmark, compare the previous netsplit implementation with the framer.
+ */
+namespace {
+
+template <typename Func>
+long long measure(Func func)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	func();
+
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+} // !namespace
+
+TEST(Framer, benchmark)
+{
+	constexpr unsigned count = 20000;
+
+	std::string packet;
+
+	for (unsigned i = 0; i < count; ++i) {
+		packet += "{ \"command\": \"move\", \"x\": 10, \"y\": 20 }\r\n\r\n";
+	}
+
+	std::size_t legacy = 0, netsplit = 0, framer = 0;
+
+	auto legacyTime = measure([&] () {
+		std::string input = packet;
+
+		legacy = legacySplit(input).size();
+	});
+	auto netsplitTime = measure([&] () {
+		std::string input = packet;
+
+		netsplit = util::netsplit(input).size();
+	});
+	auto framerTime = measure([&] () {
+		util::Framer f;
+
+		f.split(packet.data(), packet.size(), [&] (const char *, std::size_t) {
+			framer ++;
+		});
+	});
+
+	std::cout << count << " messages in one packet: legacy " << legacyTime << " us, netsplit "
+		  << netsplitTime << " us, framer " << framerTime << " us" << std::endl;
+
+	ASSERT_EQ(count, legacy);
+	ASSERT_EQ(count, netsplit);
+	ASSERT_EQ(count, framer);
+}
 
 int main(int argc, char **argv)
 {
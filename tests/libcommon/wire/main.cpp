@@ -0,0 +1,510 @@
+/*
+ * main.cpp -- test wire protocol
+ *
+ * Copyright (c) 2013-2016 Malikania Authors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+#include <gtest/gtest.h>
+
+#include <malikania/Wire.h>
+
+using namespace malikania;
+
+namespace {
+
+std::vector<json::Value> decodeAll(wire::Decoder &decoder, std::string &input)
+{
+	std::vector<json::Value> messages;
+
+	auto n = decoder.split(input.data(), input.size(), [&] (json::Value message) {
+		messages.push_back(std::move(message));
+	});
+
+	input.erase(0, n);
+
+	return messages;
+}
+
+json::Value serverInfo(unsigned admins)
+{
+	auto list = json::array({});
+	auto sites = json::array({});
+
+	for (unsigned i = 0; i < admins; ++i) {
+		list.append("player" + std::to_string(i));
+		sites.append("http://pub" + std::to_string(i) + ".mygame.org/files");
+	}
+
+	return json::object({
+		{ "command", "server-info" },
+		{ "version", 1.0 },
+		{ "engine", 3.2 },
+		{ "admins", list },
+		{ "motd", "Message of the day" },
+		{ "download", json::object({{ "enabled", true }, { "sites", sites }}) }
+	});
+}
+
+json::Value characterList(unsigned count)
+{
+	auto data = json::array({});
+
+	for (unsigned i = 0; i < count; ++i) {
+		data.append(json::object({
+			{ "id", static_cast<int>(i) },
+			{ "nickname", "character" + std::to_string(i) },
+			{ "class", i % 2 ? "mage" : "warrior" },
+			{ "level", static_cast<int>(i % 60) }
+		}));
+	}
+
+	return json::object({{ "command", "character-list" }, { "request", 1 }, { "data", data }});
+}
+
+} // !namespace
+
+/*
+ * Writer and Reader
+ * ------------------------------------------------------------------
+ */
+
+TEST(Writer, fields)
+{
+	wire::Writer writer(wire::Command::ExchangeAdd);
+
+	writer.integer(-1);
+	writer.integer(std::numeric_limits<std::int64_t>::max());
+	writer.integer(std::numeric_limits<std::int64_t>::min());
+	writer.real(-2.5);
+	writer.boolean(true);
+	writer.string("hello");
+
+	std::string frame = writer.finish();
+	wire::Command command;
+	wire::Reader reader;
+
+	ASSERT_EQ(frame.size(), wire::frame(frame.data(), frame.size(), 1024, command, reader));
+	ASSERT_EQ(wire::Command::ExchangeAdd, command);
+	ASSERT_EQ(-1, reader.integer());
+	ASSERT_EQ(std::numeric_limits<std::int64_t>::max(), reader.integer());
+	ASSERT_EQ(std::numeric_limits<std::int64_t>::min(), reader.integer());
+	ASSERT_EQ(-2.5, reader.real());
+	ASSERT_TRUE(reader.boolean());
+	ASSERT_EQ("hello", reader.string());
+	ASSERT_TRUE(reader.atEnd());
+	ASSERT_THROW(reader.boolean(), std::out_of_range);
+}
+
+TEST(Writer, compact)
+{
+	/* length, command, bitmask and the id */
+	ASSERT_EQ(4U, wire::pack(json::object({
+		{ "command", "character-delete" },
+		{ "id", 12 }
+	})).size());
+}
+
+TEST(Frame, incomplete)
+{
+	std::string frame = wire::pack(json::object({
+		{ "command", "account-identify" },
+		{ "login", "jean" },
+		{ "password", "secret" }
+	}));
+
+	wire::Command command;
+	wire::Reader reader;
+
+	for (std::size_t i = 0; i < frame.size(); ++i) {
+		ASSERT_EQ(0U, wire::frame(frame.data(), i, 1024, command, reader));
+	}
+
+	ASSERT_EQ(frame.size(), wire::frame(frame.data(), frame.size(), 1024, command, reader));
+	ASSERT_THROW(wire::frame(frame.data(), frame.size(), 4, command, reader), std::length_error);
+}
+
+/*
+ * Schema conversion
+ * ------------------------------------------------------------------
+ */
+
+TEST(Pack, roundTrip)
+{
+	std::vector<json::Value> messages{
+		json::object({{ "command", "account-create" }, { "login", "jean" }, { "first-name", "Jean" },
+			      { "last-name", "Dupont" }, { "password", "p" }, { "email", "jean@example.org" }}),
+		json::object({{ "command", "account-identify" }, { "login", "jean" }, { "password", "p" }}),
+		json::object({{ "command", "character-create" }, { "nickname", "x" }, { "class", "mage" }, { "gender", "female" }}),
+		json::object({{ "command", "character-delete" }, { "id", 123 }}),
+		json::object({{ "command", "character-list" }}),
+		json::object({{ "command", "character-select" }, { "id", -4 }}),
+		json::object({{ "command", "exchange-add" }, { "id", 1 }}),
+		json::object({{ "command", "exchange-start" }, { "id", 100000 }}),
+		json::object({{ "command", "server-info" }, { "version", 1.5 }, { "engine", 3.25 },
+			      { "admins", json::array({ "player1", "player2" }) },
+			      { "download", json::object({{ "enabled", true }}) }}),
+		json::object({{ "command", "server-message" }, { "origin", "jean" }, { "message", "hello" }})
+	};
+
+	for (const auto &message : messages) {
+		std::string frame = wire::pack(message);
+		wire::Command command;
+		wire::Reader reader;
+
+		ASSERT_EQ(frame.size(), wire::frame(frame.data(), frame.size(), 1024, command, reader));
+		ASSERT_EQ(message.toJson(0), wire::unpack(command, reader).toJson(0));
+		ASSERT_TRUE(reader.atEnd());
+	}
+}
+
+TEST(Pack, request)
+{
+	/* The request id follows the fields of any command */
+	for (auto name : { "character-list", "server-message" }) {
+		auto message = json::object({{ "command", name }, { "request", 300 }});
+		std::string frame = wire::pack(message);
+		wire::Command command;
+		wire::Reader reader;
+
+		ASSERT_EQ(frame.size(), wire::frame(frame.data(), frame.size(), 1024, command, reader));
+		ASSERT_EQ(message.toJson(0), wire::unpack(command, reader).toJson(0));
+	}
+
+	ASSERT_THROW(wire::pack(json::object({{ "command", "character-list" }, { "request", "abc" }})), std::invalid_argument);
+}
+
+TEST(Pack, extra)
+{
+	/* Properties that are not in the schema, like in JSON mode */
+	auto message = json::object({
+		{ "command", "character-list" },
+		{ "request", 3 },
+		{ "data", json::array({
+			json::object({{ "id", 1 }, { "nickname", "jean" }}),
+			json::object({{ "id", 2 }, { "nickname", "pierre" }})
+		})},
+		{ "empty", nullptr }
+	});
+	std::string frame = wire::pack(message);
+	wire::Command command;
+	wire::Reader reader;
+
+	ASSERT_EQ(frame.size(), wire::frame(frame.data(), frame.size(), 1024, command, reader));
+	ASSERT_EQ(message.toJson(0), wire::unpack(command, reader).toJson(0));
+	ASSERT_TRUE(reader.atEnd());
+
+	/* Not needed when there is none */
+	ASSERT_EQ(4U, wire::pack(json::object({{ "command", "character-delete" }, { "id", 12 }})).size());
+}
+
+TEST(Pack, integerRange)
+{
+	auto message = json::object({{ "command", "character-select" }, { "id", std::numeric_limits<int>::max() }});
+	std::string frame = wire::pack(message);
+	wire::Command command;
+	wire::Reader reader;
+
+	ASSERT_EQ(frame.size(), wire::frame(frame.data(), frame.size(), 1024, command, reader));
+	ASSERT_EQ(message.toJson(0), wire::unpack(command, reader).toJson(0));
+
+	/* Written by another implementation, it does not fit in a JSON value */
+	wire::Writer writer(wire::Command::CharacterSelect);
+
+	writer.varint(1);
+	writer.integer(static_cast<std::int64_t>(std::numeric_limits<int>::max()) + 1);
+	frame = writer.finish();
+	wire::frame(frame.data(), frame.size(), 1024, command, reader);
+
+	ASSERT_THROW(wire::unpack(command, reader), std::out_of_range);
+}
+
+TEST(Pack, errors)
+{
+	ASSERT_THROW(wire::pack(json::object({{ "command", "unknown" }})), std::invalid_argument);
+	ASSERT_THROW(wire::pack(json::object({{ "command", "exchange-add" }, { "id", "abc" }})), std::invalid_argument);
+	ASSERT_THROW(wire::schema(static_cast<wire::Command>(1000)), std::invalid_argument);
+}
+
+/*
+ * Decoder
+ * ------------------------------------------------------------------
+ */
+
+TEST(Decoder, json)
+{
+	wire::Decoder decoder;
+	std::string input = "{ \"command\": \"exchange-add\",\n  \"id\": 1 }\r\n\r\n{ \"command\": \"char";
+	auto messages = decodeAll(decoder, input);
+
+	ASSERT_EQ(1U, messages.size());
+	ASSERT_EQ(1, messages[0]["id"].toInt());
+
+	input += "acter-list\" }\r\n\r\n";
+	messages = decodeAll(decoder, input);
+
+	ASSERT_EQ(1U, messages.size());
+	ASSERT_EQ("character-list", messages[0]["command"].toString());
+	ASSERT_TRUE(input.empty());
+}
+
+TEST(Decoder, negotiation)
+{
+	wire::Decoder decoder;
+	std::vector<json::Value> messages;
+
+	/* The protocol command is followed by binary data in the same chunk */
+	std::string input = wire::encode(json::object({{ "command", "protocol" }, { "mode", "binary" }}), wire::Mode::Json);
+
+	input += wire::encode(json::object({{ "command", "exchange-add" }, { "id", 7 }}), wire::Mode::Binary);
+	input += wire::encode(json::object({{ "command", "character-list" }}), wire::Mode::Binary);
+
+	auto n = decoder.split(input.data(), input.size(), [&] (json::Value message) {
+		if (message["command"].toString() == "protocol") {
+			decoder.setMode(message["mode"].toString() == "binary" ? wire::Mode::Binary : wire::Mode::Json);
+		}
+
+		messages.push_back(std::move(message));
+	});
+
+	ASSERT_EQ(input.size(), n);
+	ASSERT_EQ(wire::Mode::Binary, decoder.mode());
+	ASSERT_EQ(3U, messages.size());
+	ASSERT_EQ(7, messages[1]["id"].toInt());
+	ASSERT_EQ("character-list", messages[2]["command"].toString());
+}
+
+/*
+ * Benchmark, decode the same commands in both modes.
+ */
+TEST(Decoder, benchmark)
+{
+	constexpr unsigned count = 20000;
+
+	auto message = json::object({
+		{ "command", "server-message" },
+		{ "origin", "jean" },
+		{ "message", "hello world" }
+	});
+
+	for (auto mode : { wire::Mode::Json, wire::Mode::Binary }) {
+		wire::Decoder decoder(mode);
+		std::string input;
+		unsigned decoded = 0;
+
+		for (unsigned i = 0; i < count; ++i) {
+			input += wire::encode(message, mode);
+		}
+
+		auto start = std::chrono::steady_clock::now();
+
+		decoder.split(input.data(), input.size(), [&] (json::Value) {
+			decoded ++;
+		});
+
+		auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+		std::cout << (mode == wire::Mode::Json ? "json" : "binary") << ": " << count << " messages, "
+			  << input.size() << " bytes, " << elapsed.count() << " us" << std::endl;
+
+		ASSERT_EQ(count, decoded);
+	}
+}
+
+/*
+ * Deflate
+ * ------------------------------------------------------------------
+ */
+
+TEST(Deflate, roundTrip)
+{
+	auto deflate = std::make_shared<wire::Deflate>();
+	auto message = serverInfo(50);
+	auto frame = deflate->encode(message);
+	const auto &stats = deflate->statistics(wire::Command::ServerInfo);
+
+	ASSERT_LT(frame.size(), wire::pack(message).size() / 2);
+	ASSERT_EQ(1U, stats.sent);
+	ASSERT_EQ(1U, stats.deflated);
+	ASSERT_LT(stats.ratio(), 0.5);
+
+	/* A compressed frame followed by a small one sent unchanged */
+	auto small = json::object({{ "command", "exchange-add" }, { "id", 7 }});
+
+	frame += deflate->encode(small);
+
+	ASSERT_EQ(wire::pack(small), deflate->encode(small));
+
+	wire::Decoder decoder(wire::Mode::Binary);
+
+	decoder.setDeflate(deflate);
+
+	auto messages = decodeAll(decoder, frame);
+
+	ASSERT_EQ(2U, messages.size());
+	ASSERT_EQ(message.toJson(0), messages[0].toJson(0));
+	ASSERT_EQ(small.toJson(0), messages[1].toJson(0));
+	ASSERT_TRUE(frame.empty());
+	ASSERT_EQ(1U, stats.inflated);
+	ASSERT_EQ(stats.sentRaw, stats.receivedRaw);
+	ASSERT_EQ(stats.sentWire, stats.receivedWire);
+	ASSERT_EQ(2U, deflate->statistics(wire::Command::ExchangeAdd).sent);
+	ASSERT_EQ(1U, deflate->statistics(wire::Command::ExchangeAdd).received);
+	ASSERT_EQ(3U, deflate->total().sent);
+}
+
+TEST(Deflate, extra)
+{
+	/* The properties outside of the schema are compressed too */
+	auto deflate = std::make_shared<wire::Deflate>();
+	auto message = characterList(50);
+	auto frame = deflate->encode(message);
+
+	ASSERT_LT(frame.size(), wire::pack(message).size() / 2);
+
+	wire::Decoder decoder(wire::Mode::Binary);
+
+	decoder.setDeflate(deflate);
+
+	auto messages = decodeAll(decoder, frame);
+
+	ASSERT_EQ(1U, messages.size());
+	ASSERT_EQ(message.toJson(0), messages[0].toJson(0));
+	ASSERT_EQ(1U, deflate->statistics(wire::Command::CharacterList).deflated);
+}
+
+TEST(Deflate, negotiation)
+{
+	auto message = json::object({{ "command", "protocol" }, { "mode", "binary" }, { "compression", "deflate" }});
+	std::string frame = wire::pack(message);
+	wire::Command command;
+	wire::Reader reader;
+
+	wire::frame(frame.data(), frame.size(), 1024, command, reader);
+
+	ASSERT_EQ(message.toJson(0), wire::unpack(command, reader).toJson(0));
+
+	/* Compressed frames are refused if not negotiated */
+	wire::Deflate deflate;
+	wire::Decoder decoder(wire::Mode::Binary);
+
+	frame = deflate.encode(serverInfo(50));
+
+	ASSERT_THROW(decodeAll(decoder, frame), std::invalid_argument);
+}
+
+TEST(Deflate, threshold)
+{
+	wire::Deflate deflate(100000);
+	auto message = serverInfo(50);
+
+	ASSERT_EQ(wire::pack(message), deflate.encode(message));
+
+	deflate.setThreshold(0);
+
+	/* Not compressed if it does not make the frame smaller */
+	auto small = json::object({{ "command", "character-select" }, { "id", 1 }});
+
+	ASSERT_EQ(wire::pack(small), deflate.encode(small));
+	ASSERT_NE(wire::pack(message), deflate.encode(message));
+	ASSERT_EQ(1U, deflate.total().deflated);
+}
+
+TEST(Deflate, errors)
+{
+	auto deflate = std::make_shared<wire::Deflate>();
+	auto frame = deflate->encode(serverInfo(50));
+	wire::Decoder decoder(wire::Mode::Binary, 100);
+
+	/* The original size is checked before decompression */
+	decoder.setDeflate(deflate);
+
+	auto copy = frame;
+
+	ASSERT_THROW(decodeAll(decoder, copy), std::length_error);
+
+	decoder = wire::Decoder(wire::Mode::Binary);
+	decoder.setDeflate(deflate);
+	copy = frame;
+	copy[copy.size() / 2] ^= 0x55;
+	copy[copy.size() / 2 + 1] ^= 0x55;
+
+	ASSERT_THROW(decodeAll(decoder, copy), std::invalid_argument);
+
+	/* A different dictionary can not decode it */
+	decoder.setDeflate(std::make_shared<wire::Deflate>(256, 6, "other"));
+	copy = frame;
+
+	ASSERT_ANY_THROW(decodeAll(decoder, copy));
+	ASSERT_THROW(deflate->statistics(wire::Command::Compressed), std::invalid_argument);
+}
+
+/*
+ * Benchmark, bandwidth and time per message type with and without the dictionary.
+ */
+TEST(Deflate, benchmark)
+{
+	constexpr unsigned count = 2000;
+
+	std::vector<json::Value> messages{
+		serverInfo(8),
+		serverInfo(100),
+		characterList(20),
+		json::object({{ "command", "server-message" }, { "origin", "server" },
+			      { "message", serverInfo(100).toJson(0) }})
+	};
+
+	for (auto dictionary : { std::string(), wire::dictionary() }) {
+		auto deflate = std::make_shared<wire::Deflate>(256, 6, dictionary);
+		wire::Decoder decoder(wire::Mode::Binary);
+		std::string input;
+		unsigned decoded = 0;
+
+		decoder.setDeflate(deflate);
+
+		for (unsigned i = 0; i < count; ++i) {
+			input += deflate->encode(messages[i % messages.size()]);
+		}
+
+		decoder.split(input.data(), input.size(), [&] (json::Value) {
+			decoded ++;
+		});
+
+		for (auto command : { wire::Command::ServerInfo, wire::Command::CharacterList, wire::Command::ServerMessage }) {
+			const auto &stats = deflate->statistics(command);
+
+			std::cout << (dictionary.empty() ? "no dictionary" : "dictionary") << ", "
+				  << wire::schema(command).name << ": " << stats.sent << " messages, "
+				  << stats.sentRaw << " -> " << stats.sentWire << " bytes (" << stats.ratio() << "), "
+				  << "deflate " << stats.deflateTime.count() / stats.sent << " ns/message, "
+				  << "inflate " << stats.inflateTime.count() / stats.received << " ns/message" << std::endl;
+		}
+
+		ASSERT_EQ(count, decoded);
+		ASSERT_EQ(count, deflate->total().inflated);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	testing::InitGoogleTest(&argc, argv);
+
+	return RUN_ALL_TESTS();
+}